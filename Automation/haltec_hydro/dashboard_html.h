@@ -0,0 +1,228 @@
+// The hydro dashboard page for haltec_hydro.h
+//
+// Plain C++ with no Arduino dependency. The page is built into any string
+// type with reserve() and += of a C string, so the sketch builds an Arduino
+// String and bench/ a std::string. The sketch copies its readings and
+// relays into the views below, which keeps Settings out of this header.
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct DashboardZone {
+  const char *name;
+  float temperature;  // NAN when the sensor has no reading
+  float humidity;
+  int co2;            // Negative when there is no CO2 sensor reading
+  int waterLevel;
+};
+
+struct DashboardRelay {
+  const char *role;
+  int zone;
+  bool on;
+};
+
+// Per-zone and per-relay room for reserve(), so the page is built with
+// one allocation; the text runs to about 420 and 220 bytes
+#define DASHBOARD_ZONE_BYTES 512
+#define DASHBOARD_RELAY_BYTES 256
+
+const char DASHBOARD_HEAD[] = R"rawliteral(
+<!DOCTYPE html>
+<html>
+<head>
+  <title>ESP32 Dashboard</title>
+  <style>
+    body {
+      font-family: Arial, sans-serif;
+      margin: 0;
+      padding: 0;
+      background-color: #f4f4f4;
+    }
+    header {
+      background: #0073e6;
+      color: white;
+      padding: 1rem;
+      text-align: center;
+    }
+    h1, h2 {
+      margin: 0;
+    }
+    .container {
+      margin: 2rem;
+      padding: 2rem;
+      background: white;
+      border-radius: 8px;
+      box-shadow: 0px 4px 6px rgba(0, 0, 0, 0.1);
+    }
+    .zone {
+      margin-bottom: 2rem;
+    }
+    .status {
+      display: flex;
+      justify-content: space-between;
+      padding: 1rem 0;
+    }
+    .status div {
+      flex: 1;
+      margin: 0 1rem;
+      text-align: center;
+      border: 1px solid #ccc;
+      border-radius: 8px;
+      background: #f9f9f9;
+      padding: 1rem;
+    }
+    .status div p {
+      margin: 0.5rem 0;
+      font-size: 1.1rem;
+    }
+    .relay-item {
+      display: flex;
+      align-items: center;
+      justify-content: space-between;
+      padding: 1rem;
+      border-bottom: 1px solid #ddd;
+    }
+    .relay-item:last-child {
+      border-bottom: none;
+    }
+    .relay-item button {
+      padding: 0.5rem 1rem;
+      background: #0073e6;
+      color: white;
+      border: none;
+      border-radius: 4px;
+      cursor: pointer;
+    }
+    .relay-item button:disabled {
+      background: #ccc;
+    }
+    footer {
+      text-align: center;
+      padding: 1rem;
+      margin-top: 2rem;
+      background: #0073e6;
+      color: white;
+    }
+  </style>
+</head>
+<body>
+  <header>
+    <h1>ESP32 Environmental Control</h1>
+    <h2>Dashboard</h2>
+  </header>
+  <div class="container">
+)rawliteral";
+
+const char DASHBOARD_TAIL[] = R"rawliteral(
+  </div>
+  <footer>
+    <p>&copy; 2025 HiLetgo ESP32 LoRa Environmental Control</p>
+  </footer>
+  <script>
+    let socket;
+
+    // Apply a delta pushed by the controller; absent keys are unchanged
+    function applyUpdate(data) {
+      const show = (id, value) => {
+        const element = document.getElementById(id);
+        if (element) element.textContent = value === null ? 'nan' : value;
+      };
+      for (const z in data.z || {}) {
+        const zone = data.z[z];
+        if ('t' in zone) show('temp-' + z, zone.t);
+        if ('h' in zone) show('hum-' + z, zone.h);
+        if ('c' in zone) show('co2-' + z, zone.c);
+        if ('w' in zone) show('water-' + z, zone.w);
+      }
+      for (const i in data.r || {}) {
+        show('relay' + i, data.r[i] ? 'Turn OFF' : 'Turn ON');
+      }
+    }
+
+    function connect() {
+      socket = new WebSocket(`ws://${location.host}/ws`);
+      socket.onmessage = event => applyUpdate(JSON.parse(event.data));
+      socket.onclose = () => setTimeout(connect, 2000);
+    }
+
+    function toggleRelay(index) {
+      if (socket && socket.readyState === WebSocket.OPEN) {
+        socket.send(JSON.stringify({toggle: index}));
+      } else {
+        fetch(`/toggle?relay=${index}`)
+          .then(response => response.json())
+          .catch(error => console.error('Error:', error));
+      }
+    }
+
+    connect();
+  </script>
+</body>
+</html>
+  )rawliteral";
+
+// One decimal, or "null" for a missing reading, as formatReading() prints it
+inline void formatDashboardReading(char *out, size_t size, float value) {
+  if (isnan(value)) {
+    snprintf(out, size, "null");
+  } else {
+    snprintf(out, size, "%.1f", value);
+  }
+}
+
+template <typename Text>
+void appendStatusBox(Text &html, const char *title, const char *id, int zone, const char *value, const char *unit) {
+  char box[192];
+  snprintf(box, sizeof(box), "<div><h3>%s</h3><p><strong><span id=\"%s-%d\">%s</span> %s</strong></p></div>", title,
+           id, zone, value, unit);
+  html += box;
+}
+
+// The whole page: one section per zone with its readings, then its relays
+template <typename Text>
+void buildDashboard(Text &html, const DashboardZone *zones, int zoneCount, const DashboardRelay *relays,
+                    int relayCount) {
+  html.reserve(sizeof(DASHBOARD_HEAD) + sizeof(DASHBOARD_TAIL) + zoneCount * DASHBOARD_ZONE_BYTES +
+               relayCount * DASHBOARD_RELAY_BYTES);
+  html += DASHBOARD_HEAD;
+
+  char line[256];
+  char value[16];
+  for (int z = 0; z < zoneCount; z++) {
+    const DashboardZone &zone = zones[z];
+    snprintf(line, sizeof(line), "    <section class=\"zone\">\n      <h2>%s</h2>\n      <div class=\"status\">",
+             zone.name);
+    html += line;
+    formatDashboardReading(value, sizeof(value), zone.temperature);
+    appendStatusBox(html, "Temperature", "temp", z, value, "°C");
+    formatDashboardReading(value, sizeof(value), zone.humidity);
+    appendStatusBox(html, "Humidity", "hum", z, value, "%");
+    if (zone.co2 < 0) {
+      snprintf(value, sizeof(value), "nan");
+    } else {
+      snprintf(value, sizeof(value), "%d", zone.co2);
+    }
+    appendStatusBox(html, "CO&#8322;", "co2", z, value, "ppm");
+    snprintf(value, sizeof(value), "%d", zone.waterLevel);
+    appendStatusBox(html, "Water Level", "water", z, value, "");
+    html += "</div>\n      <div class=\"relays\">\n";
+
+    for (int i = 0; i < relayCount; i++) {
+      if (relays[i].zone != z) {
+        continue;
+      }
+      snprintf(line, sizeof(line),
+               "\n        <div class=\"relay-item\">\n          <span>Relay %d: %s</span>\n"
+               "          <button id=\"relay%d\" onclick=\"toggleRelay(%d)\">%s</button>\n        </div>\n    ",
+               i + 1, relays[i].role, i, i, relays[i].on ? "Turn OFF" : "Turn ON");
+      html += line;
+    }
+    html += "      </div>\n    </section>\n";
+  }
+
+  html += DASHBOARD_TAIL;
+}
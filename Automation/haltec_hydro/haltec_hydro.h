@@ -1,30 +1,88 @@
+#include <RadioLib.h>
+#include <SPI.h>
 #include <WiFi.h>
+#include <Wire.h>
 #include <ESPAsyncWebServer.h>
 #include <ArduinoJson.h>
-#include <DHT.h>
 #include <FS.h>
 #include <LittleFS.h>
+#include <mbedtls/md.h>
+#include <atomic>
+#include <type_traits>
+#include "relay_rules.h"
+#include "sensor_scheduler.h"
+#include "settings_journal.h"
+#include "telemetry_codec.h"
+#include "time_series.h"
+#include "traffic_classes.h"
+#include "zone_readings.h"
+#include "dashboard_html.h"
+#include "../../common/admission.h"
+#include "../../common/trace.h"
+#include "../../common/radio_profile.h"
 
-// Constants for sensors and relays
+// Default board: one zone with the sensors and relay modules below. More
+// zones, sensors and I2C relay expanders are described by the tables in
+// Settings and configured through /api/config.
 #define DHTPIN 4
-#define DHTTYPE DHT22
-#define WATER_SENSOR_PIN 35
+#define WATER_SENSOR_PIN 36
+
+// MH-Z19C CO2 sensor on UART2
+#define MHZ19_RX_PIN 39  // ESP32 RX <- sensor TX
+#define MHZ19_TX_PIN 33  // ESP32 TX -> sensor RX
+#define MHZ19_BAUD 9600
 
 // 8-Channel Relay Module Pins
 #define RELAY1_PIN 16
 #define RELAY2_PIN 17
-#define RELAY3_PIN 18
-#define RELAY4_PIN 19
+#define RELAY3_PIN 32
+#define RELAY4_PIN 13
 #define RELAY5_PIN 21
 #define RELAY6_PIN 22
 #define RELAY7_PIN 23
 #define RELAY8_PIN 25
 
 // 2-Channel High-Amperage Relay Module Pins
-#define HIGH_RELAY1_PIN 26
-#define HIGH_RELAY2_PIN 27
+#define HIGH_RELAY1_PIN 2
+#define HIGH_RELAY2_PIN 15
+
+#define DEFAULT_RELAYS 10
+const uint8_t DEFAULT_RELAY_PINS[DEFAULT_RELAYS] = {
+  RELAY1_PIN, RELAY2_PIN, RELAY3_PIN, RELAY4_PIN, RELAY5_PIN,
+  RELAY6_PIN, RELAY7_PIN, RELAY8_PIN, HIGH_RELAY1_PIN, HIGH_RELAY2_PIN
+};
+
+// On-board SX1276. Earlier defaults put relays and the water sensor on
+// these pins; images saved with those pins are moved by RADIO_PIN_MOVES.
+#define LORA_SCK 5
+#define LORA_MISO 19
+#define LORA_MOSI 27
+#define LORA_NSS 18
+#define LORA_RST 14
+#define LORA_DIO0 26
+#define LORA_DIO1 35
+const uint8_t RADIO_PINS[] = {LORA_SCK, LORA_MISO, LORA_MOSI, LORA_NSS, LORA_RST, LORA_DIO0, LORA_DIO1};
+const uint8_t RADIO_PIN_MOVES[][2] = {
+  {18, RELAY3_PIN}, {19, RELAY4_PIN}, {26, HIGH_RELAY1_PIN}, {27, HIGH_RELAY2_PIN}, {35, WATER_SENSOR_PIN}
+};
+
+// Zone tables
+#define MAX_ZONES 32
+#define MAX_SENSORS 64
+#define MAX_RELAYS 64
+#define MAX_EXPANDERS 8
+#define ZONE_NAME_LEN 16
 
-DHT dht(DHTPIN, DHTTYPE);
+// I2C bus for PCF8574 relay expanders, started only when one is configured
+#define I2C_SDA_PIN 21
+#define I2C_SCL_PIN 22
+#define I2C_CLOCK_HZ 100000
+
+// Each MH-Z19C needs its own UART; UART2 and UART1 are free on this board
+HardwareSerial co2Serial(2);
+HardwareSerial co2Serial1(1);
+HardwareSerial *const CO2_UARTS[] = {&co2Serial, &co2Serial1};
+const int NUM_CO2_UARTS = sizeof(CO2_UARTS) / sizeof(CO2_UARTS[0]);
 
 // Wi-Fi Credentials
 const char* ssid = "ESP32_AP";
@@ -33,25 +91,481 @@ const char* password = "admin123";
 // HTTP server
 AsyncWebServer server(80);
 
-// Global variables for settings
-struct Settings {
-  String adminUser;
-  String adminPassword;
+// Live updates: sensor and relay deltas are pushed to every connected client
+AsyncWebSocket ws("/ws");
+
+// Timing
+#define CONTROL_PERIOD_MS 500
+#define PUSH_INTERVAL_MS 1000
+#define RESTART_DELAY_MS 500
+
+// Sensor sampling: period and timeout per sensor (ms)
+#define DHT_PERIOD_MS 2000
+#define DHT_TIMEOUT_MS 25
+#define CO2_PERIOD_MS 5000
+#define CO2_TIMEOUT_MS 150
+#define WATER_PERIOD_MS 100
+#define WATER_TIMEOUT_MS 20
+
+// At most this many sensors start a sample per loop() pass, and a sensor
+// that cannot start yet (shared DHT22 capture in use) retries after
+// SENSOR_DEFER_MS, so one pass stays short however many sensors there are
+#define SENSOR_STARTS_PER_PASS 4
+#define SENSOR_DEFER_MS 5
+
+// Readings older than this are treated as missing by the control loop
+#define SENSOR_STALE_MS 10000
+
+// Time-series log: one sample per zone every LOG_SAMPLE_PERIOD_S into
+// 5-minute and hourly rollups for the first LOG_MAX_ZONES zones. The open
+// buckets are checkpointed every LOG_CHECKPOINT_S, which bounds what a
+// reboot loses.
+#define LOG_SAMPLE_PERIOD_S 10
+#define LOG_CHECKPOINT_S 60
+
+// Water level: samples averaged per reading, then an EMA with alpha 1/2^shift
+#define WATER_OVERSAMPLE 16
+#define WATER_SAMPLES_PER_POLL 4
+#define WATER_FILTER_SHIFT 3
+
+// A relay toggled by hand is left alone by its rules for this long
+#define MANUAL_OVERRIDE_MS (30UL * 60 * 1000)
+
+// Minimum change before a reading is pushed again
+#define TEMP_PUSH_DELTA 0.1
+#define HUMIDITY_PUSH_DELTA 0.1
+#define WATER_PUSH_DELTA 8
+
+// Largest /api/config body accepted
+#define CONFIG_BODY_MAX 8192
+#define CONFIG_JSON_CAPACITY 16384
+
+// I/O tables. A relay belongs to one zone, as a sensor does (SensorConfig
+// in zone_readings.h).
+enum RelayBus { BUS_GPIO, BUS_PCF8574 };
+#define RELAY_ACTIVE_LOW 0x01
+
+#define ROLE_NAME_LEN 12
+struct RelayConfig {
+  uint8_t zone;
+  uint8_t bus;      // RelayBus
+  uint8_t address;  // PCF8574 I2C address
+  uint8_t pin;      // GPIO number, or expander output 0-7
+  uint8_t flags;    // RELAY_ACTIVE_LOW
+  char role[ROLE_NAME_LEN];  // Fan, Pump, Light, Heater, Humidifier
+};
+
+struct ZoneSettings {
+  char name[ZONE_NAME_LEN];
   float tempMin;
   float tempMax;
   float humidityMin;
   float humidityMax;
   int waterLevelThreshold;
-  String relayAssignments[10]; // Fan, Pump, Light, etc.
-  bool relayStates[10];
+  float tempHysteresis;
+  float humidityHysteresis;
+  int waterHysteresis;
+  float lightOnHours;        // Light photoperiod per 24 h of the log clock
+};
+
+#define COMMAND_KEY_LEN 33
+
+// Global variables for settings. Plain data only: the struct is persisted
+// and restored as a raw binary image.
+struct Settings {
+  char adminUser[32];
+  char adminPassword[64];
+  uint16_t minOnSeconds;     // Shortest run once a rule switches a relay on
+  uint16_t minOffSeconds;    // Shortest rest once a rule switches a relay off
+  uint8_t zoneCount;
+  uint8_t sensorCount;
+  uint8_t relayCount;
+  uint8_t i2cSda;
+  uint8_t i2cScl;
+  ZoneSettings zones[MAX_ZONES];
+  SensorConfig sensors[MAX_SENSORS];
+  RelayConfig relays[MAX_RELAYS];
+  bool relayStates[MAX_RELAYS];
+  // Fields below were added in version 3; older images are a prefix
+  char commandKey[COMMAND_KEY_LEN];  // Shared with the gateway; empty disables commands
+  uint32_t commandSeq;               // Newest relay command applied
 } settings;
+static_assert(std::is_trivially_copyable<Settings>::value, "Settings is persisted as raw bytes");
+
+// Layout written by firmware before zones, migrated on first boot
+struct SettingsV1 {
+  char adminUser[32];
+  char adminPassword[64];
+  float tempMin;
+  float tempMax;
+  float humidityMin;
+  float humidityMax;
+  int waterLevelThreshold;
+  float tempHysteresis;
+  float humidityHysteresis;
+  int waterHysteresis;
+  float lightOnHours;
+  uint16_t minOnSeconds;
+  uint16_t minOffSeconds;
+  char relayAssignments[DEFAULT_RELAYS][ROLE_NAME_LEN];
+  bool relayStates[DEFAULT_RELAYS];
+};
+
+// A configuration posted to /api/config, applied from loop()
+Settings stagedSettings;
+volatile bool configStaged = false;
+uint32_t restartAt = 0;
+
+// Threshold and role changes posted to /settings, applied from loop().
+// Only the fields the form edits are staged, so relay states and command
+// sequences loop() changed in the meantime are not overwritten.
+struct SettingsEdit {
+  uint8_t zone;
+  ZoneSettings zoneSettings;
+  uint16_t minOnSeconds;
+  uint16_t minOffSeconds;
+  char commandKey[COMMAND_KEY_LEN];
+  char roles[MAX_RELAYS][ROLE_NAME_LEN];
+};
+SettingsEdit settingsEdit;
+volatile bool settingsEditStaged = false;
+
+// Settings persistence
+//
+// The settings image lives in two slot files; a commit always writes the
+// slot that does not hold the newest image, so a power cut mid-write
+// leaves the previous one intact. Between commits, changes are appended to
+// a journal as byte-range patches against the image. Bursts of changes are
+// coalesced into one append after a debounce window, and the journal is
+// folded into a fresh image once it grows past SETTINGS_JOURNAL_MAX.
+#define SETTINGS_MAGIC 0x53445948  // "HYDS"
+#define SETTINGS_VERSION 3
+#define SETTINGS_VERSION_V2 2
+#define SETTINGS_VERSION_V1 1
+#define SETTINGS_V2_SIZE offsetof(Settings, commandKey)
+#define SETTINGS_DEBOUNCE_MS 2000
+#define SETTINGS_MAX_DELAY_MS 10000
+#define SETTINGS_JOURNAL_MAX 1024
+#define SETTINGS_ENTRY_MAX (sizeof(JournalHeader) + sizeof(Settings) + 64)
+
+// Slots, journal, replay and load order are in settings_journal.h; this
+// sketch backs its SettingsStore with LittleFS.
+size_t settingsFileRead(const char *path, size_t offset, uint8_t *data, size_t len);
+bool settingsFileWrite(const char *path, bool append, const uint8_t *data, size_t len);
+SettingsStore settingsStore = {{"/settings.a.bin", "/settings.b.bin"}, "/settings.jnl", SETTINGS_MAGIC,
+                               settingsFileRead, settingsFileWrite, 0, 1, 0};
+Settings persistedSettings;  // What record + journal on flash add up to
+Settings settingsSnapshot;   // The copy being written; see appendSettingsJournal()
+bool settingsDirty = false;  // Guarded by settingsMux, as saveSettings() may run on any task
+bool settingsImageDue = false;  // The last write failed; write a full image next
+uint32_t settingsDirtyAt = 0;
+uint32_t settingsFirstDirtyAt = 0;
+portMUX_TYPE settingsMux = portMUX_INITIALIZER_UNLOCKED;
+uint8_t journalEntry[SETTINGS_ENTRY_MAX];  // Scratch for one journal entry
+
+// Relay rules
+//
+// compileRules() turns the relay assignments into a flat table when the
+// settings change. Each tick the zone readings are converted once into
+// integer source values (same fixed-point units as the log), and every
+// rule is a compare against two precomputed levels: it latches on past
+// onLevel and releases past offLevel, so the band between them is the
+// hysteresis. A rule reads only its relay's zone, so the tick costs one
+// pass over the zones plus one over the rules. The engine itself is in
+// relay_rules.h.
+static_assert((int)SRC_TEMP == LOG_TEMP && (int)SRC_HUMIDITY == LOG_HUMIDITY && (int)SRC_CO2 == LOG_CO2 &&
+              (int)SRC_WATER == LOG_WATER && (int)SRC_TIME_OF_DAY == LOG_FIELDS,
+              "Rule sources follow the log fields");
+static_assert(RULE_MISSING == LOG_MISSING, "Rules and log share the missing marker");
+
+#define MAX_RULES (MAX_RELAYS * 2)
+RelayRule rules[MAX_RULES];
+int ruleCount = 0;
+bool relayRuled[MAX_RELAYS];          // Relays driven by at least one rule
+uint32_t relayChangedAt[MAX_RELAYS];  // millis() of the last switch
+uint32_t overrideUntil[MAX_RELAYS];   // Manual hold after a toggle
+int32_t zoneSources[MAX_ZONES][SRC_COUNT];
+uint32_t controlTickMaxUs = 0;        // Slowest control tick since boot
+
+// PCF8574 relay expanders. Relay writes only touch a shadow byte; each
+// dirty expander is written in one I2C transaction at the end of a tick.
+struct Expander {
+  uint8_t address;
+  uint8_t shadow;
+  bool dirty;
+};
+
+Expander expanders[MAX_EXPANDERS];
+int expanderCount = 0;
+uint8_t relayExpander[MAX_RELAYS];  // Index into expanders, per relay
+
+// Latest readings per zone, shared by the control loop and the web
+// handlers; see zone_readings.h
+SensorSnapshot readings[MAX_ZONES];
+
+// Sensor drivers report progress to the scheduler in sensor_scheduler.h
+// without blocking. Driver state and the last good sample per sensor:
+struct SensorState {
+  float temperature;
+  float humidity;
+  int32_t value;     // CO2 ppm or water level
+  uint32_t at;       // millis() of the last good sample, 0 if none
+  // Driver scratch
+  HardwareSerial *uart;
+  uint32_t accum;
+  int32_t filtered;
+  uint8_t count;
+  uint8_t reply[9];
+};
+
+SensorState sensorStates[MAX_SENSORS];
+SensorTask sensorTasks[MAX_SENSORS];
+
+// Time-series log
+//
+// Buckets, checkpoints and range queries are in time_series.h; this
+// sketch backs its LogStore with LittleFS. logTick() on loop() adds to the
+// open buckets and handleHistory() on the web task copies one, both under
+// logMux; file writes happen outside it.
+#define LOG_CHECKPOINT_PATH "/ts_open.bin"
+
+bool logWriteAt(const char *path, size_t offset, const uint8_t *data, size_t len);
+const LogStore LOG_STORE = {settingsFileRead, logWriteAt};
+
+uint32_t logEpoch = 0;  // logNow() at millis() == 0
+uint32_t logNextSampleAt = 0;
+uint32_t logCheckpointAt = 0;  // logNow() of the next checkpoint
+portMUX_TYPE logMux = portMUX_INITIALIZER_UNLOCKED;
+
+const RollupLevel rollupLevels[] = {
+  {300, 2016, "ts_5m"},  // 7 days of 5-minute buckets
+  {3600, 720, "ts_1h"},  // 30 days of hourly buckets
+};
+const int NUM_ROLLUP_LEVELS = sizeof(rollupLevels) / sizeof(rollupLevels[0]);
+static_assert(NUM_ROLLUP_LEVELS <= LOG_MAX_LEVELS, "A checkpoint holds LOG_MAX_LEVELS levels");
+LogCheckpoint logOpen;  // Open buckets, guarded by logMux; magic and time are set when saved
+
+// Values last pushed to WebSocket clients, so only changes go out
+struct PushedState {
+  float temperature;
+  float humidity;
+  int co2;
+  int waterLevel;
+};
+
+PushedState pushed[MAX_ZONES];
+int8_t pushedRelays[MAX_RELAYS];  // -1 until first pushed
+
+// Relay toggles requested by web clients, applied from loop()
+std::atomic<uint32_t> pendingToggles[MAX_RELAYS / 32];
+
+// LoRa telemetry
+//
+// Every TELEMETRY_PERIOD_MS the controller sends its zone readings (log
+// fixed-point units) and relay bitmap to the gateway. A KEY frame carries
+// absolute values; a DELTA frame carries int8 changes against the last
+// frame the gateway acknowledged, so a lost frame or ACK never corrupts
+// the gateway's view. A KEY is sent every TELEMETRY_KEY_INTERVAL frames,
+// when too many frames go unacknowledged, or when a change does not fit
+// in a delta.
+//
+//   byte 0    TELEMETRY_MARK | flags | type
+//   byte 1-2  node id (little-endian)
+//   byte 3    sequence number
+//   KEY       zone count, relay count, int16 values per zone and field,
+//             relay bitmap
+//   DELTA     base sequence, a 4-bit changed-field mask per zone (two per
+//             byte), int8 delta per changed field, relay bitmap when
+//             FRAME_FLAG_RELAYS is set
+//   ACK       (gateway to node) header only, sequence = frame acknowledged
+//   CMD       (gateway to node) uint32 command sequence, change count, one
+//             byte per change (relay index | 0x80 for on), tag
+//   STATE     (node to gateway) uint32 newest command applied, relay
+//             count, relay bitmap, tag
+//   ALARM     (node to gateway) zone count, uint32 bitmap of zones under
+//             their water threshold
+//   ALARM_ACK (gateway to node) header only, sequence = alarm acknowledged
+//   last      CRC-8 of everything before it
+//
+// CMD and STATE carry a truncated HMAC-SHA256 tag under the command key.
+// A command sets absolute relay states and is applied only when its
+// sequence is newer than the last one applied, so a retried or replayed
+// command changes nothing; the node still answers with its current
+// state, which is how the gateway learns a retry already landed.
+//
+// 0xA_ can never start a UTF-8 text message, so the gateway tells these
+// frames apart from chat traffic by the first byte alone. Frame
+// constants, the KEY/DELTA encoder and command parsing are in
+// telemetry_codec.h.
+#define TELEMETRY_PERIOD_MS 30000
+#define TELEMETRY_KEY_INTERVAL 20
+#define TELEMETRY_MAX_UNACKED 8
+static_assert(TELEMETRY_FIELDS == LOG_FIELDS && TELEMETRY_MAX_RELAYS == MAX_RELAYS &&
+              TELEMETRY_MISSING == LOG_MISSING, "Telemetry frames carry the log fields and relay table");
+
+SX1276 radio = new Module(LORA_NSS, LORA_DIO0, LORA_RST, LORA_DIO1);
+volatile bool radioEvent = false;  // DIO0: transmit done or packet received
+bool radioReady = false;
+bool radioTransmitting = false;
+
+uint16_t telemetryNodeId = 0;
+uint8_t telemetrySeq = 0;
+uint8_t telemetryFramesSinceKey = 0;
+uint32_t telemetryNextAt = 0;
+TelemetryState telemetrySent;   // Content of frame telemetrySeq
+TelemetryState telemetryAcked;  // Content of the newest acknowledged frame
+uint8_t telemetryAckedSeq = 0;
+bool telemetryHaveAck = false;
+uint32_t radioTxStartedUs = 0;
+size_t radioTxLength = 0;
+
+// Traffic classes and alarms: the slots, the wait for answers, the alarm
+// rounds and their rate limit are in traffic_classes.h; the sketch drives
+// the radio.
+TxSlot txSlots[TRAFFIC_CLASSES];
+int txClass = 0;  // Class of the frame on the air while radioTransmitting
+TxAnswerWait txAnswer;
+AlarmState alarmState;
+uint32_t alarmChangedUs = 0;  // When alarmState.reported changed, for latency
+
+// Metrics
+//
+// Counters and histograms for the control loop, radio, HMAC and HTTP
+// paths, served at /metrics in Prometheus text format and printed by the
+// serial command "/metrics". Recording is one relaxed atomic add, safe
+// from the web server task. Histograms count microseconds in power-of-four
+// buckets, so the bucket is found from the leading-zero count; sums wrap
+// like any 32-bit counter.
+#define METRIC_BUCKETS 11  // le 3, 15, 63, ... 4^11-1 us, then +Inf
+enum CounterId { COUNTER_TX, COUNTER_TX_ERRORS, COUNTER_RX, COUNTER_RX_ERRORS, COUNTER_AIRTIME,
+                 COUNTER_HTTP_REJECTED_HEAP, COUNTER_HTTP_REJECTED_BUSY, COUNTER_HTTP_REJECTED_RATE,
+                 COUNTER_HTTP_REJECTED_BODY, COUNTER_TX_PREEMPTED, COUNTER_ALARM_TX, COUNTER_ALARM_ACKED,
+                 COUNTER_ALARM_DEFERRED, COUNTER_COUNT };
+const char* COUNTER_NAMES[] = {"lora_tx_total", "lora_tx_errors_total", "lora_rx_total", "lora_rx_errors_total",
+                               "lora_airtime_microseconds_total", "http_rejected_heap_total",
+                               "http_rejected_busy_total", "http_rejected_rate_total", "http_rejected_body_total",
+                               "lora_tx_preempted_total", "alarm_tx_total", "alarm_acked_total",
+                               "alarm_deferred_total"};
+enum HistogramId { HIST_CONTROL, HIST_TX, HIST_HMAC, HIST_HTTP, HIST_ALARM, HIST_COUNT };
+const char* HISTOGRAM_NAMES[] = {"control_tick_microseconds", "lora_tx_microseconds", "hmac_microseconds",
+                                 "http_handler_microseconds", "alarm_latency_microseconds"};
+
+struct Histogram {
+  std::atomic<uint32_t> buckets[METRIC_BUCKETS + 1];  // Last is +Inf
+  std::atomic<uint32_t> sum;
+};
+
+std::atomic<uint32_t> counters[COUNTER_COUNT];
+Histogram histograms[HIST_COUNT];
+
+inline void countMetric(CounterId id, uint32_t n) {
+  counters[id].fetch_add(n, std::memory_order_relaxed);
+}
+
+inline void observeMetric(HistogramId id, uint32_t us) {
+  uint32_t bucket = (31 - __builtin_clz(us | 1)) / 2;
+  histograms[id].buckets[bucket < METRIC_BUCKETS ? bucket : METRIC_BUCKETS].fetch_add(1, std::memory_order_relaxed);
+  histograms[id].sum.fetch_add(us, std::memory_order_relaxed);
+}
+
+// Admission Control
+//
+// See admission.h. /api/config takes up to CONFIG_BODY_MAX, other form
+// posts ADMISSION_BODY_MAX. /ws upgrades hold no in-flight slot but are
+// capped at maxUpgrades open dashboards.
+#define ADMISSION_BODY_MAX 4096
+const AdmissionLimits ADMISSION_LIMITS = {
+  24576,  // heapReserve
+  4,      // maxInFlight
+  4,      // maxUpgrades
+  5,      // ratePerS
+  10,     // burst
+  8,      // clients
+  [](const char *url) -> size_t { return strcmp(url, "/api/config") == 0 ? CONFIG_BODY_MAX : ADMISSION_BODY_MAX; },
+  []() -> size_t { return ws.count(); },
+};
+Admission admission = {&ADMISSION_LIMITS, {}, 0, {}};
+
+// Performance Suite
+//
+// "/perf" on Serial times the per-message paths on the device itself:
+// dashboard and WebSocket rendering, config JSON both ways, rule
+// evaluation, telemetry encoding, the command HMAC and the settings CRC.
+// Each case repeats for at least PERF_CASE_MS after one warm-up call.
+// "heap B/op" is the change in free heap per call, so anything but 0 is
+// memory a path keeps. "/perf save" stores the results as the baseline,
+// and later runs flag cases more than PERF_REGRESSION_PCT slower. The
+// control loop pauses for the run, under two seconds.
+#define PERF_CASE_MS 200
+#define PERF_REGRESSION_PCT 10
+#define PERF_NAME_LEN 16
+#define PERF_MAX_CASES 16
+const char* PERF_BASELINE_PATH = "/perf.bin";
+
+struct PerfCase {
+  const char *name;
+  void (*run)();
+};
+
+struct PerfResult {
+  char name[PERF_NAME_LEN];
+  uint32_t nsPerOp;
+  int32_t heapPerOp;
+};
+
+String perfConfigJson;               // Input of the config_parse case
+volatile uint32_t perfSinkValue;     // Keeps pure cases from being optimised away
+
+// Tracing
+//
+// See trace.h. The control loop, radio, log and web paths are slices;
+// each sensor sample is an async span from start to completion, named
+// after its driver.
+#if TRACE_ENABLED
+enum TraceName { TRACE_CONTROL, TRACE_SENSORS, TRACE_LOG, TRACE_RADIO, TRACE_TELEMETRY, TRACE_HTTP, TRACE_SAMPLE };
+const char* TRACE_NAMES[] = {"controlTick", "runSensorTasks", "logTick", "radioTick", "telemetryTick", "http",
+                             "sample"};
+#endif
+#define TRACE_SAMPLE_BEGIN(id) TRACE_SPAN_BEGIN(TRACE_SAMPLE, id)
+#define TRACE_SAMPLE_END(id) TRACE_SPAN_END(TRACE_SAMPLE, id)
 
 // Function prototypes
 void initWiFi();
 void initWebServer();
+void initSensors();
+void initRelays();
 void loadSettings();
 void saveSettings();
+bool commitSettings();
+bool commitSettingsImage(const Settings &image);
+void settingsPersistTick();
 String generateDashboard();
+void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type,
+               void *arg, uint8_t *data, size_t len);
+String buildUpdate(bool full);
+void pushUpdates();
+void queueToggle(int index);
+void setRelay(int index, bool on);
+void flushExpanders();
+void compileRules();
+void applySettingsEdit();
+void runSensorTasks();
+void controlTick();
+bool sensorFresh(uint32_t at);
+void readZoneValues(int zone, int16_t values[LOG_FIELDS]);
+void initLog();
+void logTick();
+void handleHistory(AsyncWebServerRequest *request);
+void handleSetTime(AsyncWebServerRequest *request);
+void handleState(AsyncWebServerRequest *request);
+void initRadio();
+void radioTick();
+void telemetryTick();
+void alarmTick();
+void txTick();
+bool radioTransmit(uint8_t *data, size_t len);
+void serialTick();
+void printMetrics(Print &out);
 
 void setup() {
   Serial.begin(115200);
@@ -64,277 +578,1925 @@ void setup() {
 
   // Load settings
   loadSettings();
+  compileRules();
+
+  // Open the sensor history log
+  initLog();
 
   // Initialize Wi-Fi
   initWiFi();
 
-  // Initialize DHT sensor
-  dht.begin();
-
-  // Initialize relays
-  pinMode(RELAY1_PIN, OUTPUT);
-  pinMode(RELAY2_PIN, OUTPUT);
-  pinMode(RELAY3_PIN, OUTPUT);
-  pinMode(RELAY4_PIN, OUTPUT);
-  pinMode(RELAY5_PIN, OUTPUT);
-  pinMode(RELAY6_PIN, OUTPUT);
-  pinMode(RELAY7_PIN, OUTPUT);
-  pinMode(RELAY8_PIN, OUTPUT);
-  pinMode(HIGH_RELAY1_PIN, OUTPUT);
-  pinMode(HIGH_RELAY2_PIN, OUTPUT);
+  // Initialize sensors and relays (to their saved states) from the tables
+  initSensors();
+  initRelays();
+
+  // LoRa telemetry to the gateway; the controller runs without it if the
+  // radio fails to start
+  initRadio();
 
   // Start HTTP server
   initWebServer();
 }
 
 void loop() {
-  // Read sensors periodically
-  float temperature = dht.readTemperature();
-  float humidity = dht.readHumidity();
+  static uint32_t lastControl = 0;
+  static uint32_t lastPush = 0;
 
-  // Relay control logic based on temperature and humidity
-  for (int i = 0; i < 10; i++) {
-    if (settings.relayAssignments[i] == "Fan" &&
-        (temperature > settings.tempMax || humidity > settings.humidityMax)) {
-      digitalWrite(relayPin(i), HIGH); // Turn ON fan relay
-      settings.relayStates[i] = true;
-    } else if (settings.relayAssignments[i] == "Fan") {
-      digitalWrite(relayPin(i), LOW); // Turn OFF fan relay
-      settings.relayStates[i] = false;
+  // A new configuration takes effect through a restart, so pins, UARTs
+  // and the I2C bus are set up from the new tables
+  if (configStaged) {
+    if (commitSettingsImage(stagedSettings)) {
+      memcpy(&settings, &stagedSettings, sizeof(Settings));
+      restartAt = millis() + RESTART_DELAY_MS;
+    } else {
+      Serial.println("Configuration not saved: settings write failed");
     }
+    configStaged = false;
   }
+  if (settingsEditStaged) {
+    applySettingsEdit();
+    settingsEditStaged = false;
+  }
+  if (restartAt) {
+    if ((int32_t)(millis() - restartAt) >= 0) {
+      ESP.restart();
+    }
+    delay(1);
+    return;
+  }
+
+  // Advance every sensor driver by one non-blocking step
+  runSensorTasks();
+
+  // Apply relay toggles queued by the web handlers
+  bool toggled = false;
+  for (int word = 0; word < MAX_RELAYS / 32; word++) {
+    uint32_t toggles = pendingToggles[word].exchange(0);
+    for (int i = word * 32; toggles; i++, toggles >>= 1) {
+      if ((toggles & 1) && i < settings.relayCount) {
+        setRelay(i, !settings.relayStates[i]);
+        overrideUntil[i] = millis() + MANUAL_OVERRIDE_MS;
+        toggled = true;
+      }
+    }
+  }
+  if (toggled) {
+    flushExpanders();
+    pushUpdates();
+  }
+
+  if (millis() - lastControl >= CONTROL_PERIOD_MS) {
+    lastControl = millis();
+    controlTick();
+  }
+
+  logTick();
+  settingsPersistTick();
+  radioTick();
+  alarmTick();
+  telemetryTick();
+  txTick();
+  serialTick();
 
-  // Water level warning
-  int waterLevel = analogRead(WATER_SENSOR_PIN);
-  if (waterLevel < settings.waterLevelThreshold) {
-    Serial.println("Low water level detected!");
+  if (millis() - lastPush >= PUSH_INTERVAL_MS) {
+    lastPush = millis();
+    pushUpdates();
+    ws.cleanupClients();
   }
 
-  delay(2000); // Adjust delay as needed
+  delay(1);
+}
+
+// True when a reading taken at 'at' is recent enough to act on
+bool sensorFresh(uint32_t at) {
+  return readingFresh(at, millis(), SENSOR_STALE_MS);
+}
+
+int32_t scaleLevel(float value, int field) {
+  return lroundf(value * LOG_SCALES[field]);
 }
 
-// Get relay pin by index
-int relayPin(int index) {
-  switch (index) {
-    case 0: return RELAY1_PIN;
-    case 1: return RELAY2_PIN;
-    case 2: return RELAY3_PIN;
-    case 3: return RELAY4_PIN;
-    case 4: return RELAY5_PIN;
-    case 5: return RELAY6_PIN;
-    case 6: return RELAY7_PIN;
-    case 7: return RELAY8_PIN;
-    case 8: return HIGH_RELAY1_PIN;
-    case 9: return HIGH_RELAY2_PIN;
-    default: return -1;
+// Rebuild the rule table from the settings; call from loop() whenever
+// they change. A rule that survives keeps its latched state, so an edit
+// does not drop the hysteresis of relays it did not touch.
+void compileRules() {
+  static RelayRule previous[MAX_RULES];
+  int previousCount = ruleCount;
+  memcpy(previous, rules, sizeof(RelayRule) * ruleCount);
+  ruleCount = 0;
+  memset(relayRuled, 0, sizeof(relayRuled));
+  for (int i = 0; i < settings.relayCount; i++) {
+    uint8_t z = settings.relays[i].zone;
+    const ZoneSettings &zone = settings.zones[z];
+    RuleLevels levels = {
+      scaleLevel(zone.tempMin, LOG_TEMP), scaleLevel(zone.tempMax, LOG_TEMP),
+      scaleLevel(zone.tempHysteresis, LOG_TEMP), scaleLevel(zone.humidityMin, LOG_HUMIDITY),
+      scaleLevel(zone.humidityMax, LOG_HUMIDITY), scaleLevel(zone.humidityHysteresis, LOG_HUMIDITY),
+      zone.waterLevelThreshold, zone.waterHysteresis, (int32_t)lroundf(zone.lightOnHours * 3600)
+    };
+    if (addRoleRules(rules, ruleCount, MAX_RULES, i, z, parseRole(settings.relays[i].role), levels) > 0) {
+      relayRuled[i] = true;
+    }
   }
+  carryRuleLatches(rules, ruleCount, previous, previousCount);
 }
 
-// Initialize Wi-Fi as AP + Client
-void initWiFi() {
-  WiFi.softAP(ssid, password);
-  Serial.println("Access Point Started");
+// Apply a /settings edit staged by the web task
+void applySettingsEdit() {
+  const SettingsEdit &edit = settingsEdit;
+  settings.zones[edit.zone] = edit.zoneSettings;
+  settings.minOnSeconds = edit.minOnSeconds;
+  settings.minOffSeconds = edit.minOffSeconds;
+  memcpy(settings.commandKey, edit.commandKey, COMMAND_KEY_LEN);
+  for (int i = 0; i < settings.relayCount; i++) {
+    memcpy(settings.relays[i].role, edit.roles[i], ROLE_NAME_LEN);
+  }
+  compileRules();
+  saveSettings();
 }
 
-// Start HTTP server and define routes
-void initWebServer() {
-  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(200, "text/html", generateDashboard());
-  });
+// Fold the per-sensor samples into per-zone readings
+void aggregateReadings() {
+  ZoneSums sums[MAX_ZONES];
+  aggregateZoneReadings(settings.sensors, sensorStates, settings.sensorCount, sums, readings, settings.zoneCount,
+                        millis(), SENSOR_STALE_MS);
+}
+
+// A zone's readings in log units, LOG_MISSING where nothing is fresh
+void readZoneValues(int zone, int16_t values[LOG_FIELDS]) {
+  zoneLogValues(readings[zone], millis(), SENSOR_STALE_MS, values);
+}
+
+// A relay is demanded when any of its rules is latched. Missing readings
+// release the rule, so loads fail safe to off.
+void evaluateRules(bool *demand) {
+  evaluateRuleTable(rules, ruleCount, zoneSources, demand, settings.relayCount);
+}
+
+// Relay control from the latest readings; never touches the sensors
+void controlTick() {
+  TRACE_SCOPE(TRACE_CONTROL);
+  uint32_t startedUs = micros();
+  uint32_t now = millis();
+  aggregateReadings();
+
+  zoneRuleSources(readings, settings.zoneCount, now, SENSOR_STALE_MS, logNow() % 86400, zoneSources);
 
-  server.on("/settings", HTTP_POST, [](AsyncWebServerRequest *request) {
-    if (request->hasParam("tempMin", true)) {
-      settings.tempMin = request->getParam("tempMin", true)->value().toFloat();
+  bool demand[MAX_RELAYS];
+  evaluateRules(demand);
+
+  // Switch relays whose demand changed, honouring minimum on/off times
+  for (int i = 0; i < settings.relayCount; i++) {
+    bool on = settings.relayStates[i];
+    if (relayRuled[i] && relayMaySwitch(on, demand[i], now, relayChangedAt[i], overrideUntil[i],
+                                        settings.minOnSeconds * 1000UL, settings.minOffSeconds * 1000UL)) {
+      setRelay(i, !on);
     }
-    saveSettings();
-    request->send(200, "application/json", "{\"message\":\"Settings saved\"}");
-  });
+  }
+  flushExpanders();
 
-  server.begin();
+  // Water level warning, printed when a zone's state changes;
+  // alarmTick() reports changes to the gateway
+  uint32_t lowWater = 0;
+  for (int z = 0; z < settings.zoneCount; z++) {
+    int32_t water = zoneSources[z][SRC_WATER];
+    if (water != LOG_MISSING && water < settings.zones[z].waterLevelThreshold) {
+      lowWater |= 1UL << z;
+    }
+  }
+  if (lowWater != alarmState.lowWater) {
+    for (int z = 0; z < settings.zoneCount; z++) {
+      uint32_t bit = 1UL << z;
+      if ((lowWater ^ alarmState.lowWater) & bit) {
+        Serial.printf(lowWater & bit ? "Low water level detected in %s!\n" : "Water level restored in %s\n",
+                      settings.zones[z].name);
+      }
+    }
+    alarmState.lowWater = lowWater;
+  }
+
+  uint32_t elapsedUs = micros() - startedUs;
+  observeMetric(HIST_CONTROL, elapsedUs);
+  if (elapsedUs > controlTickMaxUs) {
+    controlTickMaxUs = elapsedUs;
+  }
 }
 
-// Generate dashboard HTML
-String generateDashboard() {
-  String html = R"rawliteral(
-<!DOCTYPE html>
-<html>
-<head>
-  <title>ESP32 Dashboard</title>
-  <style>
-    body {
-      font-family: Arial, sans-serif;
-      margin: 0;
-      padding: 0;
-      background-color: #f4f4f4;
-    }
-    header {
-      background: #0073e6;
-      color: white;
-      padding: 1rem;
-      text-align: center;
-    }
-    h1, h2 {
-      margin: 0;
-    }
-    .container {
-      margin: 2rem;
-      padding: 2rem;
-      background: white;
-      border-radius: 8px;
-      box-shadow: 0px 4px 6px rgba(0, 0, 0, 0.1);
-    }
-    .status {
-      display: flex;
-      justify-content: space-between;
-      padding: 1rem 0;
-    }
-    .status div {
-      flex: 1;
-      margin: 0 1rem;
-      text-align: center;
-      border: 1px solid #ccc;
-      border-radius: 8px;
-      background: #f9f9f9;
-      padding: 1rem;
-    }
-    .status div p {
-      margin: 0.5rem 0;
-      font-size: 1.1rem;
-    }
-    .relays {
-      margin-top: 2rem;
-    }
-    .relay-item {
-      display: flex;
-      align-items: center;
-      justify-content: space-between;
-      padding: 1rem;
-      border-bottom: 1px solid #ddd;
-    }
-    .relay-item:last-child {
-      border-bottom: none;
-    }
-    .relay-item button {
-      padding: 0.5rem 1rem;
-      background: #0073e6;
-      color: white;
-      border: none;
-      border-radius: 4px;
-      cursor: pointer;
-    }
-    .relay-item button:disabled {
-      background: #ccc;
-    }
-    footer {
-      text-align: center;
-      padding: 1rem;
-      margin-top: 2rem;
-      background: #0073e6;
-      color: white;
-    }
-  </style>
-</head>
-<body>
-  <header>
-    <h1>ESP32 Environmental Control</h1>
-    <h2>Dashboard</h2>
-  </header>
-  <div class="container">
-    <section class="status">
-      <div>
-        <h3>Temperature</h3>
-        <p><strong>)rawliteral" + String(dht.readTemperature()) + R"rawliteral( °C</strong></p>
-      </div>
-      <div>
-        <h3>Humidity</h3>
-        <p><strong>)rawliteral" + String(dht.readHumidity()) + R"rawliteral( %</strong></p>
-      </div>
-      <div>
-        <h3>Water Level</h3>
-        <p><strong>)rawliteral" + String(analogRead(WATER_SENSOR_PIN)) + R"rawliteral(</strong></p>
-      </div>
-    </section>
-    <section class="relays">
-      <h3>Relay Control</h3>
-      <div>
-)rawliteral";
-
-  // Add relay controls dynamically
-  for (int i = 0; i < 10; i++) {
-    html += R"rawliteral(
-        <div class="relay-item">
-          <span>Relay )rawliteral" + String(i + 1) + R"rawliteral(: )rawliteral" + settings.relayAssignments[i] + R"rawliteral(</span>
-          <button onclick="toggleRelay()rawliteral" + String(i) + R"rawliteral()">)rawliteral" +
-            (settings.relayStates[i] ? "Turn OFF" : "Turn ON") +
-            R"rawliteral(</button>
-        </div>
-    )rawliteral";
-  }
-
-  // Closing HTML
-  html += R"rawliteral(
-      </div>
-    </section>
-  </div>
-  <footer>
-    <p>&copy; 2025 HiLetgo ESP32 LoRa Environmental Control</p>
-  </footer>
-  <script>
-    function toggleRelay(index) {
-      fetch(`/toggle?relay=${index}`)
-        .then(response => response.json())
-        .then(data => {
-          alert(data.message);
-          location.reload();
-        })
-        .catch(error => console.error('Error:', error));
-    }
-  </script>
-</body>
-</html>
-  )rawliteral";
+// Set up relay outputs and expanders from the table, then restore the
+// saved relay states
+void initRelays() {
+  expanderCount = 0;
+  for (int i = 0; i < settings.relayCount; i++) {
+    const RelayConfig &relay = settings.relays[i];
+    relayExpander[i] = MAX_EXPANDERS;
+    if (relay.bus != BUS_PCF8574) {
+      pinMode(relay.pin, OUTPUT);
+      continue;
+    }
+    for (int e = 0; e < expanderCount; e++) {
+      if (expanders[e].address == relay.address) {
+        relayExpander[i] = e;
+      }
+    }
+    if (relayExpander[i] == MAX_EXPANDERS && expanderCount < MAX_EXPANDERS) {
+      // PCF8574 outputs power up high
+      expanders[expanderCount] = {relay.address, 0xFF, true};
+      relayExpander[i] = expanderCount++;
+    }
+  }
+  if (expanderCount > 0) {
+    Wire.begin(settings.i2cSda, settings.i2cScl, I2C_CLOCK_HZ);
+  }
 
-  return html;
+  for (int i = 0; i < settings.relayCount; i++) {
+    setRelay(i, settings.relayStates[i]);
+  }
+  flushExpanders();
 }
 
+// Drive a relay and record its state. Expander outputs are buffered
+// until flushExpanders().
+void setRelay(int index, bool on) {
+  const RelayConfig &relay = settings.relays[index];
+  bool level = on != ((relay.flags & RELAY_ACTIVE_LOW) != 0);
+  if (relay.bus == BUS_PCF8574) {
+    if (relayExpander[index] < expanderCount) {
+      Expander &expander = expanders[relayExpander[index]];
+      uint8_t bit = 1 << (relay.pin & 7);
+      expander.shadow = level ? expander.shadow | bit : expander.shadow & ~bit;
+      expander.dirty = true;
+    }
+  } else {
+    digitalWrite(relay.pin, level ? HIGH : LOW);
+  }
+  if (settings.relayStates[index] != on) {
+    relayChangedAt[index] = millis();
+  }
+  settings.relayStates[index] = on;
+}
 
-// Load settings from JSON file
-void loadSettings() {
-  if (LittleFS.exists("/settings.json")) {
-    File file = LittleFS.open("/settings.json", "r");
-    StaticJsonDocument<1024> doc;
-    deserializeJson(doc, file);
-    file.close();
+// Write every expander whose outputs changed, one byte each
+void flushExpanders() {
+  for (int e = 0; e < expanderCount; e++) {
+    Expander &expander = expanders[e];
+    if (!expander.dirty) {
+      continue;
+    }
+    Wire.beginTransmission(expander.address);
+    Wire.write(expander.shadow);
+    expander.dirty = Wire.endTransmission() != 0;  // Retry next tick on a NACK
+  }
+}
+
+// DHT22: the host start pulse and the 40-bit reply are timed from GPIO
+// edge interrupts, so a read never busy-waits. Each bit starts with a
+// falling edge; the gap to the next falling edge is ~78us for a 0 and
+// ~120us for a 1. All DHT22s share one capture buffer, so one read is in
+// flight at a time and the others defer.
+#define DHT_START_LOW_US 1100
+#define DHT_EDGES 42  // response edge + 40 bits + trailing edge
+#define DHT_ONE_THRESHOLD_US 100
+
+volatile uint32_t dhtEdges[DHT_EDGES];
+volatile uint8_t dhtEdgeCount = 0;
+uint32_t dhtStartedUs = 0;
+bool dhtListening = false;
+int dhtOwner = -1;  // Sensor id holding the capture buffer
+
+void IRAM_ATTR dhtEdgeIsr() {
+  if (dhtEdgeCount < DHT_EDGES) {
+    dhtEdges[dhtEdgeCount++] = micros();
+  }
+}
+
+SampleResult dhtStart(uint8_t id) {
+  if (dhtOwner >= 0) {
+    return SAMPLE_DEFER;
+  }
+  dhtOwner = id;
+  uint8_t pin = settings.sensors[id].pin;
+  pinMode(pin, OUTPUT);
+  digitalWrite(pin, LOW);
+  dhtStartedUs = micros();
+  dhtListening = false;
+  return SAMPLE_BUSY;
+}
 
-    settings.tempMin = doc["tempMin"];
-    settings.tempMax = doc["tempMax"];
-    settings.humidityMin = doc["humidityMin"];
-    settings.humidityMax = doc["humidityMax"];
-    settings.waterLevelThreshold = doc["waterLevelThreshold"];
-    for (int i = 0; i < 10; i++) {
-      settings.relayAssignments[i] = doc["relayAssignments"][i].as<String>();
-      settings.relayStates[i] = doc["relayStates"][i];
+SampleResult dhtPoll(uint8_t id) {
+  uint8_t pin = settings.sensors[id].pin;
+  if (!dhtListening) {
+    if (micros() - dhtStartedUs < DHT_START_LOW_US) {
+      return SAMPLE_BUSY;
     }
+    // Arm the edge capture before releasing the line to the sensor
+    dhtEdgeCount = 0;
+    attachInterrupt(digitalPinToInterrupt(pin), dhtEdgeIsr, FALLING);
+    pinMode(pin, INPUT_PULLUP);
+    dhtListening = true;
+    return SAMPLE_BUSY;
+  }
+  if (dhtEdgeCount < DHT_EDGES) {
+    return SAMPLE_BUSY;
+  }
+  detachInterrupt(digitalPinToInterrupt(pin));
+  dhtListening = false;
+  dhtOwner = -1;
+
+  uint8_t data[5] = {0};
+  for (int bit = 0; bit < 40; bit++) {
+    uint32_t period = dhtEdges[bit + 2] - dhtEdges[bit + 1];
+    data[bit / 8] = (data[bit / 8] << 1) | (period > DHT_ONE_THRESHOLD_US ? 1 : 0);
+  }
+  if (((data[0] + data[1] + data[2] + data[3]) & 0xFF) != data[4]) {
+    return SAMPLE_FAILED;
   }
+
+  SensorState &state = sensorStates[id];
+  state.humidity = ((data[0] << 8) | data[1]) * 0.1f;
+  state.temperature = (((data[2] & 0x7F) << 8) | data[3]) * 0.1f;
+  if (data[2] & 0x80) {
+    state.temperature = -state.temperature;
+  }
+  state.at = millis();
+  return SAMPLE_DONE;
 }
 
-// Save settings to JSON file
-void saveSettings() {
-  StaticJsonDocument<1024> doc;
-  doc["tempMin"] = settings.tempMin;
-  doc["tempMax"] = settings.tempMax;
-  doc["humidityMin"] = settings.humidityMin;
-  doc["humidityMax"] = settings.humidityMax;
-  doc["waterLevelThreshold"] = settings.waterLevelThreshold;
+void dhtAbort(uint8_t id) {
+  uint8_t pin = settings.sensors[id].pin;
+  detachInterrupt(digitalPinToInterrupt(pin));
+  pinMode(pin, INPUT_PULLUP);
+  dhtListening = false;
+  dhtOwner = -1;
+}
+
+// MH-Z19C: send the "read CO2" command, then collect the 9-byte reply as
+// it trickles in over UART.
+const uint8_t MHZ19_READ_CMD[9] = {0xFF, 0x01, 0x86, 0x00, 0x00, 0x00, 0x00, 0x00, 0x79};
+
+SampleResult co2Start(uint8_t id) {
+  SensorState &state = sensorStates[id];
+  if (!state.uart) {
+    return SAMPLE_FAILED;  // No UART left for this sensor
+  }
+  while (state.uart->available()) {
+    state.uart->read();  // Drop stale bytes from an earlier timed-out reply
+  }
+  state.uart->write(MHZ19_READ_CMD, sizeof(MHZ19_READ_CMD));
+  state.count = 0;
+  return SAMPLE_BUSY;
+}
+
+SampleResult co2Poll(uint8_t id) {
+  SensorState &state = sensorStates[id];
+  while (state.uart->available() && state.count < sizeof(state.reply)) {
+    uint8_t b = state.uart->read();
+    // Resynchronise on the 0xFF 0x86 reply header
+    if ((state.count == 0 && b != 0xFF) || (state.count == 1 && b != 0x86)) {
+      state.count = 0;
+      continue;
+    }
+    state.reply[state.count++] = b;
+  }
+  if (state.count < sizeof(state.reply)) {
+    return SAMPLE_BUSY;
+  }
+
+  uint8_t checksum = 0;
+  for (int i = 1; i < 8; i++) {
+    checksum += state.reply[i];
+  }
+  checksum = 0xFF - checksum + 1;
+  if (checksum != state.reply[8]) {
+    return SAMPLE_FAILED;
+  }
+
+  state.value = state.reply[2] * 256 + state.reply[3];
+  state.at = millis();
+  return SAMPLE_DONE;
+}
+
+void co2Abort(uint8_t id) {
+  sensorStates[id].count = 0;
+}
+
+// Water level: a burst of ADC samples spread over a few polls, averaged,
+// then smoothed with an exponential moving average (kept in 1/16 units).
+SampleResult waterStart(uint8_t id) {
+  SensorState &state = sensorStates[id];
+  state.accum = 0;
+  state.count = 0;
+  return SAMPLE_BUSY;
+}
+
+SampleResult waterPoll(uint8_t id) {
+  SensorState &state = sensorStates[id];
+  uint8_t pin = settings.sensors[id].pin;
+  for (int i = 0; i < WATER_SAMPLES_PER_POLL && state.count < WATER_OVERSAMPLE; i++) {
+    state.accum += analogRead(pin);
+    state.count++;
+  }
+  if (state.count < WATER_OVERSAMPLE) {
+    return SAMPLE_BUSY;
+  }
+
+  int32_t average = (state.accum << 4) / WATER_OVERSAMPLE;
+  if (state.filtered < 0) {
+    state.filtered = average;
+  } else {
+    state.filtered += (average - state.filtered) >> WATER_FILTER_SHIFT;
+  }
+  state.value = (state.filtered + 8) >> 4;
+  state.at = millis();
+  return SAMPLE_DONE;
+}
+
+void waterAbort(uint8_t id) {
+  sensorStates[id].count = 0;
+}
+
+// Indexed by SensorKind
+const SensorDriver SENSOR_DRIVERS[NUM_SENSOR_KINDS] = {
+  {"none", 0, 0, nullptr, nullptr, nullptr},
+  {"dht22", DHT_PERIOD_MS, DHT_TIMEOUT_MS, dhtStart, dhtPoll, dhtAbort},
+  {"mhz19c", CO2_PERIOD_MS, CO2_TIMEOUT_MS, co2Start, co2Poll, co2Abort},
+  {"water", WATER_PERIOD_MS, WATER_TIMEOUT_MS, waterStart, waterPoll, waterAbort},
+};
+
+const SensorScheduler SENSOR_SCHEDULER = {
+  SENSOR_DRIVERS, NUM_SENSOR_KINDS, SENSOR_STARTS_PER_PASS, SENSOR_DEFER_MS,
+#if TRACE_ENABLED
+  [](uint8_t id) { TRACE_SAMPLE_BEGIN(id); },
+  [](uint8_t id) { TRACE_SAMPLE_END(id); },
+#else
+  nullptr, nullptr,
+#endif
+};
+
+SensorKind parseSensorKind(const char *name) {
+  for (int kind = 1; kind < NUM_SENSOR_KINDS; kind++) {
+    if (strcasecmp(name, SENSOR_DRIVERS[kind].name) == 0) {
+      return (SensorKind)kind;
+    }
+  }
+  return SENSOR_NONE;
+}
+
+// Prepare each configured sensor. First samples are spread across each
+// sensor's period so sensors of one kind do not all start together.
+void initSensors() {
+  int uarts = 0;
+  uint32_t now = millis();
+  for (int z = 0; z < MAX_ZONES; z++) {
+    readings[z] = {NAN, NAN, -1, 0, 0, 0, 0};
+  }
+  for (int id = 0; id < settings.sensorCount; id++) {
+    const SensorConfig &sensor = settings.sensors[id];
+    SensorState &state = sensorStates[id];
+    memset(&state, 0, sizeof(state));
+    state.filtered = -1;
+
+    switch (sensor.kind) {
+      case SENSOR_DHT22:
+        pinMode(sensor.pin, INPUT_PULLUP);
+        break;
+      case SENSOR_MHZ19C:
+        if (uarts < NUM_CO2_UARTS) {
+          state.uart = CO2_UARTS[uarts++];
+          state.uart->begin(MHZ19_BAUD, SERIAL_8N1, sensor.pin, sensor.pin2);
+        } else {
+          Serial.printf("Sensor %d: no free UART for MH-Z19C\n", id);
+        }
+        break;
+    }
+    sensorTasks[id] = {sensor.kind, false, 0, 0, 0};
+  }
+  scheduleFirstSamples(SENSOR_SCHEDULER, sensorTasks, settings.sensorCount, now);
+}
+
+// Advance every sensor by one step; see sensor_scheduler.h
+void runSensorTasks() {
+  TRACE_SCOPE(TRACE_SENSORS);
+  runSensorScheduler(SENSOR_SCHEDULER, sensorTasks, settings.sensorCount, millis());
+}
+
+uint32_t logNow() {
+  return logEpoch + millis() / 1000;
+}
+
+int loggedZones() {
+  return min((int)settings.zoneCount, LOG_MAX_ZONES);
+}
+
+void rollupPath(const RollupLevel &level, int zone, char *path, size_t size) {
+  if (zone == 0) {
+    snprintf(path, size, "/%s.bin", level.name);
+  } else {
+    snprintf(path, size, "/%s.z%d.bin", level.name, zone);
+  }
+}
 
-  JsonArray relayAssignments = doc.createNestedArray("relayAssignments");
-  JsonArray relayStates = doc.createNestedArray("relayStates");
-  for (int i = 0; i < 10; i++) {
-    relayAssignments.add(settings.relayAssignments[i]);
-    relayStates.add(settings.relayStates[i]);
+// Create a file of the given size filled with zeros so slots can be
+// rewritten in place
+void logEnsureFile(const char* path, size_t size) {
+  if (LittleFS.exists(path)) {
+    File file = LittleFS.open(path, "r");
+    size_t existing = file.size();
+    file.close();
+    if (existing == size) {
+      return;
+    }
   }
+  File file = LittleFS.open(path, "w");
+  uint8_t zeros[256] = {0};
+  for (size_t written = 0; written < size; written += sizeof(zeros)) {
+    file.write(zeros, min(sizeof(zeros), size - written));
+  }
+  file.close();
+}
 
-  File file = LittleFS.open("/settings.json", "w");
-  serializeJson(doc, file);
+bool logWriteAt(const char *path, size_t offset, const uint8_t *data, size_t len) {
+  File file = LittleFS.open(path, "r+");
+  if (!file) {
+    return false;
+  }
+  bool written = file.seek(offset) && file.write(data, len) == len;
   file.close();
+  return written;
+}
+
+// Save the open buckets as of 'now'
+void logCheckpoint(uint32_t now) {
+  static LogCheckpoint checkpoint;
+  portENTER_CRITICAL(&logMux);
+  memcpy(&checkpoint, &logOpen, sizeof(checkpoint));
+  portEXIT_CRITICAL(&logMux);
+  checkpoint.magic = LOG_CHECKPOINT_MAGIC;
+  checkpoint.time = now;
+  saveLogCheckpoint(LOG_STORE, LOG_CHECKPOINT_PATH, checkpoint);
+  logCheckpointAt = now + LOG_CHECKPOINT_S;
+}
+
+// Restore the open buckets and resume the log clock after the last sample
+// they hold, or after the newest closed bucket when there is no checkpoint
+void initLog() {
+  // Raw sample rings from earlier firmware; nothing reads them any more
+  LittleFS.remove("/ts_raw.bin");
+  LittleFS.remove("/ts_zones.bin");
+
+  for (int i = 0; i < NUM_ROLLUP_LEVELS; i++) {
+    for (int z = 0; z < loggedZones(); z++) {
+      char path[32];
+      rollupPath(rollupLevels[i], z, path, sizeof(path));
+      logEnsureFile(path, (size_t)rollupLevels[i].slots * sizeof(RollupRecord));
+    }
+  }
+  logEnsureFile(LOG_CHECKPOINT_PATH, sizeof(LogCheckpoint));
+
+  uint32_t lastTime = 0;
+  if (loadLogCheckpoint(LOG_STORE, LOG_CHECKPOINT_PATH, logOpen)) {
+    lastTime = logOpen.time;
+  } else {
+    for (int i = 0; i < NUM_ROLLUP_LEVELS; i++) {
+      for (int z = 0; z < LOG_MAX_ZONES; z++) {
+        rollupReset(logOpen.open[i][z], 0);
+      }
+    }
+    char path[32];
+    rollupPath(rollupLevels[0], 0, path, sizeof(path));
+    lastTime = newestRollupEnd(LOG_STORE, path, rollupLevels[0]);
+  }
+
+  // Keep the clock monotonic across reboots so the rollup slots stay valid
+  logEpoch = lastTime + LOG_SAMPLE_PERIOD_S - millis() / 1000;
+  logNextSampleAt = logNow();
+  logCheckpointAt = logNow() + LOG_CHECKPOINT_S;
+}
+
+// Record every logged zone once per LOG_SAMPLE_PERIOD_S. A closed bucket
+// is written to its slot and the open ones checkpointed in the same pass,
+// so a checkpoint is never older than a bucket on flash.
+void logTick() {
+  TRACE_SCOPE(TRACE_LOG);
+  uint32_t now = logNow();
+  if ((int32_t)(now - logNextSampleAt) < 0) {
+    return;
+  }
+  logNextSampleAt = now + LOG_SAMPLE_PERIOD_S;
+
+  bool closedAny = false;
+  for (int z = 0; z < loggedZones(); z++) {
+    int16_t values[LOG_FIELDS];
+    readZoneValues(z, values);
+    for (int i = 0; i < NUM_ROLLUP_LEVELS; i++) {
+      RollupBucket closed;
+      portENTER_CRITICAL(&logMux);
+      bool closes = rollupAdd(rollupLevels[i], logOpen.open[i][z], now, values, closed);
+      portEXIT_CRITICAL(&logMux);
+      if (closes) {
+        char path[32];
+        rollupPath(rollupLevels[i], z, path, sizeof(path));
+        writeRollup(LOG_STORE, path, rollupLevels[i], closed);
+        closedAny = true;
+      }
+    }
+  }
+  if (closedAny || (int32_t)(now - logCheckpointAt) >= 0) {
+    logCheckpoint(now);
+  }
+}
+
+void printLogArray(Print &out, const char* name, const int16_t values[LOG_FIELDS]) {
+  out.print(",\"");
+  out.print(name);
+  out.print("\":[");
+  for (int f = 0; f < LOG_FIELDS; f++) {
+    if (f) out.print(',');
+    printLogValue(out, values[f], f);
+  }
+  out.print(']');
+}
+
+// GET /api/history?zone=&from=&to=&res= : rollup buckets covering [from, to]
+void handleHistory(AsyncWebServerRequest *request) {
+  uint32_t now = logNow();
+  int zone = request->hasParam("zone") ? request->getParam("zone")->value().toInt() : 0;
+  uint32_t to = request->hasParam("to") ? request->getParam("to")->value().toInt() : now;
+  if (to > now) {
+    to = now;  // Nothing is logged past now
+  }
+  uint32_t from = request->hasParam("from") ? request->getParam("from")->value().toInt()
+                                            : (to > 86400 ? to - 86400 : 0);
+  uint32_t res = request->hasParam("res") ? request->getParam("res")->value().toInt() : 0;
+  if (zone < 0 || zone >= loggedZones()) {
+    request->send(400, "application/json", "{\"message\":\"Zone has no history\"}");
+    return;
+  }
+  if (from > to) {
+    request->send(400, "application/json", "{\"message\":\"from must not be after to\"}");
+    return;
+  }
+
+  // Pick the requested resolution, or the finest one whose retention covers the range
+  int levelIndex = -1;
+  for (int i = 0; i < NUM_ROLLUP_LEVELS; i++) {
+    const RollupLevel &candidate = rollupLevels[i];
+    bool covers = from >= now || now - from <= candidate.resolution * candidate.slots;
+    if (res ? candidate.resolution == res : (covers || i == NUM_ROLLUP_LEVELS - 1)) {
+      levelIndex = i;
+      break;
+    }
+  }
+  if (levelIndex < 0) {
+    request->send(400, "application/json", "{\"message\":\"res must be 300 or 3600\"}");
+    return;
+  }
+  const RollupLevel &level = rollupLevels[levelIndex];
+  char path[32];
+  rollupPath(level, zone, path, sizeof(path));
+  RollupBucket open;
+  portENTER_CRITICAL(&logMux);
+  memcpy(&open, &logOpen.open[levelIndex][zone], sizeof(open));
+  portEXIT_CRITICAL(&logMux);
+  static RollupCursor cursor;  // 600 bytes; handlers run one at a time on the web task
+  startRollupQuery(cursor, level, path, open, from, to, now);
+
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->print("{\"zone\":");
+  response->print(zone);
+  response->print(",\"res\":");
+  response->print(level.resolution);
+  response->print(",\"fields\":[");
+  for (int f = 0; f < LOG_FIELDS; f++) {
+    if (f) response->print(',');
+    response->print('"');
+    response->print(LOG_FIELD_NAMES[f]);
+    response->print('"');
+  }
+  response->print("],\"points\":[");
+
+  bool firstPoint = true;
+  RollupRecord record;
+  while (nextRollupRecord(LOG_STORE, cursor, record)) {
+    response->print(firstPoint ? "{\"t\":" : ",{\"t\":");
+    firstPoint = false;
+    response->print(record.start);
+    response->print(",\"n\":");
+    response->print(record.count);
+    printLogArray(*response, "min", record.min);
+    printLogArray(*response, "max", record.max);
+    printLogArray(*response, "avg", record.avg);
+    response->print('}');
+  }
+
+  response->print("]}");
+  request->send(response);
+}
+
+// POST /api/time?epoch= : align the log clock with wall time (forward only)
+void handleSetTime(AsyncWebServerRequest *request) {
+  uint32_t epoch = request->hasParam("epoch", true) ? request->getParam("epoch", true)->value().toInt() : 0;
+  if (epoch <= logNow()) {
+    request->send(400, "application/json", "{\"message\":\"Clock can only move forward\"}");
+    return;
+  }
+  logEpoch = epoch - millis() / 1000;
+  logNextSampleAt = logNow();
+  request->send(200, "application/json", "{\"message\":\"Clock set\"}");
+}
+
+// GET /api/state : current readings per zone and every relay
+void handleState(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->print("{\"zones\":[");
+  for (int z = 0; z < settings.zoneCount; z++) {
+    int16_t values[LOG_FIELDS];
+    readZoneValues(z, values);
+    printZoneState(*response, z, settings.zones[z].name, values);
+  }
+  response->print("],\"relays\":[");
+  for (int i = 0; i < settings.relayCount; i++) {
+    printRelayState(*response, i, settings.relays[i].zone, settings.relays[i].role, settings.relayStates[i]);
+  }
+  response->print("],\"controlTickMaxUs\":");
+  response->print(controlTickMaxUs);
+  response->print('}');
+  request->send(response);
+}
+
+// The zone, sensor and relay tables as JSON
+void printConfig(Print &out) {
+  out.printf("{\"i2c\":{\"sda\":%u,\"scl\":%u},\"zones\":[", settings.i2cSda, settings.i2cScl);
+  for (int z = 0; z < settings.zoneCount; z++) {
+    out.printf(z ? ",\"%s\"" : "\"%s\"", settings.zones[z].name);
+  }
+  out.print("],\"sensors\":[");
+  for (int id = 0; id < settings.sensorCount; id++) {
+    const SensorConfig &sensor = settings.sensors[id];
+    const char *kind = sensor.kind < NUM_SENSOR_KINDS ? SENSOR_DRIVERS[sensor.kind].name : "none";
+    out.printf("%s{\"kind\":\"%s\",\"zone\":%u,\"pin\":%u", id ? "," : "", kind, sensor.zone, sensor.pin);
+    if (sensor.kind == SENSOR_MHZ19C) {
+      out.printf(",\"tx\":%u", sensor.pin2);
+    }
+    out.print('}');
+  }
+  out.print("],\"relays\":[");
+  for (int i = 0; i < settings.relayCount; i++) {
+    const RelayConfig &relay = settings.relays[i];
+    out.printf("%s{\"zone\":%u,\"bus\":\"%s\",", i ? "," : "", relay.zone,
+               relay.bus == BUS_PCF8574 ? "pcf8574" : "gpio");
+    if (relay.bus == BUS_PCF8574) {
+      out.printf("\"addr\":%u,", relay.address);
+    }
+    out.printf("\"pin\":%u,\"activeLow\":%s,\"role\":\"%s\"}", relay.pin,
+               relay.flags & RELAY_ACTIVE_LOW ? "true" : "false", relay.role);
+  }
+  out.print("]}");
+}
+
+// GET /api/config
+void handleConfigGet(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  printConfig(*response);
+  request->send(response);
+}
+
+// Keep user-supplied names safe to embed in JSON and HTML
+void sanitizeName(char *text, size_t size) {
+  text[size - 1] = '\0';
+  for (char *c = text; *c; c++) {
+    if (*c < 0x20 || strchr("\"\\<>&", *c)) {
+      *c = '_';
+    }
+  }
+}
+
+// Parse a posted configuration into 'out'; false with a message when invalid
+bool parseConfig(JsonDocument &doc, Settings &out, String &error) {
+  JsonArray zones = doc["zones"];
+  JsonArray sensors = doc["sensors"];
+  JsonArray relays = doc["relays"];
+  if (zones.size() < 1 || zones.size() > MAX_ZONES) {
+    error = "zones must name 1 to " + String(MAX_ZONES) + " zones";
+    return false;
+  }
+  if (sensors.size() > MAX_SENSORS || relays.size() > MAX_RELAYS) {
+    error = "At most " + String(MAX_SENSORS) + " sensors and " + String(MAX_RELAYS) + " relays";
+    return false;
+  }
+
+  out.zoneCount = zones.size();
+  for (int z = 0; z < out.zoneCount; z++) {
+    strlcpy(out.zones[z].name, zones[z] | out.zones[z].name, ZONE_NAME_LEN);
+  }
+  out.i2cSda = doc["i2c"]["sda"] | out.i2cSda;
+  out.i2cScl = doc["i2c"]["scl"] | out.i2cScl;
+
+  // Wire.begin() takes the I2C pins over once any expander is configured,
+  // so they are claimed first and no GPIO relay or sensor may share them
+  uint64_t usedPins = 0;
+  bool expander = false;
+  for (JsonObject relay : relays) {
+    expander |= strcasecmp(relay["bus"] | "gpio", "pcf8574") == 0;
+  }
+  if (expander && (!claimPin(out.i2cSda, true, usedPins, "I2C SDA", error) ||
+                   !claimPin(out.i2cScl, true, usedPins, "I2C SCL", error))) {
+    return false;
+  }
+
+  for (size_t id = 0; id < sensors.size(); id++) {
+    JsonObject sensor = sensors[id];
+    SensorConfig &config = out.sensors[id];
+    config.kind = parseSensorKind(sensor["kind"] | "");
+    config.zone = sensor["zone"] | 0;
+    config.pin = sensor["pin"] | 0;
+    config.pin2 = sensor["tx"] | 0;
+    if (config.kind == SENSOR_NONE || config.zone >= out.zoneCount) {
+      error = "Sensor " + String(id) + ": unknown kind or zone";
+      return false;
+    }
+    // Only the DHT22 data line and the MH-Z19C TX are driven by the ESP32
+    String owner = "Sensor " + String(id);
+    if (!claimPin(config.pin, config.kind == SENSOR_DHT22, usedPins, owner, error) ||
+        (config.kind == SENSOR_MHZ19C && !claimPin(config.pin2, true, usedPins, owner + " tx", error))) {
+      return false;
+    }
+  }
+
+  uint8_t addresses[MAX_EXPANDERS];
+  int addressCount = 0;
+  for (size_t i = 0; i < relays.size(); i++) {
+    JsonObject relay = relays[i];
+    RelayConfig &config = out.relays[i];
+    config.zone = relay["zone"] | 0;
+    config.bus = strcasecmp(relay["bus"] | "gpio", "pcf8574") == 0 ? BUS_PCF8574 : BUS_GPIO;
+    config.address = relay["addr"] | 0x20;
+    config.pin = relay["pin"] | 0;
+    config.flags = (relay["activeLow"] | false) ? RELAY_ACTIVE_LOW : 0;
+    strlcpy(config.role, relay["role"] | "", ROLE_NAME_LEN);
+    if (config.zone >= out.zoneCount) {
+      error = "Relay " + String(i) + ": unknown zone";
+      return false;
+    }
+    if (config.bus == BUS_GPIO && !claimPin(config.pin, true, usedPins, "Relay " + String(i), error)) {
+      return false;
+    }
+    if (config.bus == BUS_PCF8574) {
+      int e = 0;
+      while (e < addressCount && addresses[e] != config.address) e++;
+      if (e == addressCount) {
+        if (addressCount == MAX_EXPANDERS) {
+          error = "At most " + String(MAX_EXPANDERS) + " expanders";
+          return false;
+        }
+        addresses[addressCount++] = config.address;
+      }
+      if (config.pin > 7) {
+        error = "Relay " + String(i) + ": expander pin must be 0-7";
+        return false;
+      }
+    }
+  }
+
+  // Relays past the end of the old table start switched off
+  for (int i = out.relayCount; i < (int)relays.size(); i++) {
+    out.relayStates[i] = false;
+  }
+  out.sensorCount = sensors.size();
+  out.relayCount = relays.size();
+  return true;
+}
+
+// Collect a POSTed body in the request's scratch buffer
+void handleConfigBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+  if (index == 0 && total <= CONFIG_BODY_MAX) {
+    request->_tempObject = malloc(total + 1);
+  }
+  char *body = (char *)request->_tempObject;
+  if (!body || index + len > total) {
+    return;
+  }
+  memcpy(body + index, data, len);
+  if (index + len == total) {
+    body[total] = '\0';
+  }
+}
+
+// POST /api/config : replace the tables, then restart into them
+void handleConfigPost(AsyncWebServerRequest *request) {
+  const char *body = (const char *)request->_tempObject;
+  if (!body) {
+    request->send(400, "application/json", "{\"message\":\"Missing or oversized body\"}");
+    return;
+  }
+  if (configStaged) {
+    request->send(409, "application/json", "{\"message\":\"Restart already pending\"}");
+    return;
+  }
+  DynamicJsonDocument doc(CONFIG_JSON_CAPACITY);
+  if (deserializeJson(doc, body)) {
+    request->send(400, "application/json", "{\"message\":\"Invalid JSON\"}");
+    return;
+  }
+
+  memcpy(&stagedSettings, &settings, sizeof(Settings));
+  String error;
+  if (!parseConfig(doc, stagedSettings, error)) {
+    request->send(400, "application/json", "{\"message\":\"" + error + "\"}");
+    return;
+  }
+  for (int z = 0; z < stagedSettings.zoneCount; z++) {
+    sanitizeName(stagedSettings.zones[z].name, ZONE_NAME_LEN);
+  }
+  for (int i = 0; i < stagedSettings.relayCount; i++) {
+    sanitizeName(stagedSettings.relays[i].role, ROLE_NAME_LEN);
+  }
+  configStaged = true;
+  request->send(200, "application/json", "{\"message\":\"Configuration saved, restarting\"}");
+}
+
+size_t telemetryHeader(uint8_t *out, uint8_t type, uint8_t seq) {
+  return writeFrameHeader(out, type, telemetryNodeId, seq);
+}
+
+// Current zone readings and relay states, in log units
+void captureTelemetry(TelemetryState &state) {
+  memset(&state, 0, sizeof(state));
+  state.zoneCount = min((int)settings.zoneCount, TELEMETRY_MAX_ZONES);
+  state.relayCount = settings.relayCount;
+  for (int z = 0; z < state.zoneCount; z++) {
+    readZoneValues(z, state.values[z]);
+  }
+  for (int i = 0; i < state.relayCount; i++) {
+    if (settings.relayStates[i]) {
+      state.relays[i / 8] |= 1 << (i % 8);
+    }
+  }
+}
+
+void IRAM_ATTR onRadioEvent() {
+  radioEvent = true;
+}
+
+// Start the SX1276 with the same parameters as the gateway sketches
+void initRadio() {
+  SPI.begin(LORA_SCK, LORA_MISO, LORA_MOSI, LORA_NSS);
+  int state = radio.begin(915.0, HydroProfile::BW_KHZ, HydroProfile::SF, HydroProfile::CR, 0x12, 17);
+  radio.setCRC(false);
+  if (state != RADIOLIB_ERR_NONE) {
+    Serial.printf("LoRa init failed: %d\n", state);
+    return;
+  }
+  radio.setDio0Action(onRadioEvent, RISING);
+  radio.startReceive();
+  initAlarm(alarmState);
+  radioReady = true;
+
+  // Node id from the low MAC bytes; the first report is offset by it so
+  // controllers powered up together do not transmit together
+  telemetryNodeId = (uint16_t)(ESP.getEfuseMac() >> 32);
+  telemetryNextAt = millis() + telemetryNodeId % TELEMETRY_PERIOD_MS;
+  Serial.printf("LoRa telemetry as node %04X\n", telemetryNodeId);
+}
+
+// Truncated HMAC-SHA256 of a command frame under the shared key
+void commandTag(const uint8_t *data, size_t len, uint8_t *tag) {
+  uint8_t mac[32];
+  uint32_t startedUs = micros();
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t *)settings.commandKey,
+                  strlen(settings.commandKey), data, len, mac);
+  observeMetric(HIST_HMAC, micros() - startedUs);
+  memcpy(tag, mac, COMMAND_TAG_LEN);
+}
+
+const CommandNode COMMAND_NODE = {
+  commandTag,
+  [](int index, bool on) {
+    setRelay(index, on);
+    overrideUntil[index] = millis() + MANUAL_OVERRIDE_MS;
+  },
+};
+
+// Report the relay states and newest applied command to the gateway
+void sendCommandState() {
+  uint8_t frame[TELEMETRY_HEADER + 5 + MAX_RELAYS / 8 + COMMAND_TAG_LEN + 1];
+  size_t len = commandStateFrame(COMMAND_NODE, frame, telemetryNodeId, settings.commandSeq, settings.relayStates,
+                                 settings.relayCount);
+  queueTxFrame(txSlots, TRAFFIC_CONTROL, frame, len);
+}
+
+// Apply an authenticated relay command once, then confirm the state
+void handleCommand(const uint8_t *frame, size_t len) {
+  if (settings.commandKey[0] == '\0') {
+    return;
+  }
+  int receipt = receiveCommand(COMMAND_NODE, frame, len, settings.commandSeq, settings.relayCount);
+  if (receipt == COMMAND_REFUSED) {
+    return;
+  }
+  if (receipt == COMMAND_APPLIED) {
+    flushExpanders();
+    saveSettings();
+    pushUpdates();
+  }
+  sendCommandState();
+}
+
+// An ACK moves the delta base to the frame it acknowledges
+void handleTelemetryAck(const uint8_t *frame, size_t len) {
+  if (len != TELEMETRY_HEADER + 1 || (frame[0] & 0xF0) != TELEMETRY_MARK ||
+      (frame[0] & FRAME_TYPE_MASK) != FRAME_ACK || crc8(frame, TELEMETRY_HEADER) != frame[TELEMETRY_HEADER]) {
+    return;
+  }
+  uint16_t node = frame[1] | (frame[2] << 8);
+  if (node != telemetryNodeId || frame[3] != telemetrySeq) {
+    return;  // Another controller's ACK, or a stale one
+  }
+  memcpy(&telemetryAcked, &telemetrySent, sizeof(TelemetryState));
+  telemetryAckedSeq = telemetrySeq;
+  telemetryHaveAck = true;
+}
+
+// An ALARM_ACK for the alarm in flight ends its retries
+void handleAlarmAck(const uint8_t *frame, size_t len) {
+  if (!alarmAcked(alarmState, frame, len)) {
+    return;
+  }
+  countMetric(COUNTER_ALARM_ACKED, 1);
+  observeMetric(HIST_ALARM, micros() - alarmChangedUs);
+}
+
+// Start sending a frame; radioTick() finishes it on the DIO0 interrupt
+bool radioTransmit(uint8_t *data, size_t len) {
+  if (radio.startTransmit(data, len) != RADIOLIB_ERR_NONE) {
+    countMetric(COUNTER_TX_ERRORS, 1);
+    return false;
+  }
+  radioTransmitting = true;
+  radioTxStartedUs = micros();
+  radioTxLength = len;
+  return true;
+}
+
+// Finish a transmission or read a received packet, then listen again
+void radioTick() {
+  if (!radioReady || !radioEvent) {
+    return;
+  }
+  TRACE_SCOPE(TRACE_RADIO);
+  radioEvent = false;
+  if (radioTransmitting) {
+    radio.finishTransmit();
+    radioTransmitting = false;
+    observeMetric(HIST_TX, micros() - radioTxStartedUs);
+    countMetric(COUNTER_TX, 1);
+    countMetric(COUNTER_AIRTIME, frameAirtimeUs(txClass == TRAFFIC_ALARM ? ALARM_PROFILE : HYDRO_PROFILE, radioTxLength));
+    if (txClass == TRAFFIC_ALARM) {
+      radio.setCodingRate(LORA_CODING_RATE);
+    }
+    txSent(txAnswer, txClass, millis());
+  } else {
+    uint8_t frame[256];
+    size_t len = radio.getPacketLength();
+    bool read = len > 0 && len <= sizeof(frame) && radio.readData(frame, len) == RADIOLIB_ERR_NONE;
+    countMetric(read ? COUNTER_RX : COUNTER_RX_ERRORS, 1);
+    if (read && len > TELEMETRY_HEADER &&
+        (frame[0] & 0xF0) == TELEMETRY_MARK && (frame[1] | (frame[2] << 8)) == telemetryNodeId &&
+        crc8(frame, len - 1) == frame[len - 1]) {
+      switch (frame[0] & FRAME_TYPE_MASK) {
+        case FRAME_ACK:
+          txAnswer.waiting = false;
+          handleTelemetryAck(frame, len);
+          break;
+        case FRAME_CMD:
+          handleCommand(frame, len);  // Queues the STATE reply
+          break;
+        case FRAME_ALARM_ACK:
+          txAnswer.waiting = false;
+          handleAlarmAck(frame, len);
+          break;
+      }
+    }
+  }
+  if (!radioTransmitting) {
+    radio.startReceive();
+  }
+}
+
+// Send the next report as a DELTA against the acknowledged base when possible
+void telemetryTick() {
+  bool bulkBusy = txSlots[TRAFFIC_BULK].queued || (radioTransmitting && txClass == TRAFFIC_BULK);
+  if (!radioReady || bulkBusy || (int32_t)(millis() - telemetryNextAt) < 0) {
+    return;
+  }
+  TRACE_SCOPE(TRACE_TELEMETRY);
+  telemetryNextAt = millis() + TELEMETRY_PERIOD_MS;
+
+  uint8_t seq = telemetrySeq + 1;
+  TelemetryState state;
+  captureTelemetry(state);
+
+  uint8_t frame[TELEMETRY_FRAME_MAX];
+  size_t len = 0;
+  if (telemetryHaveAck && (uint8_t)(seq - telemetryAckedSeq) <= TELEMETRY_MAX_UNACKED &&
+      telemetryFramesSinceKey < TELEMETRY_KEY_INTERVAL) {
+    len = encodeTelemetryDelta(frame, telemetryNodeId, seq, telemetryAckedSeq, telemetryAcked, state);
+  }
+  if (len == 0) {
+    len = encodeTelemetryKey(frame, telemetryNodeId, seq, state);
+    telemetryFramesSinceKey = 0;
+  } else {
+    telemetryFramesSinceKey++;
+  }
+
+  queueTxFrame(txSlots, TRAFFIC_BULK, frame, len);
+  telemetrySeq = seq;
+  memcpy(&telemetrySent, &state, sizeof(TelemetryState));
+}
+
+// Start a round for a changed low-water set when a token allows, and
+// resend the unacknowledged alarm on its retry timer
+void alarmTick() {
+  if (!radioReady) {
+    return;
+  }
+  int result = alarmStep(alarmState, millis(), esp_random() % ALARM_RETRY_JITTER_MS);
+  if (result & ALARM_CHANGED) {
+    alarmChangedUs = micros();
+  }
+  if (result & ALARM_DEFERRED) {
+    countMetric(COUNTER_ALARM_DEFERRED, 1);
+  }
+  if (result & ALARM_SEND) {
+    uint8_t frame[ALARM_FRAME_LEN];
+    size_t len = encodeAlarm(frame, telemetryNodeId, alarmState, settings.zoneCount);
+    queueTxFrame(txSlots, TRAFFIC_ALARM, frame, len);
+    countMetric(COUNTER_ALARM_TX, 1);
+  }
+}
+
+// Start the highest class waiting once the radio is free. An alarm
+// aborts a bulk frame on the air, which then waits for its turn again;
+// one that already finished (DIO0 raised) is simply sent twice. Nothing
+// starts while the gateway's answer to the last frame is due.
+void txTick() {
+  if (!radioReady || txAwaitingAnswer(txAnswer, millis())) {
+    return;
+  }
+  bool preempt;
+  int c = nextTxClass(txSlots, radioTransmitting, txClass, preempt);
+  if (preempt) {
+    radio.standby();
+    radioTransmitting = false;
+    radioEvent = false;
+    countMetric(COUNTER_TX_PREEMPTED, 1);
+  }
+  if (c < 0) {
+    return;
+  }
+  txClass = c;
+  if (c == TRAFFIC_ALARM) {
+    radio.setCodingRate(ALARM_CODING_RATE);
+  }
+  if (!radioTransmit(txSlots[c].data, txSlots[c].len)) {
+    if (c == TRAFFIC_ALARM) {
+      radio.setCodingRate(LORA_CODING_RATE);
+    }
+    radio.startReceive();  // Dropped; an alarm is resent by its retry timer
+  }
+}
+
+// Serial commands: "/metrics" prints the metrics, "/trace" the trace
+// ring, "/perf [save]" runs the performance suite
+void serialTick() {
+  static String line;
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c == '\n' || c == '\r') {
+      if (line == "/metrics") {
+        printMetrics(Serial);
+      }
+      if (line == "/perf" || line == "/perf save") {
+        runPerf(line == "/perf save");
+      }
+#if TRACE_ENABLED
+      if (line == "/trace") {
+        printTrace(Serial, TRACE_NAMES, sizeof(TRACE_NAMES) / sizeof(TRACE_NAMES[0]), sensorSpanName);
+      }
+#endif
+      line = "";
+    } else if (line.length() < 32) {
+      line += c;
+    }
+  }
+}
+
+// Print that appends to a String, or only counts when it has none
+struct PerfSink : public Print {
+  String *text;
+  size_t count;
+  PerfSink(String *target) : text(target), count(0) {}
+  size_t write(uint8_t c) override {
+    count++;
+    if (text) {
+      *text += (char)c;
+    }
+    return 1;
+  }
+};
+
+const PerfCase PERF_CASES[] = {
+  {"dashboard", []() { generateDashboard(); }},
+  {"ws_snapshot", []() { buildUpdate(true); }},
+  {"config_print", []() {
+    PerfSink sink(nullptr);
+    printConfig(sink);
+    perfSinkValue = sink.count;
+  }},
+  {"config_parse", []() {
+    // Its own target: stagedSettings belongs to /api/config on the web task.
+    // Allocated by the warm-up run, and only once /perf is used.
+    static Settings *parsed = (Settings *)malloc(sizeof(Settings));
+    if (!parsed) {
+      return;
+    }
+    DynamicJsonDocument doc(CONFIG_JSON_CAPACITY);
+    deserializeJson(doc, perfConfigJson);
+    memcpy(parsed, &settings, sizeof(Settings));
+    String error;
+    perfSinkValue = parseConfig(doc, *parsed, error);
+  }},
+  {"rules", []() {
+    static bool demand[MAX_RELAYS];
+    evaluateRules(demand);
+  }},
+  {"telemetry_key", []() {
+    static TelemetryState state;
+    static uint8_t frame[TELEMETRY_FRAME_MAX];
+    captureTelemetry(state);
+    perfSinkValue = encodeTelemetryKey(frame, 0, 0, state);
+  }},
+  {"command_hmac", []() {
+    static uint8_t frame[16];
+    static uint8_t tag[COMMAND_TAG_LEN];
+    commandTag(frame, sizeof(frame), tag);
+  }},
+  {"settings_crc", []() { perfSinkValue = crc32((const uint8_t *)&settings, sizeof(Settings)); }},
+};
+const int NUM_PERF_CASES = sizeof(PERF_CASES) / sizeof(PERF_CASES[0]);
+static_assert(NUM_PERF_CASES <= PERF_MAX_CASES, "Raise PERF_MAX_CASES");
+
+// "/perf" runs every case against the saved baseline; "/perf save" also
+// makes this run the baseline
+void runPerf(bool save) {
+  PerfResult baseline[PERF_MAX_CASES] = {};
+  int baselineCount = 0;
+  File file = LittleFS.open(PERF_BASELINE_PATH, "r");
+  if (file) {
+    baselineCount = file.read((uint8_t *)baseline, sizeof(baseline)) / sizeof(PerfResult);
+    file.close();
+  }
+
+  perfConfigJson = "";
+  PerfSink sink(&perfConfigJson);
+  printConfig(sink);
+
+  PerfResult results[PERF_MAX_CASES] = {};
+  Serial.printf("%-16s %12s %10s %12s %8s\n", "case", "ns/op", "heap B/op", "baseline", "change");
+  for (int i = 0; i < NUM_PERF_CASES; i++) {
+    const PerfCase &perfCase = PERF_CASES[i];
+    perfCase.run();  // Warm-up: first-call allocations are not per message
+    uint32_t iterations = 0;
+    uint32_t heapBefore = ESP.getFreeHeap();
+    uint32_t startedUs = micros();
+    do {
+      perfCase.run();
+      iterations++;
+    } while (micros() - startedUs < PERF_CASE_MS * 1000UL);
+    uint32_t elapsedUs = micros() - startedUs;
+
+    PerfResult &result = results[i];
+    strlcpy(result.name, perfCase.name, sizeof(result.name));
+    result.nsPerOp = (uint64_t)elapsedUs * 1000 / iterations;
+    result.heapPerOp = ((int32_t)heapBefore - (int32_t)ESP.getFreeHeap()) / (int32_t)iterations;
+
+    const PerfResult *base = nullptr;
+    for (int b = 0; b < baselineCount && !base; b++) {
+      if (strncmp(baseline[b].name, result.name, PERF_NAME_LEN) == 0) {
+        base = &baseline[b];
+      }
+    }
+    Serial.printf("%-16s %12u %10d", result.name, (unsigned)result.nsPerOp, (int)result.heapPerOp);
+    if (base && base->nsPerOp) {
+      float change = 100.0f * ((float)result.nsPerOp - base->nsPerOp) / base->nsPerOp;
+      Serial.printf(" %12u %+7.1f%%%s\n", (unsigned)base->nsPerOp, change,
+                    change > PERF_REGRESSION_PCT ? " REGRESSION" : "");
+    } else {
+      Serial.println();
+    }
+    yield();
+  }
+  perfConfigJson = String();
+
+  if (save) {
+    file = LittleFS.open(PERF_BASELINE_PATH, "w");
+    if (file) {
+      file.write((const uint8_t *)results, NUM_PERF_CASES * sizeof(PerfResult));
+      file.close();
+      Serial.println("Baseline saved");
+    } else {
+      Serial.println("Failed to save baseline");
+    }
+  }
+}
+
+// Prometheus text exposition of every counter, histogram and heap gauge
+void printMetrics(Print &out) {
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    out.printf("# TYPE %s counter\n%s %u\n", COUNTER_NAMES[i], COUNTER_NAMES[i],
+               (unsigned)counters[i].load(std::memory_order_relaxed));
+  }
+  for (int i = 0; i < HIST_COUNT; i++) {
+    const char *name = HISTOGRAM_NAMES[i];
+    out.printf("# TYPE %s histogram\n", name);
+    uint32_t total = 0;
+    for (int b = 0; b <= METRIC_BUCKETS; b++) {
+      total += histograms[i].buckets[b].load(std::memory_order_relaxed);
+      if (b < METRIC_BUCKETS) {
+        out.printf("%s_bucket{le=\"%u\"} %u\n", name, (unsigned)((1UL << (2 * b + 2)) - 1), (unsigned)total);
+      } else {
+        out.printf("%s_bucket{le=\"+Inf\"} %u\n", name, (unsigned)total);
+      }
+    }
+    out.printf("%s_sum %u\n%s_count %u\n", name, (unsigned)histograms[i].sum.load(std::memory_order_relaxed),
+               name, (unsigned)total);
+  }
+  out.printf("# TYPE heap_free_bytes gauge\nheap_free_bytes %u\n", (unsigned)ESP.getFreeHeap());
+  out.printf("# TYPE heap_min_free_bytes gauge\nheap_min_free_bytes %u\n", (unsigned)ESP.getMinFreeHeap());
+  out.printf("# TYPE http_in_flight gauge\nhttp_in_flight %u\n", (unsigned)admission.inFlight);
+  out.printf("# TYPE uptime_seconds gauge\nuptime_seconds %u\n", (unsigned)(millis() / 1000));
+}
+
+// GET /metrics
+void handleMetrics(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+  printMetrics(*response);
+  request->send(response);
+}
+
+#if TRACE_ENABLED
+// The driver name of a sensor sample span
+const char *sensorSpanName(const TraceEvent &event) {
+  if (event.name == TRACE_SAMPLE && event.id < settings.sensorCount &&
+      settings.sensors[event.id].kind < NUM_SENSOR_KINDS) {
+    return SENSOR_DRIVERS[settings.sensors[event.id].kind].name;
+  }
+  return nullptr;
+}
+
+// GET /trace
+void handleTrace(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  printTrace(*response, TRACE_NAMES, sizeof(TRACE_NAMES) / sizeof(TRACE_NAMES[0]), sensorSpanName);
+  request->send(response);
+}
+#endif
+
+// Wrap a handler so its run time feeds the HTTP latency histogram
+ArRequestHandlerFunction timed(ArRequestHandlerFunction handler) {
+  return [handler](AsyncWebServerRequest *request) {
+    TRACE_SCOPE(TRACE_HTTP);
+    uint32_t startedUs = micros();
+    handler(request);
+    observeMetric(HIST_HTTP, micros() - startedUs);
+  };
+}
+
+// Initialize Wi-Fi as AP + Client
+void initWiFi() {
+  WiFi.softAP(ssid, password);
+  Serial.println("Access Point Started");
+}
+
+// Copy a POSTed form field into a setting when present
+void readParam(AsyncWebServerRequest *request, const char *name, float &value) {
+  if (request->hasParam(name, true)) {
+    value = request->getParam(name, true)->value().toFloat();
+  }
+}
+
+void readParam(AsyncWebServerRequest *request, const char *name, int &value) {
+  if (request->hasParam(name, true)) {
+    value = request->getParam(name, true)->value().toInt();
+  }
+}
+
+void readParam(AsyncWebServerRequest *request, const char *name, uint16_t &value) {
+  if (request->hasParam(name, true)) {
+    value = request->getParam(name, true)->value().toInt();
+  }
+}
+
+// Start HTTP server and define routes
+void initWebServer() {
+  // Admission runs before every route
+  server.addHandler(new AdmissionHandler(admission, true, [](int result) {
+    countMetric((CounterId)(COUNTER_HTTP_REJECTED_HEAP + result - ADMIT_HEAP), 1);
+  }));
+
+  server.on("/", HTTP_GET, timed([](AsyncWebServerRequest *request) {
+    request->send(200, "text/html", generateDashboard());
+  }));
+
+  server.on("/toggle", HTTP_GET, timed([](AsyncWebServerRequest *request) {
+    int index = request->hasParam("relay") ? request->getParam("relay")->value().toInt() : -1;
+    if (index < 0 || index >= settings.relayCount) {
+      request->send(400, "application/json", "{\"message\":\"Invalid relay\"}");
+      return;
+    }
+    queueToggle(index);
+    request->send(200, "application/json", "{\"message\":\"Relay toggled\"}");
+  }));
+
+  // Thresholds apply to the zone given by 'zone' (default 0); relay
+  // assignments relay1..relayN address the relay table directly
+  // Changes are staged in settingsEdit; loop() applies them, rebuilds the
+  // rules and saves
+  server.on("/settings", HTTP_POST, timed([](AsyncWebServerRequest *request) {
+    int z = request->hasParam("zone", true) ? request->getParam("zone", true)->value().toInt() : 0;
+    if (z < 0 || z >= settings.zoneCount) {
+      request->send(400, "application/json", "{\"message\":\"Invalid zone\"}");
+      return;
+    }
+    if (settingsEditStaged || configStaged) {
+      request->send(503, "application/json", "{\"message\":\"Previous change still pending, retry\"}");
+      return;
+    }
+    SettingsEdit &edit = settingsEdit;
+    edit.zone = z;
+    edit.zoneSettings = settings.zones[z];
+    edit.minOnSeconds = settings.minOnSeconds;
+    edit.minOffSeconds = settings.minOffSeconds;
+    memcpy(edit.commandKey, settings.commandKey, COMMAND_KEY_LEN);
+    for (int i = 0; i < settings.relayCount; i++) {
+      memcpy(edit.roles[i], settings.relays[i].role, ROLE_NAME_LEN);
+    }
+    ZoneSettings &zone = edit.zoneSettings;
+    readParam(request, "tempMin", zone.tempMin);
+    readParam(request, "tempMax", zone.tempMax);
+    readParam(request, "humidityMin", zone.humidityMin);
+    readParam(request, "humidityMax", zone.humidityMax);
+    readParam(request, "waterLevelThreshold", zone.waterLevelThreshold);
+    readParam(request, "tempHysteresis", zone.tempHysteresis);
+    readParam(request, "humidityHysteresis", zone.humidityHysteresis);
+    readParam(request, "waterHysteresis", zone.waterHysteresis);
+    readParam(request, "lightOnHours", zone.lightOnHours);
+    readParam(request, "minOnSeconds", edit.minOnSeconds);
+    readParam(request, "minOffSeconds", edit.minOffSeconds);
+    if (request->hasParam("commandKey", true)) {
+      strlcpy(edit.commandKey, request->getParam("commandKey", true)->value().c_str(), COMMAND_KEY_LEN);
+    }
+    if (request->hasParam("name", true)) {
+      strlcpy(zone.name, request->getParam("name", true)->value().c_str(), ZONE_NAME_LEN);
+      sanitizeName(zone.name, ZONE_NAME_LEN);
+    }
+    for (int i = 0; i < settings.relayCount; i++) {
+      String name = "relay" + String(i + 1);
+      if (request->hasParam(name, true)) {
+        strlcpy(edit.roles[i], request->getParam(name, true)->value().c_str(), ROLE_NAME_LEN);
+        sanitizeName(edit.roles[i], ROLE_NAME_LEN);
+      }
+    }
+    settingsEditStaged = true;
+    request->send(200, "application/json", "{\"message\":\"Settings saved\"}");
+  }));
+
+  server.on("/api/history", HTTP_GET, timed(handleHistory));
+  server.on("/api/time", HTTP_POST, timed(handleSetTime));
+  server.on("/api/state", HTTP_GET, timed(handleState));
+  server.on("/api/config", HTTP_GET, timed(handleConfigGet));
+  server.on("/api/config", HTTP_POST, timed(handleConfigPost), nullptr, handleConfigBody);
+
+  server.on("/metrics", HTTP_GET, handleMetrics);
+#if TRACE_ENABLED
+  server.on("/trace", HTTP_GET, handleTrace);
+#endif
+
+  ws.onEvent(onWsEvent);
+  server.addHandler(&ws);
+
+  server.begin();
+}
+
+// Queue a relay toggle for loop(); safe from any task
+void queueToggle(int index) {
+  pendingToggles[index / 32].fetch_or(1UL << (index % 32));
+}
+
+// WebSocket events: full snapshot on connect, relay toggles from clients
+void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type,
+               void *arg, uint8_t *data, size_t len) {
+  if (type == WS_EVT_CONNECT) {
+    client->text(buildUpdate(true));
+  } else if (type == WS_EVT_DATA) {
+    AwsFrameInfo *info = (AwsFrameInfo *)arg;
+    if (!info->final || info->index != 0 || info->len != len || info->opcode != WS_TEXT) {
+      return;  // Commands are small single-frame text messages
+    }
+    StaticJsonDocument<64> doc;
+    if (deserializeJson(doc, (const char *)data, len)) {
+      return;
+    }
+    int index = doc["toggle"] | -1;
+    if (index >= 0 && index < settings.relayCount) {
+      queueToggle(index);
+    }
+  }
+}
+
+// Append one "key":value pair to a JSON object being built
+void appendField(String &json, const char *key, const String &value) {
+  if (json.length() > 1) {
+    json += ',';
+  }
+  json += '"';
+  json += key;
+  json += "\":";
+  json += value;
+}
+
+String formatReading(float value) {
+  return isnan(value) ? String("null") : String(value, 1);
+}
+
+// Fields of one zone that moved past their push delta (all when full)
+String buildZoneUpdate(int zone, bool full) {
+  const SensorSnapshot &reading = readings[zone];
+  PushedState &last = pushed[zone];
+  String json = "{";
+
+  if (full || fabs(reading.temperature - last.temperature) >= TEMP_PUSH_DELTA ||
+      (isnan(last.temperature) && !isnan(reading.temperature))) {
+    appendField(json, "t", formatReading(reading.temperature));
+    if (!full) last.temperature = reading.temperature;
+  }
+  if (full || fabs(reading.humidity - last.humidity) >= HUMIDITY_PUSH_DELTA ||
+      (isnan(last.humidity) && !isnan(reading.humidity))) {
+    appendField(json, "h", formatReading(reading.humidity));
+    if (!full) last.humidity = reading.humidity;
+  }
+  if (full || reading.co2 != last.co2) {
+    appendField(json, "c", reading.co2 < 0 ? String("null") : String(reading.co2));
+    if (!full) last.co2 = reading.co2;
+  }
+  if (full || abs(reading.waterLevel - last.waterLevel) >= WATER_PUSH_DELTA) {
+    appendField(json, "w", String(reading.waterLevel));
+    if (!full) last.waterLevel = reading.waterLevel;
+  }
+
+  json += '}';
+  return json;
+}
+
+// Build a JSON update: {"z":{"<zone>":{...}},"r":{"<relay>":0|1}}. A full
+// update carries every field; otherwise only changes are included and
+// remembered.
+String buildUpdate(bool full) {
+  String zones = "{";
+  for (int z = 0; z < settings.zoneCount; z++) {
+    String zone = buildZoneUpdate(z, full);
+    if (zone.length() > 2) {
+      appendField(zones, String(z).c_str(), zone);
+    }
+  }
+  zones += '}';
+
+  String relays = "{";
+  for (int i = 0; i < settings.relayCount; i++) {
+    int8_t on = settings.relayStates[i];
+    if (full || pushedRelays[i] != on) {
+      appendField(relays, String(i).c_str(), String(on));
+      if (!full) pushedRelays[i] = on;
+    }
+  }
+  relays += '}';
+
+  String json = "{";
+  if (zones.length() > 2) appendField(json, "z", zones);
+  if (relays.length() > 2) appendField(json, "r", relays);
+  json += '}';
+  return json;
+}
+
+// Send pending changes to all WebSocket clients
+void pushUpdates() {
+  static bool primed = false;
+  if (!primed) {
+    // Nothing has been pushed yet, so everything counts as changed
+    for (int z = 0; z < MAX_ZONES; z++) {
+      pushed[z] = {NAN, NAN, -2, -1};
+    }
+    memset(pushedRelays, -1, sizeof(pushedRelays));
+    primed = true;
+  }
+  if (ws.count() == 0) {
+    return;
+  }
+  String update = buildUpdate(false);
+  if (update.length() > 2) {
+    ws.textAll(update);
+  }
+}
+
+// Generate dashboard HTML; the page itself is in dashboard_html.h
+String generateDashboard() {
+  DashboardZone zones[MAX_ZONES];
+  DashboardRelay relays[MAX_RELAYS];
+  for (int z = 0; z < settings.zoneCount; z++) {
+    const SensorSnapshot &reading = readings[z];
+    zones[z] = {settings.zones[z].name, reading.temperature, reading.humidity, reading.co2, reading.waterLevel};
+  }
+  for (int i = 0; i < settings.relayCount; i++) {
+    relays[i] = {settings.relays[i].role, settings.relays[i].zone, settings.relayStates[i]};
+  }
+  String html;
+  buildDashboard(html, zones, settings.zoneCount, relays, settings.relayCount);
+  return html;
+}
+
+
+void applyZoneDefaults(ZoneSettings &zone, int index) {
+  memset(&zone, 0, sizeof(zone));
+  snprintf(zone.name, sizeof(zone.name), "Zone %d", index + 1);
+  zone.tempMin = 18.0;
+  zone.tempMax = 28.0;
+  zone.humidityMin = 40.0;
+  zone.humidityMax = 70.0;
+  zone.waterLevelThreshold = 1000;
+  zone.tempHysteresis = 0.5;
+  zone.humidityHysteresis = 2.0;
+  zone.waterHysteresis = 50;
+  zone.lightOnHours = 18.0;
+}
+
+// Defaults for a fresh controller: one zone wired as the default board.
+// Also the base for fields missing from an older settings.json.
+void applyDefaultSettings() {
+  memset(&settings, 0, sizeof(settings));
+  strlcpy(settings.adminUser, "admin", sizeof(settings.adminUser));
+  strlcpy(settings.adminPassword, password, sizeof(settings.adminPassword));
+  settings.minOnSeconds = 30;
+  settings.minOffSeconds = 30;
+  settings.i2cSda = I2C_SDA_PIN;
+  settings.i2cScl = I2C_SCL_PIN;
+  for (int z = 0; z < MAX_ZONES; z++) {
+    applyZoneDefaults(settings.zones[z], z);
+  }
+  settings.zoneCount = 1;
+
+  settings.sensors[0] = {SENSOR_DHT22, 0, DHTPIN, 0};
+  settings.sensors[1] = {SENSOR_MHZ19C, 0, MHZ19_RX_PIN, MHZ19_TX_PIN};
+  settings.sensors[2] = {SENSOR_WATER, 0, WATER_SENSOR_PIN, 0};
+  settings.sensorCount = 3;
+
+  for (int i = 0; i < DEFAULT_RELAYS; i++) {
+    settings.relays[i].bus = BUS_GPIO;
+    settings.relays[i].pin = DEFAULT_RELAY_PINS[i];
+  }
+  settings.relayCount = DEFAULT_RELAYS;
+}
+
+// Import the settings.json written by earlier firmware
+bool loadLegacySettings() {
+  if (!LittleFS.exists("/settings.json")) {
+    return false;
+  }
+  File file = LittleFS.open("/settings.json", "r");
+  StaticJsonDocument<1024> doc;
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+  if (error) {
+    return false;
+  }
+
+  ZoneSettings &zone = settings.zones[0];
+  zone.tempMin = doc["tempMin"] | zone.tempMin;
+  zone.tempMax = doc["tempMax"] | zone.tempMax;
+  zone.humidityMin = doc["humidityMin"] | zone.humidityMin;
+  zone.humidityMax = doc["humidityMax"] | zone.humidityMax;
+  zone.waterLevelThreshold = doc["waterLevelThreshold"] | zone.waterLevelThreshold;
+  for (int i = 0; i < DEFAULT_RELAYS; i++) {
+    strlcpy(settings.relays[i].role, doc["relayAssignments"][i] | "", ROLE_NAME_LEN);
+    settings.relayStates[i] = doc["relayStates"][i];
+  }
+  return true;
+}
+
+// Convert a pre-zone image: its thresholds and relays become zone 0
+void migrateSettingsV1(const SettingsV1 &old) {
+  applyDefaultSettings();
+  memcpy(settings.adminUser, old.adminUser, sizeof(settings.adminUser));
+  memcpy(settings.adminPassword, old.adminPassword, sizeof(settings.adminPassword));
+  settings.minOnSeconds = old.minOnSeconds;
+  settings.minOffSeconds = old.minOffSeconds;
+
+  ZoneSettings &zone = settings.zones[0];
+  zone.tempMin = old.tempMin;
+  zone.tempMax = old.tempMax;
+  zone.humidityMin = old.humidityMin;
+  zone.humidityMax = old.humidityMax;
+  zone.waterLevelThreshold = old.waterLevelThreshold;
+  zone.tempHysteresis = old.tempHysteresis;
+  zone.humidityHysteresis = old.humidityHysteresis;
+  zone.waterHysteresis = old.waterHysteresis;
+  zone.lightOnHours = old.lightOnHours;
+  for (int i = 0; i < DEFAULT_RELAYS; i++) {
+    memcpy(settings.relays[i].role, old.relayAssignments[i], ROLE_NAME_LEN);
+    settings.relayStates[i] = old.relayStates[i];
+  }
+}
+
+bool radioPin(uint8_t pin) {
+  for (uint8_t radioPin : RADIO_PINS) {
+    if (pin == radioPin) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// GPIO 34-39 have no output driver
+bool inputOnlyPin(uint8_t pin) {
+  return pin >= 34 && pin <= 39;
+}
+
+// Reserve 'pin' for 'owner' in the 'used' bitmask; false with a message
+// when it is not a GPIO, belongs to the radio, cannot drive an output
+// that needs one, or is already taken
+bool claimPin(uint8_t pin, bool output, uint64_t &used, const String &owner, String &error) {
+  if (pin > 39) {
+    error = owner + ": GPIO " + String(pin) + " does not exist";
+  } else if (radioPin(pin)) {
+    error = owner + ": GPIO " + String(pin) + " is used by the radio";
+  } else if (output && inputOnlyPin(pin)) {
+    error = owner + ": GPIO " + String(pin) + " is input-only";
+  } else if (used & (1ULL << pin)) {
+    error = owner + ": GPIO " + String(pin) + " is already in use";
+  } else {
+    used |= 1ULL << pin;
+    return true;
+  }
+  return false;
+}
+
+// Map a pin from the pre-radio defaults to its replacement
+uint8_t moveRadioPin(uint8_t pin) {
+  for (const uint8_t *move : RADIO_PIN_MOVES) {
+    if (pin == move[0]) {
+      return move[1];
+    }
+  }
+  return pin;
+}
+
+// Clamp table sizes and references so a damaged or hand-edited image
+// cannot index past the tables
+void sanitizeSettings() {
+  settings.zoneCount = constrain(settings.zoneCount, (uint8_t)1, (uint8_t)MAX_ZONES);
+  settings.sensorCount = min(settings.sensorCount, (uint8_t)MAX_SENSORS);
+  settings.relayCount = min(settings.relayCount, (uint8_t)MAX_RELAYS);
+  settings.commandKey[COMMAND_KEY_LEN - 1] = '\0';
+  for (int z = 0; z < settings.zoneCount; z++) {
+    sanitizeName(settings.zones[z].name, ZONE_NAME_LEN);
+  }
+  for (int id = 0; id < settings.sensorCount; id++) {
+    if (settings.sensors[id].zone >= settings.zoneCount) {
+      settings.sensors[id].kind = SENSOR_NONE;
+    }
+    settings.sensors[id].pin = moveRadioPin(settings.sensors[id].pin);
+    settings.sensors[id].pin2 = moveRadioPin(settings.sensors[id].pin2);
+  }
+  for (int i = 0; i < settings.relayCount; i++) {
+    if (settings.relays[i].zone >= settings.zoneCount) {
+      settings.relays[i].zone = 0;
+      settings.relays[i].role[0] = '\0';
+    }
+    if (settings.relays[i].bus == BUS_GPIO) {
+      settings.relays[i].pin = moveRadioPin(settings.relays[i].pin);
+    }
+    sanitizeName(settings.relays[i].role, ROLE_NAME_LEN);
+  }
+}
+
+size_t settingsFileRead(const char *path, size_t offset, uint8_t *data, size_t len) {
+  File file = LittleFS.open(path, "r");
+  if (!file) {
+    return 0;
+  }
+  size_t got = file.seek(offset) ? file.read(data, len) : 0;
+  file.close();
+  return got;
+}
+
+bool settingsFileWrite(const char *path, bool append, const uint8_t *data, size_t len) {
+  File file = LittleFS.open(path, append ? "a" : "w");
+  if (!file) {
+    return false;
+  }
+  bool written = len == 0 || file.write(data, len) == len;
+  file.close();
+  return written;
+}
+
+// Write 'image' to the other slot and start an empty journal; false when
+// the slot was not written in full
+bool commitSettingsImage(const Settings &image) {
+  if (!commitSettingsImage(settingsStore, SETTINGS_VERSION, (const uint8_t *)&image, sizeof(Settings))) {
+    return false;
+  }
+  memcpy(&persistedSettings, &image, sizeof(Settings));
+  return true;
+}
+
+// Write the current settings as a full image
+bool commitSettings() {
+  memcpy(&settingsSnapshot, &settings, sizeof(Settings));
+  return commitSettingsImage(settingsSnapshot);
+}
+
+// Append the bytes that differ from the persisted image as one entry.
+// Diff, write and the new persisted image all come from one snapshot, so
+// an edit landing meanwhile stays a difference for the next append
+// instead of being marked persisted without being written. False when
+// nothing was persisted.
+bool appendSettingsJournal() {
+  memcpy(&settingsSnapshot, &settings, sizeof(Settings));
+  return appendSettingsJournal(settingsStore, SETTINGS_VERSION, (const uint8_t *)&settingsSnapshot,
+                               (uint8_t *)&persistedSettings, sizeof(Settings), journalEntry, SETTINGS_ENTRY_MAX,
+                               SETTINGS_JOURNAL_MAX);
+}
+
+// Load settings: newest valid slot image plus journal, copied straight
+// into memory. A version 2 image is a prefix of the current layout; the
+// fields after it start zeroed. A pre-zone image has its journal replayed
+// in the old layout, then is converted. Without an image, settings.json
+// is imported, or defaults used. Anything not current is rewritten.
+void loadSettings() {
+  static_assert(sizeof(SettingsV1) <= sizeof(Settings), "A pre-zone image loads into stagedSettings");
+  const uint16_t versions[] = {SETTINGS_VERSION, SETTINGS_VERSION_V2, SETTINGS_VERSION_V1};
+  const size_t sizes[] = {sizeof(Settings), SETTINGS_V2_SIZE, sizeof(SettingsV1)};
+  int loaded = loadSettingsImage(settingsStore, versions, sizes, 3, (uint8_t *)&stagedSettings, sizeof(Settings),
+                                 journalEntry, SETTINGS_ENTRY_MAX);
+  if (loaded == 2) {
+    SettingsV1 legacy;
+    memcpy(&legacy, &stagedSettings, sizeof(SettingsV1));
+    migrateSettingsV1(legacy);
+  } else if (loaded >= 0) {
+    memcpy(&settings, &stagedSettings, sizeof(Settings));
+  } else {
+    applyDefaultSettings();
+    loadLegacySettings();
+  }
+  sanitizeSettings();
+  memcpy(&persistedSettings, &settings, sizeof(Settings));
+  if (loaded != 0 || settingsStore.journalSize > SETTINGS_JOURNAL_MAX) {
+    commitSettings();
+  }
+}
+
+// Request a save; the write happens once changes settle
+void saveSettings() {
+  portENTER_CRITICAL(&settingsMux);
+  if (!settingsDirty) {
+    settingsFirstDirtyAt = millis();
+  }
+  settingsDirtyAt = millis();
+  settingsDirty = true;
+  portEXIT_CRITICAL(&settingsMux);
+}
+
+// Flush after SETTINGS_DEBOUNCE_MS without changes, or SETTINGS_MAX_DELAY_MS
+// after the first change of a continuous burst
+void settingsPersistTick() {
+  uint32_t now = millis();
+  portENTER_CRITICAL(&settingsMux);
+  bool due = settingsDirty &&
+             (now - settingsDirtyAt >= SETTINGS_DEBOUNCE_MS || now - settingsFirstDirtyAt >= SETTINGS_MAX_DELAY_MS);
+  if (due) {
+    settingsDirty = false;  // Cleared before the snapshot, so a later edit marks it again
+  }
+  portEXIT_CRITICAL(&settingsMux);
+  if (!due) {
+    return;
+  }
+  // After a failed write the journal may end in a torn entry that hides
+  // anything appended after it, so only a full image is safe until one
+  // succeeds
+  bool written = settingsImageDue ? commitSettings() : appendSettingsJournal();
+  if (!written && !settingsImageDue) {
+    Serial.println("Settings write failed, retrying");
+  }
+  settingsImageDue = !written;
+  if (!written) {
+    saveSettings();
+  }
 }
@@ -0,0 +1,147 @@
+// Relay rule engine for haltec_hydro.h
+//
+// Plain C++ with no Arduino dependency, so the host tests in tests/ build
+// the same code the controller runs. The sketch scales its zone settings
+// into RuleLevels, compiles them into a RelayRule table when the settings
+// change, and evaluates the table against integer sources every tick.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+enum RelayRole { ROLE_NONE, ROLE_FAN, ROLE_PUMP, ROLE_LIGHT, ROLE_HEATER, ROLE_HUMIDIFIER };
+const char *const ROLE_NAMES[] = {"", "Fan", "Pump", "Light", "Heater", "Humidifier"};
+const int NUM_ROLES = sizeof(ROLE_NAMES) / sizeof(ROLE_NAMES[0]);
+
+// Sources a rule can read; the first four follow the log fields
+enum SensorSource { SRC_TEMP, SRC_HUMIDITY, SRC_CO2, SRC_WATER, SRC_TIME_OF_DAY, SRC_COUNT };
+#define RULE_MISSING INT16_MIN  // Source value with no fresh reading
+
+struct RelayRule {
+  uint8_t relay;
+  uint8_t zone;
+  uint8_t source;
+  bool onAbove;   // true: on above onLevel; false: on below onLevel
+  bool latched;   // Current demand, kept between ticks for hysteresis
+  int32_t onLevel;
+  int32_t offLevel;
+};
+
+// One zone's thresholds in source units (log fixed point, seconds of day)
+struct RuleLevels {
+  int32_t tempMin;
+  int32_t tempMax;
+  int32_t tempBand;
+  int32_t humidityMin;
+  int32_t humidityMax;
+  int32_t humidityBand;
+  int32_t waterThreshold;
+  int32_t waterBand;
+  int32_t lightOnSeconds;
+};
+
+inline RelayRole parseRole(const char *name) {
+  for (int role = 1; role < NUM_ROLES; role++) {
+    if (strcasecmp(name, ROLE_NAMES[role]) == 0) {
+      return (RelayRole)role;
+    }
+  }
+  return ROLE_NONE;
+}
+
+// Add a rule that latches on past onLevel and releases once the value is
+// back past onLevel by 'band'; false when the table is full
+inline bool addRule(RelayRule *rules, int &count, int max, uint8_t relay, uint8_t zone, uint8_t source,
+                    bool onAbove, int32_t onLevel, int32_t band) {
+  if (count >= max) {
+    return false;
+  }
+  RelayRule &rule = rules[count++];
+  rule.relay = relay;
+  rule.zone = zone;
+  rule.source = source;
+  rule.onAbove = onAbove;
+  rule.latched = false;
+  rule.onLevel = onLevel;
+  rule.offLevel = onAbove ? onLevel - band : onLevel + band;
+  return true;
+}
+
+// Append the rules for one relay's role; returns how many were added
+inline int addRoleRules(RelayRule *rules, int &count, int max, uint8_t relay, uint8_t zone, RelayRole role,
+                        const RuleLevels &levels) {
+  int before = count;
+  switch (role) {
+    case ROLE_FAN:
+      addRule(rules, count, max, relay, zone, SRC_TEMP, true, levels.tempMax, levels.tempBand);
+      addRule(rules, count, max, relay, zone, SRC_HUMIDITY, true, levels.humidityMax, levels.humidityBand);
+      break;
+    case ROLE_HEATER:
+      addRule(rules, count, max, relay, zone, SRC_TEMP, false, levels.tempMin, levels.tempBand);
+      break;
+    case ROLE_HUMIDIFIER:
+      addRule(rules, count, max, relay, zone, SRC_HUMIDITY, false, levels.humidityMin, levels.humidityBand);
+      break;
+    case ROLE_PUMP:
+      // Dry-run protection: run only while the reservoir is above threshold
+      addRule(rules, count, max, relay, zone, SRC_WATER, true, levels.waterThreshold + levels.waterBand,
+              levels.waterBand);
+      break;
+    case ROLE_LIGHT:
+      addRule(rules, count, max, relay, zone, SRC_TIME_OF_DAY, false, levels.lightOnSeconds, 0);
+      break;
+    default:
+      break;  // Manual relay
+  }
+  return count - before;
+}
+
+// Give each rule the latched state of its match in 'previous', so a
+// recompile does not drop the hysteresis of relays it did not touch
+inline void carryRuleLatches(RelayRule *rules, int count, const RelayRule *previous, int previousCount) {
+  for (int r = 0; r < count; r++) {
+    for (int p = 0; p < previousCount; p++) {
+      if (previous[p].relay == rules[r].relay && previous[p].zone == rules[r].zone &&
+          previous[p].source == rules[r].source && previous[p].onAbove == rules[r].onAbove) {
+        rules[r].latched = previous[p].latched;
+        break;
+      }
+    }
+  }
+}
+
+// Latch or release one rule; a missing reading releases it, so loads
+// fail safe to off
+inline bool evaluateRule(RelayRule &rule, int32_t value) {
+  if (value == RULE_MISSING) {
+    rule.latched = false;
+  } else if (rule.onAbove) {
+    if (value > rule.onLevel) rule.latched = true;
+    else if (value <= rule.offLevel) rule.latched = false;
+  } else {
+    if (value < rule.onLevel) rule.latched = true;
+    else if (value >= rule.offLevel) rule.latched = false;
+  }
+  return rule.latched;
+}
+
+// A relay is demanded when any of its rules is latched
+inline void evaluateRuleTable(RelayRule *rules, int count, const int32_t (*sources)[SRC_COUNT], bool *demand,
+                              int relayCount) {
+  memset(demand, 0, relayCount);
+  for (int r = 0; r < count; r++) {
+    RelayRule &rule = rules[r];
+    demand[rule.relay] |= evaluateRule(rule, sources[rule.zone][rule.source]);
+  }
+}
+
+// True when a relay that has been 'on' since 'changedAt' may follow its
+// demand at 'now': outside a manual hold, and past its minimum on/off time
+inline bool relayMaySwitch(bool on, bool demand, uint32_t now, uint32_t changedAt, uint32_t holdUntil,
+                           uint32_t minOnMs, uint32_t minOffMs) {
+  if (demand == on || (int32_t)(holdUntil - now) > 0) {
+    return false;
+  }
+  return now - changedAt >= (on ? minOnMs : minOffMs);
+}
@@ -0,0 +1,107 @@
+// Cooperative sensor sampling for haltec_hydro.h
+//
+// Plain C++ with no Arduino dependency; the drivers are the sketch's, and
+// tests/ runs the scheduler against fake ones. A driver starts a sample
+// and is then polled until it reports a result, and neither call may
+// block. Each sensor starts when its period elapses and is polled until it
+// finishes or its timeout expires. At most startsPerPass sensors start per
+// pass, so a pass costs one call per sensor in flight plus a few starts,
+// however slow or stuck the sensors are.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SAMPLE_DEFER means the driver could not start yet and wants a retry
+enum SampleResult { SAMPLE_BUSY, SAMPLE_DONE, SAMPLE_FAILED, SAMPLE_DEFER };
+
+struct SensorDriver {
+  const char *name;
+  uint32_t periodMs;
+  uint32_t timeoutMs;
+  SampleResult (*start)(uint8_t id);
+  SampleResult (*poll)(uint8_t id);
+  void (*abort)(uint8_t id);
+};
+
+// Scheduler state for one configured sensor
+struct SensorTask {
+  uint8_t kind;  // Index into the drivers; one with no start is skipped
+  bool active;
+  uint32_t dueAt;
+  uint32_t startedAt;
+  uint32_t failures;
+};
+
+struct SensorScheduler {
+  const SensorDriver *drivers;
+  int driverCount;
+  int startsPerPass;
+  uint32_t deferMs;  // Retry delay after SAMPLE_DEFER
+  // Optional: told when a sample starts and ends, for tracing
+  void (*sampleBegin)(uint8_t id);
+  void (*sampleEnd)(uint8_t id);
+};
+
+inline const SensorDriver *sensorDriver(const SensorScheduler &scheduler, const SensorTask &task) {
+  if (task.kind >= scheduler.driverCount || !scheduler.drivers[task.kind].start) {
+    return nullptr;
+  }
+  return &scheduler.drivers[task.kind];
+}
+
+// Spread first samples across each sensor's period, so sensors of one
+// kind do not all start together
+inline void scheduleFirstSamples(const SensorScheduler &scheduler, SensorTask *tasks, int count, uint32_t now) {
+  for (int id = 0; id < count; id++) {
+    const SensorDriver *driver = sensorDriver(scheduler, tasks[id]);
+    tasks[id].active = false;
+    tasks[id].dueAt = driver ? now + driver->periodMs * id / count : now;
+  }
+}
+
+// One pass: start due sensors and advance the ones in flight by one step
+inline void runSensorScheduler(const SensorScheduler &scheduler, SensorTask *tasks, int count, uint32_t now) {
+  int starts = 0;
+  for (int id = 0; id < count; id++) {
+    const SensorDriver *driver = sensorDriver(scheduler, tasks[id]);
+    if (!driver) {
+      continue;
+    }
+    SensorTask &task = tasks[id];
+    SampleResult result;
+
+    if (!task.active) {
+      if ((int32_t)(now - task.dueAt) < 0 || starts >= scheduler.startsPerPass) {
+        continue;
+      }
+      starts++;
+      task.active = true;
+      task.startedAt = now;
+      task.dueAt = now + driver->periodMs;
+      if (scheduler.sampleBegin) {
+        scheduler.sampleBegin(id);
+      }
+      result = driver->start(id);
+    } else {
+      result = driver->poll(id);
+    }
+
+    if (result == SAMPLE_BUSY && now - task.startedAt > driver->timeoutMs) {
+      driver->abort(id);
+      result = SAMPLE_FAILED;
+    }
+    if (result == SAMPLE_BUSY) {
+      continue;
+    }
+    task.active = false;
+    if (result == SAMPLE_DEFER) {
+      task.dueAt = now + scheduler.deferMs;
+    } else if (result == SAMPLE_FAILED) {
+      task.failures++;
+    }
+    if (scheduler.sampleEnd) {
+      scheduler.sampleEnd(id);
+    }
+  }
+}
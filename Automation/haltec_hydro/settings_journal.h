@@ -0,0 +1,251 @@
+// Settings slots and journal for haltec_hydro.h
+//
+// Plain C++ with no Arduino dependency; files are reached through the
+// read and write functions of a SettingsStore, which the sketch backs
+// with LittleFS and tests/ with files in memory.
+//
+// A slot file is a PersistHeader and the image. A journal entry is a
+// JournalHeader, then runs of {uint16 offset, uint16 len, bytes}, then a
+// CRC-32 over header and runs. A torn append fails its CRC and ends
+// replay there.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+struct PersistHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;  // Bytes of payload following the header
+  uint32_t seq;
+  uint32_t crc;   // CRC-32 of the payload
+};
+
+struct JournalHeader {
+  uint32_t seq;
+  uint16_t bytes;  // Length of the runs that follow
+};
+
+inline uint32_t crc32(const uint8_t *data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (len--) {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+// Write the bytes of 'current' that differ from 'stored' into 'entry' as
+// runs after the header. Returns the bytes used, header included (so just
+// the header when nothing changed), or 0 when the runs and CRC would not
+// fit in 'max' bytes and a full image should be written instead.
+inline size_t journalDiff(const uint8_t *current, const uint8_t *stored, size_t size, uint8_t *entry,
+                          size_t max) {
+  size_t used = sizeof(JournalHeader);
+  for (size_t i = 0; i < size;) {
+    if (current[i] == stored[i]) {
+      i++;
+      continue;
+    }
+    // Extend the run across short equal gaps; a new run costs 4 bytes
+    size_t end = i + 1;
+    for (size_t j = end; j < size && j < end + 4; j++) {
+      if (current[j] != stored[j]) {
+        end = j + 1;
+      }
+    }
+    uint16_t offset = i, len = end - i;
+    if (used + 4 + len + 4 > max) {
+      return 0;
+    }
+    memcpy(entry + used, &offset, 2);
+    memcpy(entry + used + 2, &len, 2);
+    memcpy(entry + used + 4, current + i, len);
+    used += 4 + len;
+    i = end;
+  }
+  return used;
+}
+
+// Fill in the header of an entry from journalDiff() and append its CRC;
+// returns the length to write
+inline size_t journalSeal(uint8_t *entry, size_t used, uint32_t seq) {
+  JournalHeader header = {seq, (uint16_t)(used - sizeof(JournalHeader))};
+  memcpy(entry, &header, sizeof(header));
+  uint32_t crc = crc32(entry, used);
+  memcpy(entry + used, &crc, 4);
+  return used + 4;
+}
+
+// Apply the runs of a CRC-checked entry of 'used' bytes (header included,
+// CRC excluded) to an image of 'size' bytes; a run past either end stops it
+inline void journalApply(uint8_t *image, size_t size, const uint8_t *entry, size_t used) {
+  for (size_t pos = sizeof(JournalHeader); pos + 4 <= used;) {
+    uint16_t offset, len;
+    memcpy(&offset, entry + pos, 2);
+    memcpy(&len, entry + pos + 2, 2);
+    if ((size_t)offset + len > size || pos + 4 + len > used) {
+      break;
+    }
+    memcpy(image + offset, entry + pos + 4, len);
+    pos += 4 + len;
+  }
+}
+
+// The two slot files and the journal, and where they stand
+struct SettingsStore {
+  const char *slots[2];
+  const char *journal;
+  uint32_t magic;
+  // Up to 'len' bytes of 'path' from 'offset'; 0 when missing or past the end
+  size_t (*read)(const char *path, size_t offset, uint8_t *data, size_t len);
+  // Replace 'path' with, or append to it, 'len' bytes; false unless all were written
+  bool (*write)(const char *path, bool append, const uint8_t *data, size_t len);
+  uint32_t seq;          // Newest sequence number on flash
+  int slot;              // Slot holding the newest image
+  uint32_t journalSize;
+};
+
+// Read one slot; true when it holds a complete image of the given version
+inline bool readSettingsSlot(const SettingsStore &store, int slot, uint16_t version, uint8_t *out, size_t size,
+                             uint32_t &seq) {
+  PersistHeader header;
+  if (store.read(store.slots[slot], 0, (uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+      header.magic != store.magic || header.version != version || header.size != size ||
+      store.read(store.slots[slot], sizeof(header), out, size) != size || crc32(out, size) != header.crc) {
+    return false;
+  }
+  seq = header.seq;
+  return true;
+}
+
+// Load the newest slot holding a valid image of 'version' into 'out',
+// falling back to the other slot when the newer one is damaged
+inline bool loadSettingsSlot(SettingsStore &store, uint16_t version, uint8_t *out, size_t size) {
+  PersistHeader headers[2];
+  bool present[2];
+  for (int slot = 0; slot < 2; slot++) {
+    present[slot] = store.read(store.slots[slot], 0, (uint8_t *)&headers[slot], sizeof(PersistHeader)) ==
+                        sizeof(PersistHeader) &&
+                    headers[slot].magic == store.magic && headers[slot].version == version;
+  }
+  int newest = present[1] && (!present[0] || headers[1].seq > headers[0].seq) ? 1 : 0;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int slot = attempt == 0 ? newest : 1 - newest;
+    uint32_t seq;
+    if (present[slot] && readSettingsSlot(store, slot, version, out, size, seq)) {
+      store.seq = seq;
+      store.slot = slot;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Apply journal entries newer than the loaded image to an image of 'size'
+// bytes, reading through 'buffer', which holds the largest entry. Counts
+// every intact entry in journalSize.
+inline void replaySettingsJournal(SettingsStore &store, uint8_t *image, size_t size, uint8_t *buffer,
+                                  size_t bufferSize) {
+  size_t pos = 0;
+  store.journalSize = 0;
+  for (;;) {
+    size_t got = store.read(store.journal, pos, buffer, bufferSize);
+    size_t at = 0;
+    while (at + sizeof(JournalHeader) <= got) {
+      JournalHeader header;
+      memcpy(&header, buffer + at, sizeof(header));
+      size_t used = sizeof(header) + header.bytes;
+      if (used + 4 > bufferSize) {
+        return;  // Longer than any entry written: damaged
+      }
+      if (at + used + 4 > got) {
+        break;  // Continues past this read
+      }
+      uint32_t crc;
+      memcpy(&crc, buffer + at + used, 4);
+      if (crc32(buffer + at, used) != crc) {
+        return;  // Torn write: nothing after it can be trusted
+      }
+      store.journalSize += used + 4;
+      if (header.seq > store.seq) {
+        journalApply(image, size, buffer + at, used);
+        store.seq = header.seq;
+      }
+      at += used + 4;
+    }
+    if (at == 0) {
+      return;  // End of the journal, or a torn entry at its end
+    }
+    pos += at;
+  }
+}
+
+// Write 'image' to the slot not holding the newest one and start an empty
+// journal. False when the slot was not written in full; the newest slot
+// and its journal then still stand. Journal entries carry older sequence
+// numbers than the new image, so a crash before the truncation only
+// leaves entries that replay skips.
+inline bool commitSettingsImage(SettingsStore &store, uint16_t version, const uint8_t *image, size_t size) {
+  int slot = 1 - store.slot;
+  PersistHeader header = {store.magic, version, (uint16_t)size, store.seq + 1, crc32(image, size)};
+  if (!store.write(store.slots[slot], false, (const uint8_t *)&header, sizeof(header)) ||
+      !store.write(store.slots[slot], true, image, size)) {
+    return false;
+  }
+  store.seq++;
+  store.slot = slot;
+  store.write(store.journal, false, nullptr, 0);
+  store.journalSize = 0;
+  return true;
+}
+
+// Append the bytes of 'current' that differ from 'persisted' as one
+// entry built in 'entry', or write a full image when the change is too
+// scattered or the journal would pass 'journalMax'. On success
+// 'persisted' becomes 'current'. False when nothing was written in full;
+// the journal may then end in a torn entry, so the caller's next write
+// should be a full image.
+inline bool appendSettingsJournal(SettingsStore &store, uint16_t version, const uint8_t *current,
+                                  uint8_t *persisted, size_t size, uint8_t *entry, size_t entrySize,
+                                  size_t journalMax) {
+  size_t used = journalDiff(current, persisted, size, entry, entrySize);
+  if (used == sizeof(JournalHeader)) {
+    return true;  // Nothing changed
+  }
+  if (used == 0 || store.journalSize + used + 4 > journalMax) {
+    if (!commitSettingsImage(store, version, current, size)) {
+      return false;
+    }
+  } else {
+    used = journalSeal(entry, used, store.seq + 1);
+    if (!store.write(store.journal, true, entry, used)) {
+      return false;
+    }
+    store.seq++;
+    store.journalSize += used;
+  }
+  memcpy(persisted, current, size);
+  return true;
+}
+
+// Load the newest valid image, trying 'versions' in order, and replay the
+// journal on top. An image of an older, smaller version fills the front
+// of 'out' and the rest stays zeroed. Returns the index into 'versions'
+// of the one loaded, or -1 when no slot holds a valid image.
+inline int loadSettingsImage(SettingsStore &store, const uint16_t *versions, const size_t *sizes, int count,
+                             uint8_t *out, size_t outSize, uint8_t *buffer, size_t bufferSize) {
+  store.seq = 0;
+  store.journalSize = 0;
+  for (int v = 0; v < count; v++) {
+    memset(out, 0, outSize);
+    if (sizes[v] <= outSize && loadSettingsSlot(store, versions[v], out, sizes[v])) {
+      replaySettingsJournal(store, out, sizes[v], buffer, bufferSize);
+      return v;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,168 @@
+// LoRa telemetry frame encoder and the node end of the relay command
+// channel for haltec_hydro.h
+//
+// Plain C++ with no Arduino dependency; the frame layout is described in
+// the sketch's "LoRa telemetry" section, and the constants both ends share
+// are in common/telemetry_frame.h. The gateway's decoder is
+// testing/tx-rx/tx-rx-ap-httpd/hydro_codec.h, and tests/ round-trips one
+// through the other.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../../common/telemetry_frame.h"
+
+inline size_t encodeTelemetryKey(uint8_t *out, uint16_t node, uint8_t seq, const TelemetryState &state) {
+  size_t len = writeFrameHeader(out, FRAME_KEY, node, seq);
+  out[len++] = state.zoneCount;
+  out[len++] = state.relayCount;
+  for (int z = 0; z < state.zoneCount; z++) {
+    for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+      out[len++] = state.values[z][f] & 0xFF;
+      out[len++] = (uint16_t)state.values[z][f] >> 8;
+    }
+  }
+  size_t relayBytes = (state.relayCount + 7) / 8;
+  memcpy(out + len, state.relays, relayBytes);
+  return telemetryFinish(out, len + relayBytes);
+}
+
+// Encode 'state' as changes against 'base'; 0 when it needs a KEY instead
+inline size_t encodeTelemetryDelta(uint8_t *out, uint16_t node, uint8_t seq, uint8_t baseSeq,
+                                   const TelemetryState &base, const TelemetryState &state) {
+  if (state.zoneCount != base.zoneCount || state.relayCount != base.relayCount) {
+    return 0;
+  }
+  size_t relayBytes = (state.relayCount + 7) / 8;
+  bool relaysChanged = memcmp(state.relays, base.relays, relayBytes) != 0;
+  size_t len = writeFrameHeader(out, FRAME_DELTA | (relaysChanged ? FRAME_FLAG_RELAYS : 0), node, seq);
+  out[len++] = baseSeq;
+
+  uint8_t *masks = out + len;
+  size_t maskBytes = (state.zoneCount + 1) / 2;
+  memset(masks, 0, maskBytes);
+  len += maskBytes;
+  for (int z = 0; z < state.zoneCount; z++) {
+    for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+      int16_t value = state.values[z][f], previous = base.values[z][f];
+      if (value == previous) {
+        continue;
+      }
+      int32_t delta = (int32_t)value - previous;
+      if (value == TELEMETRY_MISSING || previous == TELEMETRY_MISSING || delta < -128 || delta > 127) {
+        return 0;
+      }
+      masks[z / 2] |= 1 << (f + (z % 2) * 4);
+      out[len++] = (uint8_t)(int8_t)delta;
+    }
+  }
+  if (relaysChanged) {
+    memcpy(out + len, state.relays, relayBytes);
+    len += relayBytes;
+  }
+  return telemetryFinish(out, len);
+}
+
+// Relay commands
+//
+// The node end of the command channel: CMD parsing, the idempotency
+// check and the STATE reply. Tags and relays are reached through a
+// CommandNode, which the sketch fills in with mbedtls and its relay
+// outputs and tests/ with a host HMAC and an array.
+
+// Length of a CMD frame's tagged body; 0 when the frame is malformed
+inline size_t commandBodyLength(const uint8_t *frame, size_t len) {
+  if (len < TELEMETRY_HEADER + 5 + COMMAND_TAG_LEN + 1) {
+    return 0;
+  }
+  size_t body = TELEMETRY_HEADER + 5 + frame[TELEMETRY_HEADER + 4];
+  return len == body + COMMAND_TAG_LEN + 1 ? body : 0;
+}
+
+inline uint32_t commandSequence(const uint8_t *frame) {
+  uint32_t seq;
+  memcpy(&seq, frame + TELEMETRY_HEADER, 4);
+  return seq;
+}
+
+// A command is applied once: only a sequence past the newest applied one
+// changes anything, so retries and replays are harmless
+inline bool commandIsNew(uint32_t seq, uint32_t applied) {
+  return seq > applied;
+}
+
+inline uint8_t commandChangeCount(const uint8_t *frame) {
+  return frame[TELEMETRY_HEADER + 4];
+}
+
+// Relay index of change 'c', with its requested state in 'on'
+inline uint8_t commandChange(const uint8_t *frame, int c, bool &on) {
+  uint8_t change = frame[TELEMETRY_HEADER + 5 + c];
+  on = change & COMMAND_ON;
+  return change & ~COMMAND_ON;
+}
+
+// STATE body: newest applied sequence and the relay bitmap; the caller
+// appends the tag and the CRC
+inline size_t encodeCommandState(uint8_t *out, uint16_t node, uint32_t applied, const bool *relayStates,
+                                 uint8_t relayCount) {
+  size_t len = writeFrameHeader(out, FRAME_STATE, node, applied & 0xFF);
+  memcpy(out + len, &applied, 4);
+  len += 4;
+  out[len++] = relayCount;
+  size_t relayBytes = (relayCount + 7) / 8;
+  memset(out + len, 0, relayBytes);
+  for (int i = 0; i < relayCount; i++) {
+    if (relayStates[i]) {
+      out[len + i / 8] |= 1 << (i % 8);
+    }
+  }
+  return len + relayBytes;
+}
+
+struct CommandNode {
+  // COMMAND_TAG_LEN bytes of HMAC-SHA256 under the shared key
+  void (*tag)(const uint8_t *data, size_t len, uint8_t *tag);
+  void (*setRelay)(int index, bool on);
+};
+
+enum CommandReceipt { COMMAND_REFUSED, COMMAND_REPEATED, COMMAND_APPLIED };
+
+// Check a CMD frame's tag and apply its changes to relays below
+// 'relayCount' if its sequence is past 'applied', which then moves to it.
+// A refused frame gets no reply; the others are answered with a STATE.
+inline int receiveCommand(const CommandNode &node, const uint8_t *frame, size_t len, uint32_t &applied,
+                          uint8_t relayCount) {
+  size_t body = commandBodyLength(frame, len);
+  if (body == 0) {
+    return COMMAND_REFUSED;
+  }
+  uint8_t expected[COMMAND_TAG_LEN];
+  node.tag(frame, body, expected);
+  if (!commandTagsEqual(expected, frame + body)) {
+    return COMMAND_REFUSED;
+  }
+  uint32_t seq = commandSequence(frame);
+  if (!commandIsNew(seq, applied)) {
+    return COMMAND_REPEATED;
+  }
+  for (int c = 0; c < commandChangeCount(frame); c++) {
+    bool on;
+    int index = commandChange(frame, c, on);
+    if (index < relayCount) {
+      node.setRelay(index, on);
+    }
+  }
+  applied = seq;
+  return COMMAND_APPLIED;
+}
+
+// The tagged STATE frame reporting 'applied' and the relay states
+inline size_t commandStateFrame(const CommandNode &node, uint8_t *out, uint16_t id, uint32_t applied,
+                                const bool *relayStates, uint8_t relayCount) {
+  size_t len = encodeCommandState(out, id, applied, relayStates, relayCount);
+  node.tag(out, len, out + len);
+  return telemetryFinish(out, len + COMMAND_TAG_LEN);
+}
@@ -0,0 +1,225 @@
+// Sensor history rollups for haltec_hydro.h
+//
+// Plain C++ with no Arduino dependency; files are reached through the
+// read and write functions of a LogStore, which the sketch backs with
+// LittleFS and bench/ with files in memory.
+//
+// Min/max/avg rollups live in fixed-slot files, one per resolution and
+// zone. The slot for a bucket is (start / resolution) % slots, so a range
+// query seeks straight to its buckets. The buckets still filling are kept
+// in RAM and checkpointed together to one file, which also carries the
+// log clock over a reboot.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LOG_FIELDS 4
+#define LOG_MISSING INT16_MIN
+#define LOG_MAX_ZONES 8
+#define LOG_MAX_LEVELS 2
+#define LOG_CHECKPOINT_MAGIC 0x314F5354  // "TSO1"; changes with the bucket layout
+#define ROLLUP_READ_RECORDS 16            // Slots a query reads per file access
+
+struct RollupRecord {
+  uint32_t start;
+  uint16_t count;
+  int16_t min[LOG_FIELDS];
+  int16_t max[LOG_FIELDS];
+  int16_t avg[LOG_FIELDS];
+  uint8_t reserved[2];
+};
+
+struct RollupLevel {
+  uint32_t resolution;  // seconds per bucket
+  uint16_t slots;
+  const char *name;     // Zone 0 uses /<name>.bin, zone n /<name>.z<n>.bin
+};
+
+// Bucket being accumulated in RAM for one level and zone
+struct RollupBucket {
+  uint32_t start;
+  uint16_t count;
+  int16_t min[LOG_FIELDS];
+  int16_t max[LOG_FIELDS];
+  int32_t sum[LOG_FIELDS];
+  uint16_t samples[LOG_FIELDS];
+};
+
+// Every open bucket, and the log time of the last sample added to them
+struct LogCheckpoint {
+  uint32_t magic;
+  uint32_t time;
+  RollupBucket open[LOG_MAX_LEVELS][LOG_MAX_ZONES];
+};
+
+struct LogStore {
+  size_t (*read)(const char *path, size_t offset, uint8_t *data, size_t len);
+  bool (*writeAt)(const char *path, size_t offset, const uint8_t *data, size_t len);  // Within the file
+};
+
+inline void rollupReset(RollupBucket &bucket, uint32_t start) {
+  bucket.start = start;
+  bucket.count = 0;
+  for (int f = 0; f < LOG_FIELDS; f++) {
+    bucket.min[f] = INT16_MAX;
+    bucket.max[f] = INT16_MIN;
+    bucket.sum[f] = 0;
+    bucket.samples[f] = 0;
+  }
+}
+
+inline void rollupToRecord(const RollupBucket &bucket, RollupRecord &record) {
+  memset(&record, 0, sizeof(record));
+  record.start = bucket.start;
+  record.count = bucket.count;
+  for (int f = 0; f < LOG_FIELDS; f++) {
+    bool seen = bucket.samples[f] > 0;
+    record.min[f] = seen ? bucket.min[f] : LOG_MISSING;
+    record.max[f] = seen ? bucket.max[f] : LOG_MISSING;
+    record.avg[f] = seen ? (int16_t)(bucket.sum[f] / bucket.samples[f]) : LOG_MISSING;
+  }
+}
+
+inline size_t rollupSlotOffset(const RollupLevel &level, uint32_t start) {
+  return (size_t)((start / level.resolution) % level.slots) * sizeof(RollupRecord);
+}
+
+// Add a sample to a level's open bucket. A sample past the bucket closes
+// it: the closed bucket is copied to 'closed' for the caller to write with
+// writeRollup(), and true returned.
+inline bool rollupAdd(const RollupLevel &level, RollupBucket &bucket, uint32_t time,
+                      const int16_t values[LOG_FIELDS], RollupBucket &closed) {
+  uint32_t start = time - time % level.resolution;
+  bool closes = start != bucket.start && bucket.count > 0;
+  if (closes) {
+    closed = bucket;
+  }
+  if (start != bucket.start) {
+    rollupReset(bucket, start);
+  }
+  bucket.count++;
+  for (int f = 0; f < LOG_FIELDS; f++) {
+    if (values[f] == LOG_MISSING) {
+      continue;
+    }
+    bucket.min[f] = values[f] < bucket.min[f] ? values[f] : bucket.min[f];
+    bucket.max[f] = values[f] > bucket.max[f] ? values[f] : bucket.max[f];
+    bucket.sum[f] += values[f];
+    bucket.samples[f]++;
+  }
+  return closes;
+}
+
+inline bool writeRollup(const LogStore &store, const char *path, const RollupLevel &level,
+                        const RollupBucket &bucket) {
+  RollupRecord record;
+  rollupToRecord(bucket, record);
+  return store.writeAt(path, rollupSlotOffset(level, bucket.start), (const uint8_t *)&record, sizeof(record));
+}
+
+// Checkpoints
+//
+// The checkpoint is written in one call, so on LittleFS it is replaced
+// whole or not at all.
+inline bool saveLogCheckpoint(const LogStore &store, const char *path, const LogCheckpoint &checkpoint) {
+  return store.writeAt(path, 0, (const uint8_t *)&checkpoint, sizeof(checkpoint));
+}
+
+// False when there is no checkpoint or it is from another layout
+inline bool loadLogCheckpoint(const LogStore &store, const char *path, LogCheckpoint &checkpoint) {
+  return store.read(path, 0, (uint8_t *)&checkpoint, sizeof(checkpoint)) == sizeof(checkpoint) &&
+         checkpoint.magic == LOG_CHECKPOINT_MAGIC;
+}
+
+// End of the newest bucket in a rollup file, 0 for none: the clock resumes
+// from here when there is no checkpoint
+inline uint32_t newestRollupEnd(const LogStore &store, const char *path, const RollupLevel &level) {
+  RollupRecord chunk[ROLLUP_READ_RECORDS];
+  uint32_t newest = 0;
+  for (uint32_t slot = 0; slot < level.slots; slot += ROLLUP_READ_RECORDS) {
+    size_t got = store.read(path, slot * sizeof(RollupRecord), (uint8_t *)chunk, sizeof(chunk)) /
+                 sizeof(RollupRecord);
+    for (size_t i = 0; i < got; i++) {
+      if (chunk[i].count > 0 && chunk[i].start + level.resolution > newest) {
+        newest = chunk[i].start + level.resolution;
+      }
+    }
+    if (got < ROLLUP_READ_RECORDS) {
+      break;
+    }
+  }
+  return newest;
+}
+
+// Range queries
+//
+// A RollupCursor walks the buckets of one level and zone from 'from' to
+// 'to', never more than the ring holds, reading ROLLUP_READ_RECORDS slots
+// at a time. The bucket still filling comes from 'open', a copy the caller
+// takes under its lock.
+struct RollupCursor {
+  const RollupLevel *level;
+  const char *path;
+  RollupBucket open;
+  uint32_t start;       // Next bucket
+  uint32_t slotsLeft;
+  uint32_t chunkStart;  // Bucket of chunk[0]
+  uint32_t chunkCount;
+  RollupRecord chunk[ROLLUP_READ_RECORDS];
+};
+
+inline void startRollupQuery(RollupCursor &cursor, const RollupLevel &level, const char *path,
+                             const RollupBucket &open, uint32_t from, uint32_t to, uint32_t now) {
+  cursor.level = &level;
+  cursor.path = path;
+  cursor.open = open;
+  uint32_t first = from - from % level.resolution;
+  uint32_t newest = now - now % level.resolution;
+  uint32_t span = (level.slots - 1) * level.resolution;
+  uint32_t oldest = newest >= span ? newest - span : 0;
+  cursor.start = first < oldest ? oldest : first;
+  cursor.slotsLeft = cursor.start > to ? 0 : (to - cursor.start) / level.resolution + 1;
+  if (cursor.slotsLeft > level.slots) {
+    cursor.slotsLeft = level.slots;
+  }
+  cursor.chunkCount = 0;
+}
+
+// The next bucket holding data; false when the range is done
+inline bool nextRollupRecord(const LogStore &store, RollupCursor &cursor, RollupRecord &record) {
+  const RollupLevel &level = *cursor.level;
+  while (cursor.slotsLeft > 0) {
+    uint32_t start = cursor.start;
+    cursor.start += level.resolution;
+    cursor.slotsLeft--;
+    if (start == cursor.open.start && cursor.open.count > 0) {
+      rollupToRecord(cursor.open, record);  // Still accumulating in RAM
+      return true;
+    }
+
+    uint32_t index = (start - cursor.chunkStart) / level.resolution;
+    if (cursor.chunkCount == 0 || start < cursor.chunkStart || index >= cursor.chunkCount) {
+      // Read on to the end of the range or of the file, whichever is first
+      uint32_t slot = (start / level.resolution) % level.slots;
+      uint32_t count = cursor.slotsLeft + 1;
+      count = count < ROLLUP_READ_RECORDS ? count : ROLLUP_READ_RECORDS;
+      count = count < level.slots - slot ? count : level.slots - slot;
+      cursor.chunkStart = start;
+      cursor.chunkCount = store.read(cursor.path, slot * sizeof(RollupRecord), (uint8_t *)cursor.chunk,
+                                     count * sizeof(RollupRecord)) / sizeof(RollupRecord);
+      index = 0;
+      if (cursor.chunkCount == 0) {
+        cursor.slotsLeft = 0;  // No file
+        return false;
+      }
+    }
+    if (cursor.chunk[index].start == start && cursor.chunk[index].count > 0) {
+      record = cursor.chunk[index];
+      return true;
+    }
+    // Empty slot, or overwritten by a newer bucket
+  }
+  return false;
+}
@@ -0,0 +1,181 @@
+// Traffic classes and low-water alarms on the haltec_hydro.h TX path
+//
+// Plain C++ with no Arduino dependency; the sketch drives the radio, and
+// tests/test_alarm_latency.cpp runs the same queue and alarm logic against
+// a simulated channel kept busy with bulk frames.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../../common/radio_profile.h"
+#include "../../common/telemetry_frame.h"
+
+// Traffic Classes
+//
+// Frames wait in one slot per class, and the radio always starts the
+// highest class waiting: ALARM, then CONTROL (STATE replies), then BULK
+// (telemetry reports). A newer frame replaces one still waiting in its
+// slot; every class carries absolute state, so only the newest matters.
+// An alarm queued while a bulk frame is on the air aborts it, and the
+// bulk frame goes out again after the alarm. After a frame the gateway
+// answers (an alarm or a report) nothing starts until the answer arrives
+// or TX_ANSWER_WINDOW_MS pass, so the next frame does not talk over it.
+#define LORA_CODING_RATE 5
+#define ALARM_CODING_RATE 8  // 4/8: more redundancy per alarm frame
+typedef RadioProfile<7, 125, LORA_CODING_RATE> HydroProfile;  // As the gateway sketches
+const RadioProfileInfo HYDRO_PROFILE = HydroProfile::info();
+const RadioProfileInfo ALARM_PROFILE = RadioProfile<7, 125, ALARM_CODING_RATE>::info();
+enum TrafficClass { TRAFFIC_ALARM, TRAFFIC_CONTROL, TRAFFIC_BULK, TRAFFIC_CLASSES };
+#define TX_ANSWER_WINDOW_MS 100  // Gateway turnaround plus an ACK's ~31 ms on air
+
+struct TxSlot {
+  bool queued;
+  uint8_t len;
+  uint8_t data[TELEMETRY_FRAME_MAX];
+};
+
+// Put a frame in its class's slot, replacing any frame still waiting there
+inline void queueTxFrame(TxSlot *slots, TrafficClass cls, const uint8_t *data, size_t len) {
+  TxSlot &slot = slots[cls];
+  memcpy(slot.data, data, len);
+  slot.len = len;
+  slot.queued = true;
+}
+
+// The class to start next, taken from its slot, or -1. While 'onAir' is
+// on the air nothing starts, unless it is bulk and an alarm waits: then
+// 'preempt' is set, the caller aborts the transmission, and the bulk
+// frame waits in its slot again.
+inline int nextTxClass(TxSlot *slots, bool transmitting, int onAir, bool &preempt) {
+  preempt = false;
+  if (transmitting) {
+    if (onAir != TRAFFIC_BULK || !slots[TRAFFIC_ALARM].queued) {
+      return -1;
+    }
+    preempt = true;
+    slots[TRAFFIC_BULK].queued = true;
+  }
+  for (int c = 0; c < TRAFFIC_CLASSES; c++) {
+    if (slots[c].queued) {
+      slots[c].queued = false;
+      return c;
+    }
+  }
+  return -1;
+}
+
+// The wait for the gateway's answer to the last frame sent
+struct TxAnswerWait {
+  bool waiting;
+  uint32_t until;
+};
+
+// A frame of class 'cls' finished on the air; STATE replies get no answer
+inline void txSent(TxAnswerWait &wait, int cls, uint32_t now) {
+  wait.waiting = cls != TRAFFIC_CONTROL;
+  wait.until = now + TX_ANSWER_WINDOW_MS;
+}
+
+// Whether the radio should stay listening instead of starting a frame
+inline bool txAwaitingAnswer(TxAnswerWait &wait, uint32_t now) {
+  wait.waiting = wait.waiting && (int32_t)(now - wait.until) < 0;
+  return wait.waiting;
+}
+
+// Alarms
+//
+// The zones under their water threshold are reported in an ALARM frame
+// as soon as the set changes, without waiting for the telemetry period.
+// The frame is repeated every ALARM_RETRY_MS (plus jitter) until the
+// gateway acknowledges its sequence, up to ALARM_MAX_ATTEMPTS times. Each
+// new set, and each new round after one ran out, spends a token from a
+// bucket of ALARM_BURST refilled every ALARM_REFILL_MS, so a sensor
+// flapping around its threshold costs at most one round per refill; the
+// set sent when a token frees is always the newest.
+#define ALARM_RETRY_MS 1500
+#define ALARM_RETRY_JITTER_MS 500
+#define ALARM_MAX_ATTEMPTS 6
+#define ALARM_BURST 3
+#define ALARM_REFILL_MS 60000
+#define ALARM_FRAME_LEN (TELEMETRY_HEADER + 5 + 1)
+
+struct AlarmState {
+  uint32_t lowWater;  // Zones under threshold, set by the control loop
+  uint32_t reported;  // Set carried by seq
+  uint8_t seq;
+  bool pending;       // seq not acknowledged yet
+  bool deferred;      // A change is waiting for a token
+  uint8_t attempts;
+  uint32_t nextAt;
+  uint8_t tokens;
+  uint32_t refilledAt;
+};
+
+inline void initAlarm(AlarmState &alarm) {
+  memset(&alarm, 0, sizeof(alarm));
+  alarm.tokens = ALARM_BURST;
+}
+
+// What alarmStep() did, as flags
+#define ALARM_CHANGED 0x01   // A new set started a round
+#define ALARM_DEFERRED 0x02  // A change found no token
+#define ALARM_SEND 0x04      // Queue the alarm frame now
+
+// Start a round for a changed set when a token allows, and ask for the
+// unacknowledged alarm again on its retry timer. 'jitterMs' is a random
+// value under ALARM_RETRY_JITTER_MS.
+inline int alarmStep(AlarmState &alarm, uint32_t now, uint32_t jitterMs) {
+  int result = 0;
+  if (alarm.tokens < ALARM_BURST && now - alarm.refilledAt >= ALARM_REFILL_MS) {
+    alarm.tokens++;
+    alarm.refilledAt = now;
+  }
+
+  bool changed = alarm.lowWater != alarm.reported;
+  if (changed || (alarm.pending && alarm.attempts >= ALARM_MAX_ATTEMPTS)) {
+    if (alarm.tokens > 0) {
+      if (alarm.tokens == ALARM_BURST) {
+        alarm.refilledAt = now;
+      }
+      alarm.tokens--;
+      if (changed) {
+        alarm.reported = alarm.lowWater;
+        result |= ALARM_CHANGED;
+      }
+      alarm.seq++;
+      alarm.pending = true;
+      alarm.deferred = false;
+      alarm.attempts = 0;
+      alarm.nextAt = now;
+    } else if (changed && !alarm.deferred) {
+      alarm.deferred = true;  // Sent when a token frees, as the newest set
+      result |= ALARM_DEFERRED;
+    }
+  }
+
+  if (!alarm.pending || alarm.attempts >= ALARM_MAX_ATTEMPTS || (int32_t)(now - alarm.nextAt) < 0) {
+    return result;
+  }
+  alarm.attempts++;
+  alarm.nextAt = now + ALARM_RETRY_MS + jitterMs;
+  return result | ALARM_SEND;
+}
+
+// The ALARM frame for the current round
+inline size_t encodeAlarm(uint8_t *out, uint16_t node, const AlarmState &alarm, uint8_t zoneCount) {
+  size_t len = writeFrameHeader(out, FRAME_ALARM, node, alarm.seq);
+  out[len++] = zoneCount;
+  memcpy(out + len, &alarm.reported, 4);
+  return telemetryFinish(out, len + 4);
+}
+
+// An ALARM_ACK for the alarm in flight ends its retries; true when it did
+inline bool alarmAcked(AlarmState &alarm, const uint8_t *frame, size_t len) {
+  if (len != TELEMETRY_HEADER + 1 || !alarm.pending || frame[3] != alarm.seq) {
+    return false;
+  }
+  alarm.pending = false;
+  return true;
+}
@@ -0,0 +1,191 @@
+// Zone readings for haltec_hydro.h
+//
+// Plain C++ with no Arduino dependency; bench/zones.cpp runs it on the
+// host. Each control tick folds the sensors' last good samples into one
+// reading per zone, converts those once into log fixed-point units, and
+// hands them to the rules in relay_rules.h as per-zone sources. Every step
+// is one pass over the sensors or the zones. /api/state prints the same
+// values through the printers below, which take any output with the
+// print() overloads of Arduino's Print.
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "relay_rules.h"
+#include "time_series.h"
+
+// I/O tables. A sensor belongs to one zone; a zone's reading is the
+// average of its sensors that reported recently.
+enum SensorKind { SENSOR_NONE, SENSOR_DHT22, SENSOR_MHZ19C, SENSOR_WATER, NUM_SENSOR_KINDS };
+
+struct SensorConfig {
+  uint8_t kind;  // SensorKind
+  uint8_t zone;
+  uint8_t pin;   // DHT22 data, water ADC input, or MH-Z19C ESP32 RX
+  uint8_t pin2;  // MH-Z19C ESP32 TX
+};
+
+enum LogField { LOG_TEMP, LOG_HUMIDITY, LOG_CO2, LOG_WATER };
+
+// Fixed-point scale per field; the log stores value * scale as int16
+const float LOG_SCALES[LOG_FIELDS] = {10, 10, 1, 1};
+const char *const LOG_FIELD_NAMES[LOG_FIELDS] = {"temperature", "humidity", "co2", "water"};
+
+// Latest readings of one zone. Each group carries the millis() of its
+// newest sample.
+struct SensorSnapshot {
+  float temperature;
+  float humidity;
+  int co2;
+  int waterLevel;
+  uint32_t climateAt;
+  uint32_t co2At;
+  uint32_t waterAt;
+};
+
+// Per-zone accumulator used while averaging sensors into readings
+struct ZoneSums {
+  float temperature;
+  float humidity;
+  int32_t co2;
+  int32_t water;
+  uint8_t climateCount;
+  uint8_t co2Count;
+  uint8_t waterCount;
+  uint32_t climateAt;
+  uint32_t co2At;
+  uint32_t waterAt;
+};
+
+// True when a reading taken at 'at' is recent enough to act on
+inline bool readingFresh(uint32_t at, uint32_t now, uint32_t staleMs) {
+  return at != 0 && now - at < staleMs;
+}
+
+inline int16_t logQuantize(float value, float scale) {
+  return isnan(value) ? LOG_MISSING : (int16_t)lroundf(value * scale);
+}
+
+// Fold the per-sensor samples into per-zone readings: the average of the
+// zone's sensors that reported within staleMs. A zone with no fresh sensor
+// keeps its last reading, which then ages out. 'Sensor' is any type with
+// the last good sample in temperature, humidity, value and at; 'sums' has
+// room for zoneCount zones.
+template <typename Sensor>
+void aggregateZoneReadings(const SensorConfig *sensors, const Sensor *states, int sensorCount, ZoneSums *sums,
+                           SensorSnapshot *readings, int zoneCount, uint32_t now, uint32_t staleMs) {
+  memset(sums, 0, sizeof(ZoneSums) * zoneCount);
+
+  for (int id = 0; id < sensorCount; id++) {
+    const Sensor &state = states[id];
+    if (sensors[id].zone >= zoneCount || !readingFresh(state.at, now, staleMs)) {
+      continue;
+    }
+    ZoneSums &sum = sums[sensors[id].zone];
+    switch (sensors[id].kind) {
+      case SENSOR_DHT22:
+        sum.temperature += state.temperature;
+        sum.humidity += state.humidity;
+        sum.climateCount++;
+        sum.climateAt = state.at > sum.climateAt ? state.at : sum.climateAt;
+        break;
+      case SENSOR_MHZ19C:
+        sum.co2 += state.value;
+        sum.co2Count++;
+        sum.co2At = state.at > sum.co2At ? state.at : sum.co2At;
+        break;
+      case SENSOR_WATER:
+        sum.water += state.value;
+        sum.waterCount++;
+        sum.waterAt = state.at > sum.waterAt ? state.at : sum.waterAt;
+        break;
+    }
+  }
+
+  for (int z = 0; z < zoneCount; z++) {
+    const ZoneSums &sum = sums[z];
+    SensorSnapshot &reading = readings[z];
+    if (sum.climateCount) {
+      reading.temperature = sum.temperature / sum.climateCount;
+      reading.humidity = sum.humidity / sum.climateCount;
+      reading.climateAt = sum.climateAt;
+    }
+    if (sum.co2Count) {
+      reading.co2 = sum.co2 / sum.co2Count;
+      reading.co2At = sum.co2At;
+    }
+    if (sum.waterCount) {
+      reading.waterLevel = sum.water / sum.waterCount;
+      reading.waterAt = sum.waterAt;
+    }
+  }
+}
+
+// A zone's readings in log units, LOG_MISSING where nothing is fresh
+inline void zoneLogValues(const SensorSnapshot &reading, uint32_t now, uint32_t staleMs,
+                          int16_t values[LOG_FIELDS]) {
+  bool climateFresh = readingFresh(reading.climateAt, now, staleMs);
+  values[LOG_TEMP] = climateFresh ? logQuantize(reading.temperature, LOG_SCALES[LOG_TEMP]) : LOG_MISSING;
+  values[LOG_HUMIDITY] = climateFresh ? logQuantize(reading.humidity, LOG_SCALES[LOG_HUMIDITY]) : LOG_MISSING;
+  values[LOG_CO2] = readingFresh(reading.co2At, now, staleMs) ? reading.co2 : LOG_MISSING;
+  values[LOG_WATER] = readingFresh(reading.waterAt, now, staleMs) ? reading.waterLevel : LOG_MISSING;
+}
+
+// Rule sources for every zone: its log values and the time of day
+inline void zoneRuleSources(const SensorSnapshot *readings, int zoneCount, uint32_t now, uint32_t staleMs,
+                            int32_t timeOfDay, int32_t (*sources)[SRC_COUNT]) {
+  for (int z = 0; z < zoneCount; z++) {
+    int16_t values[LOG_FIELDS];
+    zoneLogValues(readings[z], now, staleMs, values);
+    for (int f = 0; f < LOG_FIELDS; f++) {
+      sources[z][f] = values[f];
+    }
+    sources[z][SRC_TIME_OF_DAY] = timeOfDay;
+  }
+}
+
+// JSON
+//
+// A log value in its own units, or null
+template <typename Out>
+void printLogValue(Out &out, int16_t value, int field) {
+  if (value == LOG_MISSING) {
+    out.print("null");
+  } else {
+    out.print(value / LOG_SCALES[field], field == LOG_TEMP || field == LOG_HUMIDITY ? 1 : 0);
+  }
+}
+
+// One zone of /api/state: {"id":z,"name":"...","temperature":...}
+template <typename Out>
+void printZoneState(Out &out, int zone, const char *name, const int16_t values[LOG_FIELDS]) {
+  out.print(zone ? ",{\"id\":" : "{\"id\":");
+  out.print(zone);
+  out.print(",\"name\":\"");
+  out.print(name);
+  out.print('"');
+  for (int f = 0; f < LOG_FIELDS; f++) {
+    out.print(",\"");
+    out.print(LOG_FIELD_NAMES[f]);
+    out.print("\":");
+    printLogValue(out, values[f], f);
+  }
+  out.print('}');
+}
+
+// One relay of /api/state
+template <typename Out>
+void printRelayState(Out &out, int relay, int zone, const char *role, bool on) {
+  out.print(relay ? ",{\"id\":" : "{\"id\":");
+  out.print(relay);
+  out.print(",\"zone\":");
+  out.print(zone);
+  out.print(",\"role\":\"");
+  out.print(role);
+  out.print("\",\"on\":");
+  out.print(on ? "true" : "false");
+  out.print('}');
+}
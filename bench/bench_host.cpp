@@ -0,0 +1,426 @@
+// Host microbenchmarks for the sketches' plain C++ code: the hydro rule
+// loop, telemetry frames, relay commands, CRCs, the settings journal, the
+// tx-rx message hex and AES, Serial command parsing, the display lines and
+// the hydro dashboard page. Each case runs once to warm up, then repeats
+// for at least BENCH_CASE_MS in BENCH_ROUNDS rounds and reports the
+// fastest round's ns/op plus heap allocations and bytes per op; the
+// dashboard is built into a std::string, so its allocations are real.
+// Given a baseline file, a case more than BENCH_REGRESSION_PCT slower, or
+// allocating more, is flagged and the exit status is 1.
+//
+//   bench_host                        print the results
+//   bench_host --baseline F           compare with F
+//   bench_host --save --baseline F    write the results to F
+//
+// Timings only compare on one machine, so no baseline is kept in the tree:
+// bench/record_baseline.sh records one here from any commit. AES is
+// OpenSSL's, standing in for the sketches' AES library; without OpenSSL
+// the message cases are left out. The JSON paths need ArduinoJson and are
+// timed on the device by /perf.
+#include <chrono>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+
+#ifdef BENCH_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#include "hydro_codec.h"
+#include "relay_rules.h"
+#include "settings_journal.h"
+#include "telemetry_codec.h"
+#include "dashboard_html.h"
+#include "message_text.h"
+
+#define BENCH_CASE_MS 200
+#define BENCH_ROUNDS 5  // ns/op is the fastest round, which filters out scheduler noise
+#define BENCH_REGRESSION_PCT 10
+#define BENCH_MAX_CASES 32
+#define BENCH_NAME_LEN 32
+
+// Heap accounting: every operator new in the process is counted
+static size_t allocCount = 0, allocBytes = 0;
+
+void *operator new(size_t size) {
+  allocCount++;
+  allocBytes += size;
+  void *p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void operator delete(void *p) noexcept {
+  free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+volatile uint32_t benchSink;
+
+// Shared inputs, built once
+#define ZONES 16
+#define RELAYS 64
+#define IMAGE 4096  // About the size of the hydro Settings image
+
+RelayRule rules[RELAYS * 2];
+int ruleCount = 0;
+int32_t sources[ZONES][SRC_COUNT];
+TelemetryState nodeState, nodeBase;
+bool commandRelays[RELAYS];
+const CommandNode BENCH_COMMAND_NODE = {
+  [](const uint8_t *, size_t, uint8_t *tag) { memset(tag, 0, COMMAND_TAG_LEN); },
+  [](int index, bool on) { commandRelays[index] = on; },
+};
+uint8_t keyFrame[TELEMETRY_FRAME_MAX], deltaFrame[TELEMETRY_FRAME_MAX];
+size_t keyLen, deltaLen;
+uint8_t stored[IMAGE], current[IMAGE], entry[IMAGE + 64];
+size_t entryUsed;
+char zoneNames[ZONES][16];
+DashboardZone dashboardZones[ZONES];
+DashboardRelay dashboardRelays[RELAYS];
+const uint8_t MESSAGE_KEY[16] = {0xA1, 0xB2, 0xC3, 0xD4, 0xE5, 0xF6, 0xA7, 0xB8,
+                                 0xC9, 0xDA, 0xEB, 0xFC, 0xAD, 0xBE, 0xCF, 0xD0};
+char messageHex[MESSAGE_HEX_LEN + 1];
+
+// AES-128 on one block, keyed per call as the sketches' AES library is
+#ifdef BENCH_OPENSSL
+void aesBlock(const uint8_t *in, uint8_t *out, const uint8_t *key, bool encrypt) {
+  static EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
+  int len;
+  EVP_CipherInit_ex(context, EVP_aes_128_ecb(), nullptr, key, nullptr, encrypt);
+  EVP_CIPHER_CTX_set_padding(context, 0);
+  EVP_CipherUpdate(context, out, &len, in, MESSAGE_BLOCK);
+}
+void aesEncryptBlock(const uint8_t *in, uint8_t *out, const uint8_t *key) {
+  aesBlock(in, out, key, true);
+}
+void aesDecryptBlock(const uint8_t *in, uint8_t *out, const uint8_t *key) {
+  aesBlock(in, out, key, false);
+}
+#else
+void aesEncryptBlock(const uint8_t *in, uint8_t *out, const uint8_t *) {
+  memcpy(out, in, MESSAGE_BLOCK);
+}
+#endif
+
+// Feed one line through a LineReader and dispatch it as handleSerialInput()
+// in tx-rx-ap-httpd.h does; returns which command matched
+int serialLine(const char *text) {
+  static LineReader reader;
+  const char *line = nullptr, *arg;
+  for (const char *c = text; *c; c++) {
+    if (const char *done = lineFeed(reader, *c)) {
+      line = done;
+    }
+  }
+  if (!line) {
+    return -1;
+  }
+  if (commandIs(line, "/metrics")) {
+    return 1;
+  } else if (commandIs(line, "/perf", &arg)) {
+    return 2;
+  } else if (commandIs(line, "/capture", &arg)) {
+    return 3;
+  } else if (commandIs(line, "/replay", &arg)) {
+    return 4 + atoi(arg);
+  }
+  return 0;
+}
+
+void setupInputs() {
+  RuleLevels levels = {250, 300, 10, 400, 600, 50, 100, 10, 12 * 3600};
+  for (int i = 0; i < RELAYS; i++) {
+    addRoleRules(rules, ruleCount, RELAYS * 2, i, i % ZONES, (RelayRole)(1 + i % 5), levels);
+  }
+  for (int z = 0; z < ZONES; z++) {
+    sources[z][SRC_TEMP] = 240 + z * 5;
+    sources[z][SRC_HUMIDITY] = 500 + z * 10;
+    sources[z][SRC_CO2] = 800;
+    sources[z][SRC_WATER] = 90 + z * 2;
+    sources[z][SRC_TIME_OF_DAY] = 30000;
+  }
+
+  nodeState.zoneCount = ZONES;
+  nodeState.relayCount = RELAYS;
+  for (int z = 0; z < ZONES; z++) {
+    for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+      nodeState.values[z][f] = 200 + z * 7 + f * 31;
+    }
+  }
+  nodeBase = nodeState;
+  for (int z = 0; z < ZONES; z += 3) {
+    nodeState.values[z][z % TELEMETRY_FIELDS] += 2;
+  }
+  keyLen = encodeTelemetryKey(keyFrame, 1, 1, nodeState);
+  deltaLen = encodeTelemetryDelta(deltaFrame, 1, 2, 1, nodeBase, nodeState);
+
+  srand(1);
+  for (int i = 0; i < IMAGE; i++) {
+    stored[i] = rand();
+  }
+  memcpy(current, stored, IMAGE);
+  current[40] ^= 1;  // A typical /settings edit: one zone's thresholds
+  memset(current + 1000, 0x11, 24);
+  entryUsed = journalDiff(current, stored, IMAGE, entry, sizeof(entry));
+
+  for (int z = 0; z < ZONES; z++) {
+    snprintf(zoneNames[z], sizeof(zoneNames[z]), "Zone %d", z + 1);
+    dashboardZones[z] = {zoneNames[z], 21.5f + z, z % 5 ? 55.0f : NAN, z % 3 ? 800 + z : -1, 900 + z};
+  }
+  const char *roles[] = {"Fan", "Pump", "Light", "Heater", "Humidifier"};
+  for (int i = 0; i < RELAYS; i++) {
+    dashboardRelays[i] = {roles[i % 5], i % ZONES, i % 2 == 0};
+  }
+  encryptMessageHex("Hello from node", 15, MESSAGE_KEY, aesEncryptBlock, messageHex);
+}
+
+struct BenchCase {
+  const char *name;
+  void (*run)();
+};
+
+const BenchCase CASES[] = {
+  {"rules_compile", []() {
+    static RelayRule table[RELAYS * 2];
+    int count = 0;
+    RuleLevels levels = {250, 300, 10, 400, 600, 50, 100, 10, 12 * 3600};
+    for (int i = 0; i < RELAYS; i++) {
+      addRoleRules(table, count, RELAYS * 2, i, i % ZONES, (RelayRole)(1 + i % 5), levels);
+    }
+    carryRuleLatches(table, count, rules, ruleCount);
+    benchSink = count;
+  }},
+  {"rules_evaluate", []() {
+    static bool demand[RELAYS];
+    evaluateRuleTable(rules, ruleCount, sources, demand, RELAYS);
+    benchSink = demand[0];
+  }},
+  {"telemetry_key_encode", []() {
+    static uint8_t frame[TELEMETRY_FRAME_MAX];
+    benchSink = encodeTelemetryKey(frame, 1, 1, nodeState);
+  }},
+  {"telemetry_delta_encode", []() {
+    static uint8_t frame[TELEMETRY_FRAME_MAX];
+    benchSink = encodeTelemetryDelta(frame, 1, 2, 1, nodeBase, nodeState);
+  }},
+  {"telemetry_key_decode", []() {
+    static TelemetryState state;
+    benchSink = decodeTelemetryKey(keyFrame, keyLen, state);
+  }},
+  {"telemetry_delta_decode", []() {
+    static TelemetryState state;
+    benchSink = decodeTelemetryDelta(deltaFrame, deltaLen, nodeBase, state);
+  }},
+  {"command_round_trip", []() {
+    static RelayCommand command;
+    static uint32_t applied = 0;
+    uint8_t frame[TELEMETRY_HEADER + 5 + RELAYS + COMMAND_TAG_LEN + 1];
+    uint8_t state[TELEMETRY_HEADER + 5 + RELAYS / 8 + COMMAND_TAG_LEN + 1];
+    queueCommandChange(command, 3, true, 0);
+    queueCommandChange(command, 9, false, 0);
+    size_t len = nextCommandFrame(command, 1, 0, frame);
+    len += COMMAND_TAG_LEN + 1;  // Zero tags: this times the codec, not HMAC
+    receiveCommand(BENCH_COMMAND_NODE, frame, len, applied, RELAYS);
+    size_t stateLen = commandStateFrame(BENCH_COMMAND_NODE, state, 1, applied, commandRelays, RELAYS);
+    if (commandStateBody(state, stateLen)) {
+      applyCommandState(command, state, 0);
+    }
+    benchSink = command.status;
+  }},
+  {"crc8_64", []() { benchSink = crc8(keyFrame, 64); }},
+  {"settings_crc32", []() { benchSink = crc32(current, IMAGE); }},
+  {"journal_diff", []() {
+    static uint8_t out[IMAGE + 64];
+    benchSink = journalDiff(current, stored, IMAGE, out, sizeof(out));
+  }},
+  {"journal_replay", []() {
+    static uint8_t image[IMAGE];
+    journalApply(image, IMAGE, entry, entryUsed);
+    benchSink = image[40];
+  }},
+  {"hex_encode_16", []() {
+    static char hex[MESSAGE_HEX_LEN + 1];
+    hexEncode(keyFrame, MESSAGE_BLOCK, hex);
+    benchSink = hex[3];
+  }},
+  {"hex_decode_16", []() {
+    static uint8_t block[MESSAGE_BLOCK];
+    benchSink = hexDecode(messageHex, MESSAGE_HEX_LEN, block, sizeof(block));
+  }},
+#ifdef BENCH_OPENSSL
+  {"encrypt_message", []() {
+    static char hex[MESSAGE_HEX_LEN + 1];
+    encryptMessageHex("Hello from node", 15, MESSAGE_KEY, aesEncryptBlock, hex);
+    benchSink = hex[0];
+  }},
+  {"decrypt_message", []() {
+    static char text[MESSAGE_BLOCK + 1];
+    benchSink = decryptMessageHex(messageHex, MESSAGE_HEX_LEN, MESSAGE_KEY, aesDecryptBlock, text);
+  }},
+#endif
+  {"serial_command", []() { benchSink = serialLine("/replay 3\n"); }},
+  {"serial_message", []() { benchSink = serialLine("Pump 2 on in the east greenhouse\n"); }},
+  {"channel_command", []() {
+    int channel, key;
+    benchSink = parseChannelCommand("C 2 3", 4, 4, channel, key);
+  }},
+  {"display_line", []() {
+    static char line[DISPLAY_LINE_MAX];
+    benchSink = formatDisplayLine(line, sizeof(line), "Received", "The quick brown fox jumps");
+  }},
+  {"status_line", []() {
+    static char line[DISPLAY_LINE_MAX];
+    benchSink = formatStatusLine(line, sizeof(line), -97.5f, 6.25f, 86400);
+  }},
+  {"dashboard_1z_4r", []() {
+    std::string html;
+    buildDashboard(html, dashboardZones, 1, dashboardRelays, 4);
+    benchSink = html.size();
+  }},
+  {"dashboard_16z_64r", []() {
+    std::string html;
+    buildDashboard(html, dashboardZones, ZONES, dashboardRelays, RELAYS);
+    benchSink = html.size();
+  }},
+};
+const int NUM_CASES = sizeof(CASES) / sizeof(CASES[0]);
+
+struct BenchResult {
+  char name[BENCH_NAME_LEN];
+  double nsPerOp;
+  double allocsPerOp;
+  double bytesPerOp;
+};
+
+BenchResult runCase(const BenchCase &bench) {
+  using Clock = std::chrono::steady_clock;
+  bench.run();  // Warm up
+  size_t allocsBefore = allocCount, bytesBefore = allocBytes;
+  uint64_t totalOps = 0;
+  double best = 0;
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    uint64_t ops = 0;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::milliseconds(BENCH_CASE_MS / BENCH_ROUNDS);
+    Clock::time_point now;
+    do {
+      for (int i = 0; i < 64; i++) {
+        bench.run();
+      }
+      ops += 64;
+      now = Clock::now();
+    } while (now < deadline);
+    double ns = std::chrono::duration<double, std::nano>(now - start).count() / ops;
+    if (round == 0 || ns < best) {
+      best = ns;
+    }
+    totalOps += ops;
+  }
+
+  BenchResult result = {};
+  snprintf(result.name, sizeof(result.name), "%s", bench.name);
+  result.nsPerOp = best;
+  result.allocsPerOp = (double)(allocCount - allocsBefore) / totalOps;
+  result.bytesPerOp = (double)(allocBytes - bytesBefore) / totalOps;
+  return result;
+}
+
+int loadBaseline(const char *path, BenchResult *baseline) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return 0;
+  }
+  int count = 0;
+  char line[128];
+  while (count < BENCH_MAX_CASES && fgets(line, sizeof(line), file)) {
+    BenchResult &entry = baseline[count];
+    if (line[0] != '#' && sscanf(line, "%31s %lf %lf %lf", entry.name, &entry.nsPerOp, &entry.allocsPerOp,
+                                 &entry.bytesPerOp) == 4) {
+      count++;
+    }
+  }
+  fclose(file);
+  return count;
+}
+
+bool saveBaseline(const char *path, const BenchResult *results, int count) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+  fprintf(file, "# name ns/op allocs/op bytes/op, written by bench_host --save\n");
+  for (int i = 0; i < count; i++) {
+    fprintf(file, "%s %.2f %.2f %.2f\n", results[i].name, results[i].nsPerOp, results[i].allocsPerOp,
+            results[i].bytesPerOp);
+  }
+  fclose(file);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *path = nullptr;
+  bool save = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--save") == 0) {
+      save = true;
+    } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else {
+      fprintf(stderr, "usage: %s [--save] [--baseline FILE]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (save && !path) {
+    fprintf(stderr, "--save needs --baseline FILE\n");
+    return 2;
+  }
+
+  setupInputs();
+  BenchResult baseline[BENCH_MAX_CASES];
+  int baselineCount = save || !path ? 0 : loadBaseline(path, baseline);
+  BenchResult results[NUM_CASES];
+  int regressions = 0;
+
+  printf("%-24s %12s %10s %10s %10s\n", "case", "ns/op", "allocs/op", "bytes/op", "vs base");
+  for (int i = 0; i < NUM_CASES; i++) {
+    BenchResult &result = results[i] = runCase(CASES[i]);
+    printf("%-24s %12.1f %10.2f %10.1f", result.name, result.nsPerOp, result.allocsPerOp, result.bytesPerOp);
+    const BenchResult *base = nullptr;
+    for (int b = 0; b < baselineCount; b++) {
+      if (strcmp(baseline[b].name, result.name) == 0) {
+        base = &baseline[b];
+      }
+    }
+    if (base && base->nsPerOp > 0) {
+      double change = (result.nsPerOp - base->nsPerOp) * 100 / base->nsPerOp;
+      bool slower = change > BENCH_REGRESSION_PCT;
+      bool allocates = result.allocsPerOp > base->allocsPerOp;
+      printf(" %+9.1f%%%s%s", change, slower ? "  SLOWER" : "", allocates ? "  ALLOCATES" : "");
+      regressions += slower || allocates;
+    }
+    printf("\n");
+  }
+
+  if (save) {
+    if (!saveBaseline(path, results, NUM_CASES)) {
+      fprintf(stderr, "cannot write %s\n", path);
+      return 2;
+    }
+    printf("Baseline saved to %s\n", path);
+  } else if (path && baselineCount == 0) {
+    printf("No baseline at %s; bench/record_baseline.sh records one\n", path);
+  } else if (regressions) {
+    printf("%d case(s) regressed against %s\n", regressions, path);
+    return 1;
+  }
+  return 0;
+}
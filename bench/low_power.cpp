@@ -0,0 +1,63 @@
+// Battery life against latency for the low-power mode of tx-rx.h, with
+// traffic: testing/tx-rx/energy_model.h simulates a node listening
+// continuously or in windows, with messages to it and from it arriving at
+// random, and the table shows what each interval costs and saves. Latency
+// runs from the sender keying up to the node holding the message; the
+// stretched preamble is the added part, and messages the node misses while
+// it sends are lost.
+//
+//   bench_low_power [SF] [PAYLOAD] [HOURS]   defaults 7, 20 bytes, 24 hours
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "energy_model.h"
+
+// The profiles tx-rx.h can switch to
+const RadioProfileInfo PROFILES[] = {RadioProfile<7, 125, 5>::info(), RadioProfile<9, 125, 5>::info(),
+                                     RadioProfile<12, 125, 5>::info()};
+
+// Messages per hour to the node and from it
+const LowPowerTraffic TRAFFIC[] = {{0, 0, 0}, {10, 10, 0}, {60, 60, 0}, {360, 60, 0}, {3600, 360, 0}};
+
+int main(int argc, char **argv) {
+  unsigned sf = argc > 1 ? atoi(argv[1]) : 7;
+  uint8_t payload = argc > 2 ? atoi(argv[2]) : 20;
+  uint32_t seconds = (argc > 3 ? atoi(argv[3]) : 24) * 3600;
+  const RadioProfileInfo *profile = nullptr;
+  for (const RadioProfileInfo &candidate : PROFILES) {
+    profile = candidate.sf == sf ? &candidate : profile;
+  }
+  if (!profile) {
+    fprintf(stderr, "usage: %s [7|9|12] [PAYLOAD] [HOURS]\n", argv[0]);
+    return 2;
+  }
+
+  printf("SF%u BW%u, %u byte messages, %u h simulated, %u mAh battery\n", profile->sf, profile->bwKHz,
+         (unsigned)payload, (unsigned)(seconds / 3600), BATTERY_MAH);
+  for (LowPowerTraffic traffic : TRAFFIC) {
+    traffic.payload = payload;
+    printf("\n%u msgs/h to the node, %u from it:\n", (unsigned)traffic.rxPerHour, (unsigned)traffic.txPerHour);
+    printf("  window ms   avg mA   battery days   latency ms   added ms   lost   TX uAh/msg\n");
+    double continuousMs = 0;
+    for (int i = -1; i < (int)(sizeof(PROJECTION_INTERVALS_MS) / sizeof(PROJECTION_INTERVALS_MS[0])); i++) {
+      uint32_t intervalMs = i < 0 ? 0 : PROJECTION_INTERVALS_MS[i];
+      if (lowPowerPreamble(*profile, intervalMs) > LOWPOWER_MAX_PREAMBLE) {
+        break;
+      }
+      LowPowerResult result = simulateLowPower(*profile, intervalMs, traffic, seconds);
+      double latencyMs =
+          traffic.rxPerHour ? result.latencyMs : lowPowerAirtimeUs(*profile, intervalMs, payload) / 1000.0;
+      continuousMs = intervalMs ? continuousMs : latencyMs;
+      double txUah = lowPowerAirtimeUs(*profile, intervalMs, payload) *
+                     (double)(RADIO_CURRENT_UA[POWER_TX] + CPU_ACTIVE_UA) / 3.6e9;
+      if (intervalMs) {
+        printf("  %9u", (unsigned)intervalMs);
+      } else {
+        printf("  continuous");
+      }
+      printf(" %*.2f %14.1f %12.1f %10.1f %6u %12.2f\n", intervalMs ? 8 : 7, result.averageUa / 1000,
+             batteryDays(result.averageUa), latencyMs, latencyMs - continuousMs, (unsigned)result.lost, txUah);
+    }
+  }
+  return 0;
+}
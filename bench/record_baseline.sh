@@ -0,0 +1,33 @@
+#!/bin/sh
+# Records a bench_host baseline on this machine, from the working tree or
+# from a commit built in a scratch worktree, for later runs to compare
+# against. Timings do not carry between machines, so record on the one
+# that will run the comparison.
+#
+#   bench/record_baseline.sh [REF] [FILE]    default: HEAD, bench_baseline.txt
+#   _gate_build/bench_host --baseline bench_baseline.txt
+#
+# REF "." uses the working tree as it is.
+set -e
+
+ref=${1:-HEAD}
+out=${2:-bench_baseline.txt}
+case $out in
+  /*) ;;
+  *) out=$(pwd)/$out ;;
+esac
+root=$(git rev-parse --show-toplevel)
+scratch=$(mktemp -d)
+
+if [ "$ref" = "." ]; then
+  src=$root
+  trap 'rm -rf "$scratch"' EXIT
+else
+  src=$scratch/src
+  git -C "$root" worktree add --quiet --detach "$src" "$ref"
+  trap 'git -C "$root" worktree remove --force "$src"; rm -rf "$scratch"' EXIT
+fi
+
+cmake -S "$src" -B "$scratch/build" -DCMAKE_BUILD_TYPE=Release > /dev/null
+cmake --build "$scratch/build" --target bench_host -j"$(nproc)" > /dev/null
+"$scratch/build/bench_host" --save --baseline "$out"
@@ -0,0 +1,247 @@
+// Gateway capture replay on the host: the frames of a capture from
+// tx-rx-ap-httpd go through testing/tx-rx/tx-rx-ap-httpd/packet_capture.h,
+// the reader and pacing the device replays with, into the gateway's host
+// pipeline: telemetry is CRC checked, ingested by telemetry_store.h and
+// acknowledged, other frames are counted. The capture can be
+// /capture.bin as downloaded, or a serial log with "CAP" lines. --synth
+// writes a capture of nodes reporting as fast as SF7 allows, to try it
+// without a device.
+//
+//   bench_replay FILE [SPEED]              0 (default) back to back, 1 at the recorded pace, N N times faster
+//   bench_replay --synth FILE NODES SECONDS
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "packet_capture.h"
+#include "radio_profile.h"
+#include "telemetry_codec.h"
+#include "telemetry_store.h"
+
+#define MAX_NODES 512
+#define STALE_MS 600000
+#define REPLAY_BATCH 32  // As the sketch
+#define FREQ_KHZ 915000
+
+typedef RadioProfile<7, 125, 5> GatewayProfile;  // As tx-rx-ap-httpd.h
+const RadioProfileInfo PROFILE = GatewayProfile::info();
+
+// The capture in memory, and the read function replay takes
+std::vector<uint8_t> capture;
+size_t capturePos;
+size_t readCapture(uint8_t *data, size_t len) {
+  size_t got = std::min(len, capture.size() - capturePos);
+  memcpy(data, capture.data() + capturePos, got);
+  capturePos += got;
+  return got;
+}
+
+// A serial log becomes the records of its "CAP" lines
+bool loadCapture(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+  uint8_t buffer[4096];
+  size_t got;
+  while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    capture.insert(capture.end(), buffer, buffer + got);
+  }
+  fclose(file);
+  if (!capture.empty() && capture[0] == CAPTURE_MAGIC) {
+    return true;
+  }
+  std::vector<uint8_t> records;
+  std::string text(capture.begin(), capture.end());
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t end = text.find('\n', start);
+    end = end == std::string::npos ? text.size() : end;
+    uint8_t record[CAPTURE_RECORD_MAX];
+    size_t len = parseCaptureLine(text.substr(start, end - start).c_str(), record, sizeof(record));
+    records.insert(records.end(), record, record + len);
+    start = end + 1;
+  }
+  capture.swap(records);
+  return true;
+}
+
+// The gateway's node table, as the sketch keeps it
+TelemetryNode *nodes[MAX_NODES];
+int16_t nodeIndex[2 * MAX_NODES];
+uint32_t now;
+TelemetryNode *addNode(uint16_t id);
+int16_t *newHistory(int zones) {
+  return (int16_t *)malloc(zones * TELEMETRY_FIELDS * TELEMETRY_HISTORY * sizeof(int16_t));
+}
+TelemetryTable table = {nodes, nodeIndex, 2 * MAX_NODES, MAX_NODES, 0, addNode, newHistory};
+
+TelemetryNode *addNode(uint16_t id) {
+  if (table.count == table.capacity) {
+    int oldest = stalestTelemetryNode(table, now, STALE_MS);
+    if (oldest < 0) {
+      return nullptr;
+    }
+    TelemetryNode *node = nodes[oldest];
+    int16_t *values = node->values;
+    uint8_t historyZones = node->historyZones;
+    memset(node, 0, sizeof(TelemetryNode));
+    node->id = id;
+    node->lastHeard = now;
+    node->values = values;
+    node->historyZones = historyZones;
+    rebuildTelemetryIndex(table);
+    return node;
+  }
+  TelemetryNode *node = (TelemetryNode *)calloc(1, sizeof(TelemetryNode));
+  node->id = id;
+  node->lastHeard = now;
+  addTelemetryNode(table, node);
+  return node;
+}
+
+enum Outcome { TELEMETRY_ACKED, TELEMETRY_DROPPED, TELEMETRY_OTHER, NOT_TELEMETRY, OUTCOMES };
+const char *OUTCOME_NAMES[OUTCOMES] = {"reports acknowledged", "reports dropped", "other telemetry",
+                                       "user and text frames"};
+
+uint8_t ack[TELEMETRY_HEADER + 1];  // What radioTransmit() would send
+
+// handlePacket() minus the display and Serial
+Outcome handlePacket(const uint8_t *frame, size_t len, float rssi, float snr) {
+  if (len == 0 || (frame[0] & 0xF0) != TELEMETRY_MARK) {
+    return NOT_TELEMETRY;
+  }
+  uint8_t type = frame[0] & FRAME_TYPE_MASK;
+  if (len < TELEMETRY_HEADER + 2 || crc8(frame, len - 1) != frame[len - 1]) {
+    return TELEMETRY_DROPPED;
+  }
+  if (type != FRAME_KEY && type != FRAME_DELTA) {
+    return TELEMETRY_OTHER;
+  }
+  TelemetryState state;
+  if (!ingestTelemetryReport(table, frame, len, now, rssi, snr, state)) {
+    return TELEMETRY_DROPPED;
+  }
+  ack[0] = TELEMETRY_MARK | FRAME_ACK;
+  memcpy(ack + 1, frame + 1, TELEMETRY_HEADER - 1);
+  ack[TELEMETRY_HEADER] = crc8(ack, TELEMETRY_HEADER);
+  return TELEMETRY_ACKED;
+}
+
+void append(const CaptureRecord &record, const uint8_t *data) {
+  capture.insert(capture.end(), (const uint8_t *)&record, (const uint8_t *)&record + sizeof(record));
+  capture.insert(capture.end(), data, data + record.len);
+}
+
+// Nodes taking turns as fast as a report and its ACK fit on the air
+int synth(const char *path, int nodeCount, uint32_t seconds) {
+  std::vector<TelemetryState> acked(nodeCount);
+  uint64_t timeUs = 0;
+  uint32_t ackUs = frameAirtimeUs(PROFILE, TELEMETRY_HEADER + 1);
+  for (int sent = 0; timeUs < (uint64_t)seconds * 1000000; sent++) {
+    int n = sent % nodeCount, step = sent / nodeCount;
+    uint16_t id = 0x1000 + n;
+    TelemetryState state;
+    memset(&state, 0, sizeof(state));
+    state.zoneCount = 2;
+    state.relayCount = 4;
+    for (int z = 0; z < state.zoneCount; z++) {
+      state.values[z][0] = 220 + (n + step) % 30;
+      state.values[z][1] = 600 + (n * 3 + step) % 100;
+      state.values[z][2] = 800 + (step * 7) % 90;
+      state.values[z][3] = 1500 - step % 200;
+    }
+    uint8_t frame[TELEMETRY_FRAME_MAX];
+    size_t len = step ? encodeTelemetryDelta(frame, id, step & 0xFF, (step - 1) & 0xFF, acked[n], state) : 0;
+    if (len == 0) {
+      len = encodeTelemetryKey(frame, id, step & 0xFF, state);
+    }
+    acked[n] = state;
+    timeUs += frameAirtimeUs(PROFILE, len);
+    append(makeCaptureRecord(0, timeUs / 1000, FREQ_KHZ, 7, -80 - n % 40, 9.5f - n % 20, len), frame);
+
+    uint8_t reply[TELEMETRY_HEADER + 1] = {TELEMETRY_MARK | FRAME_ACK, frame[1], frame[2], frame[3], 0};
+    reply[TELEMETRY_HEADER] = crc8(reply, TELEMETRY_HEADER);
+    timeUs += ackUs;
+    append(makeCaptureRecord(CAPTURE_TX, timeUs / 1000, FREQ_KHZ, 7, 0, 0, sizeof(reply)), reply);
+  }
+  FILE *file = fopen(path, "wb");
+  if (!file || fwrite(capture.data(), 1, capture.size(), file) != capture.size()) {
+    perror(path);
+    return 1;
+  }
+  fclose(file);
+  printf("Wrote %zu bytes, %u s of %d nodes, to %s\n", capture.size(), (unsigned)seconds, nodeCount, path);
+  return 0;
+}
+
+uint32_t wallMs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+  if (argc == 5 && strcmp(argv[1], "--synth") == 0) {
+    return synth(argv[2], std::max(1, atoi(argv[3])), strtoul(argv[4], nullptr, 10));
+  }
+  if (argc < 2 || !loadCapture(argv[1])) {
+    fprintf(stderr, "usage: %s FILE [SPEED] | --synth FILE NODES SECONDS\n", argv[0]);
+    return 2;
+  }
+  uint32_t speed = argc > 2 ? strtoul(argv[2], nullptr, 10) : 0;
+
+  memset(nodeIndex, 0xFF, sizeof(nodeIndex));
+  static CaptureReplay replay;
+  replay.read = readCapture;
+  capturePos = 0;
+  auto start = std::chrono::steady_clock::now();
+  startCaptureReplay(replay, speed, 0);
+
+  uint32_t outcomes[OUTCOMES] = {};
+  double pipelineNs = 0;
+  uint32_t firstAt = 0, lastAt = 0, peak = 0;
+  std::deque<uint32_t> window;  // Capture times of the last second's frames
+  bool more = true;
+  while (more) {
+    more = replayCaptureFrames(replay, wallMs(start), REPLAY_BATCH, [&](CaptureRecord &record, uint8_t *payload) {
+      now = record.time;  // The node table ages by capture time
+      auto handled = std::chrono::steady_clock::now();
+      Outcome outcome = handlePacket(payload, record.len, record.rssi, record.snr / 4.0f);
+      pipelineNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - handled).count();
+      outcomes[outcome]++;
+      firstAt = replay.frames == 0 ? record.time : firstAt;
+      lastAt = record.time;
+      window.push_back(record.time);
+      while (record.time - window.front() >= 1000) {
+        window.pop_front();
+      }
+      peak = std::max(peak, (uint32_t)window.size());
+    });
+    if (more && speed) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  if (capturePos < capture.size()) {
+    printf("Stopped at byte %zu of %zu: truncated or not a capture\n", capturePos, capture.size());
+  }
+
+  uint32_t frames = replay.frames;
+  double spanS = (lastAt - firstAt) / 1000.0;
+  printf("%u received frames over %.1f s of capture, replayed in %u ms at speed %u\n", (unsigned)frames, spanS,
+         (unsigned)wallMs(start), (unsigned)speed);
+  for (int o = 0; o < OUTCOMES; o++) {
+    printf("  %-22s %u\n", OUTCOME_NAMES[o], (unsigned)outcomes[o]);
+  }
+  printf("  %-22s %d\n", "nodes", table.count);
+  if (frames) {
+    double perFrame = pipelineNs / frames;
+    printf("Pipeline %.0f ns/frame, %.0f frames/s; the capture peaks at %u frames/s (%.0fx headroom)\n", perFrame,
+           1e9 / perFrame, (unsigned)peak, 1e9 / perFrame / std::max(peak, 1u));
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+// Settings persistence on the host: flash writes per saved edit, and the
+// cost of loading at boot, for the slots and journal in
+// Automation/haltec_hydro/settings_journal.h on files in memory.
+//
+// Edits are what /settings and /api/relay produce: a threshold or a relay
+// state, a few bytes each, with now and then a zone copied wholesale.
+// "image" writes a full image per save, as the firmware did before the
+// journal; "journal" is what settingsPersistTick() does.
+//
+//   bench_settings_persist
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mem_files.h"
+#include "settings_journal.h"
+
+#define IMAGE 4096  // About the size of the hydro Settings image
+#define ENTRY_MAX (sizeof(JournalHeader) + IMAGE + 64)
+#define JOURNAL_MAX 1024
+#define EDITS 1000
+#define LOADS 2000
+
+const uint16_t VERSIONS[] = {3, 2, 1};
+const size_t SIZES[] = {IMAGE, 3000, 512};
+
+uint8_t current[IMAGE], persisted[IMAGE], loaded[IMAGE], entry[ENTRY_MAX];
+
+SettingsStore newStore() {
+  return {{"/settings.a.bin", "/settings.b.bin"}, "/settings.jnl", 0x53445948, memRead, memWrite, 0, 1, 0};
+}
+
+void edit(int i) {
+  if (i % 50 == 49) {
+    memset(current + 64 + (i % 16) * 200, i, 200);  // A zone replaced
+  } else {
+    current[64 + rand() % 3200] = rand();  // One threshold or relay state
+  }
+}
+
+void writes(bool journal) {
+  memReset();
+  SettingsStore store = newStore();
+  srand(1);
+  for (int i = 0; i < IMAGE; i++) {
+    current[i] = rand();
+  }
+  commitSettingsImage(store, 3, current, IMAGE);
+  memcpy(persisted, current, IMAGE);
+  size_t images = 0;
+  memWrites = memBytesWritten = 0;
+  for (int i = 0; i < EDITS; i++) {
+    edit(i);
+    uint32_t seq = store.seq;
+    int slot = store.slot;
+    if (journal) {
+      appendSettingsJournal(store, 3, current, persisted, IMAGE, entry, ENTRY_MAX, JOURNAL_MAX);
+    } else {
+      commitSettingsImage(store, 3, current, IMAGE);
+    }
+    images += store.slot != slot && store.seq != seq;
+  }
+  printf("%-8s %10.2f %12.1f %10zu\n", journal ? "journal" : "image", (double)memWrites / EDITS,
+         (double)memBytesWritten / EDITS, images);
+}
+
+void load(const char *label, int entries) {
+  memReset();
+  SettingsStore store = newStore();
+  srand(2);
+  for (int i = 0; i < IMAGE; i++) {
+    current[i] = rand();
+  }
+  commitSettingsImage(store, 3, current, IMAGE);
+  memcpy(persisted, current, IMAGE);
+  for (int i = 0; i < entries; i++) {
+    current[64 + i * 37] ^= 1;
+    appendSettingsJournal(store, 3, current, persisted, IMAGE, entry, ENTRY_MAX, JOURNAL_MAX);
+  }
+
+  memReads = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < LOADS; i++) {
+    SettingsStore booted = newStore();
+    loadSettingsImage(booted, VERSIONS, SIZES, 3, loaded, IMAGE, entry, ENTRY_MAX);
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / LOADS;
+  printf("%-22s %8u %10zu %10.0f\n", label, store.journalSize, memReads / LOADS, ns);
+}
+
+int main() {
+  printf("Flash writes per saved edit (%d edits, %d-byte image, %d-byte journal)\n", EDITS, IMAGE, JOURNAL_MAX);
+  printf("%-8s %10s %12s %10s\n", "mode", "writes", "bytes", "images");
+  writes(false);
+  writes(true);
+
+  printf("\nBoot load (%d loads)\n", LOADS);
+  printf("%-22s %8s %10s %10s\n", "journal", "bytes", "reads", "ns/load");
+  load("empty", 0);
+  load("half full", 30);
+  load("full", 60);
+  return 0;
+}
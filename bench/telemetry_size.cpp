@@ -0,0 +1,93 @@
+// Telemetry frame sizes on the host: one simulated day of reports from a
+// controller with slowly drifting readings, encoded the way telemetryTick()
+// in haltec_hydro.h does (KEY every TELEMETRY_KEY_INTERVAL frames or after
+// TELEMETRY_MAX_UNACKED unacknowledged ones, DELTA otherwise), for a few
+// zone counts and ACK loss rates.
+//
+//   bench_telemetry_size
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "telemetry_codec.h"
+
+#define REPORTS 2880  // 24 h at TELEMETRY_PERIOD_MS
+#define KEY_INTERVAL 20
+#define MAX_UNACKED 8
+
+struct Totals {
+  size_t bytes = 0;
+  int keys = 0;
+  int deltas = 0;
+  size_t largest = 0;
+};
+
+Totals simulate(int zones, int relays, int ackLossPct) {
+  Totals totals;
+  TelemetryState state = {};
+  state.zoneCount = zones;
+  state.relayCount = relays;
+  for (int z = 0; z < zones; z++) {
+    state.values[z][0] = 240;
+    state.values[z][1] = 550;
+    state.values[z][2] = 800;
+    state.values[z][3] = 2000;
+  }
+  TelemetryState acked = state;
+  uint8_t seq = 0, ackedSeq = 0, sinceKey = 0;
+  bool haveAck = false;
+  uint8_t frame[TELEMETRY_FRAME_MAX];
+  srand(zones * 1000 + ackLossPct);
+
+  for (int report = 0; report < REPORTS; report++) {
+    for (int z = 0; z < zones; z++) {
+      for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+        state.values[z][f] += rand() % 5 - 2;
+      }
+    }
+    if (report % 40 == 0 && relays) {
+      state.relays[0] ^= 1 << (report / 40 % 8);
+    }
+
+    uint8_t next = seq + 1;
+    size_t len = 0;
+    if (haveAck && (uint8_t)(next - ackedSeq) <= MAX_UNACKED && sinceKey < KEY_INTERVAL) {
+      len = encodeTelemetryDelta(frame, 1, next, ackedSeq, acked, state);
+    }
+    if (len == 0) {
+      len = encodeTelemetryKey(frame, 1, next, state);
+      totals.keys++;
+      sinceKey = 0;
+    } else {
+      totals.deltas++;
+      sinceKey++;
+    }
+    seq = next;
+    totals.bytes += len;
+    if (len > totals.largest) {
+      totals.largest = len;
+    }
+    if (rand() % 100 >= ackLossPct) {
+      acked = state;
+      ackedSeq = seq;
+      haveAck = true;
+    }
+  }
+  return totals;
+}
+
+int main() {
+  printf("%-6s %-7s %-9s %10s %8s %8s %8s %12s\n", "zones", "relays", "ack loss", "bytes/rpt", "largest",
+         "keys", "deltas", "KEY-only");
+  const int zoneCounts[] = {1, 4, 16};
+  const int losses[] = {0, 10, 50};
+  for (int zones : zoneCounts) {
+    int relays = zones == 1 ? 10 : zones * 4;
+    for (int loss : losses) {
+      Totals totals = simulate(zones, relays, loss);
+      size_t keyOnly = TELEMETRY_HEADER + 2 + zones * TELEMETRY_FIELDS * 2 + (relays + 7) / 8 + 1;
+      printf("%-6d %-7d %7d%% %10.1f %8zu %8d %8d %12zu\n", zones, relays, loss,
+             (double)totals.bytes / REPORTS, totals.largest, totals.keys, totals.deltas, keyOnly);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,136 @@
+// Sensor history on the host: flash writes over 30 days of logging, and
+// the cost of /api/history range queries at the end of it, for the
+// rollups and checkpoints in Automation/haltec_hydro/time_series.h on
+// files in memory.
+//
+// Each tick adds one sample per zone to every level and writes closed
+// buckets and checkpoints as logTick() does. Flash cost is an estimate:
+// LittleFS rewrites every 4 KiB block a write touches, plus a metadata
+// commit, taken here as 256 bytes. Write amplification is that over the
+// 8 bytes a sample of four fields holds.
+//
+//   bench_time_series
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mem_files.h"
+#include "time_series.h"
+
+#define ZONES 8
+#define SAMPLE_PERIOD_S 10
+#define DAYS 30
+#define BLOCK 4096
+#define COMMIT 256
+#define QUERIES 2000
+
+// The sketch's levels
+const RollupLevel LEVELS[] = {
+  {300, 2016, "ts_5m"},
+  {3600, 720, "ts_1h"},
+};
+const int LEVEL_COUNT = sizeof(LEVELS) / sizeof(LEVELS[0]);
+
+size_t flashBytes = 0;
+
+bool countedWriteAt(const char *path, size_t offset, const uint8_t *data, size_t len) {
+  flashBytes += ((offset + len - 1) / BLOCK - offset / BLOCK + 1) * BLOCK + COMMIT;
+  return memWriteAt(path, offset, data, len);
+}
+
+const LogStore STORE = {memRead, countedWriteAt};
+
+char paths[LEVEL_COUNT][ZONES][32];
+LogCheckpoint logOpen;
+
+// A slow random walk per zone and field, with a sensor now and then missing
+int16_t walk[ZONES][LOG_FIELDS];
+void sample(int zone, int16_t values[LOG_FIELDS]) {
+  for (int f = 0; f < LOG_FIELDS; f++) {
+    walk[zone][f] += rand() % 5 - 2;
+    values[f] = rand() % 500 == 0 ? LOG_MISSING : walk[zone][f];
+  }
+}
+
+// Log DAYS days with a checkpoint every 'checkpointS' seconds; returns the
+// log time of the last sample
+uint32_t run(uint32_t checkpointS) {
+  memReset();
+  srand(1);
+  for (int i = 0; i < LEVEL_COUNT; i++) {
+    for (int z = 0; z < ZONES; z++) {
+      snprintf(paths[i][z], sizeof(paths[i][z]), z ? "/%s.z%d.bin" : "/%s.bin", LEVELS[i].name, z);
+      std::vector<uint8_t> &file = memFiles[paths[i][z]];
+      file.assign((size_t)LEVELS[i].slots * sizeof(RollupRecord), 0);
+      rollupReset(logOpen.open[i][z], 0);
+    }
+  }
+  for (int z = 0; z < ZONES; z++) {
+    for (int f = 0; f < LOG_FIELDS; f++) {
+      walk[z][f] = 200 + 100 * f;
+    }
+  }
+  flashBytes = 0;
+
+  uint32_t start = 1735689600;  // Log clocks set to wall time
+  uint32_t checkpointAt = start + checkpointS;
+  uint32_t now = start;
+  for (; now < start + DAYS * 86400; now += SAMPLE_PERIOD_S) {
+    bool closedAny = false;
+    for (int z = 0; z < ZONES; z++) {
+      int16_t values[LOG_FIELDS];
+      sample(z, values);
+      for (int i = 0; i < LEVEL_COUNT; i++) {
+        RollupBucket closed;
+        if (rollupAdd(LEVELS[i], logOpen.open[i][z], now, values, closed)) {
+          writeRollup(STORE, paths[i][z], LEVELS[i], closed);
+          closedAny = true;
+        }
+      }
+    }
+    if (closedAny || (int32_t)(now - checkpointAt) >= 0) {
+      logOpen.magic = LOG_CHECKPOINT_MAGIC;
+      logOpen.time = now;
+      saveLogCheckpoint(STORE, "/ts_open.bin", logOpen);
+      checkpointAt = now + checkpointS;
+    }
+  }
+
+  double payload = (double)ZONES * (86400 / SAMPLE_PERIOD_S) * LOG_FIELDS * 2;
+  printf("%8us %12.0f %12.0f %14.0f %10.1f%s\n", (unsigned)checkpointS, (double)memWrites / DAYS,
+         (double)memBytesWritten / DAYS, (double)flashBytes / DAYS / 1024, flashBytes / DAYS / payload,
+         checkpointS == 60 ? "  (LOG_CHECKPOINT_S)" : "");
+  return now - SAMPLE_PERIOD_S;
+}
+
+void query(const char *label, int level, uint32_t span, uint32_t now) {
+  RollupCursor cursor;
+  RollupRecord record;
+  size_t points = 0;
+  memReads = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (int q = 0; q < QUERIES; q++) {
+    startRollupQuery(cursor, LEVELS[level], paths[level][0], logOpen.open[level][0], now - span, now, now);
+    points = 0;
+    while (nextRollupRecord(STORE, cursor, record)) {
+      points++;
+    }
+  }
+  double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count() / QUERIES;
+  printf("%-14s %8zu %8zu %10.1f\n", label, points, memReads / QUERIES, us);
+}
+
+int main() {
+  printf("Flash writes per day (%d zones, a sample every %d s, %d days)\n", ZONES, SAMPLE_PERIOD_S, DAYS);
+  printf("%9s %12s %12s %14s %10s\n", "checkpoint", "writes", "bytes", "est. KiB", "amplif.");
+  run(10);
+  run(300);
+  uint32_t now = run(60);  // The sketch's LOG_CHECKPOINT_S; queries run on this one
+
+  printf("\nRange queries after %d days (%d each; zone 0)\n", DAYS, QUERIES);
+  printf("%-14s %8s %8s %10s\n", "range", "points", "reads", "us/query");
+  query("24 h at 5 min", 0, 86400, now);
+  query("7 d at 5 min", 0, 7 * 86400, now);
+  query("30 d at 1 h", 1, 30 * 86400, now);
+  return 0;
+}
@@ -0,0 +1,184 @@
+// Gateway user sessions against user count: the cost of adding a user
+// and of receiving a frame, for the id index and cipher LRU in
+// testing/tx-rx/user_session.h with HMAC-SHA256 and AES-128-CCM from
+// OpenSSL standing in for mbedtls.
+//
+// "hot" frames come from 8 users in turn, all in the cipher cache;
+// "spread" frames from users drawn at random from every user, so past
+// USER_CIPHER_CACHE users most of them expand a key; "foreign" frames
+// carry ids no user has and are dropped without decrypting. A node's own
+// receive path is timed for frames to it and to another user.
+//
+//   bench_user_sessions
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "user_session.h"
+
+#define FRAMES 4096
+#define TEXT_LEN 48
+
+EVP_CIPHER_CTX *slots[USER_CIPHER_CACHE];
+
+// CCM with a 7-byte nonce and 4-byte tag; the key is expanded once per
+// slot and kept across frames, as mbedtls keeps it
+bool ccm(int slot, bool encrypt, const uint8_t *header, const uint8_t *in, size_t len, uint8_t *out, uint8_t *tag) {
+  EVP_CIPHER_CTX *context = slots[slot];
+  int outLen;
+  if (!encrypt) {
+    EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_SET_TAG, USER_TAG_LEN, tag);
+  }
+  EVP_CipherInit_ex(context, nullptr, nullptr, nullptr, header, encrypt);
+  EVP_CipherUpdate(context, nullptr, &outLen, nullptr, len);
+  if (EVP_CipherUpdate(context, out, &outLen, in, len) != 1) {
+    return false;
+  }
+  if (encrypt) {
+    EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_GET_TAG, USER_TAG_LEN, tag);
+  }
+  return true;
+}
+
+void setKey(int slot, const uint8_t *key) {
+  EVP_CIPHER_CTX *context = slots[slot];
+  EVP_CipherInit_ex(context, EVP_aes_128_ccm(), nullptr, nullptr, nullptr, 1);
+  EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_SET_IVLEN, USER_HEADER, nullptr);
+  EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_SET_TAG, USER_TAG_LEN, nullptr);
+  EVP_CipherInit_ex(context, nullptr, nullptr, key, nullptr, 1);
+}
+
+const SessionCrypto OPENSSL_CRYPTO = {
+  [](const uint8_t *key, size_t keyLen, uint8_t *mac) {
+    unsigned int macLen;
+    HMAC(EVP_sha256(), key, keyLen, (const uint8_t *)USER_SESSION_LABEL, strlen(USER_SESSION_LABEL), mac, &macLen);
+  },
+  setKey,
+  [](int slot, const uint8_t *header, const uint8_t *text, size_t len, uint8_t *out, uint8_t *tag) {
+    ccm(slot, true, header, text, len, out, tag);
+  },
+  [](int slot, const uint8_t *header, const uint8_t *in, size_t len, uint8_t *text, const uint8_t *tag) {
+    return ccm(slot, false, header, in, len, text, (uint8_t *)tag);
+  },
+};
+
+SessionTable table;
+uint8_t frames[FRAMES][USER_FRAME_MAX];
+size_t frameLens[FRAMES];
+volatile int benchSink;
+
+void userKey(int user, char *key, size_t size) {
+  snprintf(key, size, "user-key-%d", user);
+}
+
+// Frames from the given users, each user's counters rising in order,
+// sealed as that user's node would
+void buildFrames(const int *users) {
+  static uint32_t counters[USER_MAX];
+  memset(counters, 0, sizeof(counters));
+  char text[TEXT_LEN];
+  memset(text, 'm', sizeof(text));
+  for (int i = 0; i < FRAMES; i++) {
+    UserSession &session = table.sessions[users[i]];
+    setKey(0, session.key);
+    frameLens[i] = sealUserFrame(OPENSSL_CRYPTO, 0, session, USER_UP, ++counters[users[i]], text, sizeof(text),
+                                 frames[i]);
+  }
+  memset(table.slotUser, 0xFF, sizeof(table.slotUser));  // Slot 0 was borrowed
+}
+
+// ns per received frame, and the share that expanded a key
+double receive(double &missRate) {
+  for (int i = 0; i < table.count; i++) {
+    table.sessions[i].lastCounter = 0;
+  }
+  char text[USER_TEXT_MAX + 1];
+  uint32_t misses = table.misses;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < FRAMES; i++) {
+    benchSink = openUserFrame(table, OPENSSL_CRYPTO, frames[i], frameLens[i], text);
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / FRAMES;
+  missRate = (double)(table.misses - misses) / FRAMES;
+  return ns;
+}
+
+void gatewayRow(int count) {
+  clearSessionTable(table);
+  char key[32];
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++) {
+    userKey(i, key, sizeof(key));
+    addUserSession(table, OPENSSL_CRYPTO, key, strlen(key));
+  }
+  double addNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+
+  static int users[FRAMES];
+  double hotMiss, spreadMiss, foreignMiss;
+  for (int i = 0; i < FRAMES; i++) {
+    users[i] = i % (count < 8 ? count : 8);
+  }
+  buildFrames(users);
+  receive(hotMiss);  // Warm the cache
+  double hotNs = receive(hotMiss);
+
+  srand(count);
+  for (int i = 0; i < FRAMES; i++) {
+    users[i] = rand() % count;
+  }
+  buildFrames(users);
+  double spreadNs = receive(spreadMiss);
+
+  for (int i = 0; i < FRAMES; i++) {
+    frames[i][1] ^= 0x5A;  // Ids no user is likely to have
+  }
+  double foreignNs = receive(foreignMiss);
+
+  printf("%6d %10.0f %10.0f %10.0f %8.0f%% %10.0f\n", count, addNs, hotNs, spreadNs, spreadMiss * 100, foreignNs);
+}
+
+void nodeRow() {
+  UserSession own, other;
+  deriveUserSession(OPENSSL_CRYPTO, "user-key-0", 10, own);
+  deriveUserSession(OPENSSL_CRYPTO, "user-key-1", 10, other);
+  char text[TEXT_LEN];
+  memset(text, 'm', sizeof(text));
+  setKey(1, other.key);
+  for (int i = 0; i < FRAMES; i++) {
+    bool mine = i % 2 == 0;
+    setKey(0, mine ? own.key : other.key);
+    frameLens[i] = sealUserFrame(OPENSSL_CRYPTO, 0, mine ? own : other, USER_DOWN, i + 1, text, sizeof(text), frames[i]);
+  }
+  setKey(0, own.key);
+  char out[USER_TEXT_MAX + 1];
+  double ns[2];
+  for (int mine = 0; mine < 2; mine++) {
+    own.lastCounter = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = mine ? 0 : 1; i < FRAMES; i += 2) {
+      benchSink = openSessionFrame(OPENSSL_CRYPTO, 0, own, frames[i], frameLens[i], USER_DOWN, out);
+    }
+    ns[mine] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (FRAMES / 2);
+  }
+  printf("\nNode receive (ns/frame): own %.0f, another user's %.0f\n", ns[1], ns[0]);
+}
+
+int main() {
+  for (EVP_CIPHER_CTX *&slot : slots) {
+    slot = EVP_CIPHER_CTX_new();
+  }
+  UserSession warm;
+  deriveUserSession(OPENSSL_CRYPTO, "warm", 4, warm);  // Load the digest before timing adds
+  const int COUNTS[] = {1, 16, 64, 256, USER_MAX};
+  printf("Gateway receive, %d frames of %d bytes (ns/frame unless noted)\n", FRAMES, TEXT_LEN);
+  printf("%6s %10s %10s %10s %9s %10s\n", "users", "add ns", "hot", "spread", "misses", "foreign");
+  for (int count : COUNTS) {
+    gatewayRow(count);
+  }
+  nodeRow();
+  return 0;
+}
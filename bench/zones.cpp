@@ -0,0 +1,202 @@
+// Hydro zones on the host: the control tick, the /api/state body and a
+// settings save at 1 to 32 zones, for Automation/haltec_hydro/
+// zone_readings.h, relay_rules.h and settings_journal.h.
+//
+// Each zone has a DHT22, a water sensor, a fan and a pump, as a grow tent
+// would; 32 zones fill the sketch's 64 sensors and 64 relays. Readings
+// wander each tick, so rules latch and release. The tick is what
+// controlTick() runs, minus the relay outputs. The save is the journal
+// diff settingsPersistTick() makes after the tick's relay changes, on an
+// image the size of the sketch's Settings.
+//
+//   bench_zones
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "settings_journal.h"
+#include "zone_readings.h"
+
+#define MAX_ZONES 32
+#define SENSORS_PER_ZONE 2
+#define RELAYS_PER_ZONE 2
+#define MAX_SENSORS (MAX_ZONES * SENSORS_PER_ZONE)
+#define MAX_RELAYS (MAX_ZONES * RELAYS_PER_ZONE)
+#define MAX_RULES (MAX_RELAYS * 2)
+#define STALE_MS 10000
+#define TICK_MS 500
+#define TICKS 20000
+#define IMAGE 4096          // About the size of the hydro Settings image
+#define RELAY_STATES 3000   // Where the relay states sit in it
+#define ENTRY_MAX (sizeof(JournalHeader) + IMAGE + 64)
+
+// The last good sample per sensor, as in the sketch's SensorState
+struct BenchSensor {
+  float temperature;
+  float humidity;
+  int32_t value;
+  uint32_t at;
+};
+
+// Print's overloads the /api/state printers use, into a std::string
+struct TextOut {
+  std::string text;
+  void print(const char *s) { text += s; }
+  void print(char c) { text += c; }
+  void print(int v) { text += std::to_string(v); }
+  void print(float v, int digits) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%.*f", digits, v);
+    text += buf;
+  }
+};
+
+SensorConfig sensors[MAX_SENSORS];
+BenchSensor states[MAX_SENSORS];
+ZoneSums sums[MAX_ZONES];
+SensorSnapshot readings[MAX_ZONES];
+int32_t sources[MAX_ZONES][SRC_COUNT];
+RelayRule rules[MAX_RULES];
+int ruleCount;
+int relayCount;
+uint8_t relayZones[MAX_RELAYS];
+bool relayStates[MAX_RELAYS];
+uint32_t relayChangedAt[MAX_RELAYS];
+int waterThresholds[MAX_ZONES];
+uint32_t lowWater;
+uint8_t current[IMAGE], persisted[IMAGE], entry[ENTRY_MAX];
+const char *ROLES[RELAYS_PER_ZONE] = {"Fan", "Pump"};
+
+void setup(int zones) {
+  ruleCount = 0;
+  relayCount = zones * RELAYS_PER_ZONE;
+  for (int z = 0; z < zones; z++) {
+    sensors[z * 2] = {SENSOR_DHT22, (uint8_t)z, 0, 0};
+    sensors[z * 2 + 1] = {SENSOR_WATER, (uint8_t)z, 0, 0};
+    states[z * 2] = {24, 60, 0, 1};
+    states[z * 2 + 1] = {0, 0, 1500, 1};
+    readings[z] = {NAN, NAN, -1, 0, 0, 0, 0};
+    waterThresholds[z] = 1000;
+    RuleLevels levels = {180, 280, 10, 40, 70, 5, 1000, 50, 18 * 3600};
+    for (int r = 0; r < RELAYS_PER_ZONE; r++) {
+      int i = z * RELAYS_PER_ZONE + r;
+      relayZones[i] = z;
+      relayStates[i] = false;
+      relayChangedAt[i] = 0;
+      addRoleRules(rules, ruleCount, MAX_RULES, i, z, parseRole(ROLES[r]), levels);
+    }
+  }
+  lowWater = 0;
+}
+
+// New samples for every sensor: a random walk around the rule levels
+void sample(int zones, uint32_t now) {
+  for (int id = 0; id < zones * SENSORS_PER_ZONE; id++) {
+    BenchSensor &state = states[id];
+    state.temperature += (rand() % 21 - 10) * 0.05f;
+    state.humidity += (rand() % 21 - 10) * 0.1f;
+    state.value += rand() % 41 - 20;
+    state.at = now;
+  }
+}
+
+// One controlTick(); returns the relays switched
+int tick(int zones, uint32_t now) {
+  aggregateZoneReadings(sensors, states, zones * SENSORS_PER_ZONE, sums, readings, zones, now, STALE_MS);
+  zoneRuleSources(readings, zones, now, STALE_MS, (int32_t)(now / 1000 % 86400), sources);
+
+  bool demand[MAX_RELAYS];
+  evaluateRuleTable(rules, ruleCount, sources, demand, relayCount);
+  int switched = 0;
+  for (int i = 0; i < relayCount; i++) {
+    if (relayMaySwitch(relayStates[i], demand[i], now, relayChangedAt[i], 0, 60000, 60000)) {
+      relayStates[i] = !relayStates[i];
+      relayChangedAt[i] = now;
+      switched++;
+    }
+  }
+
+  uint32_t low = 0;
+  for (int z = 0; z < zones; z++) {
+    int32_t water = sources[z][SRC_WATER];
+    if (water != LOG_MISSING && water < waterThresholds[z]) {
+      low |= 1UL << z;
+    }
+  }
+  lowWater = low;
+  return switched;
+}
+
+// The /api/state body
+size_t state(int zones, uint32_t now, TextOut &out) {
+  out.text.clear();
+  out.print("{\"zones\":[");
+  for (int z = 0; z < zones; z++) {
+    int16_t values[LOG_FIELDS];
+    zoneLogValues(readings[z], now, STALE_MS, values);
+    printZoneState(out, z, "Tent", values);
+  }
+  out.print("],\"relays\":[");
+  for (int i = 0; i < relayCount; i++) {
+    printRelayState(out, i, relayZones[i], ROLES[i % RELAYS_PER_ZONE], relayStates[i]);
+  }
+  out.print("],\"controlTickMaxUs\":0}");
+  return out.text.size();
+}
+
+void run(int zones) {
+  srand(zones);
+  setup(zones);
+  TextOut out;
+  out.text.reserve(64 + zones * 256);
+  memset(current, 0, sizeof(current));
+  memset(persisted, 0, sizeof(persisted));
+
+  std::vector<double> tickNs(TICKS);
+  double stateNs = 0, saveNs = 0;
+  size_t stateBytes = 0, saves = 0;
+  uint32_t now = 1000;
+  for (int t = 0; t < TICKS; t++, now += TICK_MS) {
+    sample(zones, now);
+    auto start = std::chrono::steady_clock::now();
+    int switched = tick(zones, now);
+    tickNs[t] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    if (t % 20 == 0) {  // A dashboard poll every 10 s
+      start = std::chrono::steady_clock::now();
+      stateBytes = state(zones, now, out);
+      stateNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    if (switched) {
+      memcpy(current + RELAY_STATES, relayStates, zones * RELAYS_PER_ZONE);
+      start = std::chrono::steady_clock::now();
+      size_t used = journalDiff(current, persisted, IMAGE, entry, ENTRY_MAX);
+      saveNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      memcpy(persisted, current, IMAGE);
+      saves += used > sizeof(JournalHeader);
+    }
+  }
+  double total = 0;
+  for (double ns : tickNs) {
+    total += ns;
+  }
+  std::sort(tickNs.begin(), tickNs.end());
+  printf("%5d %7d %6d %6d %9.0f %9.1f %9.0f %8zu %9.0f %9.0f\n", zones, zones * SENSORS_PER_ZONE, relayCount,
+         ruleCount, total / TICKS, total / TICKS / zones, tickNs[TICKS * 99 / 100], stateBytes,
+         stateNs / (TICKS / 20), saves ? saveNs / saves : 0.0);
+}
+
+int main() {
+  printf("Control tick, /api/state and settings save per zone count (%d ticks of %d ms)\n", TICKS, TICK_MS);
+  printf("%5s %7s %6s %6s %9s %9s %9s %8s %9s %9s\n", "zones", "sensors", "relays", "rules", "tick ns",
+         "ns/zone", "p99 ns", "state B", "state ns", "save ns");
+  const int ZONE_COUNTS[] = {1, 2, 4, 8, 16, 32};
+  for (int zones : ZONE_COUNTS) {
+    run(zones);
+  }
+  return 0;
+}
@@ -0,0 +1,172 @@
+// HTTP admission control shared by haltec_hydro, tx-rx-ap-httpd and
+// tx-rx-ap-ssh
+//
+// The decision is plain C++ with no Arduino dependency, so tests/ can
+// soak it on the host; free heap and the clock are passed in. A request
+// is turned away when free heap is under heapReserve (503), maxInFlight
+// requests are still open (503), the client has spent its token bucket
+// (429), or the declared body is over what its route takes (413).
+//
+// An admitted request holds an in-flight slot until its connection
+// closes. A WebSocket upgrade holds none, as its connection outlives the
+// request; a sketch with a WebSocket caps those with maxUpgrades and
+// openUpgrades instead. Everything runs on the AsyncTCP task, so the
+// state needs no locking.
+//
+// Each sketch fills in an AdmissionLimits and registers an
+// AdmissionHandler ahead of every route.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ADMIT_CLIENTS_MAX 8  // Token buckets an Admission can keep
+
+enum AdmitResult { ADMIT_OK, ADMIT_HEAP, ADMIT_BUSY, ADMIT_RATE, ADMIT_BODY, ADMIT_RESULTS };
+
+struct AdmissionLimits {
+  uint32_t heapReserve;  // Bytes of free heap kept for the rest of the firmware
+  uint8_t maxInFlight;   // Requests open at once
+  uint8_t maxUpgrades;   // WebSocket connections open at once
+  uint16_t ratePerS;     // Sustained requests per second per client
+  uint16_t burst;        // Requests a client may send back to back
+  uint8_t clients;       // Buckets kept, at most ADMIT_CLIENTS_MAX; the least recently seen is reused
+  size_t (*bodyMax)(const char *url);  // Largest body a route takes
+  size_t (*openUpgrades)();            // WebSockets open now; nullptr if the sketch serves none
+};
+
+struct ClientBucket {
+  uint32_t ip;
+  uint32_t tokens;     // Thousandths of a request
+  uint32_t updatedAt;  // millis()
+};
+
+struct Admission {
+  const AdmissionLimits *limits;
+  ClientBucket buckets[ADMIT_CLIENTS_MAX];
+  uint8_t inFlight;
+  uint32_t rejected[ADMIT_RESULTS];  // Indexed by AdmitResult
+};
+
+// Spend one request from the client's bucket; false when it is empty
+inline bool admitTake(Admission &admission, uint32_t ip, uint32_t now) {
+  const AdmissionLimits &limits = *admission.limits;
+  uint32_t full = limits.burst * 1000;
+  ClientBucket *bucket = nullptr;
+  ClientBucket *oldest = &admission.buckets[0];
+  for (int i = 0; i < limits.clients && !bucket; i++) {
+    if (admission.buckets[i].ip == ip) {
+      bucket = &admission.buckets[i];
+    } else if (now - admission.buckets[i].updatedAt > now - oldest->updatedAt) {
+      oldest = &admission.buckets[i];
+    }
+  }
+  if (!bucket) {
+    bucket = oldest;
+    bucket->ip = ip;
+    bucket->tokens = full;
+  } else {
+    uint32_t elapsed = now - bucket->updatedAt;
+    uint32_t tokens = elapsed >= full ? full : bucket->tokens + elapsed * limits.ratePerS;
+    bucket->tokens = tokens > full ? full : tokens;
+  }
+  bucket->updatedAt = now;
+  if (bucket->tokens < 1000) {
+    return false;
+  }
+  bucket->tokens -= 1000;
+  return true;
+}
+
+// True if an admitted request of this kind holds an in-flight slot that
+// admitRelease() must give back
+inline bool admitHoldsSlot(const Admission &admission, bool upgrade) {
+  return !upgrade || !admission.limits->openUpgrades;
+}
+
+// Decide on a request whose headers are in, counting rejections. An
+// admitted request takes an in-flight slot if admitHoldsSlot().
+inline int admitRequest(Admission &admission, const char *url, size_t contentLength, bool upgrade, uint32_t ip,
+                        uint32_t freeHeap, uint32_t now) {
+  const AdmissionLimits &limits = *admission.limits;
+  int result = ADMIT_OK;
+  bool holdsSlot = admitHoldsSlot(admission, upgrade);
+  if (freeHeap < limits.heapReserve) {
+    result = ADMIT_HEAP;
+  } else if (contentLength > limits.bodyMax(url)) {
+    result = ADMIT_BODY;
+  } else if (holdsSlot ? admission.inFlight >= limits.maxInFlight : limits.openUpgrades() >= limits.maxUpgrades) {
+    result = ADMIT_BUSY;
+  } else if (!admitTake(admission, ip, now)) {
+    result = ADMIT_RATE;
+  }
+  if (result != ADMIT_OK) {
+    admission.rejected[result]++;
+  } else if (holdsSlot) {
+    admission.inFlight++;
+  }
+  return result;
+}
+
+inline void admitRelease(Admission &admission) {
+  if (admission.inFlight > 0) {
+    admission.inFlight--;
+  }
+}
+
+#ifdef ARDUINO
+#include <ESPAsyncWebServer.h>
+
+// Answers the requests admitRequest() turns away, as JSON or plain text;
+// the reason travels in _tempObject from canHandle() to handleRequest().
+// 'rejected', when set, is told each rejection for the sketch's metrics.
+class AdmissionHandler : public AsyncWebHandler {
+ public:
+  AdmissionHandler(Admission &admission, bool json, void (*rejected)(int result) = nullptr)
+      : admission(admission), json(json), rejected(rejected) {}
+
+  bool canHandle(AsyncWebServerRequest *request) override {
+    bool upgrade = request->requestedConnType() == RCT_WS;
+    int result = admitRequest(admission, request->url().c_str(), request->contentLength(), upgrade,
+                              request->client()->remoteIP(), ESP.getFreeHeap(), millis());
+    if (result == ADMIT_OK) {
+      if (admitHoldsSlot(admission, upgrade)) {
+        Admission *held = &admission;
+        request->onDisconnect([held]() { admitRelease(*held); });
+      }
+      return false;
+    }
+    if (rejected) {
+      rejected(result);
+    }
+    request->_tempObject = malloc(1);
+    if (request->_tempObject) {
+      *(uint8_t *)request->_tempObject = result;
+    }
+    return true;
+  }
+
+  void handleRequest(AsyncWebServerRequest *request) override {
+    int result = request->_tempObject ? *(uint8_t *)request->_tempObject : ADMIT_HEAP;
+    int status = result == ADMIT_RATE ? 429 : result == ADMIT_BODY ? 413 : 503;
+    const char *message = result == ADMIT_RATE   ? "Too many requests"
+                          : result == ADMIT_BODY ? "Request body too large"
+                                                 : "Busy";
+    AsyncWebServerResponse *response;
+    if (json) {
+      response = request->beginResponse(status, "application/json", String("{\"message\":\"") + message + "\"}");
+    } else {
+      response = request->beginResponse(status, "text/plain", message);
+    }
+    if (result != ADMIT_BODY) {
+      response->addHeader("Retry-After", "1");
+    }
+    request->send(response);
+  }
+
+ private:
+  Admission &admission;
+  bool json;
+  void (*rejected)(int result);
+};
+#endif
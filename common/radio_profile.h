@@ -0,0 +1,98 @@
+// Radio profiles for the SX1276 sketches: tx-rx.h, tx-rx-ap-httpd and
+// haltec_hydro
+//
+// Plain C++ with no Arduino or RadioLib dependency. A profile is a type
+// whose timing is computed at compile time: symbol time, preamble time,
+// the time on air of every payload length 0-255 and the receive timeouts
+// that follow from them, for an explicit header with CRC off as these
+// sketches configure the radio, and low data rate optimisation once a
+// symbol exceeds 16 ms as the SX1276 requires. static_asserts reject
+// combinations the radio or this firmware cannot use. At runtime a profile
+// is a pointer to its RadioProfileInfo, so timeouts and airtime accounting
+// are table lookups with no float math.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROFILE_MAX_PAYLOAD 255
+#define PROFILE_RX_GUARD_SYMBOLS 2  // Preamble detection and DIO0 latency
+
+struct RadioProfileInfo {
+  uint8_t sf;
+  uint16_t bwKHz;
+  uint8_t cr;             // Denominator of the 4/x coding rate
+  uint32_t symbolUs;
+  uint32_t preambleUs;    // Preamble plus sync symbols
+  uint32_t rxTimeoutUs;   // A receive open this long catches any frame that has started
+  const uint32_t *airtimeUs;  // Indexed by payload length
+};
+
+// 0..N-1 as a template parameter pack, for building tables
+template <size_t... I> struct IndexList {};
+template <size_t N, size_t... I> struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+template <size_t... I> struct MakeIndexList<0, I...> {
+  typedef IndexList<I...> type;
+};
+
+template <typename Profile, typename Indices> struct AirtimeTable;
+template <typename Profile, size_t... I> struct AirtimeTable<Profile, IndexList<I...> > {
+  static constexpr uint32_t US[sizeof...(I)] = {Profile::airtimeUs(I)...};
+};
+template <typename Profile, size_t... I>
+constexpr uint32_t AirtimeTable<Profile, IndexList<I...> >::US[sizeof...(I)];
+
+template <uint8_t SF_, uint16_t BW_KHZ_, uint8_t CR_, uint16_t PREAMBLE_ = 8>
+struct RadioProfile {
+  static_assert(SF_ >= 7 && SF_ <= 12, "SF must be 7-12 (SF6 needs implicit headers)");
+  static_assert(BW_KHZ_ == 125 || BW_KHZ_ == 250 || BW_KHZ_ == 500, "Bandwidth must be 125, 250 or 500 kHz");
+  static_assert(CR_ >= 5 && CR_ <= 8, "Coding rate must be 4/5 to 4/8");
+  static_assert(PREAMBLE_ >= 6, "The SX1276 needs a preamble of at least 6 symbols");
+
+  static constexpr uint8_t SF = SF_;
+  static constexpr uint16_t BW_KHZ = BW_KHZ_;
+  static constexpr uint8_t CR = CR_;
+  static constexpr uint32_t SYMBOL_US = (1UL << SF_) * 1000 / BW_KHZ_;
+  static constexpr bool LOW_DATA_RATE = SYMBOL_US > 16000;
+  static constexpr uint32_t PREAMBLE_US = (PREAMBLE_ * 4 + 17) * SYMBOL_US / 4;  // n + 4.25 symbols
+  static constexpr int32_t BLOCK_BITS = 4 * (SF_ - (LOW_DATA_RATE ? 2 : 0));
+
+  static_assert(((1UL << SF_) * 1000) % BW_KHZ_ == 0, "Symbol time must be a whole number of microseconds");
+
+  static constexpr int32_t payloadBits(size_t len) {
+    return 8 * (int32_t)len - 4 * SF_ + 28;
+  }
+  static constexpr uint32_t payloadSymbols(size_t len) {
+    return 8 + (payloadBits(len) > 0 ? (payloadBits(len) + BLOCK_BITS - 1) / BLOCK_BITS * CR_ : 0);
+  }
+  static constexpr uint32_t airtimeUs(size_t len) {
+    return PREAMBLE_US + payloadSymbols(len) * SYMBOL_US;
+  }
+  static constexpr uint32_t RX_TIMEOUT_US = airtimeUs(PROFILE_MAX_PAYLOAD) + PROFILE_RX_GUARD_SYMBOLS * SYMBOL_US;
+  static constexpr RadioProfileInfo info() {
+    return {SF_, BW_KHZ_, CR_, SYMBOL_US, PREAMBLE_US, RX_TIMEOUT_US,
+            AirtimeTable<RadioProfile, typename MakeIndexList<PROFILE_MAX_PAYLOAD + 1>::type>::US};
+  }
+};
+
+// How long to listen for a frame of 'len' bytes whose preamble starts now
+inline uint32_t frameTimeoutUs(const RadioProfileInfo &profile, size_t len) {
+  return profile.airtimeUs[len < PROFILE_MAX_PAYLOAD ? len : PROFILE_MAX_PAYLOAD] +
+         PROFILE_RX_GUARD_SYMBOLS * profile.symbolUs;
+}
+
+// Airtime of a transmitted frame, for accounting
+inline uint32_t frameAirtimeUs(const RadioProfileInfo &profile, size_t len) {
+  return profile.airtimeUs[len < PROFILE_MAX_PAYLOAD ? len : PROFILE_MAX_PAYLOAD];
+}
+
+// The profile in 'profiles' with these settings, or nullptr
+inline const RadioProfileInfo *findRadioProfile(const RadioProfileInfo *profiles, int count, uint8_t sf,
+                                                uint16_t bwKHz, uint8_t cr) {
+  for (int i = 0; i < count; i++) {
+    if (profiles[i].sf == sf && profiles[i].bwKHz == bwKHz && profiles[i].cr == cr) {
+      return &profiles[i];
+    }
+  }
+  return nullptr;
+}
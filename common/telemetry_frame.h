@@ -0,0 +1,74 @@
+// Wire format of the haltec_hydro LoRa frames, shared by the node's
+// encoder (Automation/haltec_hydro/telemetry_codec.h) and the gateway's
+// decoder (testing/tx-rx/tx-rx-ap-httpd/hydro_codec.h)
+//
+// Plain C++ with no Arduino dependency. Every frame starts with
+// mark|type, the node id (2) and a sequence byte, and ends with a CRC-8 of
+// what precedes it; the bodies are described in the hydro README.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TELEMETRY_MARK 0xA0
+#define FRAME_TYPE_MASK 0x07
+#define FRAME_FLAG_RELAYS 0x08
+#define FRAME_KEY 0
+#define FRAME_DELTA 1
+#define FRAME_ACK 2
+#define FRAME_CMD 3
+#define FRAME_STATE 4
+#define FRAME_ALARM 5
+#define FRAME_ALARM_ACK 6
+#define TELEMETRY_HEADER 4
+#define TELEMETRY_FIELDS 4
+#define TELEMETRY_MAX_ZONES 16  // Keeps a KEY frame within one LoRa packet
+#define TELEMETRY_MAX_RELAYS 64
+#define TELEMETRY_MISSING INT16_MIN
+#define TELEMETRY_FRAME_MAX \
+  (TELEMETRY_HEADER + 2 + TELEMETRY_MAX_ZONES * TELEMETRY_FIELDS * 2 + TELEMETRY_MAX_RELAYS / 8 + 1)
+
+// CMD and STATE frames carry a tag over their body, then the CRC
+#define COMMAND_TAG_LEN 8
+#define COMMAND_ON 0x80  // Set in a CMD change byte to switch the relay on
+
+struct TelemetryState {
+  uint8_t zoneCount;
+  uint8_t relayCount;
+  int16_t values[TELEMETRY_MAX_ZONES][TELEMETRY_FIELDS];
+  uint8_t relays[TELEMETRY_MAX_RELAYS / 8];
+};
+
+// CRC-8 (polynomial 0x07); the radio's own CRC is off on this network
+inline uint8_t crc8(const uint8_t *data, size_t len) {
+  uint8_t crc = 0;
+  while (len--) {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+inline size_t writeFrameHeader(uint8_t *out, uint8_t type, uint16_t node, uint8_t seq) {
+  out[0] = TELEMETRY_MARK | type;
+  out[1] = node & 0xFF;
+  out[2] = node >> 8;
+  out[3] = seq;
+  return TELEMETRY_HEADER;
+}
+
+inline size_t telemetryFinish(uint8_t *out, size_t len) {
+  out[len] = crc8(out, len);
+  return len + 1;
+}
+
+// Compare tags without an early exit, so timing reveals nothing
+inline bool commandTagsEqual(const uint8_t *a, const uint8_t *b) {
+  uint8_t diff = 0;
+  for (int i = 0; i < COMMAND_TAG_LEN; i++) {
+    diff |= a[i] ^ b[i];
+  }
+  return diff == 0;
+}
@@ -0,0 +1,99 @@
+// Trace ring shared by haltec_hydro and tx-rx-ap-ssh
+//
+// Build with TRACE_ENABLED 1 to record begin/end events into a RAM ring
+// stamped with the CPU cycle counter; printTrace() dumps it as Chrome
+// trace JSON (chrome://tracing or Perfetto). Each sketch names its events
+// with its own TraceName enum and TRACE_NAMES table, and traces a tick
+// only once it knows the tick has work, so idle passes leave no events.
+// With TRACE_ENABLED 0 the TRACE_ macros expand to nothing.
+#pragma once
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+
+#include <stdint.h>
+
+struct TraceEvent {
+  uint32_t cycles;  // CCOUNT of the core that recorded it
+  uint8_t name;
+  char phase;       // 'B'/'E' slice on this core, 'b'/'e' async span
+  uint8_t core;
+  uint8_t id;       // Which span of an async name, e.g. a sensor
+};
+
+#if TRACE_ENABLED
+#include <atomic>
+
+#define TRACE_EVENTS 1024  // 8 bytes each
+
+TraceEvent traceRing[TRACE_EVENTS];
+std::atomic<uint32_t> traceHead(0);  // Events recorded since boot
+
+// Records a begin event now and the matching end when the scope exits
+struct TraceScope {
+  static void record(uint8_t name, char phase, uint8_t id) {
+    TraceEvent &event = traceRing[traceHead.fetch_add(1, std::memory_order_relaxed) % TRACE_EVENTS];
+    event.cycles = ESP.getCycleCount();
+    event.name = name;
+    event.phase = phase;
+    event.core = xPortGetCoreID();
+    event.id = id;
+  }
+
+  uint8_t name;
+  TraceScope(uint8_t traceName) : name(traceName) { record(name, 'B', 0); }
+  ~TraceScope() { record(name, 'E', 0); }
+};
+
+#define TRACE_SCOPE(name) TraceScope traceScope(name)
+#define TRACE_SPAN_BEGIN(name, id) TraceScope::record(name, 'b', id)
+#define TRACE_SPAN_END(name, id) TraceScope::record(name, 'e', id)
+
+// Chrome trace JSON of the events still in the ring. Slices are category
+// "loop" and async spans "span". 'spanName', when set, names each span
+// event in place of its TRACE_NAMES entry. Each core's cycle counter
+// becomes a thread; time is unwrapped by adding the cycles between
+// consecutive events of a core, so a gap must stay under 2^32 cycles
+// (about 17 s at 240 MHz). Events recorded during the dump may be torn.
+inline void printTrace(Print &out, const char *const *names, size_t nameCount,
+                       const char *(*spanName)(const TraceEvent &event) = nullptr) {
+  uint32_t head = traceHead.load(std::memory_order_relaxed);
+  uint32_t start = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  uint32_t origin = traceRing[start % TRACE_EVENTS].cycles;
+  uint64_t clock[2] = {0, 0};
+  uint32_t last[2] = {0, 0};
+  bool seen[2] = {false, false};
+
+  out.print("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (uint32_t i = start; i < head; i++) {
+    const TraceEvent &event = traceRing[i % TRACE_EVENTS];
+    int core = event.core & 1;
+    if (!seen[core]) {
+      // Both counters start at reset, so the first event of a core is
+      // placed relative to the oldest event in the ring
+      int32_t offset = (int32_t)(event.cycles - origin);
+      clock[core] = offset > 0 ? offset : 0;
+      seen[core] = true;
+    } else {
+      clock[core] += (uint32_t)(event.cycles - last[core]);
+    }
+    last[core] = event.cycles;
+
+    bool span = event.phase == 'b' || event.phase == 'e';
+    const char *name = span && spanName ? spanName(event) : nullptr;
+    if (!name) {
+      name = event.name < nameCount ? names[event.name] : "?";
+    }
+    out.printf("%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"id\":%u,\"pid\":1,\"tid\":%d,\"ts\":%llu.%03u}",
+               i == start ? "" : ",", name, span ? "span" : "loop", event.phase, (unsigned)event.id, core,
+               (unsigned long long)(clock[core] / mhz), (unsigned)(clock[core] % mhz * 1000 / mhz));
+  }
+  out.print("]}\n");
+}
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_SPAN_BEGIN(name, id)
+#define TRACE_SPAN_END(name, id)
+#endif
@@ -0,0 +1,196 @@
+// Energy model for the low-power mode of tx-rx.h
+//
+// Plain C++ with no Arduino dependency; bench/low_power.cpp runs the
+// traffic simulation on the host. Charge is time per state times typical
+// currents from the SX1276 and ESP32 datasheets (TX at 17 dBm on PA_BOOST,
+// CPU at 240 MHz with Wi-Fi off); the display, LED and regulator quiescent
+// current are left out. In low-power mode the receiver wakes for one CAD
+// every interval, and senders stretch their preamble past the interval so
+// a CAD always falls inside it: listening gets cheaper as the interval
+// grows, and every message takes longer and costs its sender more.
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../common/radio_profile.h"
+
+#define LOWPOWER_MAX_PREAMBLE 65535   // Symbols, the SX1276 register limit
+#define LOWPOWER_RX_PREAMBLE 8        // Symbols left after detection, as in continuous mode
+#define LOWPOWER_CAD_SYMBOLS 2
+#define LOWPOWER_WAKE_US 1500         // CPU awake per window: wake-up, SPI, CAD setup
+
+#define BATTERY_MAH 1000
+#define CPU_ACTIVE_UA 50000
+#define CPU_SLEEP_UA 800
+enum PowerState { POWER_RX, POWER_TX, POWER_CAD, POWER_STANDBY, POWER_SLEEP, POWER_STATES };
+const char *const POWER_STATE_NAMES[] = {"rx", "tx", "cad", "standby", "sleep"};
+const uint32_t RADIO_CURRENT_UA[] = {10800, 87000, 10800, 1600, 1};
+const uint32_t PROJECTION_INTERVALS_MS[] = {100, 250, 500, 1000, 2000, 5000};
+
+// Preamble in symbols that spans one window interval plus a CAD
+inline uint32_t lowPowerPreamble(const RadioProfileInfo &profile, uint32_t intervalMs) {
+  return ((uint64_t)intervalMs * 1000 + LOWPOWER_CAD_SYMBOLS * profile.symbolUs) / profile.symbolUs +
+         LOWPOWER_RX_PREAMBLE;
+}
+
+// Time on air of a 'len' byte frame with that preamble (0: the usual one)
+inline uint32_t lowPowerAirtimeUs(const RadioProfileInfo &profile, uint32_t intervalMs, size_t len) {
+  uint32_t extra = intervalMs ? lowPowerPreamble(profile, intervalMs) - LOWPOWER_RX_PREAMBLE : 0;
+  return frameAirtimeUs(profile, len) + extra * profile.symbolUs;
+}
+
+inline double batteryDays(double averageUa) {
+  return BATTERY_MAH * 1000.0 / averageUa / 24;
+}
+
+// Average current in uA of a node listening with windows every intervalMs
+// (0: continuous receive), with no traffic
+inline double projectedCurrentUa(const RadioProfileInfo &profile, uint32_t intervalMs) {
+  if (intervalMs == 0) {
+    return RADIO_CURRENT_UA[POWER_RX] + CPU_ACTIVE_UA;
+  }
+  double periodUs = intervalMs * 1000.0;
+  double cadUs = LOWPOWER_CAD_SYMBOLS * profile.symbolUs;
+  double sleepUs = periodUs - cadUs - LOWPOWER_WAKE_US;
+  return (LOWPOWER_WAKE_US * (double)(CPU_ACTIVE_UA + RADIO_CURRENT_UA[POWER_STANDBY]) +
+          cadUs * (RADIO_CURRENT_UA[POWER_CAD] + CPU_SLEEP_UA) +
+          sleepUs * (RADIO_CURRENT_UA[POWER_SLEEP] + CPU_SLEEP_UA)) / periodUs;
+}
+
+// Time per radio state and CPU state, and the charge it adds up to
+struct EnergyLedger {
+  int64_t radioUs[POWER_STATES];
+  int64_t cpuActiveUs;
+  int64_t cpuSleepUs;
+};
+
+inline double ledgerChargeUah(const EnergyLedger &ledger) {
+  double uAus = ledger.cpuActiveUs * (double)CPU_ACTIVE_UA + ledger.cpuSleepUs * (double)CPU_SLEEP_UA;
+  for (int i = 0; i < POWER_STATES; i++) {
+    uAus += ledger.radioUs[i] * (double)RADIO_CURRENT_UA[i];
+  }
+  return uAus / 3.6e9;
+}
+
+// Traffic Simulation
+//
+// A node in low-power mode, or receiving continuously with interval 0,
+// over 'seconds' of random traffic: messages to it and from it arrive as
+// independent Poisson streams. Each window is a CPU wake-up and a CAD; a
+// CAD inside a preamble turns into a reception, with the CPU asleep, to
+// the end of the frame. Own messages go out with the stretched preamble,
+// CPU awake, and the windows they cover are skipped. A message to the
+// node whose preamble no window catches, because the node was sending or
+// receiving, is lost; in continuous mode one that starts while the node
+// is busy is lost.
+struct LowPowerTraffic {
+  uint32_t rxPerHour;  // Messages to the node
+  uint32_t txPerHour;  // Messages from it
+  uint8_t payload;     // Bytes per message
+};
+
+struct LowPowerResult {
+  EnergyLedger ledger;
+  double averageUa;
+  double latencyMs;     // Mean, from the sender keying up to the node holding the message
+  double maxLatencyMs;
+  uint32_t delivered;
+  uint32_t lost;
+  uint32_t sent;
+  uint32_t windows;
+};
+
+// Exponential gaps from a fixed xorshift seed, so runs repeat
+inline int64_t poissonGapUs(uint32_t &state, uint32_t perHour) {
+  if (perHour == 0) {
+    return INT64_MAX / 4;
+  }
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  double u = (state + 1.0) / 4294967297.0;
+  return (int64_t)(-log(u) * 3.6e9 / perHour);
+}
+
+inline LowPowerResult simulateLowPower(const RadioProfileInfo &profile, uint32_t intervalMs,
+                                       const LowPowerTraffic &traffic, uint32_t seconds, uint32_t seed = 1) {
+  LowPowerResult result = {};
+  EnergyLedger &ledger = result.ledger;
+  const int64_t endUs = (int64_t)seconds * 1000000;
+  const int64_t periodUs = (int64_t)intervalMs * 1000;
+  const int64_t frameUs = lowPowerAirtimeUs(profile, intervalMs, traffic.payload);
+  const int64_t preambleUs = frameUs - frameAirtimeUs(profile, traffic.payload) + profile.preambleUs;
+  const int64_t cadUs = LOWPOWER_CAD_SYMBOLS * profile.symbolUs;
+  uint32_t rxState = seed * 2654435761u | 1, txState = seed * 40503u + 7;
+  int64_t nextRx = poissonGapUs(rxState, traffic.rxPerHour);
+  int64_t nextTx = poissonGapUs(txState, traffic.txPerHour);
+  int64_t busyUntil = 0;  // End of the node's current TX or RX
+  double latencySum = 0;
+
+  auto receive = [&]() {
+    int64_t end = nextRx + frameUs;
+    result.delivered++;
+    double latencyMs = (end - nextRx) / 1000.0;
+    latencySum += latencyMs;
+    result.maxLatencyMs = latencyMs > result.maxLatencyMs ? latencyMs : result.maxLatencyMs;
+    busyUntil = end;
+    nextRx += poissonGapUs(rxState, traffic.rxPerHour);
+  };
+  auto transmit = [&](int64_t before) {
+    while (nextTx < before && nextTx < endUs) {
+      int64_t start = nextTx > busyUntil ? nextTx : busyUntil;
+      ledger.radioUs[POWER_TX] += frameUs;
+      ledger.cpuActiveUs += frameUs;
+      busyUntil = start + frameUs;
+      result.sent++;
+      nextTx += poissonGapUs(txState, traffic.txPerHour);
+    }
+  };
+
+  if (intervalMs == 0) {
+    // Continuous receive: the CPU spins and the radio listens between sends
+    while (nextRx < endUs || nextTx < endUs) {
+      if (nextTx <= nextRx) {
+        transmit(nextTx + 1);
+      } else if (nextRx < busyUntil) {
+        result.lost++;
+        nextRx += poissonGapUs(rxState, traffic.rxPerHour);
+      } else {
+        receive();
+      }
+    }
+    ledger.radioUs[POWER_RX] = endUs - ledger.radioUs[POWER_TX];
+    ledger.cpuActiveUs = endUs;
+  } else {
+    for (int64_t window = 0; window < endUs; window += periodUs) {
+      transmit(window);  // loop() sends before lowPowerTick()
+      // Preambles that ended before this CAD, with no window free to catch them
+      while (nextRx + preambleUs < window + cadUs) {
+        result.lost++;
+        nextRx += poissonGapUs(rxState, traffic.rxPerHour);
+      }
+      if (window < busyUntil) {
+        continue;
+      }
+      result.windows++;
+      ledger.radioUs[POWER_STANDBY] += LOWPOWER_WAKE_US;
+      ledger.cpuActiveUs += LOWPOWER_WAKE_US;
+      ledger.radioUs[POWER_CAD] += cadUs;
+      if (nextRx <= window) {
+        ledger.radioUs[POWER_RX] += nextRx + frameUs - window - cadUs;
+        receive();
+      }
+    }
+    int64_t awake = 0;
+    for (int i = 0; i < POWER_STATES; i++) {
+      awake += i == POWER_SLEEP ? 0 : ledger.radioUs[i];
+    }
+    ledger.radioUs[POWER_SLEEP] = endUs > awake ? endUs - awake : 0;
+    ledger.cpuSleepUs = endUs - ledger.cpuActiveUs;
+  }
+  result.averageUa = ledgerChargeUah(ledger) * 3.6e9 / endUs;
+  result.latencyMs = result.delivered ? latencySum / result.delivered : 0;
+  return result;
+}
@@ -0,0 +1,244 @@
+// The link benchmark for tx-rx.h
+//
+// Plain C++ with no Arduino or RadioLib dependency. The generator and the
+// responder reach the radio and the clock only through a BenchRadio, which
+// the sketch fills in with RadioLib and Arduino calls and tests/ with a
+// simulated link. Profiles are common/radio_profile.h.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#include "../../common/radio_profile.h"
+
+// Link Benchmark
+//
+// "/bench" on Serial runs a traffic generator against a node in responder
+// mode ("/respond"), once per SF/BW/CR combination given. For each one the
+// sender asks the responder to switch with a SWITCH frame on the base
+// profile, sends bursts of probes, and the responder echoes the last probe
+// of each burst with its running receive count. Frames start with 0xB_,
+// which no text message does.
+//
+//   PROBE       mark|flags, run, seq (2), sender micros() (4), padding
+//   ECHO        mark, run, seq (2), sender micros() (4), probes received
+//               (2), bytes received (4), RSSI, SNR x4
+//   SWITCH/ACK  mark, run, SF, CR, BW x10 (2), frequency kHz (4)
+#define BENCH_MARK 0xB0
+#define BENCH_TYPE_MASK 0x07
+#define BENCH_FLAG_ECHO 0x08  // The responder answers this probe
+#define BENCH_PROBE 0
+#define BENCH_ECHO 1
+#define BENCH_SWITCH 2
+#define BENCH_SWITCH_ACK 3
+#define BENCH_PROBE_HEADER 8
+#define BENCH_ECHO_SIZE 16
+#define BENCH_SWITCH_SIZE 10
+#define BENCH_FRAME_MAX 256     // Receive buffer for one frame
+#define BENCH_MAX_VALUES 6      // Per SF/BW/CR list
+#define BENCH_MAX_SAMPLES 256   // RTT samples kept per combination
+#define BENCH_SWITCH_TRIES 5
+#define BENCH_IDLE_MS 15000     // Responder falls back to the base profile after this long
+#define BENCH_TURNAROUND_MS 200 // Added to the airtime of a request and its reply
+
+// What the benchmark needs from the radio and the board
+struct BenchRadio {
+  int (*transmit)(const uint8_t *data, size_t len);  // Blocks until sent; 0 on success
+  size_t (*receive)(uint8_t *frame);  // Polls once: length of a frame received, 0 for none
+  int (*applyProfile)(float freq, const RadioProfileInfo &profile);
+  float (*rssi)();                    // Of the last frame received
+  float (*snr)();
+  uint32_t (*millis)();
+  uint32_t (*micros)();
+  void (*delay)(uint32_t ms);
+  long (*random)(long low, long high);  // In [low, high)
+  bool (*stopRequested)();
+};
+
+struct BenchConfig {
+  uint8_t sfs[BENCH_MAX_VALUES];
+  uint16_t bws[BENCH_MAX_VALUES];
+  uint8_t crs[BENCH_MAX_VALUES];
+  uint8_t sfCount, bwCount, crCount;
+  float freq;
+  uint16_t count;    // Probes per combination
+  uint8_t minSize;   // Probe sizes are uniform in [minSize, maxSize]
+  uint8_t maxSize;
+  float rate;        // Probes per second, on average
+  uint8_t burst;     // Probes sent back to back
+};
+
+// One combination's results, as the sketch prints them
+struct BenchResult {
+  uint16_t sent;
+  uint16_t delivered;      // Probes the responder counted, as of the last echo
+  uint32_t deliveredBytes;
+  uint32_t airUs;          // Airtime of probes and echoes
+  uint32_t elapsedMs;
+  uint16_t samples;        // Echoes received
+  uint32_t p50Ms, p90Ms, p99Ms;
+};
+
+// Probe counts of the run the responder is answering
+struct BenchResponder {
+  uint8_t run;
+  uint16_t count;
+  uint32_t bytes;
+};
+
+// Time to wait for a reply to a request on 'profile'
+inline uint32_t replyTimeoutMs(const RadioProfileInfo &profile, size_t requestLen, size_t replyLen) {
+  return (profile.airtimeUs[requestLen] + frameTimeoutUs(profile, replyLen)) / 1000 + BENCH_TURNAROUND_MS;
+}
+
+inline void writeSwitchFrame(uint8_t *frame, uint8_t type, uint8_t run, float freq, const RadioProfileInfo &profile) {
+  uint16_t bw10 = profile.bwKHz * 10;
+  uint32_t freqKHz = (uint32_t)(freq * 1000 + 0.5);
+  frame[0] = BENCH_MARK | type;
+  frame[1] = run;
+  frame[2] = profile.sf;
+  frame[3] = profile.cr;
+  memcpy(frame + 4, &bw10, 2);
+  memcpy(frame + 6, &freqKHz, 4);
+}
+
+inline int8_t benchClamp(float value) {
+  return value < -128 ? -128 : value > 127 ? 127 : (int8_t)value;
+}
+
+// Responder: count probes, echo flagged ones, follow SWITCH requests to a
+// profile in 'profiles'. Returns the profile a SWITCH moved to, with its
+// frequency in 'freqKHz', or nullptr.
+inline const RadioProfileInfo *benchRespond(const BenchRadio &radio, BenchResponder &responder,
+                                            const RadioProfileInfo *profiles, int profileCount,
+                                            const uint8_t *frame, size_t len, uint32_t &freqKHz) {
+  uint8_t type = frame[0] & BENCH_TYPE_MASK;
+  if (type == BENCH_PROBE && len >= BENCH_PROBE_HEADER) {
+    if (frame[1] != responder.run) {
+      responder.run = frame[1];
+      responder.count = 0;
+      responder.bytes = 0;
+    }
+    responder.count++;
+    responder.bytes += len;
+    if (frame[0] & BENCH_FLAG_ECHO) {
+      uint8_t echo[BENCH_ECHO_SIZE];
+      memcpy(echo, frame, BENCH_PROBE_HEADER);
+      echo[0] = BENCH_MARK | BENCH_ECHO;
+      memcpy(echo + 8, &responder.count, 2);
+      memcpy(echo + 10, &responder.bytes, 4);
+      echo[14] = benchClamp(radio.rssi());
+      echo[15] = benchClamp(radio.snr() * 4);
+      radio.transmit(echo, sizeof(echo));
+    }
+  } else if (type == BENCH_SWITCH && len == BENCH_SWITCH_SIZE) {
+    uint16_t bw10;
+    memcpy(&bw10, frame + 4, 2);
+    memcpy(&freqKHz, frame + 6, 4);
+    const RadioProfileInfo *profile = findRadioProfile(profiles, profileCount, frame[2], bw10 / 10, frame[3]);
+    if (!profile) {
+      return nullptr;  // Not compiled in; the sender reports no responder
+    }
+    uint8_t ack[BENCH_SWITCH_SIZE];
+    memcpy(ack, frame, BENCH_SWITCH_SIZE);
+    ack[0] = BENCH_MARK | BENCH_SWITCH_ACK;
+    radio.transmit(ack, sizeof(ack));
+    radio.applyProfile(freqKHz / 1000.0, *profile);
+    return profile;
+  }
+  return nullptr;
+}
+
+// Wait up to timeoutMs for a bench frame of the given type from this run
+inline bool benchReceive(const BenchRadio &radio, uint8_t run, uint8_t *frame, size_t &len, uint8_t type,
+                         uint32_t timeoutMs) {
+  uint32_t start = radio.millis();
+  while (radio.millis() - start < timeoutMs) {
+    len = radio.receive(frame);
+    if (len > 2 && frame[0] == (BENCH_MARK | type) && frame[1] == run) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Move both ends from 'current' to 'profile': SWITCH on the current one,
+// then follow the ACK
+inline bool benchSwitch(const BenchRadio &radio, uint8_t run, const RadioProfileInfo &current, float freq,
+                        const RadioProfileInfo &profile) {
+  uint8_t frame[BENCH_SWITCH_SIZE];
+  uint8_t reply[BENCH_FRAME_MAX];
+  size_t len;
+  writeSwitchFrame(frame, BENCH_SWITCH, run, freq, profile);
+  for (int attempt = 0; attempt < BENCH_SWITCH_TRIES; attempt++) {
+    radio.transmit(frame, BENCH_SWITCH_SIZE);
+    if (benchReceive(radio, run, reply, len, BENCH_SWITCH_ACK,
+                     replyTimeoutMs(current, BENCH_SWITCH_SIZE, BENCH_SWITCH_SIZE))) {
+      radio.applyProfile(freq, profile);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Probes for 'profile', which both ends are on; 'rtt' holds
+// BENCH_MAX_SAMPLES values and is left sorted
+inline BenchResult benchCombination(const BenchRadio &radio, uint8_t run, const BenchConfig &config,
+                                    const RadioProfileInfo &profile, uint32_t *rtt) {
+  BenchResult result = {};
+  uint8_t frame[BENCH_FRAME_MAX];
+  uint8_t reply[BENCH_FRAME_MAX];
+  size_t len;
+  uint32_t burstMs = (uint32_t)(config.burst * 1000 / config.rate);
+  uint32_t echoTimeoutMs = replyTimeoutMs(profile, config.maxSize, BENCH_ECHO_SIZE);
+  uint32_t start = radio.millis();
+
+  while (result.sent < config.count && !radio.stopRequested()) {
+    uint32_t burstAt = start + (result.sent / config.burst) * burstMs;
+    while ((int32_t)(radio.millis() - burstAt) < 0) {
+      radio.delay(1);
+    }
+    uint16_t seq = 0;
+    uint32_t sentUs = 0;
+    for (uint8_t b = 0; b < config.burst && result.sent < config.count; b++) {
+      size_t size = radio.random(config.minSize, config.maxSize + 1);
+      seq = result.sent;
+      sentUs = radio.micros();
+      bool last = b == config.burst - 1 || result.sent == config.count - 1;
+      frame[0] = BENCH_MARK | BENCH_PROBE | (last ? BENCH_FLAG_ECHO : 0);
+      frame[1] = run;
+      memcpy(frame + 2, &seq, 2);
+      memcpy(frame + 4, &sentUs, 4);
+      for (size_t i = BENCH_PROBE_HEADER; i < size; i++) {
+        frame[i] = (uint8_t)i;
+      }
+      if (radio.transmit(frame, size) == 0) {
+        result.airUs += profile.airtimeUs[size];
+      }
+      result.sent++;
+    }
+    if (benchReceive(radio, run, reply, len, BENCH_ECHO, echoTimeoutMs) && len == BENCH_ECHO_SIZE) {
+      uint16_t echoSeq;
+      memcpy(&echoSeq, reply + 2, 2);
+      if (echoSeq == seq) {
+        if (result.samples < BENCH_MAX_SAMPLES) {
+          rtt[result.samples++] = radio.micros() - sentUs;
+        }
+        memcpy(&result.delivered, reply + 8, 2);
+        memcpy(&result.deliveredBytes, reply + 10, 4);
+        result.airUs += profile.airtimeUs[BENCH_ECHO_SIZE];
+      }
+    }
+  }
+
+  result.elapsedMs = std::max(radio.millis() - start, (uint32_t)1);
+  std::sort(rtt, rtt + result.samples);
+  if (result.samples) {
+    result.p50Ms = rtt[(result.samples - 1) * 50 / 100] / 1000;
+    result.p90Ms = rtt[(result.samples - 1) * 90 / 100] / 1000;
+    result.p99Ms = rtt[(result.samples - 1) * 99 / 100] / 1000;
+  }
+  return result;
+}
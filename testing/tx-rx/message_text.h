@@ -0,0 +1,148 @@
+// Message and console text for the tx-rx sketches
+//
+// Plain C++ with no Arduino dependency: the hex form of an encrypted
+// message, Serial line assembly and command words, and the display lines.
+// Everything writes into caller buffers, so none of it touches the heap.
+// The block cipher is a function the sketch fills in with its AES library,
+// and bench/ with OpenSSL.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Hex
+//
+// Two digits per byte, lower case, so a decoder can step two characters
+// at a time.
+inline void hexEncode(const uint8_t *data, size_t len, char *out) {
+  static const char DIGITS[] = "0123456789abcdef";
+  for (size_t i = 0; i < len; i++) {
+    out[i * 2] = DIGITS[data[i] >> 4];
+    out[i * 2 + 1] = DIGITS[data[i] & 0x0F];
+  }
+  out[len * 2] = '\0';
+}
+
+inline int hexDigit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;  // Either case
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Bytes decoded from 'len' hex characters, or -1 for an odd length, a
+// non-hex character or more than 'max' bytes
+inline int hexDecode(const char *hex, size_t len, uint8_t *out, size_t max) {
+  if (len % 2 || len / 2 > max) {
+    return -1;
+  }
+  for (size_t i = 0; i < len / 2; i++) {
+    int high = hexDigit(hex[i * 2]), low = hexDigit(hex[i * 2 + 1]);
+    if (high < 0 || low < 0) {
+      return -1;
+    }
+    out[i] = high << 4 | low;
+  }
+  return len / 2;
+}
+
+// Encrypted Messages
+//
+// A message is one AES-128 block: up to 16 characters, zero padded, sent
+// as 32 hex digits.
+#define MESSAGE_BLOCK 16
+#define MESSAGE_HEX_LEN (MESSAGE_BLOCK * 2)
+
+typedef void (*BlockCipherFn)(const uint8_t *in, uint8_t *out, const uint8_t *key);
+
+// 'hex' holds MESSAGE_HEX_LEN + 1 characters
+inline void encryptMessageHex(const char *text, size_t len, const uint8_t *key, BlockCipherFn encrypt, char *hex) {
+  uint8_t plaintext[MESSAGE_BLOCK] = {0};
+  uint8_t ciphertext[MESSAGE_BLOCK];
+  memcpy(plaintext, text, len > MESSAGE_BLOCK ? MESSAGE_BLOCK : len);
+  encrypt(plaintext, ciphertext, key);
+  hexEncode(ciphertext, MESSAGE_BLOCK, hex);
+}
+
+// 'text' holds MESSAGE_BLOCK + 1 characters; returns the text length, or
+// -1 if 'hex' is not one block
+inline int decryptMessageHex(const char *hex, size_t len, const uint8_t *key, BlockCipherFn decrypt, char *text) {
+  uint8_t ciphertext[MESSAGE_BLOCK];
+  if (hexDecode(hex, len, ciphertext, MESSAGE_BLOCK) != MESSAGE_BLOCK) {
+    return -1;
+  }
+  decrypt(ciphertext, (uint8_t *)text, key);
+  text[MESSAGE_BLOCK] = '\0';
+  return strlen(text);
+}
+
+// Serial Lines
+//
+// Serial input is gathered into a fixed buffer; characters past its end
+// are dropped, as sendMessage() would truncate them anyway.
+#define SERIAL_LINE_MAX 256
+
+struct LineReader {
+  char data[SERIAL_LINE_MAX];
+  size_t len;
+};
+
+// The finished line when 'c' ends a non-empty one, else nullptr. The line
+// stays valid until the next call.
+inline const char *lineFeed(LineReader &reader, char c) {
+  if (c == '\n' || c == '\r') {
+    if (reader.len == 0) {
+      return nullptr;
+    }
+    reader.data[reader.len] = '\0';
+    reader.len = 0;
+    return reader.data;
+  }
+  if (reader.len < SERIAL_LINE_MAX - 1) {
+    reader.data[reader.len++] = c;
+  }
+  return nullptr;
+}
+
+// True if 'line' is 'word' alone or followed by a space; 'arg' is then
+// what follows the space, or ""
+inline bool commandIs(const char *line, const char *word, const char **arg = nullptr) {
+  size_t len = strlen(word);
+  if (strncmp(line, word, len) != 0 || (line[len] != '\0' && line[len] != ' ')) {
+    return false;
+  }
+  if (arg) {
+    *arg = line[len] ? line + len + 1 : line + len;
+  }
+  return true;
+}
+
+// "C <channel> <key>", both 1-based; false unless both are in range
+inline bool parseChannelCommand(const char *line, int channels, int keys, int &channel, int &key) {
+  channel = key = 0;
+  if (sscanf(line, "C %d %d", &channel, &key) != 2) {
+    return false;
+  }
+  return channel > 0 && channel <= channels && key > 0 && key <= keys;
+}
+
+// Display Lines
+//
+// The 128x64 OLED fits about 21 characters a line; longer text is cut at
+// DISPLAY_LINE_MAX and left to the display to clip.
+#define DISPLAY_LINE_MAX 64
+
+// "header: message"; returns the length written
+inline size_t formatDisplayLine(char *out, size_t size, const char *header, const char *message) {
+  int len = snprintf(out, size, "%s: %s", header, message);
+  return len < 0 ? 0 : (size_t)len < size ? len : size - 1;
+}
+
+// "RSSI:-97.00 SNR:6.25 12s", the status line under the messages
+inline size_t formatStatusLine(char *out, size_t size, float rssi, float snr, uint32_t seconds) {
+  int len = snprintf(out, size, "RSSI:%.2f SNR:%.2f %lus", rssi, snr, (unsigned long)seconds);
+  return len < 0 ? 0 : (size_t)len < size ? len : size - 1;
+}
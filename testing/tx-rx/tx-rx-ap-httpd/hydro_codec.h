@@ -0,0 +1,176 @@
+// Decoder for haltec_hydro telemetry frames, and the gateway end of its
+// relay command channel
+//
+// Plain C++ with no Arduino dependency. The node's encoder is
+// Automation/haltec_hydro/telemetry_codec.h (see the hydro README for the
+// layout), the constants both ends share are in common/telemetry_frame.h,
+// and tests/ round-trips one through the other.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../../../common/telemetry_frame.h"
+
+// Decode a KEY frame body; false when its length does not match
+inline bool decodeTelemetryKey(const uint8_t *frame, size_t len, TelemetryState &out) {
+  if (len < TELEMETRY_HEADER + 3) {
+    return false;
+  }
+  memset(&out, 0, sizeof(out));
+  out.zoneCount = frame[TELEMETRY_HEADER];
+  out.relayCount = frame[TELEMETRY_HEADER + 1];
+  size_t relayBytes = (out.relayCount + 7) / 8;
+  if (out.zoneCount > TELEMETRY_MAX_ZONES || out.relayCount > TELEMETRY_MAX_RELAYS ||
+      len != TELEMETRY_HEADER + 2 + out.zoneCount * TELEMETRY_FIELDS * 2 + relayBytes + 1) {
+    return false;
+  }
+  const uint8_t *in = frame + TELEMETRY_HEADER + 2;
+  for (int z = 0; z < out.zoneCount; z++) {
+    for (int f = 0; f < TELEMETRY_FIELDS; f++, in += 2) {
+      out.values[z][f] = (int16_t)(in[0] | (in[1] << 8));
+    }
+  }
+  memcpy(out.relays, in, relayBytes);
+  return true;
+}
+
+// Apply a DELTA frame body to 'base'; false when its length does not match
+inline bool decodeTelemetryDelta(const uint8_t *frame, size_t len, const TelemetryState &base,
+                                 TelemetryState &out) {
+  // Header, base sequence and CRC at least; len - 1 is safe below
+  if (len < TELEMETRY_HEADER + 2) {
+    return false;
+  }
+  memcpy(&out, &base, sizeof(out));
+  size_t relayBytes = (base.relayCount + 7) / 8;
+  size_t pos = TELEMETRY_HEADER + 1;
+  const uint8_t *masks = frame + pos;
+  pos += (base.zoneCount + 1) / 2;
+  if (pos > len - 1) {
+    return false;
+  }
+  for (int z = 0; z < base.zoneCount; z++) {
+    for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+      if (!(masks[z / 2] & (1 << (f + (z % 2) * 4)))) {
+        continue;
+      }
+      if (pos >= len - 1) {
+        return false;
+      }
+      out.values[z][f] += (int8_t)frame[pos++];
+    }
+  }
+  if (frame[0] & FRAME_FLAG_RELAYS) {
+    if (pos + relayBytes > len - 1) {
+      return false;
+    }
+    memcpy(out.relays, frame + pos, relayBytes);
+    pos += relayBytes;
+  }
+  return pos == len - 1;
+}
+
+// Relay commands
+//
+// A RelayCommand is one node's command channel: the changes waiting to be
+// confirmed and the node's last reported states. The sketch keeps one per
+// node under commandMux and adds the tag and CRC to each frame.
+#define COMMAND_RETRY_MS 2000
+#define COMMAND_MAX_ATTEMPTS 5
+enum CommandStatus { COMMAND_IDLE, COMMAND_PENDING, COMMAND_CONFIRMED, COMMAND_FAILED };
+
+struct RelayCommand {
+  uint32_t seq;          // Newest sequence used or reported by the node
+  uint8_t status;        // CommandStatus
+  uint8_t attempts;      // Transmissions of the current sequence so far
+  uint32_t nextAt;
+  uint8_t count;
+  uint8_t changes[TELEMETRY_MAX_RELAYS];  // Relay index | COMMAND_ON
+  uint8_t stateRelayCount;               // Relay states confirmed by the last STATE
+  uint8_t stateRelays[TELEMETRY_MAX_RELAYS / 8];
+};
+
+// Add a relay change; false for a relay past TELEMETRY_MAX_RELAYS. A
+// command already on air gets a new sequence, so the node applies the
+// merged set as a whole.
+inline bool queueCommandChange(RelayCommand &command, uint8_t relay, bool on, uint32_t now) {
+  if (relay >= TELEMETRY_MAX_RELAYS) {
+    return false;
+  }
+  if (command.status != COMMAND_PENDING) {
+    command.count = 0;
+    command.seq++;
+  } else if (command.attempts > 0) {
+    command.seq++;
+  }
+  command.status = COMMAND_PENDING;
+  command.attempts = 0;
+  command.nextAt = now;
+  int c = 0;
+  while (c < command.count && (command.changes[c] & ~COMMAND_ON) != relay) c++;
+  command.changes[c] = relay | (on ? COMMAND_ON : 0);
+  if (c == command.count) {
+    command.count++;
+  }
+  return true;
+}
+
+// Write the CMD body for a due command into 'out' and count the attempt;
+// 0 when nothing is due. A command out of attempts becomes FAILED.
+inline size_t nextCommandFrame(RelayCommand &command, uint16_t node, uint32_t now, uint8_t *out) {
+  if (command.status != COMMAND_PENDING || (int32_t)(now - command.nextAt) < 0) {
+    return 0;
+  }
+  if (command.attempts >= COMMAND_MAX_ATTEMPTS) {
+    command.status = COMMAND_FAILED;
+    return 0;
+  }
+  writeFrameHeader(out, FRAME_CMD, node, command.seq & 0xFF);
+  memcpy(out + TELEMETRY_HEADER, &command.seq, 4);
+  out[TELEMETRY_HEADER + 4] = command.count;
+  memcpy(out + TELEMETRY_HEADER + 5, command.changes, command.count);
+  command.attempts++;
+  command.nextAt = now + COMMAND_RETRY_MS;
+  return TELEMETRY_HEADER + 5 + command.count;
+}
+
+// Length of a STATE frame's tagged body; 0 when the frame is malformed
+inline size_t commandStateBody(const uint8_t *frame, size_t len) {
+  if (len < TELEMETRY_HEADER + 5 + COMMAND_TAG_LEN + 1) {
+    return 0;
+  }
+  uint8_t relayCount = frame[TELEMETRY_HEADER + 4];
+  size_t body = TELEMETRY_HEADER + 5 + (relayCount + 7) / 8;
+  return relayCount <= TELEMETRY_MAX_RELAYS && len == body + COMMAND_TAG_LEN + 1 ? body : 0;
+}
+
+// Apply an authenticated STATE: confirm the pending command when the
+// node shows its sequence and states, otherwise retry it
+inline void applyCommandState(RelayCommand &command, const uint8_t *frame, uint32_t now) {
+  uint32_t seq;
+  memcpy(&seq, frame + TELEMETRY_HEADER, 4);
+  uint8_t relayCount = frame[TELEMETRY_HEADER + 4];
+  const uint8_t *relays = frame + TELEMETRY_HEADER + 5;
+  command.stateRelayCount = relayCount;
+  memcpy(command.stateRelays, relays, (relayCount + 7) / 8);
+  if (command.status != COMMAND_PENDING) {
+    command.seq = seq > command.seq ? seq : command.seq;
+  } else if (seq >= command.seq) {
+    bool matches = true;
+    for (int c = 0; c < command.count; c++) {
+      uint8_t relay = command.changes[c] & ~COMMAND_ON;
+      bool on = relay < relayCount && ((relays[relay / 8] >> (relay % 8)) & 1);
+      matches &= on == ((command.changes[c] & COMMAND_ON) != 0);
+    }
+    if (matches) {
+      command.seq = seq;
+      command.status = COMMAND_CONFIRMED;
+    } else {
+      // The node is past our sequence without our changes: go beyond it
+      command.seq = seq + 1;
+      command.nextAt = now;
+    }
+  }
+}
@@ -0,0 +1,145 @@
+// Packet capture and replay for tx-rx-ap-httpd.h
+//
+// Plain C++ with no Arduino dependency; bench/replay.cpp replays captures
+// on the host through the same reader and pacing as the device. A capture
+// is a run of records, each a CaptureRecord followed by 'len' raw bytes.
+// The serial stream carries the same bytes as "CAP <hex>" lines, so a
+// serial log converts to a capture line by line. Replay reads through a
+// function the sketch fills in with its File.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../message_text.h"
+
+#define CAPTURE_MAGIC 0xC5
+#define CAPTURE_TX 0x01  // Frame sent by this gateway
+#define CAPTURE_LINE_PREFIX "CAP "
+
+struct __attribute__((packed)) CaptureRecord {
+  uint8_t magic;
+  uint8_t flags;
+  uint32_t time;     // millis() when captured
+  uint32_t freqKHz;
+  uint8_t sf;
+  int8_t rssi;       // dBm
+  int8_t snr;        // dB x4
+  uint8_t len;       // Payload bytes following the record
+};
+
+// Longest record, and its serial line without the prefix
+#define CAPTURE_RECORD_MAX (sizeof(CaptureRecord) + 255)
+#define CAPTURE_HEX_MAX (CAPTURE_RECORD_MAX * 2 + 1)
+
+inline int8_t captureClamp(float value) {
+  return value < -128 ? -128 : value > 127 ? 127 : (int8_t)value;
+}
+
+// A record for a frame of 'len' bytes, cut at 255
+inline CaptureRecord makeCaptureRecord(uint8_t flags, uint32_t time, uint32_t freqKHz, uint8_t sf, float rssi,
+                                       float snr, size_t len) {
+  CaptureRecord record;
+  record.magic = CAPTURE_MAGIC;
+  record.flags = flags;
+  record.time = time;
+  record.freqKHz = freqKHz;
+  record.sf = sf;
+  record.rssi = captureClamp(rssi);
+  record.snr = captureClamp(snr * 4);
+  record.len = len < 255 ? len : 255;
+  return record;
+}
+
+// The hex of a record and its payload, as a "CAP " line carries it;
+// 'out' has room for CAPTURE_HEX_MAX
+inline void captureHex(const CaptureRecord &record, const uint8_t *data, char *out) {
+  hexEncode((const uint8_t *)&record, sizeof(record), out);
+  hexEncode(data, record.len, out + sizeof(record) * 2);
+}
+
+// The record bytes of one serial log line, or 0 when the line is not a
+// whole "CAP " record. Text before the prefix, such as a terminal's
+// timestamp, is skipped.
+inline size_t parseCaptureLine(const char *line, uint8_t *out, size_t max) {
+  const char *hex = strstr(line, CAPTURE_LINE_PREFIX);
+  if (!hex) {
+    return 0;
+  }
+  hex += strlen(CAPTURE_LINE_PREFIX);
+  size_t len = strcspn(hex, "\r\n ");
+  int bytes = hexDecode(hex, len, out, max);
+  if (bytes < (int)sizeof(CaptureRecord) || out[0] != CAPTURE_MAGIC ||
+      (size_t)bytes != sizeof(CaptureRecord) + ((const CaptureRecord *)out)->len) {
+    return 0;
+  }
+  return bytes;
+}
+
+// Replay
+//
+// Frames are handed on at the recorded pace, 'speed' times faster, or back
+// to back with speed 0. Only received frames are replayed; the gateway's
+// own sends were replies, which the replayed frames draw again.
+struct CaptureReplay {
+  // Up to 'len' more bytes of the capture; fewer at its end
+  size_t (*read)(uint8_t *data, size_t len);
+  uint32_t speed;        // 1 = recorded pace, N = N times faster, 0 = back to back
+  uint32_t startedAt;    // Clock when replay began
+  uint32_t baseTime;     // Capture time of the first frame
+  bool pending;          // 'record' and 'payload' hold the next frame
+  CaptureRecord record;
+  uint8_t payload[256];  // Room for a terminator after the longest frame
+  uint32_t frames;
+};
+
+inline void startCaptureReplay(CaptureReplay &replay, uint32_t speed, uint32_t now) {
+  replay.speed = speed;
+  replay.startedAt = now;
+  replay.pending = false;
+  replay.frames = 0;
+}
+
+// Read the next received frame into 'record' and 'payload'; false at the
+// end of the capture, or where it is truncated or not a capture
+inline bool readCaptureFrame(CaptureReplay &replay) {
+  while (replay.read((uint8_t *)&replay.record, sizeof(CaptureRecord)) == sizeof(CaptureRecord)) {
+    if (replay.record.magic != CAPTURE_MAGIC || replay.read(replay.payload, replay.record.len) != replay.record.len) {
+      return false;
+    }
+    if (!(replay.record.flags & CAPTURE_TX)) {
+      if (replay.frames == 0) {
+        replay.baseTime = replay.record.time;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// Milliseconds into the replay at which the pending frame is due
+inline uint32_t captureFrameDue(const CaptureReplay &replay) {
+  return replay.speed ? (replay.record.time - replay.baseTime) / replay.speed : 0;
+}
+
+// Hand each frame due at 'now' to handle(record, payload), up to 'batch'
+// of them. Returns false once the capture has no more frames.
+template <typename Handle>
+bool replayCaptureFrames(CaptureReplay &replay, uint32_t now, int batch, Handle handle) {
+  for (int handled = 0; handled < batch; handled++) {
+    if (!replay.pending) {
+      if (!readCaptureFrame(replay)) {
+        return false;
+      }
+      replay.pending = true;
+    }
+    if (now - replay.startedAt < captureFrameDue(replay)) {
+      return true;  // Not due yet
+    }
+    handle(replay.record, replay.payload);
+    replay.frames++;
+    replay.pending = false;
+  }
+  return true;
+}
@@ -0,0 +1,228 @@
+// Per-node telemetry history for tx-rx-ap-httpd.h
+//
+// Plain C++ with no Arduino dependency; tests/ feeds it frames at the
+// LoRa rate on the host. Nodes are found through an open-addressing hash
+// of their id, so a report costs one probe sequence and one history append
+// however many nodes there are. Each node's history is a ring stored by
+// column: timestamps, RSSI, SNR and each zone/field are separate arrays,
+// so a windowed query reads the timestamps and one value column. Memory
+// and locking stay with the sketch, which supplies the two allocators of
+// a TelemetryTable.
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hydro_codec.h"
+
+#define TELEMETRY_HISTORY 32  // Reports kept per node
+
+// History columns past the readings
+#define TELEMETRY_COLUMN_RSSI TELEMETRY_FIELDS
+#define TELEMETRY_COLUMN_SNR (TELEMETRY_FIELDS + 1)
+
+struct TelemetryNode {
+  uint16_t id;
+  uint8_t ackedSeq[2];        // [0] newest, [1] previous
+  bool ackedValid[2];
+  TelemetryState acked[2];
+  uint32_t lastHeard;
+  uint32_t lowWater;          // Zones in the newest ALARM, one bit each
+  uint8_t alarmSeq;
+  bool alarmValid;
+  uint16_t head;              // Next history slot
+  uint16_t count;
+  uint8_t historyZones;       // Zones in 'values', fixed at the first report
+  uint32_t at[TELEMETRY_HISTORY];    // Seconds since boot
+  int8_t rssi[TELEMETRY_HISTORY];    // dBm
+  int8_t snr[TELEMETRY_HISTORY];     // Quarter dB
+  int16_t *values;            // [zone][field][TELEMETRY_HISTORY]
+  RelayCommand command;       // Guarded by the sketch's command lock
+};
+
+// Nodes in the order they were added, and the index from id to position.
+// Only one task changes the table; readers on other tasks take 'count'
+// once and read the nodes below it.
+struct TelemetryTable {
+  TelemetryNode **nodes;
+  int16_t *index;      // hashSize slots, -1 when empty
+  uint16_t hashSize;   // Power of two, at least twice 'capacity'
+  int capacity;
+  volatile int count;
+  // Called for an id not in the table: adds a node with addTelemetryNode()
+  // or reuses one, and returns it, or nullptr to drop the frame
+  TelemetryNode *(*addNode)(uint16_t id);
+  // History for 'zones' zones, or nullptr to keep none
+  int16_t *(*newHistory)(int zones);
+};
+
+inline uint16_t telemetryHome(const TelemetryTable &table, uint16_t id) {
+  return (uint16_t)(id * 40503u) & (table.hashSize - 1);
+}
+
+// Index slot holding 'id', or the empty slot where it would go
+inline uint16_t telemetrySlot(const TelemetryTable &table, uint16_t id) {
+  uint16_t slot = telemetryHome(table, id);
+  while (table.index[slot] >= 0 && table.nodes[table.index[slot]]->id != id) {
+    slot = (slot + 1) & (table.hashSize - 1);
+  }
+  return slot;
+}
+
+inline TelemetryNode *lookupTelemetryNode(const TelemetryTable &table, uint16_t id) {
+  int16_t index = table.index[telemetrySlot(table, id)];
+  return index >= 0 ? table.nodes[index] : nullptr;
+}
+
+// Append a filled-in node; false when the table is full
+inline bool addTelemetryNode(TelemetryTable &table, TelemetryNode *node) {
+  if (table.count >= table.capacity) {
+    return false;
+  }
+  int count = table.count;
+  table.nodes[count] = node;
+  table.index[telemetrySlot(table, node->id)] = count;
+  table.count = count + 1;  // Publish only once filled in
+  return true;
+}
+
+inline void rebuildTelemetryIndex(TelemetryTable &table) {
+  memset(table.index, 0xFF, table.hashSize * sizeof(int16_t));
+  for (int i = 0; i < table.count; i++) {
+    table.index[telemetrySlot(table, table.nodes[i]->id)] = i;
+  }
+}
+
+inline TelemetryNode *findTelemetryNode(TelemetryTable &table, uint16_t id) {
+  TelemetryNode *node = lookupTelemetryNode(table, id);
+  return node ? node : table.addNode(id);
+}
+
+// Position of the least recently heard node silent for at least
+// 'staleMs', or -1 when every node is still reporting
+inline int stalestTelemetryNode(const TelemetryTable &table, uint32_t now, uint32_t staleMs) {
+  int oldest = -1;
+  for (int i = 0; i < table.count; i++) {
+    uint32_t age = now - table.nodes[i]->lastHeard;
+    if (age >= staleMs && (oldest < 0 || age > now - table.nodes[oldest]->lastHeard)) {
+      oldest = i;
+    }
+  }
+  return oldest;
+}
+
+// Append a decoded report to the node's history columns
+inline void recordTelemetry(const TelemetryTable &table, TelemetryNode &node, const TelemetryState &state,
+                            uint32_t atSeconds, float rssi, float snr) {
+  if (!node.values && state.zoneCount > 0) {
+    node.values = table.newHistory(state.zoneCount);
+    node.historyZones = node.values ? state.zoneCount : 0;
+  }
+  uint16_t slot = node.head;
+  long quarterSnr = lroundf(snr * 4);
+  long dbm = lroundf(rssi);
+  node.at[slot] = atSeconds;
+  node.rssi[slot] = dbm < -128 ? -128 : dbm > 127 ? 127 : dbm;
+  node.snr[slot] = quarterSnr < -128 ? -128 : quarterSnr > 127 ? 127 : quarterSnr;
+  for (int z = 0; z < node.historyZones; z++) {
+    for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+      node.values[(z * TELEMETRY_FIELDS + f) * TELEMETRY_HISTORY + slot] =
+          z < state.zoneCount ? state.values[z][f] : TELEMETRY_MISSING;
+    }
+  }
+  node.head = (slot + 1) % TELEMETRY_HISTORY;
+  if (node.count < TELEMETRY_HISTORY) {
+    node.count++;
+  }
+}
+
+inline uint16_t newestTelemetrySlot(const TelemetryNode &node) {
+  return (node.head + TELEMETRY_HISTORY - 1) % TELEMETRY_HISTORY;
+}
+
+// Decode a KEY or DELTA report whose CRC has been checked, make it the
+// node's newest acknowledged state and record it. Only a KEY that decodes
+// may add a node; a DELTA needs a known node and base. Returns the node,
+// or nullptr when the frame is dropped; the caller acknowledges the frame
+// when it is not.
+inline TelemetryNode *ingestTelemetryReport(TelemetryTable &table, const uint8_t *frame, size_t len,
+                                            uint32_t now, float rssi, float snr, TelemetryState &state) {
+  uint8_t type = frame[0] & FRAME_TYPE_MASK;
+  uint16_t id = frame[1] | (frame[2] << 8);
+  uint8_t seq = frame[3];
+  bool decoded = type == FRAME_KEY && decodeTelemetryKey(frame, len, state);
+  if (type == FRAME_KEY && !decoded) {
+    return nullptr;
+  }
+  TelemetryNode *node = type == FRAME_KEY ? findTelemetryNode(table, id) : lookupTelemetryNode(table, id);
+  if (!node) {
+    return nullptr;
+  }
+  if (type == FRAME_DELTA) {
+    for (int i = 0; i < 2 && !decoded; i++) {
+      if (node->ackedValid[i] && node->ackedSeq[i] == frame[TELEMETRY_HEADER]) {
+        decoded = decodeTelemetryDelta(frame, len, node->acked[i], state);
+      }
+    }
+  }
+  if (!decoded) {
+    return nullptr;  // Unknown base: the node falls back to a KEY when ACKs stop
+  }
+
+  if (!node->ackedValid[0] || node->ackedSeq[0] != seq) {
+    node->acked[1] = node->acked[0];
+    node->ackedSeq[1] = node->ackedSeq[0];
+    node->ackedValid[1] = node->ackedValid[0];
+  }
+  node->acked[0] = state;
+  node->ackedSeq[0] = seq;
+  node->ackedValid[0] = true;
+  node->lastHeard = now;
+  recordTelemetry(table, *node, state, now / 1000, rssi, snr);
+  return node;
+}
+
+// Windowed aggregates
+//
+// Min, max and sum of one column of one zone over the reports of the
+// first 'count' nodes from the last 'window' seconds. Each node's ring is
+// read newest first and left at the first report outside the window.
+struct TelemetryAggregate {
+  int32_t min;
+  int32_t max;
+  int64_t sum;
+  uint32_t samples;
+  uint32_t nodes;  // Nodes with at least one report counted
+};
+
+inline void aggregateTelemetry(const TelemetryTable &table, int count, int column, int zone, uint32_t now,
+                               uint32_t window, TelemetryAggregate &out) {
+  out = {INT32_MAX, INT32_MIN, 0, 0, 0};
+  for (int i = 0; i < count; i++) {
+    const TelemetryNode *node = table.nodes[i];
+    const int16_t *values = nullptr;
+    if (column < TELEMETRY_FIELDS) {
+      if (zone >= node->historyZones) continue;
+      values = node->values + (zone * TELEMETRY_FIELDS + column) * TELEMETRY_HISTORY;
+    }
+    bool counted = false;
+    for (uint16_t k = 0, slot = node->head; k < node->count; k++) {
+      slot = (slot + TELEMETRY_HISTORY - 1) % TELEMETRY_HISTORY;
+      if (now - node->at[slot] > window) {
+        break;  // Older reports only get older
+      }
+      int32_t value = values ? values[slot] : column == TELEMETRY_COLUMN_RSSI ? node->rssi[slot] : node->snr[slot];
+      if (values && value == TELEMETRY_MISSING) {
+        continue;
+      }
+      out.min = value < out.min ? value : out.min;
+      out.max = value > out.max ? value : out.max;
+      out.sum += value;
+      out.samples++;
+      counted = true;
+    }
+    out.nodes += counted;
+  }
+}
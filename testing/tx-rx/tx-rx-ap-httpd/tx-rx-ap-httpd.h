@@ -5,24 +5,73 @@
 #include <AsyncTCP.h>
 #include <SPIFFS.h>
 #include <ArduinoJson.h>
+#include <mbedtls/md.h>
+#include <mbedtls/ccm.h>
+#include <atomic>
+#include "hydro_codec.h"
+#include "telemetry_store.h"
+#include "packet_capture.h"
+#include "../message_text.h"
+#include "../user_session.h"
+#include "../../../common/admission.h"
+#include "../../../common/radio_profile.h"
 
 // LoRa Radio Configuration
 SX1276 radio = new Module(18, 26, 14, 35);  // NSS, DIO0, RST, DIO1
+const float LORA_FREQUENCY = 915.0;  // MHz
+typedef RadioProfile<7, 125, 5> GatewayProfile;  // Airtime is a lookup in its table
+const RadioProfileInfo GATEWAY_PROFILE = GatewayProfile::info();
+const uint8_t LORA_SF = GatewayProfile::SF;
 
 // Display Configuration
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
-String displayLines[4];  // Buffer for 4 lines of text
+char displayLines[4][DISPLAY_LINE_MAX];  // Buffer for 4 lines of text
+
+// Gateway configuration, persisted as a binary image (see Configuration
+// Management below)
+struct ConfigRecord {
+  char apSSID[33];
+  char apPassword[65];
+  uint16_t userCount;  // UserRecords following the record on flash
+  // Added in version 2; a version 1 record ends here
+  char commandKey[33];  // Shared with hydro controllers; empty disables commands
+};
+ConfigRecord config = {"LoRaGateway", "password123", 0, ""};
 
 // Wi-Fi Configuration
-const char* apSSID = "LoRaGateway";
-const char* apPassword = "password123";
+const char* apSSID = config.apSSID;
+const char* apPassword = config.apPassword;
 
 // Web Server Configuration
 AsyncWebServer server(80);
 
 // Configuration Management
-const char* configFilePath = "/config.json";
+//
+// The configuration image (ConfigRecord plus every user) is written to one
+// of two slot files, alternating, so a power cut mid-write leaves the
+// previous image intact. Users added afterwards are appended to a journal
+// and folded into a new image once the journal passes CONFIG_JOURNAL_MAX.
+// Saves are debounced so a burst of changes costs one write.
+const char* configFilePath = "/config.json";  // Legacy JSON, imported once
+const char* CONFIG_SLOTS[2] = {"/config.a.bin", "/config.b.bin"};
+const char* CONFIG_JOURNAL = "/config.jnl";
+#define CONFIG_MAGIC 0x47464347  // "GCFG"
+#define CONFIG_VERSION 2
+#define CONFIG_VERSION_V1 1
+#define CONFIG_V1_RECORD_SIZE offsetof(ConfigRecord, commandKey)
+#define CONFIG_DEBOUNCE_MS 2000
+#define CONFIG_MAX_DELAY_MS 10000
+#define CONFIG_JOURNAL_MAX 4096
+
+struct PersistHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t size;  // Bytes of payload following the header
+  uint32_t seq;
+  uint32_t crc;   // CRC-32 of the payload
+};
 
 // User Management
 struct User {
@@ -31,78 +80,480 @@ struct User {
 };
 std::vector<User> users;
 
+// On-flash form of a user
+struct UserRecord {
+  char username[32];
+  char key[64];
+};
+
+// Journal entry: one added user, guarded by a CRC-32 over seq + record
+struct UserJournalEntry {
+  uint32_t seq;
+  UserRecord user;
+  uint32_t crc;
+};
+
+uint32_t configSeq = 0;
+int configSlot = 1;             // Slot holding the newest image
+size_t persistedUserCount = 0;  // Users already on flash
+uint32_t configJournalSize = 0;
+bool configImageDue = false;    // The last write failed; write a full image next
+bool configDirty = false;
+uint32_t configDirtyAt = 0;
+uint32_t configFirstDirtyAt = 0;
+uint16_t configLoadedVersion = 0;
+
+// Only loop() writes config and the files. Web handlers mark changes
+// dirty and post a new command key under configMux.
+char pendingCommandKey[33];
+bool commandKeyPending = false;
+portMUX_TYPE configMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Hydro Telemetry
+//
+// Binary frames from haltec_hydro controllers (see its README for the
+// layout). KEY frames carry absolute readings; DELTA frames carry changes
+// against a frame this gateway acknowledged. The last two acknowledged
+// states are kept per node, so a delta still decodes when the node missed
+// the newest ACK. Readings are in fixed point: temperature and humidity
+// x10, CO2 in ppm, water level raw. ALARM frames carry the set of zones
+// under their water threshold; they are acknowledged before anything else
+// is done with them, as the node retries until the ACK arrives. Frame
+// constants and the KEY/DELTA decoder are in hydro_codec.h, the node table
+// and report history in telemetry_store.h.
+#define TELEMETRY_MAX_NODES 32   // About 0.6 KB each plus up to 4 KB of history
+#define TELEMETRY_HASH_SIZE 64   // Power of two, at least 2x TELEMETRY_MAX_NODES
+#define TELEMETRY_HEAP_RESERVE 40960  // Free heap left to Wi-Fi, lwIP and AsyncTCP
+#define TELEMETRY_STALE_MS 600000     // A node silent this long may be replaced
+const char* TELEMETRY_FIELD_NAMES[TELEMETRY_FIELDS] = {"temperature", "humidity", "co2", "water"};
+const int TELEMETRY_SCALES[TELEMETRY_FIELDS] = {10, 10, 1, 1};
+
+// Nodes are allocated on first contact, from a decoded KEY or an ALARM,
+// and never freed, so a pointer read by a web handler stays valid. When
+// the table is full or free heap is under TELEMETRY_HEAP_RESERVE, the
+// least recently heard node silent for TELEMETRY_STALE_MS is reused in
+// place; with none, the new node is refused, so a flood of ids cannot
+// displace nodes that are reporting. telemetryIndex maps a node id to
+// its slot; loop() changes it and web handlers probe it under
+// telemetryMux.
+TelemetryNode *newTelemetryNode(uint16_t id);
+int16_t *newTelemetryHistory(int zones);
+TelemetryNode *telemetryNodes[TELEMETRY_MAX_NODES];
+int16_t telemetryIndex[TELEMETRY_HASH_SIZE];
+TelemetryTable telemetryTable = {telemetryNodes, telemetryIndex, TELEMETRY_HASH_SIZE, TELEMETRY_MAX_NODES, 0,
+                                 newTelemetryNode, newTelemetryHistory};
+portMUX_TYPE telemetryMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Relay Commands
+//
+// CMD frames set absolute relay states on one node, several changes per
+// frame, authenticated with a truncated HMAC-SHA256 under the command key.
+// The node applies a sequence number once and answers every CMD with a
+// STATE frame: its newest applied sequence and relay states. A command is
+// confirmed when the STATE shows its sequence and the requested states;
+// otherwise it is retried, with a sequence past the node's when the node
+// reports a newer one (e.g. after a gateway restart). The state machine
+// is RelayCommand in hydro_codec.h.
+const char* COMMAND_STATUS_NAMES[] = {"idle", "pending", "confirmed", "failed"};
+portMUX_TYPE commandMux = portMUX_INITIALIZER_UNLOCKED;
+
+// User Sessions
+//
+// Messages to and from a user are encrypted and authenticated with
+// AES-128-CCM under a session key derived from the user's key, and carry
+// the user's 16-bit recipient id in clear so a receiver can drop frames
+// for others without decrypting. Key and id come from one HMAC-SHA256 of
+// USER_SESSION_LABEL under the user's key, so a node derives its own
+// (tx-rx.h does). The frame, the id index and the LRU of expanded CCM
+// contexts are in user_session.h; a frame costs one lookup and one CCM
+// pass however many users there are.
+//
+// All crypto runs on loop(). Web requests queue their messages in
+// userOutbox, which also carries plain broadcasts (user -1) so every web
+// send reaches the radio from loop(), and queue new users in
+// pendingUsers. loop() appends them to users, whose capacity is reserved
+// up front, and then raises usersPublished; web handlers read only the
+// users below it, which never move or change.
+//
+// The session key is fixed per user, so the counter is what keeps the
+// nonce unique: each sender counts its frames and never reuses a value.
+// The gateway's downlink counter survives restarts by reserving blocks of
+// USER_COUNTER_BLOCK values on flash before using them. For the uplink it
+// keeps, per user, the highest counter that authenticated and drops any
+// frame at or below it, so a captured frame cannot be replayed. Those
+// marks are flushed USER_COUNTER_FLUSH_MS after a change; a frame from
+// the last seconds before a power cut could be accepted once more. Both
+// live in two alternating slot files, like the configuration.
+#define USER_OUTBOX 4
+#define USER_PENDING 4              // Users added on the web, waiting for loop()
+#define USER_COUNTER_BLOCK 1024     // Downlink counters reserved per flash write
+#define USER_COUNTER_FLUSH_MS 10000
+#define USER_COUNTER_MAGIC 0x53455353  // "SESS"
+const char* USER_COUNTER_SLOTS[2] = {"/sessions.a.bin", "/sessions.b.bin"};
+
+struct UserMessage {
+  int16_t user;         // -1: plain broadcast
+  uint8_t len;
+  char text[240];       // LoRa text limit; USER_TEXT_MAX to a user
+};
+
+SessionTable sessionTable;  // Sessions parallel to users, and their index
+mbedtls_ccm_context sessionCiphers[USER_CIPHER_CACHE];
+UserMessage userOutbox[USER_OUTBOX];
+uint8_t userOutboxHead = 0;
+uint8_t userOutboxCount = 0;
+portMUX_TYPE userOutboxMux = portMUX_INITIALIZER_UNLOCKED;
+UserRecord pendingUsers[USER_PENDING];
+uint8_t pendingUserCount = 0;  // Under configMux
+std::atomic<size_t> usersPublished(0);
+uint32_t userDownCounter = 1;   // Next downlink counter
+uint32_t userDownReserved = 0;  // Counters below this are reserved on flash
+uint32_t userCounterSeq = 0;
+int userCounterSlot = 1;        // Slot holding the newest counters
+bool userCountersDirty = false;
+uint32_t userCountersDirtyAt = 0;
+
+// Staged Boot
+//
+// setup() starts only the radio and display, so the gateway is receiving
+// within a few hundred milliseconds of reset. Storage, Wi-Fi and the web
+// server then start from loop(), one stage per pass with the radio polled
+// in between. A radio that fails to start is retried with a growing delay
+// instead of halting the board; a failed stage leaves the rest running.
+// Stage timings and the time to the first received packet are printed
+// when boot completes and served at /api/boot. Times are ms since reset.
+#define BOOT_RETRY_MS 1000
+#define BOOT_RETRY_MAX_MS 30000
+enum BootStage { BOOT_RADIO, BOOT_STORAGE, BOOT_WIFI, BOOT_WEB, BOOT_STAGES };
+const char* BOOT_STAGE_NAMES[] = {"radio", "storage", "wifi", "web"};
+
+struct BootStageTiming {
+  uint32_t startedAt;
+  uint32_t durationUs;  // Summed over attempts
+  uint32_t attempts;
+  bool done;
+};
+
+BootStageTiming bootTimings[BOOT_STAGES] = {};
+int bootStage = BOOT_STORAGE;  // Next stage run from loop()
+uint32_t bootCompletedAt = 0;
+uint32_t firstRxAt = 0;
+bool radioReady = false;
+uint32_t radioRetryAt = 0;
+
+// Packet Capture and Replay
+//
+// In capture mode every frame sent or received is recorded with its time,
+// radio settings and signal, either appended to CAPTURE_FILE or streamed
+// to Serial as "CAP <hex>" lines. The stream carries the same records as
+// the file, so the hex of a serial log is itself a capture. Replay feeds
+// the received frames of CAPTURE_FILE back through handlePacket() at the
+// recorded pace, sped up, or back to back. While replaying, the radio is
+// neither polled nor keyed, so acknowledgements stay off the air, and
+// live sends wait in the outbox.
+//
+// captureFile and replay.file belong to loop(): web handlers only post a
+// mode change or replay start in captureRequest/replayRequested, which
+// captureTick() applies. An upload writes CAPTURE_FILE from the web task,
+// so neither a flash capture nor a replay starts while one is active.
+// The record format, reader and pacing are packet_capture.h.
+#define CAPTURE_MAX_BYTES 262144
+#define CAPTURE_FLUSH_MS 2000
+#define REPLAY_BATCH 32          // Frames handled per loop() pass at most
+#define CAPTURE_UPLOAD_IDLE_MS 10000  // An upload with no data this long is abandoned
+const char* CAPTURE_FILE = "/capture.bin";
+
+enum CaptureMode { CAPTURE_OFF, CAPTURE_FLASH, CAPTURE_SERIAL };
+const char* CAPTURE_MODE_NAMES[] = {"off", "flash", "serial"};
+CaptureMode captureMode = CAPTURE_OFF;
+File captureFile;
+uint32_t captureFrames = 0;
+uint32_t captureBytes = 0;
+uint32_t captureFlushedAt = 0;
+File captureUpload;  // POST /capture.bin in progress
+volatile bool captureUploading = false;
+volatile uint32_t captureUploadAt = 0;  // millis() of the last upload chunk
+volatile int8_t captureRequest = -1;    // CaptureMode posted by the web task
+volatile bool replayRequested = false;
+volatile uint32_t replayRequestSpeed = 1;
+
+struct ReplayState {
+  bool active;
+  File file;
+  CaptureReplay capture;  // Reads 'file'
+  uint32_t pipelineUs;    // Time spent in handlePacket()
+  uint32_t elapsedMs;
+};
+ReplayState replay = {false, File(), {[](uint8_t *data, size_t len) { return replay.file.read(data, len); }}};
+
+// Metrics
+//
+// Counters and histograms for the radio, HMAC, display and HTTP paths,
+// served at /metrics in Prometheus text format and printed by the serial
+// command "/metrics". Recording is one relaxed atomic add, safe from the
+// web server task. Histograms count microseconds in power-of-four
+// buckets, so the bucket is found from the leading-zero count; sums wrap
+// like any 32-bit counter.
+#define METRIC_BUCKETS 11  // le 3, 15, 63, ... 4^11-1 us, then +Inf
+enum CounterId { COUNTER_TX, COUNTER_TX_ERRORS, COUNTER_RX, COUNTER_RX_ERRORS, COUNTER_AIRTIME,
+                 COUNTER_HTTP_REJECTED_HEAP, COUNTER_HTTP_REJECTED_BUSY, COUNTER_HTTP_REJECTED_RATE,
+                 COUNTER_HTTP_REJECTED_BODY, COUNTER_SESSION_CACHE_MISSES, COUNTER_SESSION_REJECTED, COUNTER_ALARMS,
+                 COUNTER_NODES_REPLACED, COUNTER_SESSION_REPLAYED, COUNTER_COUNT };
+const char* COUNTER_NAMES[] = {"lora_tx_total", "lora_tx_errors_total", "lora_rx_total", "lora_rx_errors_total",
+                               "lora_airtime_microseconds_total", "http_rejected_heap_total",
+                               "http_rejected_busy_total", "http_rejected_rate_total", "http_rejected_body_total",
+                               "session_cache_misses_total", "session_frames_rejected_total", "alarms_total",
+                               "telemetry_nodes_replaced_total", "session_frames_replayed_total"};
+enum HistogramId { HIST_TX, HIST_RX_POLL, HIST_HMAC, HIST_DISPLAY, HIST_HTTP, HIST_SESSION, HIST_COUNT };
+const char* HISTOGRAM_NAMES[] = {"lora_tx_microseconds", "lora_rx_poll_microseconds", "hmac_microseconds",
+                                 "display_flush_microseconds", "http_handler_microseconds",
+                                 "session_crypto_microseconds"};
+
+struct Histogram {
+  std::atomic<uint32_t> buckets[METRIC_BUCKETS + 1];  // Last is +Inf
+  std::atomic<uint32_t> sum;
+};
+
+std::atomic<uint32_t> counters[COUNTER_COUNT];
+Histogram histograms[HIST_COUNT];
+
+inline void countMetric(CounterId id, uint32_t n) {
+  counters[id].fetch_add(n, std::memory_order_relaxed);
+}
+
+inline void observeMetric(HistogramId id, uint32_t us) {
+  uint32_t bucket = (31 - __builtin_clz(us | 1)) / 2;
+  histograms[id].buckets[bucket < METRIC_BUCKETS ? bucket : METRIC_BUCKETS].fetch_add(1, std::memory_order_relaxed);
+  histograms[id].sum.fetch_add(us, std::memory_order_relaxed);
+}
+
+// Admission Control
+//
+// See admission.h. /capture.bin takes up to CAPTURE_MAX_BYTES, other form
+// posts ADMISSION_BODY_MAX.
+#define ADMISSION_BODY_MAX 2048
+const AdmissionLimits ADMISSION_LIMITS = {
+  24576,  // heapReserve
+  4,      // maxInFlight
+  0,      // maxUpgrades
+  5,      // ratePerS
+  10,     // burst
+  8,      // clients
+  [](const char *url) -> size_t { return strcmp(url, "/capture.bin") == 0 ? CAPTURE_MAX_BYTES : ADMISSION_BODY_MAX; },
+  nullptr,  // No WebSocket
+};
+Admission admission = {&ADMISSION_LIMITS, {}, 0, {}};
+
+// Performance Suite
+//
+// "/perf" on Serial times the per-message paths on the device itself:
+// display updates, the users JSON, telemetry decoding, session and
+// command crypto, and the config image records. Each case repeats for at
+// least PERF_CASE_MS after one warm-up call. "heap B/op" is the change in
+// free heap per call, so anything but 0 is memory a path keeps.
+// "/perf save" stores the results as the baseline, and later runs flag
+// cases more than PERF_REGRESSION_PCT slower. The radio is not polled
+// for the run, under two seconds.
+#define PERF_CASE_MS 200
+#define PERF_REGRESSION_PCT 10
+#define PERF_NAME_LEN 16
+#define PERF_MAX_CASES 16
+const char* PERF_BASELINE_PATH = "/perf.bin";
+
+struct PerfCase {
+  const char *name;
+  void (*run)();
+};
+
+struct PerfResult {
+  char name[PERF_NAME_LEN];
+  uint32_t nsPerOp;
+  int32_t heapPerOp;
+};
+
+volatile uint32_t perfSinkValue;  // Keeps pure cases from being optimised away
+
 void setup() {
   // Initialize Heltec hardware (Display, disable LoRa init, enable Serial)
   Heltec.begin(true, false, true);  // Display = true, LoRa = false, Serial = true
+  Serial.setTimeout(50);
+
+  // The radio comes first so the gateway hears traffic as early as
+  // possible; storage, Wi-Fi and the web server follow from loop()
+  bootRadio();
 
   // Custom display initialization
   Heltec.display->init();
   Heltec.display->flipScreenVertically();
   Heltec.display->setFont(ArialMT_Plain_10);
-  updateDisplay("System Init", "Starting LoRa...");
+  updateDisplay("System Init", radioReady ? "LoRa receiving" : "LoRa retrying");
+
+  // Empty telemetry node index and session cipher cache
+  memset(telemetryIndex, 0xFF, sizeof(telemetryIndex));
+  for (mbedtls_ccm_context &cipher : sessionCiphers) {
+    mbedtls_ccm_init(&cipher);
+  }
+}
+
+void loop() {
+  bootTick();
+  handleSerialInput();
+  receiveMessage();
+  commandTick();
+  userTick();
+  userAddTick();
+  userCounterTick();
+  configPersistTick();
+  captureTick();
+  replayTick();
+}
+
+// Start the radio; on failure bootTick() retries with a growing delay
+void bootRadio() {
+  BootStageTiming &timing = bootTimings[BOOT_RADIO];
+  uint32_t startedUs = micros();
+  if (timing.attempts == 0) {
+    timing.startedAt = millis();
+  }
+  timing.attempts++;
 
-  // Initialize LoRa
-  float freq = 915.0;    // Frequency in MHz
-  float bw = 125.0;      // Bandwidth (kHz)
-  uint8_t sf = 7;        // Spreading factor
-  uint8_t cr = 5;        // Coding rate
+  float freq = LORA_FREQUENCY;  // Frequency in MHz
+  float bw = GatewayProfile::BW_KHZ;  // Bandwidth (kHz)
+  uint8_t sf = GatewayProfile::SF;     // Spreading factor
+  uint8_t cr = GatewayProfile::CR;     // Coding rate
   uint8_t syncWord = 0x12;
   int8_t power = 17;     // TX power in dBm
 
   int state = radio.begin(freq, bw, sf, cr, syncWord, power);
   radio.setCRC(false);
+  timing.durationUs += micros() - startedUs;
 
   if (state == RADIOLIB_ERR_NONE) {
-    updateDisplay("LoRa Status", "Initialized!");
+    radioReady = true;
+    timing.done = true;
     Serial.println("LoRa initialized!");
   } else {
-    updateDisplay("LoRa Error", String(state));
-    Serial.print("LoRa init failed: ");
-    Serial.println(state);
-    while (true);  // Halt on failure
+    uint32_t delayMs = min((uint32_t)BOOT_RETRY_MS << min(timing.attempts - 1, (uint32_t)5), (uint32_t)BOOT_RETRY_MAX_MS);
+    radioRetryAt = millis() + delayMs;
+    Serial.printf("LoRa init failed: %d, retrying in %u ms\n", state, (unsigned)delayMs);
   }
+}
 
-  // Initialize SPIFFS
-  if (!SPIFFS.begin(true)) {
-    Serial.println("Failed to mount SPIFFS");
-    return;
+// Mount SPIFFS and load the configuration; defaults are kept on failure
+bool bootStorage() {
+  bool mounted = SPIFFS.begin(true);
+  if (mounted) {
+    loadConfig();
+  } else {
+    Serial.println("Failed to mount SPIFFS, using default configuration");
   }
+  indexUsers();
+  if (mounted) {
+    loadUserCounters();
+  }
+  return mounted;
+}
 
-  // Load configuration
-  loadConfig();
-
-  // Start Wi-Fi AP
-  WiFi.softAP(apSSID, apPassword);
-  updateDisplay("Wi-Fi AP", "SSID: " + String(apSSID));
+bool bootWiFi() {
+  return WiFi.softAP(apSSID, apPassword);
+}
 
-  // Start Web Server
+bool bootWeb() {
   setupWebServer();
   server.begin();
-  updateDisplay("Web Server", "Started on port 80");
+  return true;
+}
 
-  // Serial setup
-  Serial.setTimeout(50);
-  updateDisplay("System Ready", "Freq: " + String(freq) + "MHz");
-  Serial.println("Enter text to send:");
+// Run the next boot stage, one per loop() pass so the radio is polled in
+// between, and retry the radio until it starts
+void bootTick() {
+  if (!radioReady && (int32_t)(millis() - radioRetryAt) >= 0) {
+    bootRadio();
+    if (radioReady) {
+      updateDisplay("LoRa Status", "Initialized!");
+    }
+  }
+  if (bootStage >= BOOT_STAGES) {
+    return;
+  }
+  BootStageTiming &timing = bootTimings[bootStage];
+  timing.startedAt = millis();
+  timing.attempts = 1;
+  uint32_t startedUs = micros();
+  switch (bootStage) {
+    case BOOT_STORAGE:
+      timing.done = bootStorage();
+      break;
+    case BOOT_WIFI:
+      timing.done = bootWiFi();
+      updateDisplay("Wi-Fi AP", "SSID: " + String(apSSID));
+      break;
+    case BOOT_WEB:
+      timing.done = bootWeb();
+      updateDisplay("Web Server", "Started on port 80");
+      break;
+  }
+  timing.durationUs = micros() - startedUs;
+  bootStage++;
+  if (bootStage == BOOT_STAGES) {
+    bootCompletedAt = millis();
+    printBootReport(Serial);
+    updateDisplay("System Ready", "Freq: " + String(LORA_FREQUENCY) + "MHz");
+    Serial.println("Enter text to send:");
+  }
 }
 
-void loop() {
-  handleSerialInput();
-  receiveMessage();
+// Per-stage timings and time to first packet, as JSON
+void printBootReport(Print &out) {
+  out.print("{\"stages\":[");
+  for (int i = 0; i < BOOT_STAGES; i++) {
+    const BootStageTiming &timing = bootTimings[i];
+    out.printf("%s{\"name\":\"%s\",\"ok\":%s,\"attempts\":%u,\"atMs\":%u,\"us\":%u}", i ? "," : "",
+               BOOT_STAGE_NAMES[i], timing.done ? "true" : "false", (unsigned)timing.attempts,
+               (unsigned)timing.startedAt, (unsigned)timing.durationUs);
+  }
+  out.printf("],\"readyMs\":%u,\"firstRxMs\":", (unsigned)bootCompletedAt);
+  if (firstRxAt) {
+    out.print(firstRxAt);
+  } else {
+    out.print("null");
+  }
+  out.println("}");
 }
 
 void handleSerialInput() {
-  static String inputBuffer;
-  
+  static LineReader input;
+
   while (Serial.available()) {
-    char c = Serial.read();
-    if (c == '\n' || c == '\r') {
-      if (inputBuffer.length() > 0) {
-        sendMessage(inputBuffer);
-        inputBuffer = "";
+    const char *line = lineFeed(input, Serial.read());
+    const char *arg;
+    if (!line) {
+      continue;
+    }
+    if (commandIs(line, "/metrics")) {
+      printMetrics(Serial);
+    } else if (commandIs(line, "/perf", &arg) && (!*arg || strcmp(arg, "save") == 0)) {
+      runPerf(*arg != '\0');
+    } else if (commandIs(line, "/capture", &arg)) {
+      for (int m = CAPTURE_OFF; m <= CAPTURE_SERIAL; m++) {
+        if (strcmp(arg, CAPTURE_MODE_NAMES[m]) == 0) {
+          setCaptureMode((CaptureMode)m);
+        }
+      }
+    } else if (commandIs(line, "/replay", &arg)) {
+      if (!startReplay(*arg ? atoi(arg) : 1)) {
+        Serial.println("Nothing to replay");
+      }
+    } else if (line[0] == '@') {
+      const char *space = strchr(line, ' ');
+      int user = space ? findUser(String(line + 1).substring(0, space - line - 1)) : -1;
+      if (user < 0) {
+        Serial.println("Usage: @<user> <message>, to a known user");
+      } else {
+        sendUserMessage(user, space + 1, strlen(space + 1));
       }
     } else {
-      inputBuffer += c;
+      sendMessage(line);
     }
   }
 }
@@ -110,12 +561,17 @@ void handleSerialInput() {
 void sendMessage(String message) {
   // Truncate to 240 characters (LoRa packet limit)
   message = message.substring(0, 240);
+  if (replay.active) {
+    updateDisplay("Tx Failed", "Replay running");
+    Serial.println("Replay running, message not sent");
+    return;
+  }
   
   // Display update
   updateDisplay("Transmitting", message);
 
   // Transmit message
-  int state = radio.transmit(message);
+  int state = radioTransmit((uint8_t *)message.c_str(), message.length());
   
   if (state == RADIOLIB_ERR_NONE) {
     updateDisplay("Tx Success", message);
@@ -128,25 +584,78 @@ void sendMessage(String message) {
   }
 }
 
-void receiveMessage() {
-  static uint32_t lastUpdate = 0;
-  String receivedStr;
-  int state = radio.receive(receivedStr, 0);  // Non-blocking receive
-
+// Transmit and record count, latency and airtime. Live sends are held
+// or refused while a replay runs, so only replies to replayed frames
+// reach here then.
+int radioTransmit(uint8_t *data, size_t len) {
+  if (replay.active) {
+    return RADIOLIB_ERR_NONE;  // Replies to replayed frames stay off the air
+  }
+  if (!radioReady) {
+    countMetric(COUNTER_TX_ERRORS, 1);
+    return RADIOLIB_ERR_CHIP_NOT_FOUND;
+  }
+  captureFrame(CAPTURE_TX, data, len, 0, 0);
+  uint32_t startedUs = micros();
+  int state = radio.transmit(data, len);
+  observeMetric(HIST_TX, micros() - startedUs);
   if (state == RADIOLIB_ERR_NONE) {
+    countMetric(COUNTER_TX, 1);
+    countMetric(COUNTER_AIRTIME, frameAirtimeUs(GATEWAY_PROFILE, len));
+  } else {
+    countMetric(COUNTER_TX_ERRORS, 1);
+  }
+  return state;
+}
+
+// Handle one received frame; 'packet' has room for a terminator after 'len'
+void handlePacket(uint8_t *packet, size_t len, float rssi, float snr) {
+  if (len > 0 && (packet[0] & 0xF0) == TELEMETRY_MARK) {
+    handleTelemetryFrame(packet, len, rssi, snr);
+  } else if (len > 0 && (packet[0] & 0xF0) == USER_MARK) {
+    handleUserFrame(packet, len);
+  } else {
+    packet[len] = '\0';
+    String receivedStr = (const char *)packet;
+
     // Display handling
     updateDisplay("Received", receivedStr);
-    
+
     // Serial output
     Serial.print("Received: ");
     Serial.println(receivedStr);
-    
+
     // Blink LED on reception
     digitalWrite(LED_BUILTIN, HIGH);
     delay(50);
     digitalWrite(LED_BUILTIN, LOW);
   }
+}
+
+void receiveMessage() {
+  static uint32_t lastUpdate = 0;
+  if (replay.active || !radioReady) {
+    return;
+  }
+  uint8_t packet[256];
+  uint32_t startedUs = micros();
+  int state = radio.receive(packet, 0);  // Non-blocking receive
+  observeMetric(HIST_RX_POLL, micros() - startedUs);
+
+  if (state == RADIOLIB_ERR_NONE) {
+    countMetric(COUNTER_RX, 1);
+    if (!firstRxAt) {
+      firstRxAt = millis();
+      Serial.printf("First packet %u ms after reset\n", (unsigned)firstRxAt);
+    }
+    size_t len = min(radio.getPacketLength(), sizeof(packet) - 1);
+    float rssi = radio.getRSSI();
+    float snr = radio.getSNR();
+    captureFrame(0, packet, len, rssi, snr);
+    handlePacket(packet, len, rssi, snr);
+  }
   else if (state != RADIOLIB_ERR_RX_TIMEOUT) {
+    countMetric(COUNTER_RX_ERRORS, 1);
     updateDisplay("Rx Error", String(state));
     Serial.print("Receive error: ");
     Serial.println(state);
@@ -159,31 +668,517 @@ void receiveMessage() {
   }
 }
 
-void updateDisplay(String header, String message) {
+void updateDisplay(const String &header, const String &message) {
   // Shift previous messages up
-  for(int i = 3; i > 0; i--) {
-    displayLines[i] = displayLines[i-1];
-  }
-  displayLines[0] = header + ": " + message;
+  memmove(displayLines[1], displayLines[0], sizeof(displayLines[0]) * 3);
+  formatDisplayLine(displayLines[0], DISPLAY_LINE_MAX, header.c_str(), message.c_str());
 
   // Update physical display
   Heltec.display->clear();
   for(int i = 0; i < 4; i++) {
     Heltec.display->drawString(0, i*12, displayLines[i]);
   }
+  uint32_t startedUs = micros();
   Heltec.display->display();
+  observeMetric(HIST_DISPLAY, micros() - startedUs);
 }
 
 void updateStatusLine() {
   // Keep bottom line for status info
-  displayLines[3] = "RSSI:" + String(radio.getRSSI()) + 
-                   " SNR:" + String(radio.getSNR()) + 
-                   " " + String(millis()/1000) + "s";
+  formatStatusLine(displayLines[3], DISPLAY_LINE_MAX, radio.getRSSI(), radio.getSNR(), millis() / 1000);
   Heltec.display->drawString(0, 36, displayLines[3]);
+  uint32_t startedUs = micros();
   Heltec.display->display();
+  observeMetric(HIST_DISPLAY, micros() - startedUs);
 }
 
-void loadConfig() {
+// Lookup for the web task, which may race a change from loop()
+TelemetryNode *lookupTelemetryNode(uint16_t id) {
+  portENTER_CRITICAL(&telemetryMux);
+  TelemetryNode *node = lookupTelemetryNode(telemetryTable, id);
+  portEXIT_CRITICAL(&telemetryMux);
+  return node;
+}
+
+// Give the least recently heard stale node to 'id'. Its struct and history
+// buffer are kept, so a web handler still holding the pointer reads valid
+// memory, now describing the new node.
+TelemetryNode *reuseTelemetryNode(uint16_t id) {
+  uint32_t now = millis();
+  int oldest = stalestTelemetryNode(telemetryTable, now, TELEMETRY_STALE_MS);
+  if (oldest < 0) {
+    return nullptr;  // Every node is still reporting
+  }
+  TelemetryNode *node = telemetryNodes[oldest];
+  int16_t *values = node->values;
+  uint8_t historyZones = node->historyZones;
+  portENTER_CRITICAL(&commandMux);
+  memset(node, 0, sizeof(TelemetryNode));
+  node->id = id;
+  node->lastHeard = now;
+  node->values = values;
+  node->historyZones = historyZones;
+  portEXIT_CRITICAL(&commandMux);
+
+  portENTER_CRITICAL(&telemetryMux);
+  rebuildTelemetryIndex(telemetryTable);
+  portEXIT_CRITICAL(&telemetryMux);
+  countMetric(COUNTER_NODES_REPLACED, 1);
+  return node;
+}
+
+// A node for an id not in the table: a new one while there is room and
+// heap, otherwise a stale one reused
+TelemetryNode *newTelemetryNode(uint16_t id) {
+  if (telemetryTable.count == TELEMETRY_MAX_NODES || ESP.getFreeHeap() < TELEMETRY_HEAP_RESERVE) {
+    return reuseTelemetryNode(id);
+  }
+  TelemetryNode *node = (TelemetryNode *)calloc(1, sizeof(TelemetryNode));
+  if (!node) {
+    return reuseTelemetryNode(id);
+  }
+  node->id = id;
+  node->lastHeard = millis();
+  portENTER_CRITICAL(&telemetryMux);
+  addTelemetryNode(telemetryTable, node);
+  portEXIT_CRITICAL(&telemetryMux);
+  return node;
+}
+
+// History buffer for a node's first report, while the heap allows
+int16_t *newTelemetryHistory(int zones) {
+  if (ESP.getFreeHeap() < TELEMETRY_HEAP_RESERVE) {
+    return nullptr;
+  }
+  return (int16_t *)malloc(zones * TELEMETRY_FIELDS * TELEMETRY_HISTORY * sizeof(int16_t));
+}
+
+void printTelemetryValue(String &line, int16_t value, int scale) {
+  if (value == TELEMETRY_MISSING) {
+    line += "nan";
+  } else {
+    line += String((float)value / scale, scale == 1 ? 0 : 1);
+  }
+}
+
+// Decode a hydro frame, acknowledge it, and report zone 0 on the display
+void handleTelemetryFrame(const uint8_t *frame, size_t len, float rssi, float snr) {
+  uint8_t type = frame[0] & FRAME_TYPE_MASK;
+  if (len < TELEMETRY_HEADER + 2 || crc8(frame, len - 1) != frame[len - 1]) {
+    return;
+  }
+  uint16_t id = frame[1] | (frame[2] << 8);
+  uint8_t seq = frame[3];
+  if (type == FRAME_STATE) {
+    TelemetryNode *node = lookupTelemetryNode(id);
+    if (node) {
+      handleCommandState(node, frame, len);
+    }
+    return;
+  }
+  if (type == FRAME_ALARM) {
+    TelemetryNode *node = len == TELEMETRY_HEADER + 6 ? findTelemetryNode(telemetryTable, id) : nullptr;
+    if (node) {
+      handleAlarm(node, frame, len);
+    }
+    return;
+  }
+  if (type != FRAME_KEY && type != FRAME_DELTA) {
+    return;
+  }
+
+  TelemetryState state;
+  if (!ingestTelemetryReport(telemetryTable, frame, len, millis(), rssi, snr, state)) {
+    return;
+  }
+
+  uint8_t ack[TELEMETRY_HEADER + 1] = {TELEMETRY_MARK | FRAME_ACK, frame[1], frame[2], seq, 0};
+  ack[TELEMETRY_HEADER] = crc8(ack, TELEMETRY_HEADER);
+  radioTransmit(ack, sizeof(ack));
+
+  char name[12];
+  snprintf(name, sizeof(name), "Node %04X", id);
+  String line;
+  if (state.zoneCount > 0) {
+    line += "T:";
+    printTelemetryValue(line, state.values[0][0], 10);
+    line += " H:";
+    printTelemetryValue(line, state.values[0][1], 10);
+    line += " C:";
+    printTelemetryValue(line, state.values[0][2], 1);
+    line += " W:";
+    printTelemetryValue(line, state.values[0][3], 1);
+  }
+  updateDisplay(name, line);
+  Serial.printf("%s %s seq %u (%u bytes): %s\n", name, type == FRAME_KEY ? "key" : "delta", seq,
+                (unsigned)len, line.c_str());
+}
+
+// Acknowledge an ALARM at once, then report the set when it changed
+void handleAlarm(TelemetryNode *node, const uint8_t *frame, size_t len) {
+  if (len != TELEMETRY_HEADER + 6) {
+    return;
+  }
+  uint8_t ack[TELEMETRY_HEADER + 1] = {TELEMETRY_MARK | FRAME_ALARM_ACK, frame[1], frame[2], frame[3], 0};
+  ack[TELEMETRY_HEADER] = crc8(ack, TELEMETRY_HEADER);
+  radioTransmit(ack, sizeof(ack));
+
+  node->lastHeard = millis();
+  if (node->alarmValid && node->alarmSeq == frame[3]) {
+    return;  // A retry whose ACK was lost
+  }
+  uint32_t lowWater;
+  memcpy(&lowWater, frame + TELEMETRY_HEADER + 1, 4);
+  bool changed = !node->alarmValid || lowWater != node->lowWater;
+  node->lowWater = lowWater;
+  node->alarmSeq = frame[3];
+  node->alarmValid = true;
+  countMetric(COUNTER_ALARMS, 1);
+  if (!changed) {
+    return;
+  }
+
+  char name[12];
+  snprintf(name, sizeof(name), "Node %04X", node->id);
+  String line = lowWater ? "Low water:" : "Water OK";
+  for (int z = 0; z < 32; z++) {
+    if (lowWater & (1UL << z)) {
+      line += " " + String(z);
+    }
+  }
+  updateDisplay(name, line);
+  Serial.printf("ALARM %s %s\n", name, line.c_str());
+}
+
+// user_session.h's crypto: HMAC and CCM from mbedtls, each pass timed
+const SessionCrypto SESSION_CRYPTO = {
+  [](const uint8_t *key, size_t keyLen, uint8_t *mac) {
+    uint32_t startedUs = micros();
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, keyLen, (const uint8_t *)USER_SESSION_LABEL,
+                    strlen(USER_SESSION_LABEL), mac);
+    observeMetric(HIST_HMAC, micros() - startedUs);
+  },
+  [](int slot, const uint8_t *key) {
+    countMetric(COUNTER_SESSION_CACHE_MISSES, 1);
+    mbedtls_ccm_free(&sessionCiphers[slot]);
+    mbedtls_ccm_init(&sessionCiphers[slot]);
+    mbedtls_ccm_setkey(&sessionCiphers[slot], MBEDTLS_CIPHER_ID_AES, key, 128);
+  },
+  [](int slot, const uint8_t *header, const uint8_t *text, size_t len, uint8_t *out, uint8_t *tag) {
+    uint32_t startedUs = micros();
+    mbedtls_ccm_encrypt_and_tag(&sessionCiphers[slot], len, header, USER_HEADER, nullptr, 0, text, out, tag,
+                                USER_TAG_LEN);
+    observeMetric(HIST_SESSION, micros() - startedUs);
+  },
+  [](int slot, const uint8_t *header, const uint8_t *in, size_t len, uint8_t *text, const uint8_t *tag) {
+    uint32_t startedUs = micros();
+    int result = mbedtls_ccm_auth_decrypt(&sessionCiphers[slot], len, header, USER_HEADER, nullptr, 0, in, text, tag,
+                                          USER_TAG_LEN);
+    observeMetric(HIST_SESSION, micros() - startedUs);
+    return result == 0;
+  },
+};
+
+// Rebuild the sessions after the users were loaded; users past USER_MAX
+// get none
+void indexUsers() {
+  clearSessionTable(sessionTable);
+  if (users.size() > USER_MAX) {
+    Serial.printf("%u users, only the first %u get sessions\n", (unsigned)users.size(), USER_MAX);
+  }
+  users.reserve(USER_MAX);
+  for (size_t i = 0; i < users.size() && i < USER_MAX; i++) {
+    addUserSession(sessionTable, SESSION_CRYPTO, users[i].key.c_str(), users[i].key.length());
+  }
+  usersPublished = users.size();
+}
+
+// Index of the user with this name, or -1; safe from the web task
+int findUser(const String &username) {
+  size_t count = usersPublished;
+  for (size_t i = 0; i < count && i < USER_MAX; i++) {
+    if (users[i].username == username) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Queue a user added on the web for loop(); false when the queue is full
+bool queueUser(const String &username, const String &key) {
+  bool queued = false;
+  portENTER_CRITICAL(&configMux);
+  if (pendingUserCount < USER_PENDING) {
+    UserRecord &record = pendingUsers[pendingUserCount++];
+    memset(&record, 0, sizeof(record));
+    strlcpy(record.username, username.c_str(), sizeof(record.username));
+    strlcpy(record.key, key.c_str(), sizeof(record.key));
+    queued = true;
+  }
+  portEXIT_CRITICAL(&configMux);
+  return queued;
+}
+
+// Add queued users: derive and index their sessions, then publish them
+// to the web task and save the configuration
+void userAddTick() {
+  UserRecord added[USER_PENDING];
+  portENTER_CRITICAL(&configMux);
+  uint8_t count = pendingUserCount;
+  memcpy(added, pendingUsers, count * sizeof(UserRecord));
+  pendingUserCount = 0;
+  portEXIT_CRITICAL(&configMux);
+  for (uint8_t i = 0; i < count && users.size() < USER_MAX; i++) {
+    addUserRecord(added[i]);
+    addUserSession(sessionTable, SESSION_CRYPTO, added[i].key, strlen(added[i].key));
+    usersPublished = users.size();
+  }
+  if (count > 0) {
+    saveConfig();
+  }
+}
+
+// Write the counters to the older slot: the downlink reservation and the
+// uplink mark of every user with a session
+bool saveUserCounters() {
+  size_t count = users.size() < USER_MAX ? users.size() : USER_MAX;
+  uint32_t size = 4 + count * 4;
+  uint32_t *payload = (uint32_t *)malloc(size);
+  if (!payload) {
+    return false;
+  }
+  payload[0] = userDownReserved;
+  for (size_t i = 0; i < count; i++) {
+    payload[1 + i] = sessionTable.sessions[i].lastCounter;
+  }
+  PersistHeader header = {USER_COUNTER_MAGIC, 1, 0, size, ++userCounterSeq, crc32((const uint8_t *)payload, size)};
+  int slot = 1 - userCounterSlot;
+  File file = SPIFFS.open(USER_COUNTER_SLOTS[slot], "w");
+  bool written = file && file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+                 file.write((const uint8_t *)payload, size) == size;
+  if (file) {
+    file.close();
+  }
+  free(payload);
+  if (written) {
+    userCounterSlot = slot;
+    userCountersDirty = false;
+  }
+  return written;
+}
+
+// Restore the counters from the newest valid slot. The downlink counter
+// resumes at the old reservation, so no value handed out before a
+// restart is used again. With slot files present but none valid, it
+// starts at a random point, as the values already used are unknown.
+void loadUserCounters() {
+  bool found = false, loaded = false;
+  for (int slot = 0; slot < 2; slot++) {
+    File file = SPIFFS.open(USER_COUNTER_SLOTS[slot], "r");
+    if (!file) {
+      continue;
+    }
+    found = true;
+    PersistHeader header;
+    if (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) || header.magic != USER_COUNTER_MAGIC ||
+        header.size < 4 || header.size > 4 + USER_MAX * 4 || (loaded && header.seq <= userCounterSeq)) {
+      file.close();
+      continue;
+    }
+    static uint32_t payload[1 + USER_MAX];
+    bool valid = file.read((uint8_t *)payload, header.size) == header.size &&
+                 crc32((const uint8_t *)payload, header.size) == header.crc;
+    file.close();
+    if (!valid) {
+      continue;
+    }
+    userDownCounter = payload[0];
+    for (size_t i = 0; i < header.size / 4 - 1 && i < users.size(); i++) {
+      sessionTable.sessions[i].lastCounter = payload[1 + i];
+    }
+    userCounterSeq = header.seq;
+    userCounterSlot = slot;
+    loaded = true;
+  }
+  if (found && !loaded) {
+    userDownCounter = esp_random() >> 1;
+    Serial.println("Session counters lost, downlink counter restarts at random");
+  }
+  userDownReserved = userDownCounter;  // Nothing reserved until the first send
+}
+
+// Persist uplink marks once they have been dirty for USER_COUNTER_FLUSH_MS
+void userCounterTick() {
+  if (userCountersDirty && millis() - userCountersDirtyAt >= USER_COUNTER_FLUSH_MS) {
+    saveUserCounters();
+  }
+}
+
+// Encrypt a message to one user and transmit it
+void sendUserMessage(int user, const char *text, size_t len) {
+  if (replay.active) {
+    Serial.println("Replay running, message not sent");
+    return;
+  }
+  if (userDownCounter >= userDownReserved) {
+    uint32_t previous = userDownReserved;
+    userDownReserved = userDownCounter + USER_COUNTER_BLOCK;
+    if (userDownReserved < userDownCounter || !saveUserCounters()) {
+      userDownReserved = previous;  // Never send on a counter not reserved
+      Serial.println("Cannot reserve session counters, message not sent");
+      return;
+    }
+  }
+  uint8_t frame[USER_FRAME_MAX];
+  len = len < USER_TEXT_MAX ? len : USER_TEXT_MAX;
+  size_t frameLen = sealUserFrameTo(sessionTable, SESSION_CRYPTO, user, userDownCounter++, text, len, frame);
+  int state = radioTransmit(frame, frameLen);
+  updateDisplay(state == RADIOLIB_ERR_NONE ? "Tx " + users[user].username : "Tx Failed", String(text).substring(0, len));
+  Serial.printf("%s %s (%u bytes)\n", state == RADIOLIB_ERR_NONE ? "Sent to" : "Send failed to",
+                users[user].username.c_str(), (unsigned)len);
+}
+
+// Decrypt a frame from a user; frames for unknown ids are dropped unread
+void handleUserFrame(const uint8_t *frame, size_t len) {
+  char text[USER_TEXT_MAX + 1];
+  int user = openUserFrame(sessionTable, SESSION_CRYPTO, frame, len, text);
+  if (user == USER_FRAME_REPLAYED) {
+    countMetric(COUNTER_SESSION_REPLAYED, 1);
+    return;
+  }
+  if (user < 0) {
+    countMetric(COUNTER_SESSION_REJECTED, 1);
+    return;
+  }
+  if (!userCountersDirty) {
+    userCountersDirty = true;
+    userCountersDirtyAt = millis();
+  }
+  updateDisplay(users[user].username, text);
+  Serial.printf("From %s: %s\n", users[user].username.c_str(), text);
+}
+
+// Queue a message to a user from the web task; false when the outbox is full
+bool queueUserMessage(int user, const String &text) {
+  bool queued = false;
+  portENTER_CRITICAL(&userOutboxMux);
+  if (userOutboxCount < USER_OUTBOX) {
+    UserMessage &message = userOutbox[(userOutboxHead + userOutboxCount) % USER_OUTBOX];
+    message.user = user;
+    size_t max = user < 0 ? sizeof(message.text) : USER_TEXT_MAX;
+    message.len = text.length() < max ? text.length() : max;
+    memcpy(message.text, text.c_str(), message.len);
+    userOutboxCount++;
+    queued = true;
+  }
+  portEXIT_CRITICAL(&userOutboxMux);
+  return queued;
+}
+
+// Send queued messages, one per loop() pass; held while a replay runs
+void userTick() {
+  if (replay.active) {
+    return;
+  }
+  UserMessage message;
+  portENTER_CRITICAL(&userOutboxMux);
+  bool pending = userOutboxCount > 0;
+  if (pending) {
+    message = userOutbox[userOutboxHead];
+    userOutboxHead = (userOutboxHead + 1) % USER_OUTBOX;
+    userOutboxCount--;
+  }
+  portEXIT_CRITICAL(&userOutboxMux);
+  if (pending && message.user < 0) {
+    sendMessage(String(message.text).substring(0, message.len));
+  } else if (pending) {
+    sendUserMessage(message.user, message.text, message.len);
+  }
+}
+
+// Truncated HMAC-SHA256 of a command frame under the shared key
+void commandTag(const uint8_t *data, size_t len, uint8_t *tag) {
+  uint8_t mac[32];
+  uint32_t startedUs = micros();
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t *)config.commandKey,
+                  strlen(config.commandKey), data, len, mac);
+  observeMetric(HIST_HMAC, micros() - startedUs);
+  memcpy(tag, mac, COMMAND_TAG_LEN);
+}
+
+bool commandTagValid(const uint8_t *data, size_t len, const uint8_t *tag) {
+  uint8_t expected[COMMAND_TAG_LEN];
+  commandTag(data, len, expected);
+  return commandTagsEqual(expected, tag);
+}
+
+// Add a relay change to the node's command
+void queueCommand(TelemetryNode *node, uint8_t relay, bool on) {
+  portENTER_CRITICAL(&commandMux);
+  queueCommandChange(node->command, relay, on, millis());
+  portEXIT_CRITICAL(&commandMux);
+}
+
+// Transmit due commands; one frame carries every change for a node
+void commandTick() {
+  if (replay.active) {
+    return;  // Commands wait for the replay to end
+  }
+  uint32_t now = millis();
+  int count = telemetryTable.count;
+  for (int i = 0; i < count; i++) {
+    TelemetryNode *node = telemetryNodes[i];
+    uint8_t frame[TELEMETRY_HEADER + 5 + TELEMETRY_MAX_RELAYS + COMMAND_TAG_LEN + 1];
+    portENTER_CRITICAL(&commandMux);
+    size_t len = nextCommandFrame(node->command, node->id, now, frame);
+    portEXIT_CRITICAL(&commandMux);
+
+    if (len > 0) {
+      commandTag(frame, len, frame + len);
+      len += COMMAND_TAG_LEN;
+      frame[len] = crc8(frame, len);
+      radioTransmit(frame, len + 1);
+    }
+  }
+}
+
+// A STATE frame confirms the pending command or tells us to retry it
+void handleCommandState(TelemetryNode *node, const uint8_t *frame, size_t len) {
+  size_t body = commandStateBody(frame, len);
+  if (config.commandKey[0] == '\0' || body == 0 || !commandTagValid(frame, body, frame + body)) {
+    return;
+  }
+  portENTER_CRITICAL(&commandMux);
+  applyCommandState(node->command, frame, millis());
+  portEXIT_CRITICAL(&commandMux);
+}
+
+uint32_t crc32(const uint8_t *data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (len--) {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+void toUserRecord(const User &user, UserRecord &record) {
+  memset(&record, 0, sizeof(record));
+  strlcpy(record.username, user.username.c_str(), sizeof(record.username));
+  strlcpy(record.key, user.key.c_str(), sizeof(record.key));
+}
+
+void addUserRecord(const UserRecord &record) {
+  User user;
+  user.username = String(record.username);
+  user.key = String(record.key);
+  users.push_back(user);
+}
+
+// Import the config.json written by earlier firmware
+void loadLegacyConfig() {
   if (SPIFFS.exists(configFilePath)) {
     File file = SPIFFS.open(configFilePath, "r");
     if (file) {
@@ -191,8 +1186,8 @@ void loadConfig() {
       DeserializationError error = deserializeJson(doc, file);
       if (!error) {
         // Load configuration from JSON
-        apSSID = doc["apSSID"].as<const char*>();
-        apPassword = doc["apPassword"].as<const char*>();
+        strlcpy(config.apSSID, doc["apSSID"] | config.apSSID, sizeof(config.apSSID));
+        strlcpy(config.apPassword, doc["apPassword"] | config.apPassword, sizeof(config.apPassword));
         // Load users
         JsonArray usersArray = doc["users"].as<JsonArray>();
         for (JsonObject userObj : usersArray) {
@@ -207,63 +1202,828 @@ void loadConfig() {
   }
 }
 
+// Read one slot image straight into config and users
+bool readConfigSlot(int slot, uint32_t &seq) {
+  File file = SPIFFS.open(CONFIG_SLOTS[slot], "r");
+  if (!file) {
+    return false;
+  }
+  // A version 1 record is a prefix of the current one
+  PersistHeader header;
+  bool valid = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+               header.magic == CONFIG_MAGIC &&
+               (header.version == CONFIG_VERSION || header.version == CONFIG_VERSION_V1);
+  size_t recordSize = header.version == CONFIG_VERSION ? sizeof(ConfigRecord) : CONFIG_V1_RECORD_SIZE;
+  valid = valid && header.size >= recordSize;
+  uint8_t *payload = valid ? (uint8_t *)malloc(header.size) : nullptr;
+  valid = payload && file.read(payload, header.size) == header.size &&
+          crc32(payload, header.size) == header.crc;
+  file.close();
+
+  if (valid) {
+    ConfigRecord record;
+    memset(&record, 0, sizeof(record));
+    memcpy(&record, payload, recordSize);
+    record.commandKey[sizeof(record.commandKey) - 1] = '\0';
+    valid = header.size == recordSize + record.userCount * sizeof(UserRecord);
+    if (valid) {
+      config = record;
+      configLoadedVersion = header.version;
+      users.clear();
+      users.reserve(record.userCount);
+      const UserRecord *userRecords = (const UserRecord *)(payload + recordSize);
+      for (uint16_t i = 0; i < record.userCount; i++) {
+        UserRecord user;
+        memcpy(&user, &userRecords[i], sizeof(user));
+        addUserRecord(user);
+      }
+      seq = header.seq;
+    }
+  }
+  free(payload);
+  return valid;
+}
+
+// Write the full image to the other slot and start an empty journal.
+// False when the slot was not written in full; the newest slot and its
+// journal then still stand.
+bool commitConfig() {
+  config.userCount = users.size();
+  uint32_t size = sizeof(ConfigRecord) + users.size() * sizeof(UserRecord);
+  uint8_t *payload = (uint8_t *)malloc(size);
+  if (!payload) {
+    return false;
+  }
+  memcpy(payload, &config, sizeof(ConfigRecord));
+  UserRecord *userRecords = (UserRecord *)(payload + sizeof(ConfigRecord));
+  for (size_t i = 0; i < users.size(); i++) {
+    UserRecord record;
+    toUserRecord(users[i], record);
+    memcpy(&userRecords[i], &record, sizeof(record));
+  }
+  PersistHeader header = {CONFIG_MAGIC, CONFIG_VERSION, 0, size, ++configSeq, crc32(payload, size)};
+
+  int slot = 1 - configSlot;
+  File file = SPIFFS.open(CONFIG_SLOTS[slot], "w");
+  bool written = file && file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+                 file.write(payload, size) == size;
+  if (file) {
+    file.close();
+  }
+  free(payload);
+  if (!written) {
+    return false;
+  }
+
+  // Older journal entries now replay as no-ops, so truncating last is safe
+  configSlot = slot;
+  SPIFFS.open(CONFIG_JOURNAL, "w").close();
+  configJournalSize = 0;
+  persistedUserCount = users.size();
+  return true;
+}
+
+// Append users added since the last write, in one journal write. False
+// when not every entry was written in full.
+bool appendConfigJournal() {
+  size_t pending = users.size() - persistedUserCount;
+  if (pending == 0) {
+    return true;
+  }
+  if (configJournalSize + pending * sizeof(UserJournalEntry) > CONFIG_JOURNAL_MAX) {
+    return commitConfig();
+  }
+
+  File file = SPIFFS.open(CONFIG_JOURNAL, "a");
+  if (!file) {
+    return false;
+  }
+  bool written = true;
+  for (size_t i = persistedUserCount; i < users.size() && written; i++) {
+    UserJournalEntry entry;
+    entry.seq = ++configSeq;
+    toUserRecord(users[i], entry.user);
+    entry.crc = crc32((const uint8_t *)&entry, offsetof(UserJournalEntry, crc));
+    written = file.write((const uint8_t *)&entry, sizeof(entry)) == sizeof(entry);
+  }
+  file.close();
+  if (!written) {
+    return false;  // A torn entry may end the journal; configPersistTick() writes an image next
+  }
+  configJournalSize += pending * sizeof(UserJournalEntry);
+  persistedUserCount = users.size();
+  return true;
+}
+
+// Add users journaled after the loaded image
+void replayConfigJournal() {
+  File file = SPIFFS.open(CONFIG_JOURNAL, "r");
+  if (!file) {
+    return;
+  }
+  UserJournalEntry entry;
+  while (file.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry)) {
+    if (crc32((const uint8_t *)&entry, offsetof(UserJournalEntry, crc)) != entry.crc) {
+      break;  // Torn write: nothing after it can be trusted
+    }
+    configJournalSize += sizeof(entry);
+    if (entry.seq > configSeq) {
+      entry.user.username[sizeof(entry.user.username) - 1] = 0;
+      entry.user.key[sizeof(entry.user.key) - 1] = 0;
+      addUserRecord(entry.user);
+      configSeq = entry.seq;
+    }
+  }
+  file.close();
+}
+
+// Load the newest valid image plus its journal; import config.json on
+// first boot after an upgrade
+void loadConfig() {
+  // Try the newest slot first; fall back to the other if it is damaged
+  uint32_t seqs[2];
+  bool present[2];
+  for (int slot = 0; slot < 2; slot++) {
+    File file = SPIFFS.open(CONFIG_SLOTS[slot], "r");
+    PersistHeader header;
+    present[slot] = file && file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+                    header.magic == CONFIG_MAGIC;
+    seqs[slot] = present[slot] ? header.seq : 0;
+    if (file) {
+      file.close();
+    }
+  }
+  int newest = present[1] && (!present[0] || seqs[1] > seqs[0]) ? 1 : 0;
+
+  bool loaded = false;
+  for (int attempt = 0; attempt < 2 && !loaded; attempt++) {
+    int slot = attempt == 0 ? newest : 1 - newest;
+    uint32_t seq;
+    if (present[slot] && readConfigSlot(slot, seq)) {
+      configSeq = seq;
+      configSlot = slot;
+      loaded = true;
+    }
+  }
+
+  if (loaded) {
+    replayConfigJournal();
+    persistedUserCount = users.size();
+    if (configLoadedVersion != CONFIG_VERSION || configJournalSize > CONFIG_JOURNAL_MAX) {
+      commitConfig();
+    }
+    return;
+  }
+
+  loadLegacyConfig();
+  commitConfig();
+}
+
+// Request a save; the write happens once changes settle
 void saveConfig() {
-  DynamicJsonDocument doc(1024);
-  doc["apSSID"] = apSSID;
-  doc["apPassword"] = apPassword;
+  portENTER_CRITICAL(&configMux);
+  if (!configDirty) {
+    configFirstDirtyAt = millis();
+  }
+  configDirtyAt = millis();
+  configDirty = true;
+  portEXIT_CRITICAL(&configMux);
+}
+
+// Hand a new command key to loop(), which applies and saves it
+void queueCommandKey(const char *key) {
+  portENTER_CRITICAL(&configMux);
+  strlcpy(pendingCommandKey, key, sizeof(pendingCommandKey));
+  commandKeyPending = true;
+  portEXIT_CRITICAL(&configMux);
+}
+
+// Apply a posted command key at once; flush other changes after
+// CONFIG_DEBOUNCE_MS without changes, or CONFIG_MAX_DELAY_MS after the
+// first change of a continuous burst
+void configPersistTick() {
+  uint32_t now = millis();
+  portENTER_CRITICAL(&configMux);
+  bool keyChanged = commandKeyPending;
+  if (keyChanged) {
+    memcpy(config.commandKey, pendingCommandKey, sizeof(config.commandKey));
+    commandKeyPending = false;
+  }
+  bool due = configDirty &&
+             (now - configDirtyAt >= CONFIG_DEBOUNCE_MS || now - configFirstDirtyAt >= CONFIG_MAX_DELAY_MS);
+  if (due || keyChanged) {
+    configDirty = false;
+  }
+  portEXIT_CRITICAL(&configMux);
+  if (!keyChanged && !due) {
+    return;
+  }
+  // A new key, or a journal that may end in a torn entry after a failed
+  // write, needs a full image (which includes any users still pending)
+  bool written = keyChanged || configImageDue ? commitConfig() : appendConfigJournal();
+  if (!written && !configImageDue) {
+    Serial.println("Config write failed, retrying");
+  }
+  configImageDue = !written;
+  if (!written) {
+    saveConfig();
+  }
+}
+
+void printTelemetryJson(Print &out, int16_t value, int field) {
+  if (value == TELEMETRY_MISSING) {
+    out.print("null");
+  } else {
+    out.print((float)value / TELEMETRY_SCALES[field], TELEMETRY_SCALES[field] == 1 ? 0 : 1);
+  }
+}
+
+// Node id from a hex request parameter; nullptr when unknown
+TelemetryNode *requestNode(AsyncWebServerRequest *request, bool post) {
+  if (!request->hasParam("node", post)) {
+    return nullptr;
+  }
+  return lookupTelemetryNode(strtoul(request->getParam("node", post)->value().c_str(), nullptr, 16));
+}
+
+// POST /api/command?node=<hex id>&set=<relay>=<0|1>,... : queue relay changes
+void handleCommand(AsyncWebServerRequest *request) {
+  if (config.commandKey[0] == '\0') {
+    request->send(400, "application/json", "{\"message\":\"No command key set\"}");
+    return;
+  }
+  TelemetryNode *node = requestNode(request, true);
+  if (!node || !request->hasParam("set", true)) {
+    request->send(400, "application/json", "{\"message\":\"Unknown node or missing set\"}");
+    return;
+  }
+
+  // Validate every change before queueing any
+  String set = request->getParam("set", true)->value();
+  uint8_t relays[TELEMETRY_MAX_RELAYS];
+  bool states[TELEMETRY_MAX_RELAYS];
+  int count = 0;
+  for (int start = 0; start < (int)set.length() && count < TELEMETRY_MAX_RELAYS;) {
+    int end = set.indexOf(',', start);
+    if (end < 0) end = set.length();
+    String change = set.substring(start, end);
+    int equals = change.indexOf('=');
+    int relay = change.substring(0, equals).toInt();
+    if (equals <= 0 || relay < 0 || relay >= TELEMETRY_MAX_RELAYS) {
+      request->send(400, "application/json", "{\"message\":\"set must look like 0=1,3=0\"}");
+      return;
+    }
+    relays[count] = relay;
+    states[count++] = change.substring(equals + 1).toInt() != 0;
+    start = end + 1;
+  }
+  for (int c = 0; c < count; c++) {
+    queueCommand(node, relays[c], states[c]);
+  }
+  request->send(202, "application/json", "{\"message\":\"Command queued\"}");
+}
+
+// GET /api/command?node=<hex id> : progress of the node's latest command
+void handleCommandStatus(AsyncWebServerRequest *request) {
+  TelemetryNode *node = requestNode(request, false);
+  if (!node) {
+    request->send(400, "application/json", "{\"message\":\"Unknown node\"}");
+    return;
+  }
+  RelayCommand copy;
+  portENTER_CRITICAL(&commandMux);
+  memcpy(&copy, &node->command, sizeof(RelayCommand));
+  portEXIT_CRITICAL(&commandMux);
+
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->printf("{\"node\":\"%04X\",\"seq\":%u,\"status\":\"%s\",\"attempts\":%u,\"relays\":[",
+                   node->id, (unsigned)copy.seq, COMMAND_STATUS_NAMES[copy.status], copy.attempts);
+  for (int r = 0; r < copy.stateRelayCount; r++) {
+    response->print(r ? "," : "");
+    response->print((copy.stateRelays[r / 8] >> (r % 8)) & 1);
+  }
+  response->print("]}");
+  request->send(response);
+}
+
+// GET /api/nodes : newest report from every node
+void handleNodes(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  uint32_t now = millis();
+  int count = telemetryTable.count;
+  bool first = true;
+  response->print("{\"nodes\":[");
+  for (int i = 0; i < count; i++) {
+    const TelemetryNode *node = telemetryNodes[i];
+    if (!node->ackedValid[0]) {
+      continue;  // Heard, but nothing decoded yet
+    }
+    const TelemetryState &state = node->acked[0];
+    uint16_t last = newestTelemetrySlot(*node);
+    response->printf("%s{\"id\":\"%04X\",\"age\":%u,\"seq\":%u,\"rssi\":%d,\"snr\":%.2f,\"zones\":[",
+                     first ? "" : ",", node->id, (unsigned)((now - node->lastHeard) / 1000), node->ackedSeq[0],
+                     node->rssi[last], node->snr[last] / 4.0);
+    for (int z = 0; z < state.zoneCount; z++) {
+      response->print(z ? ",[" : "[");
+      for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+        if (f) response->print(',');
+        printTelemetryJson(*response, state.values[z][f], f);
+      }
+      response->print(']');
+    }
+    response->print("],\"relays\":[");
+    for (int r = 0; r < state.relayCount; r++) {
+      response->print(r ? "," : "");
+      response->print((state.relays[r / 8] >> (r % 8)) & 1);
+    }
+    response->print("],\"lowWater\":[");
+    bool firstZone = true;
+    for (int z = 0; z < 32; z++) {
+      if (node->lowWater & (1UL << z)) {
+        response->print(firstZone ? "" : ",");
+        response->print(z);
+        firstZone = false;
+      }
+    }
+    response->print("]}");
+    first = false;
+  }
+  response->print("]}");
+  request->send(response);
+}
+
+// GET /api/aggregate?field=&zone=&window= : min/max/avg of one column over
+// every node's reports from the last 'window' seconds
+void handleAggregate(AsyncWebServerRequest *request) {
+  String field = request->hasParam("field") ? request->getParam("field")->value() : "temperature";
+  int zone = request->hasParam("zone") ? request->getParam("zone")->value().toInt() : 0;
+  uint32_t window = request->hasParam("window") ? request->getParam("window")->value().toInt() : 600;
+
+  // Columns 0-3 are readings; RSSI and SNR come from their own columns
+  int column = -1;
+  for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+    if (field == TELEMETRY_FIELD_NAMES[f]) column = f;
+  }
+  if (field == "rssi") column = TELEMETRY_COLUMN_RSSI;
+  if (field == "snr") column = TELEMETRY_COLUMN_SNR;
+  if (column < 0 || zone < 0 || zone >= TELEMETRY_MAX_ZONES) {
+    request->send(400, "application/json", "{\"message\":\"Unknown field or zone\"}");
+    return;
+  }
+
+  TelemetryAggregate result;
+  aggregateTelemetry(telemetryTable, telemetryTable.count, column, zone, millis() / 1000, window, result);
+
+  // Scale back to display units
+  float scale = column < TELEMETRY_FIELDS ? TELEMETRY_SCALES[column] : column == TELEMETRY_COLUMN_RSSI ? 1 : 4;
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->printf("{\"field\":\"%s\",\"zone\":%d,\"window\":%u,\"nodes\":%u,\"samples\":%u",
+                   field.c_str(), zone, (unsigned)window, (unsigned)result.nodes, (unsigned)result.samples);
+  if (result.samples) {
+    response->printf(",\"min\":%.2f,\"max\":%.2f,\"avg\":%.2f}", result.min / scale, result.max / scale,
+                     (double)result.sum / result.samples / scale);
+  } else {
+    response->print(",\"min\":null,\"max\":null,\"avg\":null}");
+  }
+  request->send(response);
+}
+
+// Record one frame in the current capture mode
+void captureFrame(uint8_t flags, const uint8_t *data, size_t len, float rssi, float snr) {
+  if (captureMode == CAPTURE_OFF) {
+    return;
+  }
+  CaptureRecord record =
+      makeCaptureRecord(flags, millis(), (uint32_t)(LORA_FREQUENCY * 1000), LORA_SF, rssi, snr, len);
+
+  if (captureMode == CAPTURE_SERIAL) {
+    char hex[CAPTURE_HEX_MAX];
+    captureHex(record, data, hex);
+    Serial.print(CAPTURE_LINE_PREFIX);
+    Serial.println(hex);
+  } else {
+    if (captureBytes + sizeof(record) + record.len > CAPTURE_MAX_BYTES) {
+      Serial.println("Capture full");
+      setCaptureMode(CAPTURE_OFF);
+      return;
+    }
+    captureFile.write((const uint8_t *)&record, sizeof(record));
+    captureFile.write(data, record.len);
+    captureBytes += sizeof(record) + record.len;
+  }
+  captureFrames++;
+}
+
+// An upload is active until its last chunk, or until it goes idle
+bool captureUploadActive() {
+  return captureUploading && millis() - captureUploadAt < CAPTURE_UPLOAD_IDLE_MS;
+}
+
+// Switch capture mode; entering flash mode starts a new capture file
+void setCaptureMode(CaptureMode mode) {
+  if (mode == CAPTURE_FLASH && (replay.active || captureUploadActive())) {
+    Serial.println("Capture file busy");
+    return;
+  }
+  if (captureMode == CAPTURE_FLASH) {
+    captureFile.close();
+  }
+  if (mode == CAPTURE_FLASH) {
+    captureFile = SPIFFS.open(CAPTURE_FILE, "w");
+    if (!captureFile) {
+      Serial.println("Cannot create capture file");
+      mode = CAPTURE_OFF;
+    }
+  }
+  if (mode != CAPTURE_OFF && captureMode != mode) {
+    captureFrames = 0;
+    captureBytes = 0;
+  }
+  captureMode = mode;
+  Serial.printf("Capture %s\n", CAPTURE_MODE_NAMES[mode]);
+}
+
+// Apply mode changes and replay starts posted by the web task, and bound
+// what a power cut can lose from a flash capture
+void captureTick() {
+  if (captureRequest >= 0) {
+    setCaptureMode((CaptureMode)captureRequest);
+    captureRequest = -1;
+  }
+  if (replayRequested) {
+    if (!startReplay(replayRequestSpeed)) {
+      Serial.println("Nothing to replay");
+    }
+    replayRequested = false;
+  }
+  if (captureMode == CAPTURE_FLASH && millis() - captureFlushedAt > CAPTURE_FLUSH_MS) {
+    captureFile.flush();
+    captureFlushedAt = millis();
+  }
+}
+
+// Start replaying CAPTURE_FILE; false when there is nothing to replay
+bool startReplay(uint32_t speed) {
+  if (replay.active || captureMode == CAPTURE_FLASH || captureUploadActive() || !SPIFFS.exists(CAPTURE_FILE)) {
+    return false;
+  }
+  replay.file = SPIFFS.open(CAPTURE_FILE, "r");
+  if (!replay.file) {
+    return false;
+  }
+  startCaptureReplay(replay.capture, speed, millis());
+  replay.pipelineUs = 0;
+  replay.elapsedMs = 0;
+  replay.active = true;  // Last, so the status handler never sees stale fields
+  Serial.printf("Replaying %s at speed %u\n", CAPTURE_FILE, (unsigned)speed);
+  return true;
+}
+
+// Feed the frames that are due to the receive pipeline
+void replayTick() {
+  if (!replay.active) {
+    return;
+  }
+  bool more = replayCaptureFrames(replay.capture, millis(), REPLAY_BATCH, [](CaptureRecord &record, uint8_t *payload) {
+    uint32_t startedUs = micros();
+    handlePacket(payload, record.len, record.rssi, record.snr / 4.0);
+    replay.pipelineUs += micros() - startedUs;
+  });
+  if (!more) {
+    replay.file.close();
+    replay.active = false;
+    replay.elapsedMs = millis() - replay.capture.startedAt;
+    Serial.printf("Replay done: %u frames in %u ms, %u us in the pipeline\n", (unsigned)replay.capture.frames,
+                  (unsigned)replay.elapsedMs, (unsigned)replay.pipelineUs);
+  }
+}
+
+// GET /api/capture : mode and size of the current capture
+void handleCaptureStatus(AsyncWebServerRequest *request) {
+  char json[96];
+  snprintf(json, sizeof(json), "{\"mode\":\"%s\",\"frames\":%u,\"bytes\":%u}", CAPTURE_MODE_NAMES[captureMode],
+           (unsigned)captureFrames, (unsigned)captureBytes);
+  request->send(200, "application/json", json);
+}
+
+// POST /api/capture?mode=off|flash|serial : applied by loop() on its next pass
+void handleCaptureMode(AsyncWebServerRequest *request) {
+  String mode = request->hasParam("mode", true) ? request->getParam("mode", true)->value() : "";
+  for (int m = CAPTURE_OFF; m <= CAPTURE_SERIAL; m++) {
+    if (mode == CAPTURE_MODE_NAMES[m]) {
+      if (m == CAPTURE_FLASH && (replay.active || replayRequested || captureUploadActive())) {
+        request->send(409, "text/plain", "Replay or upload running");
+        return;
+      }
+      captureRequest = m;
+      request->send(202, "application/json", "{\"message\":\"Capture mode change queued\"}");
+      return;
+    }
+  }
+  request->send(400, "text/plain", "mode must be off, flash or serial");
+}
+
+// GET /capture.bin : during a flash capture, the frames up to the last
+// periodic flush
+void handleCaptureDownload(AsyncWebServerRequest *request) {
+  if (!SPIFFS.exists(CAPTURE_FILE)) {
+    request->send(404, "text/plain", "No capture");
+    return;
+  }
+  request->send(SPIFFS, CAPTURE_FILE, "application/octet-stream");
+}
+
+// POST /capture.bin (application/octet-stream) : replace the capture
+void handleCaptureUploadBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+  if (index == 0) {
+    if (captureMode == CAPTURE_FLASH || captureRequest == CAPTURE_FLASH || replay.active || replayRequested ||
+        captureUploadActive() || total > CAPTURE_MAX_BYTES) {
+      return;
+    }
+    captureUploading = true;
+    captureUploadAt = millis();
+    captureUpload = SPIFFS.open(CAPTURE_FILE, "w");
+    request->_tempObject = malloc(1);  // Marks the upload as accepted
+  }
+  if (request->_tempObject && captureUpload) {
+    captureUploadAt = millis();
+    captureUpload.write(data, len);
+    if (index + len == total) {
+      captureUpload.close();
+      captureUploading = false;
+    }
+  }
+}
+
+void handleCaptureUpload(AsyncWebServerRequest *request) {
+  if (!request->_tempObject) {
+    request->send(409, "text/plain", "Capture or replay running, or file too large");
+    return;
+  }
+  request->send(200, "text/plain", "Capture uploaded");
+}
+
+// GET /api/replay : progress or result of the last replay
+void handleReplayStatus(AsyncWebServerRequest *request) {
+  uint32_t elapsed = replay.active ? millis() - replay.capture.startedAt : replay.elapsedMs;
+  char json[160];
+  snprintf(json, sizeof(json), "{\"active\":%s,\"speed\":%u,\"frames\":%u,\"elapsedMs\":%u,\"pipelineUs\":%u}",
+           replay.active ? "true" : "false", (unsigned)replay.capture.speed, (unsigned)replay.capture.frames, (unsigned)elapsed,
+           (unsigned)replay.pipelineUs);
+  request->send(200, "application/json", json);
+}
+
+// POST /api/replay?speed= : 1 replays at the recorded pace, 0 back to back.
+// loop() starts it on its next pass.
+void handleReplayStart(AsyncWebServerRequest *request) {
+  uint32_t speed = request->hasParam("speed", true) ? request->getParam("speed", true)->value().toInt() : 1;
+  if (replay.active || replayRequested || captureMode == CAPTURE_FLASH || captureUploadActive() ||
+      !SPIFFS.exists(CAPTURE_FILE)) {
+    request->send(409, "text/plain", "No capture, or capture, upload or replay running");
+    return;
+  }
+  replayRequestSpeed = speed;
+  replayRequested = true;
+  request->send(202, "application/json", "{\"message\":\"Replay queued\"}");
+}
+
+// Every user's name and recipient id, as JSON. Keys are left out: a key
+// is its user's session secret.
+String usersJson() {
+  size_t count = usersPublished;
+  DynamicJsonDocument doc(256 + count * 96);
   JsonArray usersArray = doc.createNestedArray("users");
-  for (const User& user : users) {
+  for (size_t i = 0; i < count; i++) {
     JsonObject userObj = usersArray.createNestedObject();
-    userObj["username"] = user.username;
-    userObj["key"] = user.key;
+    userObj["username"] = users[i].username;
+    if (i < USER_MAX) {
+      char id[5];
+      snprintf(id, sizeof(id), "%04x", sessionTable.sessions[i].id);
+      userObj["id"] = id;
+    }
   }
-  File file = SPIFFS.open(configFilePath, "w");
+  String response;
+  serializeJson(doc, response);
+  return response;
+}
+
+const PerfCase PERF_CASES[] = {
+  {"display", []() { updateDisplay("Received", "The quick brown fox jumps"); }},
+  {"status_line", []() { updateStatusLine(); }},
+  {"users_json", []() { usersJson(); }},
+  {"telemetry_key", []() {
+    // A 4-zone, 8-relay KEY frame; decoding checks lengths, not the CRC
+    static uint8_t frame[TELEMETRY_HEADER + 2 + 4 * TELEMETRY_FIELDS * 2 + 1 + 1] = {TELEMETRY_MARK | FRAME_KEY};
+    static TelemetryState state;
+    frame[TELEMETRY_HEADER] = 4;
+    frame[TELEMETRY_HEADER + 1] = 8;
+    perfSinkValue = decodeTelemetryKey(frame, sizeof(frame), state);
+  }},
+  {"session_encrypt", []() {
+    if (users.empty()) {
+      return;
+    }
+    static char text[64];
+    static uint8_t frame[USER_FRAME_MAX];
+    perfSinkValue = sealUserFrameTo(sessionTable, SESSION_CRYPTO, 0, 1, text, sizeof(text), frame);
+  }},
+  {"command_hmac", []() {
+    static uint8_t frame[16];
+    static uint8_t tag[COMMAND_TAG_LEN];
+    commandTag(frame, sizeof(frame), tag);
+  }},
+  {"config_records", []() {
+    // The user records and CRC of a configuration image, without the write
+    UserRecord record;
+    uint32_t crc = crc32((const uint8_t *)&config, sizeof(ConfigRecord));
+    for (size_t i = 0; i < users.size(); i++) {
+      toUserRecord(users[i], record);
+      crc ^= crc32((const uint8_t *)&record, sizeof(record));
+    }
+    perfSinkValue = crc;
+  }},
+};
+const int NUM_PERF_CASES = sizeof(PERF_CASES) / sizeof(PERF_CASES[0]);
+static_assert(NUM_PERF_CASES <= PERF_MAX_CASES, "Raise PERF_MAX_CASES");
+
+// "/perf" runs every case against the saved baseline; "/perf save" also
+// makes this run the baseline
+void runPerf(bool save) {
+  PerfResult baseline[PERF_MAX_CASES] = {};
+  int baselineCount = 0;
+  File file = SPIFFS.open(PERF_BASELINE_PATH, "r");
   if (file) {
-    serializeJson(doc, file);
+    baselineCount = file.read((uint8_t *)baseline, sizeof(baseline)) / sizeof(PerfResult);
     file.close();
   }
+  if (users.empty()) {
+    Serial.println("session_encrypt skipped: no users");
+  }
+
+  PerfResult results[PERF_MAX_CASES] = {};
+  Serial.printf("%-16s %12s %10s %12s %8s\n", "case", "ns/op", "heap B/op", "baseline", "change");
+  for (int i = 0; i < NUM_PERF_CASES; i++) {
+    const PerfCase &perfCase = PERF_CASES[i];
+    perfCase.run();  // Warm-up: first-call allocations are not per message
+    uint32_t iterations = 0;
+    uint32_t heapBefore = ESP.getFreeHeap();
+    uint32_t startedUs = micros();
+    do {
+      perfCase.run();
+      iterations++;
+    } while (micros() - startedUs < PERF_CASE_MS * 1000UL);
+    uint32_t elapsedUs = micros() - startedUs;
+
+    PerfResult &result = results[i];
+    strlcpy(result.name, perfCase.name, sizeof(result.name));
+    result.nsPerOp = (uint64_t)elapsedUs * 1000 / iterations;
+    result.heapPerOp = ((int32_t)heapBefore - (int32_t)ESP.getFreeHeap()) / (int32_t)iterations;
+
+    const PerfResult *base = nullptr;
+    for (int b = 0; b < baselineCount && !base; b++) {
+      if (strncmp(baseline[b].name, result.name, PERF_NAME_LEN) == 0) {
+        base = &baseline[b];
+      }
+    }
+    Serial.printf("%-16s %12u %10d", result.name, (unsigned)result.nsPerOp, (int)result.heapPerOp);
+    if (base && base->nsPerOp) {
+      float change = 100.0f * ((float)result.nsPerOp - base->nsPerOp) / base->nsPerOp;
+      Serial.printf(" %12u %+7.1f%%%s\n", (unsigned)base->nsPerOp, change,
+                    change > PERF_REGRESSION_PCT ? " REGRESSION" : "");
+    } else {
+      Serial.println();
+    }
+    yield();
+  }
+  updateDisplay("Perf", "Done");
+
+  if (save) {
+    file = SPIFFS.open(PERF_BASELINE_PATH, "w");
+    if (file) {
+      file.write((const uint8_t *)results, NUM_PERF_CASES * sizeof(PerfResult));
+      file.close();
+      Serial.println("Baseline saved");
+    } else {
+      Serial.println("Failed to save baseline");
+    }
+  }
+}
+
+// Prometheus text exposition of every counter, histogram and heap gauge
+void printMetrics(Print &out) {
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    out.printf("# TYPE %s counter\n%s %u\n", COUNTER_NAMES[i], COUNTER_NAMES[i],
+               (unsigned)counters[i].load(std::memory_order_relaxed));
+  }
+  for (int i = 0; i < HIST_COUNT; i++) {
+    const char *name = HISTOGRAM_NAMES[i];
+    out.printf("# TYPE %s histogram\n", name);
+    uint32_t total = 0;
+    for (int b = 0; b <= METRIC_BUCKETS; b++) {
+      total += histograms[i].buckets[b].load(std::memory_order_relaxed);
+      if (b < METRIC_BUCKETS) {
+        out.printf("%s_bucket{le=\"%u\"} %u\n", name, (unsigned)((1UL << (2 * b + 2)) - 1), (unsigned)total);
+      } else {
+        out.printf("%s_bucket{le=\"+Inf\"} %u\n", name, (unsigned)total);
+      }
+    }
+    out.printf("%s_sum %u\n%s_count %u\n", name, (unsigned)histograms[i].sum.load(std::memory_order_relaxed),
+               name, (unsigned)total);
+  }
+  out.printf("# TYPE heap_free_bytes gauge\nheap_free_bytes %u\n", (unsigned)ESP.getFreeHeap());
+  out.printf("# TYPE heap_min_free_bytes gauge\nheap_min_free_bytes %u\n", (unsigned)ESP.getMinFreeHeap());
+  out.printf("# TYPE http_in_flight gauge\nhttp_in_flight %u\n", (unsigned)admission.inFlight);
+  out.printf("# TYPE uptime_seconds gauge\nuptime_seconds %u\n", (unsigned)(millis() / 1000));
+}
+
+// GET /metrics
+void handleMetrics(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+  printMetrics(*response);
+  request->send(response);
+}
+
+// Wrap a handler so its run time feeds the HTTP latency histogram
+ArRequestHandlerFunction timed(ArRequestHandlerFunction handler) {
+  return [handler](AsyncWebServerRequest *request) {
+    uint32_t startedUs = micros();
+    handler(request);
+    observeMetric(HIST_HTTP, micros() - startedUs);
+  };
 }
 
 void setupWebServer() {
+  // Admission runs before every route
+  server.addHandler(new AdmissionHandler(admission, false, [](int result) {
+    countMetric((CounterId)(COUNTER_HTTP_REJECTED_HEAP + result - ADMIT_HEAP), 1);
+  }));
+
   // Serve static files from SPIFFS
   server.serveStatic("/", SPIFFS, "/www/").setDefaultFile("index.html");
 
   // API Endpoints
-  server.on("/api/send", HTTP_POST, [](AsyncWebServerRequest *request){
-    if (request->hasParam("message", true)) {
-      String message = request->getParam("message", true)->value();
-      sendMessage(message);
-      request->send(200, "text/plain", "Message sent");
+  server.on("/api/send", HTTP_POST, timed([](AsyncWebServerRequest *request){
+    if (request->hasParam("message", true) && request->hasParam("user", true)) {
+      int user = findUser(request->getParam("user", true)->value());
+      if (user < 0) {
+        request->send(404, "text/plain", "Unknown user");
+      } else if (!queueUserMessage(user, request->getParam("message", true)->value())) {
+        request->send(503, "text/plain", "Outbox full");
+      } else {
+        request->send(200, "text/plain", "Message queued");
+      }
+    } else if (request->hasParam("message", true)) {
+      if (!queueUserMessage(-1, request->getParam("message", true)->value())) {
+        request->send(503, "text/plain", "Outbox full");
+      } else {
+        request->send(200, "text/plain", replay.active ? "Message queued until the replay ends" : "Message queued");
+      }
     } else {
       request->send(400, "text/plain", "Missing message parameter");
     }
-  });
+  }));
 
-  server.on("/api/users", HTTP_GET, [](AsyncWebServerRequest *request){
-    DynamicJsonDocument doc(1024);
-    JsonArray usersArray = doc.createNestedArray("users");
-    for (const User& user : users) {
-      JsonObject userObj = usersArray.createNestedObject();
-      userObj["username"] = user.username;
-      userObj["key"] = user.key;
-    }
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
-  });
+  server.on("/api/users", HTTP_GET, timed([](AsyncWebServerRequest *request){
+    request->send(200, "application/json", usersJson());
+  }));
 
-  server.on("/api/addUser", HTTP_POST, [](AsyncWebServerRequest *request){
-    if (request->hasParam("username", true) && request->hasParam("key", true)) {
-      User user;
-      user.username = request->getParam("username", true)->value();
-      user.key = request->getParam("key", true)->value();
-      users.push_back(user);
-      saveConfig();
-      request->send(200, "text/plain", "User added");
-    } else {
+  server.on("/api/addUser", HTTP_POST, timed([](AsyncWebServerRequest *request){
+    if (usersPublished + pendingUserCount >= USER_MAX) {
+      request->send(409, "text/plain", "User limit reached");
+    } else if (!request->hasParam("username", true) || !request->hasParam("key", true)) {
       request->send(400, "text/plain", "Missing username or key parameter");
+    } else if (!queueUser(request->getParam("username", true)->value(), request->getParam("key", true)->value())) {
+      request->send(503, "text/plain", "Busy, try again");
+    } else {
+      request->send(200, "text/plain", "User added");
     }
-  });
+  }));
+
+  server.on("/api/nodes", HTTP_GET, timed(handleNodes));
+  server.on("/api/command", HTTP_POST, timed(handleCommand));
+  server.on("/api/command", HTTP_GET, timed(handleCommandStatus));
+
+  server.on("/api/commandKey", HTTP_POST, timed([](AsyncWebServerRequest *request){
+    if (!request->hasParam("key", true)) {
+      request->send(400, "text/plain", "Missing key parameter");
+      return;
+    }
+    queueCommandKey(request->getParam("key", true)->value().c_str());
+    request->send(200, "text/plain", "Command key saved");
+  }));
+  server.on("/api/aggregate", HTTP_GET, timed(handleAggregate));
+  server.on("/metrics", HTTP_GET, handleMetrics);
+  server.on("/api/boot", HTTP_GET, timed([](AsyncWebServerRequest *request){
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    printBootReport(*response);
+    request->send(response);
+  }));
+  server.on("/api/capture", HTTP_GET, timed(handleCaptureStatus));
+  server.on("/api/capture", HTTP_POST, timed(handleCaptureMode));
+  server.on("/capture.bin", HTTP_GET, handleCaptureDownload);
+  server.on("/capture.bin", HTTP_POST, handleCaptureUpload, nullptr, handleCaptureUploadBody);
+  server.on("/api/replay", HTTP_GET, timed(handleReplayStatus));
+  server.on("/api/replay", HTTP_POST, timed(handleReplayStart));
 
   // Handle 404
   server.onNotFound([](AsyncWebServerRequest *request){
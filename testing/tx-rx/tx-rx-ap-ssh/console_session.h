@@ -0,0 +1,188 @@
+// Remote console for tx-rx-ap-ssh.h
+//
+// Plain C++ with no Arduino dependency; tests/ serves it over POSIX
+// sockets on the host. Radio traffic is appended once to a ConsoleRing,
+// and every session reads that ring through its own cursor, so a line
+// costs one copy however many sessions watch. A session that falls a full
+// ring behind skips ahead to the oldest entry still held. Sockets, the
+// session table and locking stay with the sketch; the send side takes any
+// client with AsyncClient's space(), add() and send().
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CONSOLE_LINE_MAX 240
+#define CONSOLE_RING_SIZE 4096
+#define CONSOLE_MAX_FAILURES 3
+#define CONSOLE_STALL_MS 30000  // Drop a session that accepts nothing for this long
+
+#define CONSOLE_BANNER "LoRa console\r\nlogin: "
+#define CONSOLE_HELP "Logged in. Type a message to send, 'C <freq> <key>' to switch, 'quit' to leave.\r\n"
+
+// Entries are a uint16 length followed by the text. Positions count bytes
+// written since boot; 'tail' is the oldest entry still in the ring.
+struct ConsoleRing {
+  uint8_t data[CONSOLE_RING_SIZE];
+  uint32_t head;
+  uint32_t tail;
+  uint32_t entries;    // Entries written since boot
+  uint32_t tailEntry;  // Entry number at 'tail'
+};
+
+inline uint16_t consoleEntryLength(const ConsoleRing &ring, uint32_t at) {
+  return ring.data[at % CONSOLE_RING_SIZE] | (ring.data[(at + 1) % CONSOLE_RING_SIZE] << 8);
+}
+
+// Append one line, dropping the oldest entries to fit
+inline void consolePublish(ConsoleRing &ring, const char *text, size_t length) {
+  uint16_t len = length < CONSOLE_LINE_MAX ? length : CONSOLE_LINE_MAX;
+  uint32_t size = 2 + len;
+  while (ring.head + size - ring.tail > CONSOLE_RING_SIZE) {
+    ring.tail += 2 + consoleEntryLength(ring, ring.tail);
+    ring.tailEntry++;
+  }
+  uint8_t header[2] = {(uint8_t)(len & 0xFF), (uint8_t)(len >> 8)};
+  const uint8_t *parts[2] = {header, (const uint8_t *)text};
+  size_t sizes[2] = {2, len};
+  for (int p = 0; p < 2; p++) {
+    for (size_t i = 0; i < sizes[p];) {
+      size_t at = ring.head % CONSOLE_RING_SIZE;
+      size_t chunk = sizes[p] - i < CONSOLE_RING_SIZE - at ? sizes[p] - i : CONSOLE_RING_SIZE - at;
+      memcpy(ring.data + at, parts[p] + i, chunk);
+      ring.head += chunk;
+      i += chunk;
+    }
+  }
+  ring.entries++;
+}
+
+// Sessions
+
+enum ConsoleState { CONSOLE_LOGIN, CONSOLE_PASSWORD, CONSOLE_READY };
+
+struct ConsoleSession {
+  uint8_t state;
+  uint8_t failures;
+  char user[32];
+  char line[CONSOLE_LINE_MAX + 1];
+  uint16_t lineLength;
+  uint32_t cursor;         // Ring position of the next entry to send
+  uint32_t entry;          // Entry number at cursor
+  uint32_t skipped;        // Entries lost to overrun, reported on catch-up
+  uint32_t lastProgress;
+};
+
+// True when 'c' ends a non-empty line, which is then in session.line.
+// Control characters are dropped, and so is anything past CONSOLE_LINE_MAX.
+inline bool consoleFeed(ConsoleSession &session, char c) {
+  if (c == '\n' || c == '\r') {
+    if (session.lineLength == 0) {
+      return false;
+    }
+    session.line[session.lineLength] = '\0';
+    session.lineLength = 0;
+    return true;
+  }
+  if (session.lineLength < CONSOLE_LINE_MAX && (uint8_t)c >= 0x20) {
+    session.line[session.lineLength++] = c;
+  }
+  return false;
+}
+
+enum ConsoleAction {
+  CONSOLE_REPLY,  // Write 'reply' and carry on
+  CONSOLE_RUN,    // A command for the radio's owner
+  CONSOLE_CLOSE,  // Write 'reply', if any, and close
+};
+
+// Act on a finished line: log in, or hand it on. A session sees only the
+// traffic published after it logged in.
+inline ConsoleAction consoleLine(ConsoleSession &session, const ConsoleRing &ring, uint32_t now,
+                                 const char *user, const char *password, const char *&reply) {
+  reply = nullptr;
+  switch (session.state) {
+    case CONSOLE_LOGIN: {
+      size_t len = strnlen(session.line, sizeof(session.user) - 1);
+      memcpy(session.user, session.line, len);
+      session.user[len] = '\0';
+      session.state = CONSOLE_PASSWORD;
+      reply = "password: ";
+      return CONSOLE_REPLY;
+    }
+    case CONSOLE_PASSWORD:
+      if (strcmp(session.user, user) == 0 && strcmp(session.line, password) == 0) {
+        session.state = CONSOLE_READY;
+        session.cursor = ring.head;
+        session.entry = ring.entries;
+        session.lastProgress = now;
+        reply = CONSOLE_HELP;
+        return CONSOLE_REPLY;
+      }
+      if (++session.failures >= CONSOLE_MAX_FAILURES) {
+        return CONSOLE_CLOSE;
+      }
+      session.state = CONSOLE_LOGIN;
+      reply = "Login incorrect\r\nlogin: ";
+      return CONSOLE_REPLY;
+    default:
+      return strcmp(session.line, "quit") == 0 ? CONSOLE_CLOSE : CONSOLE_RUN;
+  }
+}
+
+// True if consoleFlush() has something to do for a logged-in session
+// whose client can take 'space' bytes now
+inline bool consolePending(const ConsoleSession &session, const ConsoleRing &ring, uint32_t now, uint32_t stallMs,
+                           size_t space) {
+  if (session.state != CONSOLE_READY || session.cursor >= ring.head) {
+    return false;
+  }
+  if (session.cursor < ring.tail || session.skipped > 0 || now - session.lastProgress > stallMs) {
+    return true;
+  }
+  return space >= (size_t)consoleEntryLength(ring, session.cursor) + 2;
+}
+
+// Send a logged-in session what it has not seen yet, as far as its
+// client's window allows, straight from the ring. Returns false when the
+// session has had lines waiting and taken none for 'stallMs', and should
+// be closed.
+template <typename Client>
+bool consoleFlush(ConsoleSession &session, const ConsoleRing &ring, Client &client, uint32_t now,
+                  uint32_t stallMs) {
+  if (session.state != CONSOLE_READY) {
+    return true;
+  }
+  if (session.cursor < ring.tail) {
+    // Overrun: everything up to the oldest held entry is gone
+    session.skipped += ring.tailEntry - session.entry;
+    session.cursor = ring.tail;
+    session.entry = ring.tailEntry;
+  }
+  if (session.skipped > 0 && client.space() > 32) {
+    char notice[32];
+    int len = snprintf(notice, sizeof(notice), "[%u lines skipped]\r\n", (unsigned)session.skipped);
+    client.add(notice, len);
+    session.skipped = 0;
+  }
+  while (session.cursor < ring.head) {
+    uint16_t len = consoleEntryLength(ring, session.cursor);
+    if (client.space() < (size_t)len + 2) {
+      break;  // Window full; continue next pass
+    }
+    size_t start = (session.cursor + 2) % CONSOLE_RING_SIZE;
+    size_t first = len < CONSOLE_RING_SIZE - start ? len : CONSOLE_RING_SIZE - start;
+    client.add((const char *)ring.data + start, first);
+    if (first < len) {
+      client.add((const char *)ring.data, len - first);
+    }
+    client.add("\r\n", 2);
+    session.cursor += 2 + len;
+    session.entry++;
+    session.lastProgress = now;
+  }
+  client.send();
+  return session.cursor >= ring.head || now - session.lastProgress <= stallMs;
+}
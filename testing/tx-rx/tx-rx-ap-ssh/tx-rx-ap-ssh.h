@@ -6,6 +6,11 @@
 #include <ESPAsyncWebServer.h>
 #include <AsyncTCP.h>
 #include <heltec.h>
+#include <atomic>
+#include "../message_text.h"
+#include "console_session.h"
+#include "../../../common/admission.h"
+#include "../../../common/trace.h"
 
 // LoRa Radio Configuration
 SX1276 radio = new Module(18, 26, 14, 35);  // NSS, DIO0, RST, DIO1
@@ -57,8 +62,67 @@ const int SSH_PORT = 22;
 // Web Server
 AsyncWebServer server(80);
 
+// Admission Control
+//
+// See admission.h. No route takes a body. Rejections are counted per
+// reason and shown on the status page.
+const AdmissionLimits ADMISSION_LIMITS = {
+  24576,  // heapReserve
+  2,      // maxInFlight
+  0,      // maxUpgrades
+  2,      // ratePerS
+  5,      // burst
+  4,      // clients
+  [](const char *) -> size_t { return 256; },
+  nullptr,  // No WebSocket
+};
+Admission admission = {&ADMISSION_LIMITS, {}, 0, {}};
+
+// Remote Console
+//
+// A password-protected line console on SSH_PORT (plain TCP, e.g. `nc`).
+// Each line is sent over LoRa, or `C <freq> <key>` switches channel, as
+// on Serial. Traffic goes once into consoleRing, which every session reads
+// through its own cursor; see console_session.h.
+#define CONSOLE_MAX_SESSIONS 4
+#define CONSOLE_QUEUE 8
+
+// A TCP connection and its session
+struct ConsoleSlot {
+  AsyncClient *client;     // nullptr when the slot is free
+  volatile bool closed;    // Set by the TCP task; loop() frees the slot
+  ConsoleSession session;
+};
+
+ConsoleRing consoleRing;
+
+// Lines from logged-in sessions, run by loop() so the radio has one owner
+struct ConsoleCommand {
+  int8_t session;
+  char line[CONSOLE_LINE_MAX + 1];
+};
+
+AsyncServer consoleServer(SSH_PORT);
+ConsoleSlot consoleSlots[CONSOLE_MAX_SESSIONS];
+ConsoleCommand consoleQueue[CONSOLE_QUEUE];
+uint8_t consoleQueueHead = 0;
+uint8_t consoleQueueCount = 0;
+portMUX_TYPE consoleMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Tracing
+//
+// See trace.h. The radio, crypto, display, console and web paths are
+// slices; receiveMessage and consoleTick record one only for a pass that
+// got a frame or had work to do.
+#if TRACE_ENABLED
+enum TraceName { TRACE_SEND, TRACE_RECEIVE, TRACE_ENCRYPT, TRACE_DECRYPT, TRACE_DISPLAY, TRACE_CONSOLE, TRACE_HTTP };
+const char* TRACE_NAMES[] = {"sendMessage", "receiveMessage", "encryptMessage", "decryptMessage",
+                             "updateDisplay", "consoleTick", "http"};
+#endif
+
 // Helper Functions
 void updateDisplay(String line1, String line2) {
+  TRACE_SCOPE(TRACE_DISPLAY);
   Heltec.display->clear();
   Heltec.display->drawString(0, 0, line1);
   Heltec.display->drawString(0, 16, line2);
@@ -81,33 +145,32 @@ void initializeLoRa() {
   }
 }
 
-void encryptMessage(String &message) {
-  byte plaintext[16] = {0};
-  byte ciphertext[16] = {0};
-  int len = message.length() > 16 ? 16 : message.length();
-  memcpy(plaintext, message.c_str(), len);
+void aesEncryptBlock(const uint8_t *in, uint8_t *out, const uint8_t *key) {
+  aes.do_aes_encrypt((byte *)in, MESSAGE_BLOCK, out, (byte *)key, 128);
+}
 
-  aes.do_aes_encrypt(plaintext, 16, ciphertext, currentKey, 128);
+void aesDecryptBlock(const uint8_t *in, uint8_t *out, const uint8_t *key) {
+  aes.do_aes_decrypt((byte *)in, MESSAGE_BLOCK, out, (byte *)key, 128);
+}
 
-  message = "";
-  for (int i = 0; i < 16; i++) {
-    message += String(ciphertext[i], HEX);
-  }
+void encryptMessage(String &message) {
+  TRACE_SCOPE(TRACE_ENCRYPT);
+  char hex[MESSAGE_HEX_LEN + 1];
+  encryptMessageHex(message.c_str(), message.length(), currentKey, aesEncryptBlock, hex);
+  message = hex;
 }
 
+// Leaves 'message' empty unless it is one encrypted block
 void decryptMessage(String &message) {
-  byte ciphertext[16] = {0};
-  byte plaintext[16] = {0};
-  for (int i = 0; i < 16; i++) {
-    ciphertext[i] = (byte)strtol(message.substring(i * 2, i * 2 + 2).c_str(), NULL, 16);
-  }
-
-  aes.do_aes_decrypt(ciphertext, 16, plaintext, currentKey, 128);
-
-  message = String((char *)plaintext);
+  TRACE_SCOPE(TRACE_DECRYPT);
+  char text[MESSAGE_BLOCK + 1];
+  int len = decryptMessageHex(message.c_str(), message.length(), currentKey, aesDecryptBlock, text);
+  message = len < 0 ? "" : text;
 }
 
 void sendMessage(String message) {
+  TRACE_SCOPE(TRACE_SEND);
+  consolePublish("TX ch" + String(currentFrequencyChannel + 1) + "-" + String(currentKeyIndex + 1) + ": " + message);
   encryptMessage(message);  // Encrypt before sending
   int state = radio.transmit(message);
 
@@ -127,7 +190,10 @@ void receiveMessage() {
   int state = radio.receive(receivedStr, 0);  // Non-blocking receive
 
   if (state == RADIOLIB_ERR_NONE) {
+    TRACE_SCOPE(TRACE_RECEIVE);  // Only passes that got a frame
     decryptMessage(receivedStr);  // Decrypt after receiving
+    consolePublish("RX ch" + String(currentFrequencyChannel + 1) + "-" + String(currentKeyIndex + 1) +
+                   " RSSI " + String(radio.getRSSI()) + ": " + receivedStr);
     updateDisplay("Received", receivedStr);
     Serial.print("Received: ");
     Serial.println(receivedStr);
@@ -143,18 +209,176 @@ void setupWiFiAP() {
   updateDisplay("WiFi AP", "IP: " + WiFi.softAPIP().toString());
 }
 
+void consolePublish(const String &text) {
+  consolePublish(consoleRing, text.c_str(), text.length());
+}
+
+void consoleWrite(AsyncClient *client, const char *text) {
+  if (client->space() >= strlen(text)) {
+    client->write(text);
+  }
+}
+
+// Runs on the TCP task: log in, or queue the line for loop()
+void consoleLine(int index) {
+  ConsoleSlot &slot = consoleSlots[index];
+  const char *reply;
+  ConsoleAction action = consoleLine(slot.session, consoleRing, millis(), SSH_USER, SSH_PASSWORD, reply);
+  if (reply) {
+    consoleWrite(slot.client, reply);
+  }
+  if (action == CONSOLE_CLOSE) {
+    slot.client->close();
+  } else if (action == CONSOLE_RUN) {
+    portENTER_CRITICAL(&consoleMux);
+    if (consoleQueueCount < CONSOLE_QUEUE) {
+      ConsoleCommand &command = consoleQueue[(consoleQueueHead + consoleQueueCount++) % CONSOLE_QUEUE];
+      command.session = index;
+      strlcpy(command.line, slot.session.line, sizeof(command.line));
+    }
+    portEXIT_CRITICAL(&consoleMux);
+  }
+}
+
+void onConsoleData(void *arg, AsyncClient *client, void *data, size_t len) {
+  int index = (int)(intptr_t)arg;
+  const char *bytes = (const char *)data;
+  for (size_t i = 0; i < len; i++) {
+    if (consoleFeed(consoleSlots[index].session, bytes[i])) {
+      consoleLine(index);
+    }
+  }
+}
+
+void onConsoleDisconnect(void *arg, AsyncClient *client) {
+  consoleSlots[(int)(intptr_t)arg].closed = true;
+}
+
+void onConsoleClient(void *arg, AsyncClient *client) {
+  int index = -1;
+  portENTER_CRITICAL(&consoleMux);
+  for (int i = 0; i < CONSOLE_MAX_SESSIONS && index < 0; i++) {
+    if (!consoleSlots[i].client) {
+      index = i;
+      memset(&consoleSlots[i], 0, sizeof(ConsoleSlot));
+      consoleSlots[i].client = client;
+    }
+  }
+  portEXIT_CRITICAL(&consoleMux);
+  if (index < 0) {
+    client->write("Too many sessions\r\n");
+    client->close();
+    delete client;  // Never registered, so nothing else refers to it
+    return;
+  }
+  client->setNoDelay(true);
+  client->onData(onConsoleData, (void *)(intptr_t)index);
+  client->onDisconnect(onConsoleDisconnect, (void *)(intptr_t)index);
+  client->write(CONSOLE_BANNER);
+}
+
+// Reply to one session from loop()
+void consoleReply(int index, const String &text) {
+  ConsoleSlot &slot = consoleSlots[index];
+  if (slot.client && !slot.closed && slot.client->connected()) {
+    consoleWrite(slot.client, (text + "\r\n").c_str());
+  }
+}
+
+// True if consoleTick() has a command to run, a session to free, or a
+// session with lines to send
+bool consoleHasWork() {
+  if (consoleQueueCount > 0) {
+    return true;
+  }
+  uint32_t now = millis();
+  for (int i = 0; i < CONSOLE_MAX_SESSIONS; i++) {
+    ConsoleSlot &slot = consoleSlots[i];
+    if (slot.client &&
+        (slot.closed || consolePending(slot.session, consoleRing, now, CONSOLE_STALL_MS, slot.client->space()))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Run queued lines, send each session what it has not seen yet, and free
+// slots whose connection closed
+void consoleTick() {
+  if (!consoleHasWork()) {
+    return;
+  }
+  TRACE_SCOPE(TRACE_CONSOLE);
+  // Run queued command lines
+  while (true) {
+    ConsoleCommand command;
+    bool have = false;
+    portENTER_CRITICAL(&consoleMux);
+    if (consoleQueueCount > 0) {
+      command = consoleQueue[consoleQueueHead];
+      consoleQueueHead = (consoleQueueHead + 1) % CONSOLE_QUEUE;
+      consoleQueueCount--;
+      have = true;
+    }
+    portEXIT_CRITICAL(&consoleMux);
+    if (!have) {
+      break;
+    }
+    String reply = handleCommandLine(String(command.line));
+    if (reply.length() > 0) {
+      consoleReply(command.session, reply);
+    }
+  }
+
+  uint32_t now = millis();
+  for (int i = 0; i < CONSOLE_MAX_SESSIONS; i++) {
+    ConsoleSlot &slot = consoleSlots[i];
+    if (!slot.client) {
+      continue;
+    }
+    if (slot.closed) {
+      AsyncClient *client = slot.client;
+      portENTER_CRITICAL(&consoleMux);
+      slot.client = nullptr;
+      portEXIT_CRITICAL(&consoleMux);
+      delete client;
+      continue;
+    }
+    if (!consoleFlush(slot.session, consoleRing, *slot.client, now, CONSOLE_STALL_MS)) {
+      slot.client->close();  // Not reading; onDisconnect frees the slot
+    }
+  }
+}
+
 void setupSSH() {
-  // Placeholder for SSH setup (requires additional library like SSHServer)
-  Serial.println("SSH Server Started on Port " + String(SSH_PORT));
+  consoleServer.onClient(onConsoleClient, nullptr);
+  consoleServer.begin();
+  Serial.println("Console Server Started on Port " + String(SSH_PORT));
   Serial.println("User: " + String(SSH_USER));
-  Serial.println("Password: " + String(SSH_PASSWORD));
-  updateDisplay("SSH Server", "Port: " + String(SSH_PORT));
+  updateDisplay("Console", "Port: " + String(SSH_PORT));
 }
 
 void setupWebServer() {
+  // Admission runs before every route
+  server.addHandler(new AdmissionHandler(admission, false));
+
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(200, "text/plain", "LoRa AP & SSH Server");
+    TRACE_SCOPE(TRACE_HTTP);
+    char status[160];
+    snprintf(status, sizeof(status),
+             "LoRa AP & SSH Server\nFree heap: %u\nRejected: heap %u, busy %u, rate %u, body %u\n",
+             (unsigned)ESP.getFreeHeap(), (unsigned)admission.rejected[ADMIT_HEAP],
+             (unsigned)admission.rejected[ADMIT_BUSY], (unsigned)admission.rejected[ADMIT_RATE],
+             (unsigned)admission.rejected[ADMIT_BODY]);
+    request->send(200, "text/plain", status);
+  });
+#if TRACE_ENABLED
+  server.on("/trace", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    printTrace(*response, TRACE_NAMES, sizeof(TRACE_NAMES) / sizeof(TRACE_NAMES[0]));
+    request->send(response);
   });
+#endif
   server.begin();
   Serial.println("Web Server Started");
 }
@@ -191,37 +415,48 @@ void setup() {
 void loop() {
   handleSerialInput();
   receiveMessage();
+  consoleTick();
+}
+
+// Run one line from Serial or a console session; returns an error to show
+String handleCommandLine(const String &line) {
+  if (line.startsWith("C ")) {
+    // Channel and key change command
+    int freqChannel, keyIndex;
+    if (parseChannelCommand(line.c_str(), NUM_FREQUENCY_CHANNELS, NUM_KEYS, freqChannel, keyIndex)) {
+      currentFrequencyChannel = freqChannel - 1;
+      currentKeyIndex = keyIndex - 1;
+      memcpy(currentKey, CHANNEL_KEYS[currentKeyIndex], 16);
+      initializeLoRa();
+      consolePublish("Channel " + String(freqChannel) + "-" + String(keyIndex));
+    } else {
+      updateDisplay("Error", "Invalid Ch/Key");
+      return "Invalid frequency or key. Use 'C <freq> <key>' (e.g., 'C 2 3').";
+    }
+  } else {
+    // Treat as a message to send
+    sendMessage(line);
+  }
+  return "";
 }
 
 void handleSerialInput() {
-  static String inputBuffer;
-  
+  static LineReader input;
+
   while (Serial.available()) {
-    char c = Serial.read();
-    if (c == '\n' || c == '\r') {
-      if (inputBuffer.length() > 0) {
-        if (inputBuffer.startsWith("C ")) {
-          // Channel and key change command
-          int freqChannel, keyIndex;
-          sscanf(inputBuffer.c_str(), "C %d %d", &freqChannel, &keyIndex);
-          if (freqChannel > 0 && freqChannel <= NUM_FREQUENCY_CHANNELS &&
-              keyIndex > 0 && keyIndex <= NUM_KEYS) {
-            currentFrequencyChannel = freqChannel - 1;
-            currentKeyIndex = keyIndex - 1;
-            memcpy(currentKey, CHANNEL_KEYS[currentKeyIndex], 16);
-            initializeLoRa();
-          } else {
-            updateDisplay("Error", "Invalid Ch/Key");
-            Serial.println("Invalid frequency or key. Use 'C <freq> <key>' (e.g., 'C 2 3').");
-          }
-        } else {
-          // Treat as a message to send
-          sendMessage(inputBuffer);
-        }
-        inputBuffer = "";
-      }
-    } else {
-      inputBuffer += c;
+    const char *line = lineFeed(input, Serial.read());
+    if (!line) {
+      continue;
+    }
+#if TRACE_ENABLED
+    if (strcmp(line, "/trace") == 0) {
+      printTrace(Serial, TRACE_NAMES, sizeof(TRACE_NAMES) / sizeof(TRACE_NAMES[0]));
+      continue;
+    }
+#endif
+    String error = handleCommandLine(String(line));
+    if (error.length() > 0) {
+      Serial.println(error);
     }
   }
 }
@@ -3,6 +3,7 @@
 #include <RadioLib.h>
 #include <AES.h>
 #include "heltec.h"
+#include "../message_text.h"
 
 // LoRa Radio Configuration
 SX1276 radio = new Module(18, 26, 14, 35);  // NSS, DIO0, RST, DIO1
@@ -83,62 +84,51 @@ void initializeLoRa() {
 }
 
 void handleSerialInput() {
-  static String inputBuffer;
-  
+  static LineReader input;
+
   while (Serial.available()) {
-    char c = Serial.read();
-    if (c == '\n' || c == '\r') {
-      if (inputBuffer.length() > 0) {
-        if (inputBuffer.startsWith("C ")) {
-          // Channel and key change command
-          int freqChannel, keyIndex;
-          sscanf(inputBuffer.c_str(), "C %d %d", &freqChannel, &keyIndex);
-          if (freqChannel > 0 && freqChannel <= NUM_FREQUENCY_CHANNELS &&
-              keyIndex > 0 && keyIndex <= NUM_KEYS) {
-            currentFrequencyChannel = freqChannel - 1;
-            currentKeyIndex = keyIndex - 1;
-            memcpy(currentKey, CHANNEL_KEYS[currentKeyIndex], 16);
-            initializeLoRa();
-          } else {
-            updateDisplay("Error", "Invalid Ch/Key");
-            Serial.println("Invalid frequency or key. Use 'C <freq> <key>' (e.g., 'C 2 3').");
-          }
-        } else {
-          // Treat as a message to send
-          sendMessage(inputBuffer);
-        }
-        inputBuffer = "";
+    const char *line = lineFeed(input, Serial.read());
+    if (!line) {
+      continue;
+    }
+    if (strncmp(line, "C ", 2) == 0) {
+      // Channel and key change command
+      int freqChannel, keyIndex;
+      if (parseChannelCommand(line, NUM_FREQUENCY_CHANNELS, NUM_KEYS, freqChannel, keyIndex)) {
+        currentFrequencyChannel = freqChannel - 1;
+        currentKeyIndex = keyIndex - 1;
+        memcpy(currentKey, CHANNEL_KEYS[currentKeyIndex], 16);
+        initializeLoRa();
+      } else {
+        updateDisplay("Error", "Invalid Ch/Key");
+        Serial.println("Invalid frequency or key. Use 'C <freq> <key>' (e.g., 'C 2 3').");
       }
     } else {
-      inputBuffer += c;
+      // Treat as a message to send
+      sendMessage(line);
     }
   }
 }
 
-void encryptMessage(String &message) {
-  byte plaintext[16] = {0};
-  byte ciphertext[16] = {0};
-  int len = message.length() > 16 ? 16 : message.length();
-  memcpy(plaintext, message.c_str(), len);
+void aesEncryptBlock(const uint8_t *in, uint8_t *out, const uint8_t *key) {
+  aes.do_aes_encrypt((byte *)in, MESSAGE_BLOCK, out, (byte *)key, 128);
+}
 
-  aes.do_aes_encrypt(plaintext, 16, ciphertext, currentKey, 128);
+void aesDecryptBlock(const uint8_t *in, uint8_t *out, const uint8_t *key) {
+  aes.do_aes_decrypt((byte *)in, MESSAGE_BLOCK, out, (byte *)key, 128);
+}
 
-  message = "";
-  for (int i = 0; i < 16; i++) {
-    message += String(ciphertext[i], HEX);
-  }
+void encryptMessage(String &message) {
+  char hex[MESSAGE_HEX_LEN + 1];
+  encryptMessageHex(message.c_str(), message.length(), currentKey, aesEncryptBlock, hex);
+  message = hex;
 }
 
+// Leaves 'message' empty unless it is one encrypted block
 void decryptMessage(String &message) {
-  byte ciphertext[16] = {0};
-  byte plaintext[16] = {0};
-  for (int i = 0; i < 16; i++) {
-    ciphertext[i] = (byte)strtol(message.substring(i * 2, i * 2 + 2).c_str(), NULL, 16);
-  }
-
-  aes.do_aes_decrypt(ciphertext, 16, plaintext, currentKey, 128);
-
-  message = String((char *)plaintext);
+  char text[MESSAGE_BLOCK + 1];
+  int len = decryptMessageHex(message.c_str(), message.length(), currentKey, aesDecryptBlock, text);
+  message = len < 0 ? "" : text;
 }
 
 void sendMessage(String message) {
@@ -1,13 +1,137 @@
 #include <RadioLib.h>
 #include "heltec.h"
+#include <algorithm>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <driver/uart.h>
+#include <mbedtls/md.h>
+#include <mbedtls/ccm.h>
+#include <Preferences.h>
+#include "energy_model.h"
+#include "link_bench.h"
+#include "message_text.h"
+#include "user_session.h"
 
 // LoRa Radio Configuration
-SX1276 radio = new Module(18, 26, 14, 35);  // NSS, DIO0, RST, DIO1
+#define LORA_DIO0 26
+#define PACKET_MAX 256  // Receive buffer: the largest LoRa payload plus a terminator
+SX1276 radio = new Module(18, LORA_DIO0, 14, 35);  // NSS, DIO0, RST, DIO1
 
 // Display Configuration
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
-String displayLines[4];  // Buffer for 4 lines of text
+char displayLines[4][DISPLAY_LINE_MAX];  // Buffer for 4 lines of text
+
+// Radio Profiles
+//
+// RadioProfile and its compile-time airtime and timeout tables are in
+// common/radio_profile.h.
+
+// The base profile every node starts on and returns to
+typedef RadioProfile<7, 125, 5> BaseProfile;
+const float LORA_FREQUENCY = 915.0;  // MHz
+const float LORA_BW = BaseProfile::BW_KHZ;
+const uint8_t LORA_SF = BaseProfile::SF;
+const uint8_t LORA_CR = BaseProfile::CR;
+
+// Profiles the benchmark can switch to; add entries to test others
+const RadioProfileInfo RADIO_PROFILES[] = {
+  BaseProfile::info(),
+  RadioProfile<8, 125, 5>::info(),
+  RadioProfile<9, 125, 5>::info(),
+  RadioProfile<10, 125, 5>::info(),
+  RadioProfile<11, 125, 5>::info(),
+  RadioProfile<12, 125, 5>::info(),
+  RadioProfile<12, 125, 8>::info(),
+  RadioProfile<7, 250, 5>::info(),
+  RadioProfile<8, 250, 5>::info(),
+  RadioProfile<9, 250, 5>::info(),
+  RadioProfile<7, 500, 5>::info(),
+};
+const int NUM_RADIO_PROFILES = sizeof(RADIO_PROFILES) / sizeof(RADIO_PROFILES[0]);
+const RadioProfileInfo *currentProfile = &RADIO_PROFILES[0];
+
+// Link Benchmark
+//
+// The generator, the responder and the frame layout are in link_bench.h;
+// this sketch supplies the radio and prints the results.
+uint8_t benchRun = 0;              // Tags probes so stale echoes are ignored
+uint32_t benchRtt[BENCH_MAX_SAMPLES];
+
+// Responder state
+bool responderMode = false;
+BenchResponder responder = {};
+uint32_t responderLastAt = 0;
+bool responderOnBase = true;
+
+// Low-Power Mode
+//
+// "/lowpower <ms>" duty-cycles the receiver: every <ms> the radio runs
+// one channel activity detection (CAD), about two symbols long, and
+// otherwise sleeps while the ESP32 light-sleeps. Transmissions carry a
+// preamble longer than the interval, so a CAD window always falls inside
+// it; a detection turns into a reception, again with the CPU asleep until
+// DIO0 signals the packet. Serial input also wakes the CPU, though the
+// characters that wake it are lost. Nodes that talk to each other must
+// use the same interval. The display is off while the mode is on. The
+// constants and the preamble length are in energy_model.h.
+uint32_t lowPowerMs = 0;              // 0: continuous receive
+int64_t lowPowerNextAt = 0;           // esp_timer time of the next window
+uint32_t lowPowerWindows = 0;
+uint32_t lowPowerDetections = 0;
+uint32_t lowPowerPackets = 0;
+
+// Energy Model
+//
+// Time is accumulated per radio state and for the CPU in light sleep, and
+// charge is estimated with the currents in energy_model.h. "/power"
+// prints the totals and projects battery life and added latency for a
+// range of window intervals; bench/low_power.cpp adds traffic on the host.
+
+PowerState powerState = POWER_RX;
+int64_t powerStateSince = 0;
+int64_t powerStateUs[POWER_STATES];
+int64_t cpuSleepUs = 0;
+
+// User Session
+//
+// With USER_KEY set to this node's key on a tx-rx-ap-httpd gateway,
+// messages to this user arrive as USER frames (see user_session.h) and
+// "/up <text>" sends one back. Frames for other recipient ids are dropped
+// without decrypting. The uplink counter resumes at a block reserved in
+// NVS, so a restart never reuses a nonce. The highest downlink counter
+// accepted is saved USER_MARK_FLUSH_MS after it changes; a frame from the
+// last seconds before a power cut could be accepted once more.
+#define USER_COUNTER_BLOCK 1024  // Uplink counters reserved per NVS write
+#define USER_MARK_FLUSH_MS 10000
+const char* USER_KEY = "";  // This node's key on the gateway; empty for no session
+UserSession userSession;
+bool userSessionReady = false;
+mbedtls_ccm_context userCipher;
+Preferences userPrefs;
+uint32_t userUpCounter = 1;   // Next uplink counter
+uint32_t userUpReserved = 0;  // Counters below this are reserved in NVS
+bool userMarkDirty = false;
+uint32_t userMarkDirtyAt = 0;
+
+// user_session.h's crypto on mbedtls; a node has one cipher slot
+const SessionCrypto NODE_CRYPTO = {
+  [](const uint8_t *key, size_t keyLen, uint8_t *mac) {
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, keyLen, (const uint8_t *)USER_SESSION_LABEL,
+                    strlen(USER_SESSION_LABEL), mac);
+  },
+  [](int, const uint8_t *key) {
+    mbedtls_ccm_free(&userCipher);
+    mbedtls_ccm_init(&userCipher);
+    mbedtls_ccm_setkey(&userCipher, MBEDTLS_CIPHER_ID_AES, key, 128);
+  },
+  [](int, const uint8_t *header, const uint8_t *text, size_t len, uint8_t *out, uint8_t *tag) {
+    mbedtls_ccm_encrypt_and_tag(&userCipher, len, header, USER_HEADER, nullptr, 0, text, out, tag, USER_TAG_LEN);
+  },
+  [](int, const uint8_t *header, const uint8_t *in, size_t len, uint8_t *text, const uint8_t *tag) {
+    return mbedtls_ccm_auth_decrypt(&userCipher, len, header, USER_HEADER, nullptr, 0, in, text, tag, USER_TAG_LEN) == 0;
+  },
+};
 
 void setup() {
   // Initialize Heltec hardware (Display, disable LoRa init, enable Serial)
@@ -20,15 +144,16 @@ void setup() {
   updateDisplay("System Init", "Starting LoRa...");
 
   // Initialize LoRa
-  float freq = 915.0;    // Frequency in MHz
-  float bw = 125.0;      // Bandwidth (kHz)
-  uint8_t sf = 7;        // Spreading factor
-  uint8_t cr = 5;        // Coding rate
+  float freq = LORA_FREQUENCY;  // Frequency in MHz
+  float bw = LORA_BW;    // Bandwidth (kHz)
+  uint8_t sf = LORA_SF;  // Spreading factor
+  uint8_t cr = LORA_CR;  // Coding rate
   uint8_t syncWord = 0x12;
   int8_t power = 17;     // TX power in dBm
 
   int state = radio.begin(freq, bw, sf, cr, syncWord, power);
   radio.setCRC(false);
+  powerStateSince = esp_timer_get_time();
 
   if (state == RADIOLIB_ERR_NONE) {
     updateDisplay("LoRa Status", "Initialized!");
@@ -44,25 +169,48 @@ void setup() {
   Serial.setTimeout(50);
   updateDisplay("System Ready", "Freq: " + String(freq) + "MHz");
   Serial.println("Enter text to send:");
+  Serial.println("'/bench [sf=7,9] [bw=125] [cr=5] [count=50] [size=16-64] [rate=2] [burst=1] [freq=915]' to benchmark,");
+  Serial.println("'/respond' to toggle responder mode,");
+  Serial.println("'/lowpower <ms>' to duty-cycle the receiver (0 for continuous), '/power' for the energy report.");
+  beginUserSession();
 }
 
 void loop() {
   handleSerialInput();
-  receiveMessage();
+  if (lowPowerMs) {
+    lowPowerTick();
+  } else {
+    receiveMessage();
+  }
+  responderTick();
+  userSessionTick();
 }
 
 void handleSerialInput() {
-  static String inputBuffer;
-  
+  static LineReader input;
+
   while (Serial.available()) {
-    char c = Serial.read();
-    if (c == '\n' || c == '\r') {
-      if (inputBuffer.length() > 0) {
-        sendMessage(inputBuffer);
-        inputBuffer = "";
-      }
+    const char *line = lineFeed(input, Serial.read());
+    const char *arg;
+    if (!line) {
+      continue;
+    }
+    if ((commandIs(line, "/bench") || commandIs(line, "/respond")) && lowPowerMs) {
+      Serial.println("Turn low-power mode off first: /lowpower 0");
+    } else if (commandIs(line, "/bench")) {
+      runBenchmark(String(line));
+    } else if (commandIs(line, "/lowpower", &arg)) {
+      setLowPower(atoi(arg));
+    } else if (commandIs(line, "/up", &arg)) {
+      sendUserUplink(arg);
+    } else if (commandIs(line, "/power")) {
+      printEnergyReport();
+    } else if (commandIs(line, "/respond")) {
+      responderMode = !responderMode;
+      updateDisplay("Responder", responderMode ? "On" : "Off");
+      Serial.println(responderMode ? "Responder on" : "Responder off");
     } else {
-      inputBuffer += c;
+      sendMessage(line);
     }
   }
 }
@@ -75,7 +223,7 @@ void sendMessage(String message) {
   updateDisplay("Transmitting", message);
 
   // Transmit message
-  int state = radio.transmit(message);
+  int state = transmitFrame((const uint8_t *)message.c_str(), message.length());
   
   if (state == RADIOLIB_ERR_NONE) {
     updateDisplay("Tx Success", message);
@@ -90,10 +238,31 @@ void sendMessage(String message) {
 
 void receiveMessage() {
   static uint32_t lastUpdate = 0;
-  String receivedStr;
-  int state = radio.receive(receivedStr, 0);  // Non-blocking receive
+  uint8_t packet[PACKET_MAX];
+  int state = radio.receive(packet, 0);  // Non-blocking receive
+  handleReceived(state, packet);
+
+  // Update status line every 2 seconds
+  if(millis() - lastUpdate > 2000) {
+    updateStatusLine();
+    lastUpdate = millis();
+  }
+}
+
+// Act on a reception result; 'packet' holds PACKET_MAX bytes
+void handleReceived(int state, uint8_t *packet) {
+  size_t len = state == RADIOLIB_ERR_NONE ? min(radio.getPacketLength(), (size_t)(PACKET_MAX - 1)) : 0;
+
+  if (len > 0 && (packet[0] & 0xF0) == BENCH_MARK) {
+    if (responderMode) {
+      handleBenchFrame(packet, len);
+    }
+  } else if (len > 0 && (packet[0] & 0xF0) == USER_MARK) {
+    handleUserFrame(packet, len);
+  } else if (state == RADIOLIB_ERR_NONE) {
+    packet[len] = '\0';
+    String receivedStr = (const char *)packet;
 
-  if (state == RADIOLIB_ERR_NONE) {
     // Display handling
     updateDisplay("Received", receivedStr);
     
@@ -111,20 +280,12 @@ void receiveMessage() {
     Serial.print("Receive error: ");
     Serial.println(state);
   }
-
-  // Update status line every 2 seconds
-  if(millis() - lastUpdate > 2000) {
-    updateStatusLine();
-    lastUpdate = millis();
-  }
 }
 
-void updateDisplay(String header, String message) {
+void updateDisplay(const String &header, const String &message) {
   // Shift previous messages up
-  for(int i = 3; i > 0; i--) {
-    displayLines[i] = displayLines[i-1];
-  }
-  displayLines[0] = header + ": " + message;
+  memmove(displayLines[1], displayLines[0], sizeof(displayLines[0]) * 3);
+  formatDisplayLine(displayLines[0], DISPLAY_LINE_MAX, header.c_str(), message.c_str());
 
   // Update physical display
   Heltec.display->clear();
@@ -136,9 +297,402 @@ void updateDisplay(String header, String message) {
 
 void updateStatusLine() {
   // Keep bottom line for status info
-  displayLines[3] = "RSSI:" + String(radio.getRSSI()) + 
-                   " SNR:" + String(radio.getSNR()) + 
-                   " " + String(millis()/1000) + "s";
+  formatStatusLine(displayLines[3], DISPLAY_LINE_MAX, radio.getRSSI(), radio.getSNR(), millis() / 1000);
   Heltec.display->drawString(0, 36, displayLines[3]);
   Heltec.display->display();
 }
+
+// Derive this node's session and restore its counters from NVS
+void beginUserSession() {
+  if (!USER_KEY[0]) {
+    return;
+  }
+  mbedtls_ccm_init(&userCipher);
+  deriveUserSession(NODE_CRYPTO, USER_KEY, strlen(USER_KEY), userSession);
+  NODE_CRYPTO.setKey(0, userSession.key);
+  userPrefs.begin("session", false);
+  userUpCounter = userUpReserved = userPrefs.getUInt("up", 1);
+  userSession.lastCounter = userPrefs.getUInt("down", 0);
+  userSessionReady = true;
+  Serial.printf("User session id %04x, '/up <text>' to message the gateway\n", userSession.id);
+}
+
+// Encrypt a message to the gateway and transmit it
+void sendUserUplink(const char *text) {
+  if (!userSessionReady) {
+    Serial.println("No user session: set USER_KEY");
+    return;
+  }
+  if (userUpCounter >= userUpReserved) {
+    uint32_t reserved = userUpCounter + USER_COUNTER_BLOCK;
+    if (reserved < userUpCounter || userPrefs.putUInt("up", reserved) != sizeof(uint32_t)) {
+      Serial.println("Cannot reserve session counters, message not sent");
+      return;
+    }
+    userUpReserved = reserved;
+  }
+  uint8_t frame[USER_FRAME_MAX];
+  size_t len = sealUserFrame(NODE_CRYPTO, 0, userSession, USER_UP, userUpCounter++, text, strlen(text), frame);
+  int state = transmitFrame(frame, len);
+  updateDisplay(state == RADIOLIB_ERR_NONE ? "Tx Gateway" : "Tx Failed", text);
+  Serial.printf("%s (%u bytes)\n", state == RADIOLIB_ERR_NONE ? "Sent to gateway" : "Send failed to gateway",
+                (unsigned)len);
+}
+
+// Decrypt a frame from the gateway; frames for other users are dropped
+// on their recipient id
+void handleUserFrame(const uint8_t *frame, size_t len) {
+  if (!userSessionReady) {
+    return;
+  }
+  char text[USER_TEXT_MAX + 1];
+  int result = openSessionFrame(NODE_CRYPTO, 0, userSession, frame, len, USER_DOWN, text);
+  if (result == USER_FRAME_REPLAYED) {
+    Serial.println("Dropped a repeated gateway frame");
+  }
+  if (result != 0) {
+    return;
+  }
+  if (!userMarkDirty) {
+    userMarkDirty = true;
+    userMarkDirtyAt = millis();
+  }
+  updateDisplay("Gateway", text);
+  Serial.printf("From gateway: %s\n", text);
+}
+
+// Save the downlink mark once it has been dirty for USER_MARK_FLUSH_MS
+void userSessionTick() {
+  if (userMarkDirty && millis() - userMarkDirtyAt >= USER_MARK_FLUSH_MS) {
+    userPrefs.putUInt("down", userSession.lastCounter);
+    userMarkDirty = false;
+  }
+}
+
+// The compiled profile with these settings, or nullptr
+const RadioProfileInfo *findProfile(uint8_t sf, uint16_t bwKHz, uint8_t cr) {
+  return findRadioProfile(RADIO_PROFILES, NUM_RADIO_PROFILES, sf, bwKHz, cr);
+}
+
+// Retune to a profile; the radio keeps its sync word and power
+int applyProfile(float freq, const RadioProfileInfo &profile) {
+  int state = radio.setFrequency(freq);
+  if (state == RADIOLIB_ERR_NONE) {
+    state = radio.setBandwidth(profile.bwKHz);
+  }
+  if (state == RADIOLIB_ERR_NONE) {
+    state = radio.setSpreadingFactor(profile.sf);
+  }
+  if (state == RADIOLIB_ERR_NONE) {
+    state = radio.setCodingRate(profile.cr);
+  }
+  currentProfile = &profile;
+  return state;
+}
+
+// The radio and board as link_bench.h sees them
+const BenchRadio BENCH_RADIO = {
+  transmitFrame,
+  [](uint8_t *frame) -> size_t {
+    return radio.receive(frame, 0) == RADIOLIB_ERR_NONE ? min(radio.getPacketLength(), (size_t)PROFILE_MAX_PAYLOAD) : 0;
+  },
+  applyProfile,
+  []() { return radio.getRSSI(); },
+  []() { return radio.getSNR(); },
+  []() -> uint32_t { return millis(); },
+  []() -> uint32_t { return micros(); },
+  [](uint32_t ms) { delay(ms); },
+  [](long low, long high) { return random(low, high); },
+  []() { return Serial.available() > 0; },
+};
+
+// Responder: count probes, echo flagged ones, follow SWITCH requests
+void handleBenchFrame(const uint8_t *frame, size_t len) {
+  uint32_t freqKHz;
+  responderLastAt = millis();
+  const RadioProfileInfo *profile =
+      benchRespond(BENCH_RADIO, responder, RADIO_PROFILES, NUM_RADIO_PROFILES, frame, len, freqKHz);
+  if (profile) {
+    responderOnBase = profile == &RADIO_PROFILES[0] && freqKHz == (uint32_t)(LORA_FREQUENCY * 1000);
+    updateDisplay("Bench", "SF" + String(profile->sf) + " BW" + String(profile->bwKHz) + " CR" + String(profile->cr));
+  }
+}
+
+// A responder left on a test profile (lost SWITCH back) returns to base
+void responderTick() {
+  if (responderMode && !responderOnBase && millis() - responderLastAt > BENCH_IDLE_MS) {
+    applyProfile(LORA_FREQUENCY, RADIO_PROFILES[0]);
+    responderOnBase = true;
+    updateDisplay("Bench", "Back to base profile");
+  }
+}
+
+// Move both ends to a profile: SWITCH on the current one, then follow the ACK
+bool benchSwitch(float freq, const RadioProfileInfo &profile) {
+  return benchSwitch(BENCH_RADIO, benchRun, *currentProfile, freq, profile);
+}
+
+// Parse "a,b,c" into up to BENCH_MAX_VALUES numbers
+template <typename T> uint8_t parseBenchList(const char *text, T *out) {
+  uint8_t count = 0;
+  while (*text && count < BENCH_MAX_VALUES) {
+    out[count++] = (T)atof(text);
+    const char *comma = strchr(text, ',');
+    if (!comma) {
+      break;
+    }
+    text = comma + 1;
+  }
+  return count;
+}
+
+bool parseBenchConfig(const String &command, BenchConfig &config) {
+  config.sfs[0] = LORA_SF;
+  config.bws[0] = LORA_BW;
+  config.crs[0] = LORA_CR;
+  config.sfCount = config.bwCount = config.crCount = 1;
+  config.freq = LORA_FREQUENCY;
+  config.count = 50;
+  config.minSize = config.maxSize = 16;
+  config.rate = 1;
+  config.burst = 1;
+
+  char buffer[160];
+  strlcpy(buffer, command.c_str(), sizeof(buffer));
+  char *save;
+  strtok_r(buffer, " ", &save);  // "/bench"
+  for (char *token = strtok_r(nullptr, " ", &save); token; token = strtok_r(nullptr, " ", &save)) {
+    char *value = strchr(token, '=');
+    if (!value) {
+      return false;
+    }
+    *value++ = '\0';
+    if (!strcmp(token, "sf")) {
+      config.sfCount = parseBenchList(value, config.sfs);
+    } else if (!strcmp(token, "bw")) {
+      config.bwCount = parseBenchList(value, config.bws);
+    } else if (!strcmp(token, "cr")) {
+      config.crCount = parseBenchList(value, config.crs);
+    } else if (!strcmp(token, "freq")) {
+      config.freq = atof(value);
+    } else if (!strcmp(token, "count")) {
+      config.count = atoi(value);
+    } else if (!strcmp(token, "size")) {
+      config.minSize = atoi(value);
+      const char *dash = strchr(value, '-');
+      config.maxSize = dash ? atoi(dash + 1) : config.minSize;
+    } else if (!strcmp(token, "rate")) {
+      config.rate = atof(value);
+    } else if (!strcmp(token, "burst")) {
+      config.burst = atoi(value);
+    } else {
+      return false;
+    }
+  }
+  for (int s = 0; s < config.sfCount; s++) {
+    for (int b = 0; b < config.bwCount; b++) {
+      for (int c = 0; c < config.crCount; c++) {
+        if (!findProfile(config.sfs[s], config.bws[b], config.crs[c])) {
+          Serial.printf("SF%u BW%u CR4/%u is not in RADIO_PROFILES\n", config.sfs[s], config.bws[b], config.crs[c]);
+          return false;
+        }
+      }
+    }
+  }
+  config.minSize = max(config.minSize, (uint8_t)BENCH_PROBE_HEADER);
+  config.maxSize = max(config.maxSize, config.minSize);
+  return config.sfCount && config.bwCount && config.crCount && config.count > 0 && config.rate > 0 &&
+         config.burst > 0;
+}
+
+// Probes for the current profile; prints one result line
+void benchCombination(const BenchConfig &config) {
+  const RadioProfileInfo &profile = *currentProfile;
+  BenchResult result = benchCombination(BENCH_RADIO, benchRun, config, profile, benchRtt);
+  Serial.printf("SF%u BW%u CR4/%u: sent %u delivered %u (%.1f%%) goodput %u B/s "
+                "RTT p50 %u p90 %u p99 %u ms (%u echoes) airtime %.1f%%\n",
+                profile.sf, profile.bwKHz, profile.cr, result.sent, result.delivered,
+                result.sent ? 100.0 * result.delivered / result.sent : 0.0,
+                (unsigned)(result.deliveredBytes * 1000ULL / result.elapsedMs), (unsigned)result.p50Ms,
+                (unsigned)result.p90Ms, (unsigned)result.p99Ms, result.samples, result.airUs / 10.0 / result.elapsedMs);
+  updateDisplay("SF" + String(profile.sf) + " BW" + String(profile.bwKHz),
+                String(result.delivered) + "/" + String(result.sent) + " p50 " + String(result.p50Ms) + "ms");
+}
+
+// "/bench ..." : run the generator once per SF/BW/CR combination
+void runBenchmark(const String &command) {
+  BenchConfig config;
+  if (!parseBenchConfig(command, config)) {
+    Serial.println("Usage: /bench [sf=7,9] [bw=125,250] [cr=5] [count=50] [size=16-64] [rate=2] [burst=1] [freq=915]");
+    return;
+  }
+  for (int s = 0; s < config.sfCount; s++) {
+    for (int b = 0; b < config.bwCount; b++) {
+      for (int c = 0; c < config.crCount; c++) {
+        const RadioProfileInfo &profile = *findProfile(config.sfs[s], config.bws[b], config.crs[c]);
+        benchRun++;
+        if (!benchSwitch(config.freq, profile)) {
+          Serial.printf("SF%u BW%u CR4/%u: no responder\n", profile.sf, profile.bwKHz, profile.cr);
+          continue;
+        }
+        benchCombination(config);
+        if (!benchSwitch(LORA_FREQUENCY, RADIO_PROFILES[0])) {
+          applyProfile(LORA_FREQUENCY, RADIO_PROFILES[0]);  // Responder falls back on its own
+        }
+        if (Serial.available()) {
+          Serial.println("Benchmark stopped");
+          return;
+        }
+      }
+    }
+  }
+}
+
+// Charge time spent so far to the current radio state and move to 'next'
+void setPowerState(PowerState next) {
+  int64_t now = esp_timer_get_time();
+  powerStateUs[powerState] += now - powerStateSince;
+  powerStateSince = now;
+  powerState = next;
+}
+
+// Transmit, accounting the time to the energy model
+int transmitFrame(const uint8_t *data, size_t len) {
+  setPowerState(POWER_TX);
+  int state = radio.transmit(data, len);
+  setPowerState(lowPowerMs ? POWER_STANDBY : POWER_RX);
+  return state;
+}
+
+// Light-sleep for up to 'us'; DIO0 rising ends it early when 'onDio0', and
+// Serial input always does while low-power mode is on
+void lightSleep(int64_t us, bool onDio0) {
+  Serial.flush();
+  esp_sleep_enable_timer_wakeup(us);
+  if (onDio0) {
+    gpio_wakeup_enable((gpio_num_t)LORA_DIO0, GPIO_INTR_HIGH_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+  }
+  int64_t start = esp_timer_get_time();
+  esp_light_sleep_start();
+  cpuSleepUs += esp_timer_get_time() - start;
+  if (onDio0) {
+    gpio_wakeup_disable((gpio_num_t)LORA_DIO0);
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO);
+  }
+}
+
+// Sleep until the radio raises DIO0 (CAD done, RX done); false on timeout
+bool waitForDio0(int64_t timeoutUs) {
+  int64_t deadline = esp_timer_get_time() + timeoutUs;
+  while (digitalRead(LORA_DIO0) != HIGH) {
+    int64_t left = deadline - esp_timer_get_time();
+    if (left <= 0) {
+      return false;
+    }
+    lightSleep(left, true);
+  }
+  return true;
+}
+
+// "/lowpower <ms>": duty-cycle the receiver, or 0 to receive continuously
+void setLowPower(uint32_t intervalMs) {
+  if (intervalMs > 0 && responderMode) {
+    Serial.println("Turn responder mode off first: /respond");
+    return;
+  }
+  if (intervalMs > 0) {
+    uint32_t preamble = lowPowerPreamble(*currentProfile, intervalMs);
+    if (preamble > LOWPOWER_MAX_PREAMBLE) {
+      Serial.printf("Interval too long for SF%u BW%u: max %u ms\n", currentProfile->sf, currentProfile->bwKHz,
+                    (unsigned)((uint64_t)(LOWPOWER_MAX_PREAMBLE - LOWPOWER_RX_PREAMBLE - LOWPOWER_CAD_SYMBOLS) *
+                               currentProfile->symbolUs / 1000));
+      return;
+    }
+    radio.setPreambleLength(preamble);
+    uart_set_wakeup_threshold(UART_NUM_0, 3);
+    esp_sleep_enable_uart_wakeup(0);
+    if (!lowPowerMs) {
+      updateDisplay("Low power", String(intervalMs) + " ms windows");
+      Heltec.display->displayOff();
+    }
+    lowPowerNextAt = esp_timer_get_time();
+    Serial.printf("Low power: window every %u ms, preamble %u symbols\n", (unsigned)intervalMs, (unsigned)preamble);
+  } else if (lowPowerMs) {
+    radio.setPreambleLength(LOWPOWER_RX_PREAMBLE);
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_UART);
+    setPowerState(POWER_RX);
+    Heltec.display->displayOn();
+    updateDisplay("Low power", "Off");
+    Serial.println("Low power off");
+  }
+  lowPowerMs = intervalMs;
+}
+
+// One window: CAD, a reception if it heard a preamble, then radio sleep.
+// Between windows the CPU light-sleeps; Serial input ends the sleep early
+// so loop() can read it.
+void lowPowerTick() {
+  int64_t now = esp_timer_get_time();
+  if (now < lowPowerNextAt) {
+    lightSleep(lowPowerNextAt - now, false);
+    return;
+  }
+  int64_t periodUs = (int64_t)lowPowerMs * 1000;
+  lowPowerNextAt = now - lowPowerNextAt < periodUs ? lowPowerNextAt + periodUs : now + periodUs;
+  lowPowerWindows++;
+
+  setPowerState(POWER_CAD);
+  radio.startChannelScan();
+  waitForDio0(4 * LOWPOWER_CAD_SYMBOLS * currentProfile->symbolUs + 1000);
+  if (radio.getChannelScanResult() == RADIOLIB_LORA_DETECTED) {
+    lowPowerDetections++;
+    setPowerState(POWER_RX);
+    radio.startReceive();
+    uint8_t packet[PACKET_MAX];
+    if (waitForDio0(periodUs + currentProfile->rxTimeoutUs)) {
+      lowPowerPackets++;
+      handleReceived(radio.readData(packet, 0), packet);
+    }
+  }
+  radio.sleep();
+  setPowerState(POWER_SLEEP);
+}
+
+// "/power": time and charge per state since boot, then projections for
+// the current profile
+void printEnergyReport() {
+  setPowerState(powerState);
+  int64_t uptimeUs = esp_timer_get_time();
+  double chargeUah = ((uptimeUs - cpuSleepUs) * (double)CPU_ACTIVE_UA + cpuSleepUs * (double)CPU_SLEEP_UA) / 3.6e9;
+  Serial.printf("Uptime %.1f s, CPU asleep %.1f%%\n", uptimeUs / 1e6, 100.0 * cpuSleepUs / uptimeUs);
+  for (int i = 0; i < POWER_STATES; i++) {
+    double stateUah = powerStateUs[i] * (double)RADIO_CURRENT_UA[i] / 3.6e9;
+    chargeUah += stateUah;
+    Serial.printf("  radio %-8s %10.1f s %9.1f uAh\n", POWER_STATE_NAMES[i], powerStateUs[i] / 1e6, stateUah);
+  }
+  double averageUa = chargeUah * 3.6e9 / uptimeUs;
+  Serial.printf("Charge %.3f mAh, average %.2f mA: %u mAh lasts %.1f days\n", chargeUah / 1000, averageUa / 1000,
+                BATTERY_MAH, batteryDays(averageUa));
+  if (lowPowerMs) {
+    Serial.printf("Windows %u, detections %u, packets %u\n", (unsigned)lowPowerWindows,
+                  (unsigned)lowPowerDetections, (unsigned)lowPowerPackets);
+  }
+
+  // Idle listening draw against the latency a longer preamble adds to
+  // every message, and the extra charge it costs the sender
+  Serial.printf("Projection for SF%u BW%u, no traffic:\n", currentProfile->sf, currentProfile->bwKHz);
+  Serial.println("  window ms   avg mA   battery days   added latency ms   extra TX uAh/msg");
+  Serial.printf("  continuous %7.2f %14.1f %18u %18.2f\n", projectedCurrentUa(*currentProfile, 0) / 1000,
+                batteryDays(projectedCurrentUa(*currentProfile, 0)), 0u, 0.0);
+  for (uint32_t intervalMs : PROJECTION_INTERVALS_MS) {
+    if (lowPowerPreamble(*currentProfile, intervalMs) > LOWPOWER_MAX_PREAMBLE) {
+      break;
+    }
+    double currentUa = projectedCurrentUa(*currentProfile, intervalMs);
+    uint32_t addedUs = lowPowerAirtimeUs(*currentProfile, intervalMs, 0) - lowPowerAirtimeUs(*currentProfile, 0, 0);
+    Serial.printf("  %10u %7.2f %14.1f %18u %18.2f\n", (unsigned)intervalMs, currentUa / 1000,
+                  batteryDays(currentUa), (unsigned)(addedUs / 1000),
+                  addedUs * (double)(RADIO_CURRENT_UA[POWER_TX] + CPU_ACTIVE_UA) / 3.6e9);
+  }
+}
@@ -0,0 +1,202 @@
+// User session frames for tx-rx-ap-httpd (the gateway) and tx-rx.h (a
+// user's node)
+//
+// Plain C++ with no Arduino or mbedtls dependency. Key derivation and
+// AES-128-CCM reach the crypto library through a SessionCrypto, which the
+// sketches fill in with mbedtls and bench/ and tests/ with OpenSSL or a
+// stand-in.
+//
+//   USER frame  mark|direction, recipient id (2), counter (4), ciphertext,
+//               tag (4). The first 7 bytes are the CCM nonce.
+//
+// A receiver compares the recipient id before any crypto, so frames for
+// other users cost one compare on a node and one index probe on the
+// gateway. The gateway keeps the expanded contexts of recently used users
+// in an LRU of USER_CIPHER_CACHE slots, so a frame costs one lookup and
+// one CCM pass however many users there are.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define USER_MARK 0xD0
+#define USER_DOWN 0            // Gateway to user
+#define USER_UP 1              // User to gateway
+#define USER_HEADER 7
+#define USER_TAG_LEN 4
+#define USER_TEXT_MAX (240 - USER_HEADER - USER_TAG_LEN)
+#define USER_FRAME_MAX (USER_HEADER + USER_TEXT_MAX + USER_TAG_LEN)
+#define USER_MAX 512
+#define USER_ID_HASH_SIZE 1024  // Power of two, at least 2x USER_MAX
+#define USER_CIPHER_CACHE 16    // Expanded contexts kept, about 400 bytes each on the ESP32
+#define USER_SESSION_LABEL "lora-session"
+
+// openUserFrame() results other than a user index
+#define USER_FRAME_REJECTED -1  // Not a USER frame, no matching id, or no tag verified
+#define USER_FRAME_REPLAYED -2  // Authenticated, but its counter is not new
+
+struct UserSession {
+  uint8_t key[16];
+  uint16_t id;
+  uint32_t lastCounter;  // Highest counter accepted from the other end
+};
+
+// Cipher slots are numbered 0..USER_CIPHER_CACHE-1; a node uses slot 0
+struct SessionCrypto {
+  // HMAC-SHA256 of USER_SESSION_LABEL under 'key'
+  void (*derive)(const uint8_t *key, size_t keyLen, uint8_t *mac);
+  // Expand 'key' into a slot, replacing what it held
+  void (*setKey)(int slot, const uint8_t *key);
+  // CCM under a slot's key with the 7-byte frame header as nonce
+  void (*seal)(int slot, const uint8_t *header, const uint8_t *text, size_t len, uint8_t *out, uint8_t *tag);
+  bool (*open)(int slot, const uint8_t *header, const uint8_t *in, size_t len, uint8_t *text, const uint8_t *tag);
+};
+
+// Session key and recipient id of a user's key
+inline void deriveUserSession(const SessionCrypto &crypto, const char *key, size_t keyLen, UserSession &session) {
+  uint8_t mac[32];
+  crypto.derive((const uint8_t *)key, keyLen, mac);
+  memcpy(session.key, mac, sizeof(session.key));
+  session.id = mac[16] | mac[17] << 8;
+  session.lastCounter = 0;
+}
+
+// Frames
+//
+// Text length of a well-formed frame in this direction, or -1
+inline int userFrameTextLength(const uint8_t *frame, size_t len, uint8_t direction) {
+  if (len < USER_HEADER + USER_TAG_LEN || len > USER_FRAME_MAX || frame[0] != (USER_MARK | direction)) {
+    return -1;
+  }
+  return len - USER_HEADER - USER_TAG_LEN;
+}
+
+inline uint16_t userFrameId(const uint8_t *frame) {
+  return frame[1] | frame[2] << 8;
+}
+
+inline uint32_t userFrameCounter(const uint8_t *frame) {
+  return frame[3] | frame[4] << 8 | frame[5] << 16 | (uint32_t)frame[6] << 24;
+}
+
+// Build a frame to or from 'session' in a cipher slot already keyed for
+// it; 'len' is cut to USER_TEXT_MAX. Returns the frame length.
+inline size_t sealUserFrame(const SessionCrypto &crypto, int slot, const UserSession &session, uint8_t direction,
+                            uint32_t counter, const char *text, size_t len, uint8_t *frame) {
+  len = len < USER_TEXT_MAX ? len : USER_TEXT_MAX;
+  frame[0] = USER_MARK | direction;
+  frame[1] = session.id;
+  frame[2] = session.id >> 8;
+  for (int i = 0; i < 4; i++) {
+    frame[3 + i] = counter >> (8 * i);
+  }
+  crypto.seal(slot, frame, (const uint8_t *)text, len, frame + USER_HEADER, frame + USER_HEADER + len);
+  return USER_HEADER + len + USER_TAG_LEN;
+}
+
+// Decrypt a frame for 'session' into 'text' (USER_TEXT_MAX + 1 bytes, NUL
+// terminated) and advance its counter mark. Frames for another id return
+// USER_FRAME_REJECTED without touching the cipher.
+inline int openSessionFrame(const SessionCrypto &crypto, int slot, UserSession &session, const uint8_t *frame,
+                            size_t len, uint8_t direction, char *text) {
+  int textLen = userFrameTextLength(frame, len, direction);
+  if (textLen < 0 || userFrameId(frame) != session.id ||
+      !crypto.open(slot, frame, frame + USER_HEADER, textLen, (uint8_t *)text, frame + USER_HEADER + textLen)) {
+    return USER_FRAME_REJECTED;
+  }
+  uint32_t counter = userFrameCounter(frame);
+  if (counter <= session.lastCounter) {
+    return USER_FRAME_REPLAYED;  // Seen before: a replay or a duplicate
+  }
+  session.lastCounter = counter;
+  text[textLen] = '\0';
+  return 0;
+}
+
+// Gateway Table
+//
+// Sessions are indexed by recipient id in an open-addressed table (ids
+// may collide: each candidate is tried) and share the cipher LRU.
+struct SessionTable {
+  UserSession sessions[USER_MAX];  // Parallel to the gateway's users
+  int count;
+  int16_t idIndex[USER_ID_HASH_SIZE];
+  int16_t slotUser[USER_CIPHER_CACHE];  // -1: empty
+  uint32_t slotUsed[USER_CIPHER_CACHE];
+  uint32_t clock;
+  uint32_t misses;  // Key expansions
+};
+
+inline void clearSessionTable(SessionTable &table) {
+  table.count = 0;
+  memset(table.idIndex, 0xFF, sizeof(table.idIndex));
+  memset(table.slotUser, 0xFF, sizeof(table.slotUser));
+  memset(table.slotUsed, 0, sizeof(table.slotUsed));
+  table.clock = 0;
+}
+
+// Derive the next user's session and index it; false when full
+inline bool addUserSession(SessionTable &table, const SessionCrypto &crypto, const char *key, size_t keyLen) {
+  if (table.count >= USER_MAX) {
+    return false;
+  }
+  int user = table.count;
+  deriveUserSession(crypto, key, keyLen, table.sessions[user]);
+  int index = table.sessions[user].id & (USER_ID_HASH_SIZE - 1);
+  while (table.idIndex[index] >= 0) {
+    index = (index + 1) & (USER_ID_HASH_SIZE - 1);
+  }
+  table.idIndex[index] = user;
+  table.count++;
+  return true;
+}
+
+// The cipher slot keyed for a user, expanding its key on a miss in place
+// of the least recently used slot
+inline int userCipherSlot(SessionTable &table, const SessionCrypto &crypto, int user) {
+  int victim = 0;
+  for (int slot = 0; slot < USER_CIPHER_CACHE; slot++) {
+    if (table.slotUser[slot] == user) {
+      table.slotUsed[slot] = ++table.clock;
+      return slot;
+    }
+    if (table.slotUsed[slot] < table.slotUsed[victim]) {
+      victim = slot;
+    }
+  }
+  table.misses++;
+  crypto.setKey(victim, table.sessions[user].key);
+  table.slotUser[victim] = user;
+  table.slotUsed[victim] = ++table.clock;
+  return victim;
+}
+
+inline size_t sealUserFrameTo(SessionTable &table, const SessionCrypto &crypto, int user, uint32_t counter,
+                              const char *text, size_t len, uint8_t *frame) {
+  int slot = userCipherSlot(table, crypto, user);
+  return sealUserFrame(crypto, slot, table.sessions[user], USER_DOWN, counter, text, len, frame);
+}
+
+// Decrypt an uplink frame from whichever user it authenticates as; the
+// user's index, or USER_FRAME_REJECTED / USER_FRAME_REPLAYED
+inline int openUserFrame(SessionTable &table, const SessionCrypto &crypto, const uint8_t *frame, size_t len,
+                         char *text) {
+  if (userFrameTextLength(frame, len, USER_UP) < 0) {
+    return USER_FRAME_REJECTED;
+  }
+  uint16_t id = userFrameId(frame);
+  for (int index = id & (USER_ID_HASH_SIZE - 1); table.idIndex[index] >= 0;
+       index = (index + 1) & (USER_ID_HASH_SIZE - 1)) {
+    int user = table.idIndex[index];
+    if (table.sessions[user].id != id) {
+      continue;
+    }
+    int result = openSessionFrame(crypto, userCipherSlot(table, crypto, user), table.sessions[user], frame, len,
+                                  USER_UP, text);
+    if (result != USER_FRAME_REJECTED) {
+      return result == 0 ? user : result;
+    }
+  }
+  return USER_FRAME_REJECTED;
+}
@@ -0,0 +1,35 @@
+// Minimal assertions for the host tests: a failed CHECK prints its
+// location and counts, and checkResult() turns the count into the exit
+// status that ctest reads.
+#pragma once
+
+#include <stdio.h>
+
+static int checkFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      checkFailures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQ(a, b) \
+  do { \
+    long long checkA = (long long)(a), checkB = (long long)(b); \
+    if (checkA != checkB) { \
+      fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, \
+              checkA, checkB); \
+      checkFailures++; \
+    } \
+  } while (0)
+
+inline int checkResult(const char *name) {
+  if (checkFailures) {
+    fprintf(stderr, "%s: %d check(s) failed\n", name, checkFailures);
+    return 1;
+  }
+  printf("%s: ok\n", name);
+  return 0;
+}
@@ -0,0 +1,215 @@
+// The tx-rx-ap-ssh remote console on host sockets, for tests/console_nc.sh
+// or by hand with nc:
+//
+//   console_host PORT [--rx-ms N] [--stall-ms N] [--seconds N]
+//   nc 127.0.0.1 PORT
+//
+// Login, commands and fan-out are testing/tx-rx/tx-rx-ap-ssh/
+// console_session.h, as on the device. The radio is a stand-in: a message
+// is published as sent, and every rx-ms a line is published as received.
+// Each session's window is SEND_WINDOW bytes, about what AsyncClient's
+// space() offers, on top of a small socket buffer, so a client that stops
+// reading is skipped ahead and then dropped.
+#include <arpa/inet.h>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "console_session.h"
+#include "message_text.h"
+
+#define MAX_SESSIONS 4   // As CONSOLE_MAX_SESSIONS
+#define SEND_WINDOW 5744
+#define SOCKET_BUFFER 4096
+#define CHANNELS 4
+#define KEYS 4
+
+const char *USER = "admin";
+const char *PASSWORD = "admin123";
+
+// AsyncClient's send side: add() queues, send() writes what the socket takes
+struct HostClient {
+  int fd;
+  std::string out;
+  size_t space() const { return out.size() < SEND_WINDOW ? SEND_WINDOW - out.size() : 0; }
+  void add(const char *data, size_t len) { out.append(data, len); }
+  void send() {
+    while (!out.empty()) {
+      ssize_t sent = ::send(fd, out.data(), out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (sent <= 0) {
+        return;
+      }
+      out.erase(0, sent);
+    }
+  }
+  void write(const char *text) {
+    add(text, strlen(text));
+    send();
+  }
+};
+
+struct Slot {
+  bool used;
+  HostClient client;
+  ConsoleSession session;
+};
+
+ConsoleRing ring;
+Slot slots[MAX_SESSIONS];
+int channel = 1, key = 1;
+auto startTime = std::chrono::steady_clock::now();
+
+uint32_t millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void publish(const char *text) {
+  consolePublish(ring, text, strlen(text));
+}
+
+// handleCommandLine() with the radio left out
+void runCommand(Slot &slot, const char *line) {
+  char text[CONSOLE_LINE_MAX + 32];
+  if (strncmp(line, "C ", 2) == 0) {
+    int freq, index;
+    if (!parseChannelCommand(line, CHANNELS, KEYS, freq, index)) {
+      slot.client.write("Invalid frequency or key. Use 'C <freq> <key>' (e.g., 'C 2 3').\r\n");
+      return;
+    }
+    channel = freq;
+    key = index;
+    snprintf(text, sizeof(text), "Channel %d-%d", channel, key);
+  } else {
+    snprintf(text, sizeof(text), "TX ch%d-%d: %s", channel, key, line);
+  }
+  publish(text);
+}
+
+void closeSlot(Slot &slot) {
+  close(slot.client.fd);
+  slot.used = false;
+}
+
+void accept(int listener) {
+  int fd = ::accept(listener, nullptr, nullptr);
+  if (fd < 0) {
+    return;
+  }
+  int one = 1, buffer = SOCKET_BUFFER;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  for (Slot &slot : slots) {
+    if (!slot.used) {
+      slot.used = true;
+      slot.client.fd = fd;
+      slot.client.out.clear();
+      memset(&slot.session, 0, sizeof(slot.session));
+      slot.client.write(CONSOLE_BANNER);
+      return;
+    }
+  }
+  ::send(fd, "Too many sessions\r\n", 19, MSG_NOSIGNAL);
+  close(fd);
+}
+
+// onConsoleData(); false once the session is over
+bool receive(Slot &slot) {
+  char bytes[512];
+  ssize_t len = recv(slot.client.fd, bytes, sizeof(bytes), 0);
+  if (len <= 0) {
+    return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+  for (ssize_t i = 0; i < len; i++) {
+    if (!consoleFeed(slot.session, bytes[i])) {
+      continue;
+    }
+    const char *reply;
+    ConsoleAction action = consoleLine(slot.session, ring, millis(), USER, PASSWORD, reply);
+    if (reply) {
+      slot.client.write(reply);
+    }
+    if (action == CONSOLE_CLOSE) {
+      slot.client.send();
+      return false;
+    }
+    if (action == CONSOLE_RUN) {
+      runCommand(slot, slot.session.line);
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s PORT [--rx-ms N] [--stall-ms N] [--seconds N]\n", argv[0]);
+    return 2;
+  }
+  int port = atoi(argv[1]);
+  uint32_t rxMs = 1000, stallMs = CONSOLE_STALL_MS, seconds = 0;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    uint32_t value = strtoul(argv[i + 1], nullptr, 10);
+    if (strcmp(argv[i], "--rx-ms") == 0) {
+      rxMs = value;
+    } else if (strcmp(argv[i], "--stall-ms") == 0) {
+      stallMs = value;
+    } else if (strcmp(argv[i], "--seconds") == 0) {
+      seconds = value;
+    }
+  }
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listener, (sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 8) < 0) {
+    perror("console_host");
+    return 1;
+  }
+  printf("Console on 127.0.0.1:%d, user %s\n", port, USER);
+  fflush(stdout);
+
+  uint32_t nextRx = rxMs, frames = 0;
+  while (seconds == 0 || millis() < seconds * 1000) {
+    pollfd fds[MAX_SESSIONS + 1] = {{listener, POLLIN, 0}};
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      fds[i + 1] = {slots[i].used ? slots[i].client.fd : -1, POLLIN, 0};
+    }
+    poll(fds, MAX_SESSIONS + 1, 5);
+    if (fds[0].revents & POLLIN) {
+      accept(listener);
+    }
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      if (slots[i].used && fds[i + 1].revents && !receive(slots[i])) {
+        closeSlot(slots[i]);
+      }
+    }
+
+    uint32_t now = millis();
+    if (rxMs && now >= nextRx) {
+      char text[64];
+      snprintf(text, sizeof(text), "RX ch%d-%d RSSI -87: frame %u", channel, key, (unsigned)++frames);
+      publish(text);
+      nextRx += rxMs;
+    }
+    // consoleTick()
+    for (Slot &slot : slots) {
+      if (slot.used && !consoleFlush(slot.session, ring, slot.client, now, stallMs)) {
+        closeSlot(slot);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,78 @@
+#!/usr/bin/env bash
+# The tx-rx-ap-ssh console over TCP, against console_host: a session
+# watching traffic sees what another one sends, commands and bad logins get
+# their replies, and a fifth connection is turned away. Clients are nc, or
+# bash's /dev/tcp where nc is not installed.
+#
+#   console_nc.sh path/to/console_host
+set -u
+HOST=$1
+PORT=$((20000 + $$ % 20000))
+DIR=$(mktemp -d)
+"$HOST" "$PORT" --rx-ms 200 --seconds 30 > "$DIR/host.txt" &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+# session OUT: send stdin to the console, save what comes back in OUT
+session() {
+  if command -v nc > /dev/null; then
+    nc 127.0.0.1 "$PORT" > "$1"
+  else
+    exec 3<> "/dev/tcp/127.0.0.1/$PORT" || return
+    cat >&3 &
+    cat <&3 > "$1"
+  fi
+}
+
+for i in $(seq 50); do
+  (exec 3<> "/dev/tcp/127.0.0.1/$PORT") 2> /dev/null && break
+  sleep 0.1
+done
+
+# A watcher logs in and only reads; another session sends
+{ printf 'admin\nadmin123\n'; sleep 2; printf 'quit\n'; } | session "$DIR/watch.txt" &
+WATCH=$!
+sleep 0.5
+{ printf 'admin\r\nadmin123\r\n'; sleep 0.3; printf 'hello\nC 2 3\nC 9 9\n'; sleep 0.3; printf 'quit\n'; } |
+  session "$DIR/send.txt"
+{ printf 'admin\nwrong\nadmin\nwrong\nadmin\nwrong\n'; sleep 1; } | session "$DIR/login.txt"
+wait $WATCH
+
+# Four sessions fill the table; a fifth is refused
+HOLD=
+for i in 1 2 3 4; do
+  { printf 'admin\nadmin123\n'; sleep 1.5; printf 'quit\n'; } | session "$DIR/hold$i.txt" &
+  HOLD="$HOLD $!"
+done
+sleep 0.5
+{ sleep 0.5; } | session "$DIR/extra.txt"
+wait $HOLD
+
+failures=0
+expect() {
+  if ! grep -q -- "$2" "$DIR/$1"; then
+    echo "FAIL: $1 lacks '$2'"
+    sed 's/^/  | /' "$DIR/$1"
+    failures=$((failures + 1))
+  fi
+}
+expect watch.txt "Logged in"
+expect watch.txt "RX ch1-1 RSSI -87: frame"
+expect watch.txt "TX ch1-1: hello"
+expect watch.txt "Channel 2-3"
+expect watch.txt "RX ch2-3 RSSI -87: frame"
+expect send.txt "TX ch1-1: hello"
+expect send.txt "Invalid frequency or key"
+expect login.txt "Login incorrect"
+expect hold1.txt "Logged in"
+expect extra.txt "Too many sessions"
+if [ "$(grep -c 'Login incorrect' "$DIR/login.txt")" != 2 ]; then
+  echo "FAIL: the third bad password should close the session"
+  failures=$((failures + 1))
+fi
+
+if [ $failures -gt 0 ]; then
+  echo "console_nc: $failures failed"
+  exit 1
+fi
+echo "console_nc: ok"
@@ -0,0 +1,121 @@
+// HMAC-SHA256 for host tests, which build without mbedtls or OpenSSL.
+// Small and slow; checked against RFC 4231 by tests/test_command_channel.cpp.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+struct Sha256 {
+  uint32_t h[8];
+  uint8_t block[64];
+  size_t used;
+  uint64_t bytes;
+};
+
+inline uint32_t sha256Rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+inline void sha256Block(Sha256 &ctx, const uint8_t *p) {
+  static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+  };
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = sha256Rotr(w[i - 15], 7) ^ sha256Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = sha256Rotr(w[i - 2], 17) ^ sha256Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t v[8];
+  memcpy(v, ctx.h, sizeof(v));
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = sha256Rotr(v[4], 6) ^ sha256Rotr(v[4], 11) ^ sha256Rotr(v[4], 25);
+    uint32_t t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6])) + K[i] + w[i];
+    uint32_t s0 = sha256Rotr(v[0], 2) ^ sha256Rotr(v[0], 13) ^ sha256Rotr(v[0], 22);
+    uint32_t t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+    memmove(v + 1, v, 7 * sizeof(uint32_t));
+    v[4] += t1;
+    v[0] = t1 + t2;
+  }
+  for (int i = 0; i < 8; i++) {
+    ctx.h[i] += v[i];
+  }
+}
+
+inline void sha256Start(Sha256 &ctx) {
+  static const uint32_t H[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(ctx.h, H, sizeof(H));
+  ctx.used = 0;
+  ctx.bytes = 0;
+}
+
+inline void sha256Update(Sha256 &ctx, const uint8_t *data, size_t len) {
+  ctx.bytes += len;
+  while (len--) {
+    ctx.block[ctx.used++] = *data++;
+    if (ctx.used == 64) {
+      sha256Block(ctx, ctx.block);
+      ctx.used = 0;
+    }
+  }
+}
+
+inline void sha256Finish(Sha256 &ctx, uint8_t *digest) {
+  uint64_t bits = ctx.bytes * 8;
+  uint8_t pad = 0x80;
+  sha256Update(ctx, &pad, 1);
+  pad = 0;
+  while (ctx.used != 56) {
+    sha256Update(ctx, &pad, 1);
+  }
+  uint8_t length[8];
+  for (int i = 0; i < 8; i++) {
+    length[i] = bits >> (56 - 8 * i);
+  }
+  sha256Update(ctx, length, 8);
+  for (int i = 0; i < 8; i++) {
+    for (int b = 0; b < 4; b++) {
+      digest[4 * i + b] = ctx.h[i] >> (24 - 8 * b);
+    }
+  }
+}
+
+// The same result as mbedtls_md_hmac() with MBEDTLS_MD_SHA256
+inline void hmacSha256(const uint8_t *key, size_t keyLen, const uint8_t *data, size_t len, uint8_t *mac) {
+  uint8_t block[64] = {0};
+  Sha256 ctx;
+  if (keyLen > 64) {
+    sha256Start(ctx);
+    sha256Update(ctx, key, keyLen);
+    sha256Finish(ctx, block);
+  } else {
+    memcpy(block, key, keyLen);
+  }
+  uint8_t pad[64], inner[32];
+  for (int i = 0; i < 64; i++) {
+    pad[i] = block[i] ^ 0x36;
+  }
+  sha256Start(ctx);
+  sha256Update(ctx, pad, 64);
+  sha256Update(ctx, data, len);
+  sha256Finish(ctx, inner);
+  for (int i = 0; i < 64; i++) {
+    pad[i] = block[i] ^ 0x5c;
+  }
+  sha256Start(ctx);
+  sha256Update(ctx, pad, 64);
+  sha256Update(ctx, inner, 32);
+  sha256Finish(ctx, mac);
+}
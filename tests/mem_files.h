@@ -0,0 +1,72 @@
+// Files in memory for the host tests and benchmarks, behind the same
+// read/write functions the sketches give their stores. Writes can be cut
+// short after a byte budget, as a full filesystem or a power cut leaves
+// them, and every call is counted.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+std::map<std::string, std::vector<uint8_t> > memFiles;
+long memWriteBudget = -1;  // Bytes left before writes fall short; -1 for no limit
+size_t memReads = 0, memWrites = 0, memBytesWritten = 0;
+
+size_t memRead(const char *path, size_t offset, uint8_t *data, size_t len) {
+  memReads++;
+  auto file = memFiles.find(path);
+  if (file == memFiles.end() || offset >= file->second.size()) {
+    return 0;
+  }
+  size_t got = file->second.size() - offset < len ? file->second.size() - offset : len;
+  memcpy(data, file->second.data() + offset, got);
+  return got;
+}
+
+bool memWrite(const char *path, bool append, const uint8_t *data, size_t len) {
+  memWrites++;
+  std::vector<uint8_t> &file = memFiles[path];
+  if (!append) {
+    file.clear();
+  }
+  size_t written = len;
+  if (memWriteBudget >= 0 && (long)len > memWriteBudget) {
+    written = memWriteBudget;
+  }
+  if (memWriteBudget >= 0) {
+    memWriteBudget -= written;
+  }
+  file.insert(file.end(), data, data + written);
+  memBytesWritten += written;
+  return written == len;
+}
+
+// Write within or past the end of a file, as LittleFS does with "r+"
+// after a seek; a gap is filled with zeros
+bool memWriteAt(const char *path, size_t offset, const uint8_t *data, size_t len) {
+  memWrites++;
+  std::vector<uint8_t> &file = memFiles[path];
+  size_t written = len;
+  if (memWriteBudget >= 0 && (long)len > memWriteBudget) {
+    written = memWriteBudget;
+  }
+  if (memWriteBudget >= 0) {
+    memWriteBudget -= written;
+  }
+  if (file.size() < offset + written) {
+    file.resize(offset + written);
+  }
+  memcpy(file.data() + offset, data, written);
+  memBytesWritten += written;
+  return written == len;
+}
+
+void memReset() {
+  memFiles.clear();
+  memWriteBudget = -1;
+  memReads = memWrites = memBytesWritten = 0;
+}
@@ -0,0 +1,212 @@
+// HTTP admission control from common/admission.h: each check on its own,
+// then a soak of simulated clients against the in-flight, WebSocket and
+// rate limits, across a millis() wrap
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "admission.h"
+#include "check.h"
+
+#define HEAP 100000
+#define BODY_MAX 2048
+#define UPLOAD_MAX 65536
+
+size_t openSockets = 0;
+
+const AdmissionLimits LIMITS = {
+  24576,  // heapReserve
+  4,      // maxInFlight
+  2,      // maxUpgrades
+  5,      // ratePerS
+  10,     // burst
+  8,      // clients
+  [](const char *url) -> size_t { return strcmp(url, "/upload") == 0 ? UPLOAD_MAX : BODY_MAX; },
+  []() { return openSockets; },
+};
+
+// The same limits for a sketch with no WebSocket
+const AdmissionLimits NO_SOCKETS = {24576, 4, 0, 5, 10, 8, LIMITS.bodyMax, nullptr};
+
+void reset(Admission &admission, const AdmissionLimits &limits) {
+  memset(&admission, 0, sizeof(admission));
+  admission.limits = &limits;
+  openSockets = 0;
+}
+
+int get(Admission &admission, uint32_t ip, uint32_t now, const char *url = "/", size_t body = 0) {
+  return admitRequest(admission, url, body, false, ip, HEAP, now);
+}
+
+void testChecks() {
+  Admission admission;
+  reset(admission, LIMITS);
+  CHECK_EQ(admitRequest(admission, "/", 0, false, 1, 24575, 0), ADMIT_HEAP);
+  CHECK_EQ(get(admission, 1, 0, "/", BODY_MAX + 1), ADMIT_BODY);
+  CHECK_EQ(get(admission, 1, 0, "/upload", BODY_MAX + 1), ADMIT_OK);  // The route's own cap
+  CHECK_EQ(get(admission, 1, 0, "/upload", UPLOAD_MAX + 1), ADMIT_BODY);
+  CHECK_EQ(admission.inFlight, 1);
+  CHECK_EQ(admission.rejected[ADMIT_HEAP], 1);
+  CHECK_EQ(admission.rejected[ADMIT_BODY], 2);
+
+  // Rejections spend no tokens and take no slot
+  for (int i = 0; i < 3; i++) {
+    CHECK_EQ(get(admission, 1, 0), ADMIT_OK);
+  }
+  CHECK_EQ(get(admission, 2, 0), ADMIT_BUSY);
+  admitRelease(admission);
+  CHECK_EQ(get(admission, 2, 0), ADMIT_OK);
+  for (int i = 0; i < 4; i++) {
+    admitRelease(admission);
+  }
+  admitRelease(admission);  // One too many is ignored
+  CHECK_EQ(admission.inFlight, 0);
+}
+
+void testRate() {
+  Admission admission;
+  reset(admission, LIMITS);
+  int admitted = 0;
+  for (int i = 0; i < 20; i++) {
+    if (get(admission, 7, 1000) == ADMIT_OK) {
+      admitted++;
+      admitRelease(admission);
+    }
+  }
+  CHECK_EQ(admitted, 10);  // The burst
+  CHECK_EQ(admission.rejected[ADMIT_RATE], 10);
+  CHECK_EQ(get(admission, 7, 1199), ADMIT_RATE);
+  CHECK_EQ(get(admission, 7, 1200), ADMIT_OK);  // One request per 200 ms
+  admitRelease(admission);
+  CHECK_EQ(get(admission, 8, 1200), ADMIT_OK);  // Other clients have their own bucket
+  admitRelease(admission);
+
+  // Past 'clients' addresses the least recently seen bucket is reused
+  for (int i = 0; i < LIMITS.clients; i++) {
+    CHECK_EQ(get(admission, 100 + i, 2000 + i), ADMIT_OK);
+    admitRelease(admission);
+  }
+  for (int i = 0; i < LIMITS.clients; i++) {
+    CHECK(admission.buckets[i].ip >= 100);
+  }
+}
+
+void testUpgrades() {
+  Admission admission;
+  reset(admission, LIMITS);
+  for (int i = 0; i < LIMITS.maxInFlight; i++) {
+    CHECK_EQ(get(admission, 1, 0), ADMIT_OK);
+  }
+  // A socket holds no slot, so it gets in while requests are open...
+  CHECK(!admitHoldsSlot(admission, true));
+  CHECK_EQ(admitRequest(admission, "/ws", 0, true, 2, HEAP, 0), ADMIT_OK);
+  CHECK_EQ(admission.inFlight, LIMITS.maxInFlight);
+  openSockets = 2;
+  // ...but the open sockets are capped
+  CHECK_EQ(admitRequest(admission, "/ws", 0, true, 2, HEAP, 0), ADMIT_BUSY);
+  openSockets = 1;
+  CHECK_EQ(admitRequest(admission, "/ws", 0, true, 2, HEAP, 0), ADMIT_OK);
+
+  // With no WebSocket an upgrade is an ordinary request
+  reset(admission, NO_SOCKETS);
+  CHECK(admitHoldsSlot(admission, true));
+  CHECK_EQ(admitRequest(admission, "/ws", 0, true, 2, HEAP, 0), ADMIT_OK);
+  CHECK_EQ(admission.inFlight, 1);
+}
+
+// Simulated clients, one step per millisecond: each sends faster than
+// its rate allows and holds an admitted request open for a few ms; now and
+// then one opens or closes a socket. Free heap dips and oversized bodies
+// are mixed in. With 'churn' most requests come from a wide address range
+// that keeps evicting buckets; without it FAIR clients share the buckets
+// with no one else, so each must get its rate and burst and no more.
+#define STEPS 2000000  // About 33 minutes
+#define FAIR 6
+
+void soak(bool churn) {
+  Admission admission;
+  reset(admission, LIMITS);
+  srand(churn ? 42 : 7);
+  std::vector<uint32_t> closesAt;
+  uint32_t admittedBy[FAIR] = {0};
+  uint32_t start = 0xFFFFFFFF - 600000;  // millis() wraps ten minutes in
+  uint32_t sent = 0, admitted = 0, upgrades = 0;
+
+  for (uint32_t step = 0; step < STEPS; step++) {
+    uint32_t now = start + step;
+    for (size_t i = 0; i < closesAt.size();) {
+      if (closesAt[i] == now) {
+        admitRelease(admission);
+        closesAt[i] = closesAt.back();
+        closesAt.pop_back();
+      } else {
+        i++;
+      }
+    }
+    if (openSockets > 0 && rand() % 20000 == 0) {
+      openSockets--;
+    }
+    // Fair clients send about 6.25 requests a second each; with churn
+    // there are 250 a second in all
+    if (rand() % (churn ? 4 : 160 / FAIR)) {
+      continue;
+    }
+
+    int client = rand() % FAIR;
+    uint32_t ip = churn ? 0xC0A80000 + rand() % 1000 : 0x0A000001 + client;
+    bool upgrade = churn && rand() % 50 == 0;
+    uint32_t heap = rand() % 1000 == 0 ? 10000 : HEAP;
+    size_t body = rand() % 200 == 0 ? BODY_MAX + 1 : rand() % BODY_MAX;
+    int result = admitRequest(admission, upgrade ? "/ws" : "/", body, upgrade, ip, heap, now);
+    sent++;
+
+    CHECK(admission.inFlight <= LIMITS.maxInFlight);
+    if (result != ADMIT_OK) {
+      continue;
+    }
+    admitted++;
+    CHECK(heap >= LIMITS.heapReserve && body <= BODY_MAX);
+    admittedBy[client]++;
+    if (upgrade) {
+      CHECK(openSockets < LIMITS.maxUpgrades);
+      openSockets++;
+      upgrades++;
+    } else {
+      closesAt.push_back(now + 1 + rand() % 8);
+    }
+    CHECK_EQ(admission.inFlight, closesAt.size());
+  }
+
+  uint32_t bound = LIMITS.burst + (uint64_t)STEPS * LIMITS.ratePerS / 1000;
+  if (!churn) {
+    for (int client = 0; client < FAIR; client++) {
+      CHECK(admittedBy[client] <= bound);
+      CHECK(admittedBy[client] >= bound * 9 / 10);
+    }
+  } else {
+    CHECK(upgrades > 0);
+  }
+
+  // Every request was admitted or counted once, and every slot comes back
+  uint32_t rejected = 0;
+  for (int result = ADMIT_HEAP; result < ADMIT_RESULTS; result++) {
+    rejected += admission.rejected[result];
+  }
+  CHECK_EQ(admitted + rejected, sent);
+  CHECK(admission.rejected[ADMIT_HEAP] > 0 && admission.rejected[ADMIT_BODY] > 0);
+  CHECK(admission.rejected[churn ? ADMIT_BUSY : ADMIT_RATE] > 0);
+  for (size_t i = 0; i < closesAt.size(); i++) {
+    admitRelease(admission);
+  }
+  CHECK_EQ(admission.inFlight, 0);
+}
+
+int main() {
+  testChecks();
+  testRate();
+  testUpgrades();
+  soak(false);
+  soak(true);
+  return checkResult("admission");
+}
@@ -0,0 +1,236 @@
+// Low-water alarms from Automation/haltec_hydro/traffic_classes.h under a
+// saturated TX path: the node always has a report waiting, and the alarm
+// logic, slots and preemption run as loop() runs them, one pass per
+// millisecond, against a simulated half-duplex channel to the gateway.
+// Measured: change to first reception at the gateway, and to the
+// ALARM_ACK back at the node, with and without frame loss, and what a
+// sensor flapping around its threshold costs the channel.
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "check.h"
+#include "traffic_classes.h"
+
+#define NODE_ID 0x1234
+#define BULK_LEN 60      // A KEY report with a few zones
+#define CONTROL_LEN 20   // A STATE reply
+#define TURNAROUND_MS 5  // Gateway RX to its reply starting
+#define ACK_LEN (TELEMETRY_HEADER + 1)
+
+uint32_t randomState = 1;
+uint32_t nextRandom() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+struct Sim {
+  // Node
+  TxSlot slots[TRAFFIC_CLASSES];
+  AlarmState alarm;
+  TxAnswerWait answer;
+  bool transmitting;
+  int onAir;
+  uint32_t txEndsAt;  // ms
+  uint32_t txStartedAt;
+  // Gateway: its last reply, from replyAt to replyEndsAt
+  bool replying;
+  bool replyIsAlarmAck;
+  uint8_t replySeq;
+  uint32_t replyAt, replyEndsAt;
+  bool replyHeard;  // The node listened all through it
+  // Traffic and results
+  uint32_t lossPercent;
+  uint32_t controlEveryMs;
+  bool preemptBulk;
+  uint32_t changedAt;
+  bool waitDelivery, waitAck;
+  std::vector<uint32_t> delivered, acked;
+  uint32_t alarmFrames, preempted, bulkAirMs, bulkFrames, elapsedMs;
+};
+
+bool lost(const Sim &sim) {
+  return nextRandom() % 100 < sim.lossPercent;
+}
+
+uint32_t airtimeMs(int cls, size_t len) {
+  return (frameAirtimeUs(cls == TRAFFIC_ALARM ? ALARM_PROFILE : HYDRO_PROFILE, len) + 999) / 1000;
+}
+
+// The gateway hears a frame that ended now, unless it was replying during
+// the frame or the frame was lost, and starts its reply
+void gatewayReceive(Sim &sim, uint32_t now) {
+  bool clash = sim.replyAt < now && sim.replyEndsAt > sim.txStartedAt;
+  if (clash || lost(sim) || sim.onAir == TRAFFIC_CONTROL) {
+    return;
+  }
+  const TxSlot &frame = sim.slots[sim.onAir];
+  sim.replying = true;
+  sim.replyIsAlarmAck = sim.onAir == TRAFFIC_ALARM;
+  sim.replySeq = frame.data[3];
+  sim.replyAt = now + TURNAROUND_MS;
+  sim.replyEndsAt = sim.replyAt + airtimeMs(TRAFFIC_BULK, ACK_LEN);
+  sim.replyHeard = !lost(sim);
+  if (sim.onAir == TRAFFIC_ALARM) {
+    if (sim.waitDelivery && frame.data[3] == sim.alarm.seq) {
+      sim.delivered.push_back(now - sim.changedAt);
+      sim.waitDelivery = false;
+    }
+  } else {
+    sim.bulkAirMs += airtimeMs(TRAFFIC_BULK, BULK_LEN);
+    sim.bulkFrames++;
+  }
+}
+
+// One loop() pass: radioTick(), alarmTick(), telemetryTick(), txTick()
+void pass(Sim &sim, uint32_t now) {
+  if (sim.replying && now >= sim.replyAt && sim.transmitting) {
+    sim.replyHeard = false;  // Half duplex: the node talked over the reply
+  }
+  if (sim.replying && now >= sim.replyEndsAt) {
+    sim.replying = false;
+    uint8_t ack[ACK_LEN] = {TELEMETRY_MARK | FRAME_ALARM_ACK, NODE_ID & 0xFF, NODE_ID >> 8, sim.replySeq, 0};
+    sim.answer.waiting = sim.answer.waiting && !sim.replyHeard;
+    if (sim.replyIsAlarmAck && sim.replyHeard && alarmAcked(sim.alarm, ack, sizeof(ack)) && sim.waitAck) {
+      sim.acked.push_back(now - sim.changedAt);
+      sim.waitAck = false;
+    }
+  }
+  if (sim.transmitting && now >= sim.txEndsAt) {
+    sim.transmitting = false;
+    gatewayReceive(sim, now);
+    txSent(sim.answer, sim.onAir, now);
+  }
+
+  int result = alarmStep(sim.alarm, now, nextRandom() % ALARM_RETRY_JITTER_MS);
+  if (result & ALARM_CHANGED) {
+    sim.changedAt = now;
+    sim.waitDelivery = sim.waitAck = true;
+  }
+  if (result & ALARM_SEND) {
+    uint8_t frame[ALARM_FRAME_LEN];
+    queueTxFrame(sim.slots, TRAFFIC_ALARM, frame, encodeAlarm(frame, NODE_ID, sim.alarm, 4));
+    sim.alarmFrames++;
+  }
+
+  // Saturated: a report waits whenever none is waiting or on the air
+  uint8_t frame[BULK_LEN] = {TELEMETRY_MARK | FRAME_KEY, NODE_ID & 0xFF, NODE_ID >> 8};
+  if (!sim.slots[TRAFFIC_BULK].queued && !(sim.transmitting && sim.onAir == TRAFFIC_BULK)) {
+    queueTxFrame(sim.slots, TRAFFIC_BULK, frame, sizeof(frame));
+  }
+  if (sim.controlEveryMs && now % sim.controlEveryMs == 0) {
+    queueTxFrame(sim.slots, TRAFFIC_CONTROL, frame, CONTROL_LEN);
+  }
+
+  if ((sim.transmitting && !sim.preemptBulk) || txAwaitingAnswer(sim.answer, now)) {
+    return;
+  }
+  bool preempt;
+  int c = nextTxClass(sim.slots, sim.transmitting, sim.onAir, preempt);
+  sim.preempted += preempt;
+  if (c >= 0) {
+    sim.transmitting = true;
+    sim.onAir = c;
+    sim.txStartedAt = now;
+    sim.txEndsAt = now + airtimeMs(c, sim.slots[c].len);
+  }
+}
+
+// 'changes' low-water changes, gapMs to 1.5 gapMs apart, plus time to settle
+Sim run(uint32_t lossPercent, bool preemptBulk, int changes, uint32_t gapMs) {
+  Sim sim{};
+  initAlarm(sim.alarm);
+  sim.lossPercent = lossPercent;
+  sim.preemptBulk = preemptBulk;
+  sim.controlEveryMs = 7000;
+  randomState = 12345;
+  uint32_t now = 1;
+  for (int i = 0; i < changes; i++) {
+    uint32_t changeAt = now + gapMs + nextRandom() % (gapMs / 2);
+    for (; now < changeAt; now++) {
+      pass(sim, now);
+    }
+    sim.alarm.lowWater ^= 1u << (i % 4);
+  }
+  for (uint32_t end = now + ALARM_REFILL_MS * ALARM_BURST; now < end; now++) {
+    pass(sim, now);
+  }
+  sim.elapsedMs = now;
+  return sim;
+}
+
+uint32_t percentile(std::vector<uint32_t> values, int p) {
+  std::sort(values.begin(), values.end());
+  return values.empty() ? 0 : values[(values.size() - 1) * p / 100];
+}
+
+void report(const char *name, const Sim &sim) {
+  printf("%-28s delivered p50 %4u p99 %4u max %4u ms, acked p50 %4u p99 %4u max %4u ms, %u frames, %u preempted\n",
+         name, (unsigned)percentile(sim.delivered, 50), (unsigned)percentile(sim.delivered, 99),
+         (unsigned)percentile(sim.delivered, 100), (unsigned)percentile(sim.acked, 50),
+         (unsigned)percentile(sim.acked, 99), (unsigned)percentile(sim.acked, 100), (unsigned)sim.alarmFrames,
+         (unsigned)sim.preempted);
+}
+
+// A clean channel: the alarm cuts in ahead of the report on the air, waits
+// at most for a STATE reply, and is acknowledged the first time
+void testSaturated() {
+  const int CHANGES = 100;
+  Sim sim = run(0, true, CHANGES, ALARM_REFILL_MS);
+  report("saturated, no loss", sim);
+  CHECK_EQ(sim.acked.size(), CHANGES);
+  // At worst behind a STATE reply or the answer to a report
+  uint32_t bound = std::max(airtimeMs(TRAFFIC_CONTROL, CONTROL_LEN), (uint32_t)TX_ANSWER_WINDOW_MS) +
+                   airtimeMs(TRAFFIC_ALARM, ALARM_FRAME_LEN) + 2;
+  CHECK(percentile(sim.delivered, 100) <= bound);
+  CHECK(percentile(sim.acked, 100) <= bound + TURNAROUND_MS + airtimeMs(TRAFFIC_BULK, ACK_LEN) + 1);
+  CHECK_EQ(sim.alarmFrames, CHANGES);
+  CHECK(sim.preempted > CHANGES / 2);
+
+  // Waiting behind the report instead takes up to a report's airtime more
+  Sim waiting = run(0, false, CHANGES, ALARM_REFILL_MS);
+  report("saturated, no preemption", waiting);
+  CHECK(percentile(waiting.delivered, 50) > percentile(sim.delivered, 50));
+  CHECK(percentile(waiting.delivered, 90) > bound);
+}
+
+// A lossy channel: retries get every alarm through, within the rounds one
+// token pays for
+void testLossy() {
+  const int CHANGES = 100;
+  Sim sim = run(30, true, CHANGES, ALARM_REFILL_MS);
+  report("saturated, 30% loss", sim);
+  CHECK_EQ(sim.acked.size(), CHANGES);
+  CHECK(percentile(sim.acked, 50) < ALARM_RETRY_MS);
+  CHECK(percentile(sim.acked, 100) < 2 * ALARM_MAX_ATTEMPTS * (ALARM_RETRY_MS + ALARM_RETRY_JITTER_MS));
+}
+
+// A sensor flapping every 200 ms for ten minutes: alarms stay within the
+// token bucket, reports keep nearly all the airtime, and the last set is
+// reported once tokens come back
+void testFlapping() {
+  const uint32_t MINUTES = 10;
+  Sim sim = run(0, true, MINUTES * 60 * 4, 200);
+  report("flapping every 200 ms", sim);
+  uint32_t rounds = ALARM_BURST + MINUTES + ALARM_BURST + 1;
+  CHECK(sim.alarmFrames <= rounds * ALARM_MAX_ATTEMPTS);
+  CHECK_EQ(sim.alarm.reported, sim.alarm.lowWater);
+  CHECK(!sim.alarm.pending);
+
+  // Against a quiet sensor, where reports and their answers fill the time
+  Sim quiet = run(0, true, 0, 200);
+  double share = (double)sim.bulkAirMs / sim.elapsedMs, quietShare = (double)quiet.bulkAirMs / quiet.elapsedMs;
+  CHECK(share > 0.97 * quietShare);
+  printf("%-28s %u alarm frames in %u min, reports on the air %.1f%% of the time (%.1f%% quiet)\n", "",
+         (unsigned)sim.alarmFrames, (unsigned)MINUTES, 100 * share, 100 * quietShare);
+}
+
+int main() {
+  testSaturated();
+  testLossy();
+  testFlapping();
+  return checkResult("alarm_latency");
+}
@@ -0,0 +1,259 @@
+// End-to-end relay commands over a lossy simulated link: the gateway's
+// RelayCommand (testing/tx-rx/tx-rx-ap-httpd/hydro_codec.h) against the
+// node's receiveCommand() (Automation/haltec_hydro/telemetry_codec.h).
+//
+// Both ends tag frames with HMAC-SHA256 truncated to COMMAND_TAG_LEN, as
+// the sketches do with mbedtls; tests/hmac_sha256.h stands in for it.
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "hmac_sha256.h"
+#include "hydro_codec.h"
+#include "telemetry_codec.h"
+
+#define NODE_ID 0x4242
+#define RELAYS 10
+#define TICK_MS 100
+#define FRAME_MAX (TELEMETRY_HEADER + 5 + TELEMETRY_MAX_RELAYS + COMMAND_TAG_LEN + 1)
+
+uint32_t rngState = 1;
+uint32_t nextRandom() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+// Truncated HMAC-SHA256, as commandTag() in both sketches
+void commandTag(const char *key, const uint8_t *data, size_t len, uint8_t *tag) {
+  uint8_t mac[32];
+  hmacSha256((const uint8_t *)key, strlen(key), data, len, mac);
+  memcpy(tag, mac, COMMAND_TAG_LEN);
+}
+
+// One controller: the radio's CRC check, then receiveCommand() and the
+// STATE reply as handleCommand() in haltec_hydro.h runs them
+struct Node;
+Node *receiving;  // The node the CommandNode hooks act on
+
+struct Node {
+  const char *key = "shared command key";
+  uint32_t applied = 0;
+  bool relays[RELAYS] = {};
+  int applications = 0;
+
+  // Handle a CMD; writes the STATE reply and returns its length, 0 for none
+  size_t receive(const uint8_t *frame, size_t len, uint8_t *reply);
+};
+
+const CommandNode SIMULATED_NODE = {
+  [](const uint8_t *data, size_t len, uint8_t *tag) { commandTag(receiving->key, data, len, tag); },
+  [](int index, bool on) { receiving->relays[index] = on; },
+};
+
+size_t Node::receive(const uint8_t *frame, size_t len, uint8_t *reply) {
+  if (len == 0 || crc8(frame, len - 1) != frame[len - 1]) {
+    return 0;
+  }
+  receiving = this;
+  int receipt = receiveCommand(SIMULATED_NODE, frame, len, applied, RELAYS);
+  if (receipt == COMMAND_REFUSED) {
+    return 0;
+  }
+  if (receipt == COMMAND_APPLIED) {
+    applications++;
+  }
+  return commandStateFrame(SIMULATED_NODE, reply, NODE_ID, applied, relays, RELAYS);
+}
+
+// The gateway side as commandTick() and handleCommandState() run it
+struct Gateway {
+  const char *key = "shared command key";
+  RelayCommand command = {};
+  int transmissions = 0;
+
+  size_t tick(uint32_t now, uint8_t *frame) {
+    size_t len = nextCommandFrame(command, NODE_ID, now, frame);
+    if (len == 0) {
+      return 0;
+    }
+    commandTag(key, frame, len, frame + len);
+    len += COMMAND_TAG_LEN;
+    frame[len] = crc8(frame, len);
+    transmissions++;
+    return len + 1;
+  }
+
+  void receive(const uint8_t *frame, size_t len, uint32_t now) {
+    size_t body = commandStateBody(frame, len);
+    uint8_t expected[COMMAND_TAG_LEN];
+    if (body == 0) {
+      return;
+    }
+    commandTag(key, frame, body, expected);
+    if (commandTagsEqual(expected, frame + body)) {
+      applyCommandState(command, frame, now);
+    }
+  }
+};
+
+bool delivered(int lossPct) {
+  return (int)(nextRandom() % 100) >= lossPct;
+}
+
+// Run until the command settles; true when it was confirmed
+bool settle(Gateway &gw, Node &controller, uint32_t &now, int lossPct) {
+  while (gw.command.status == COMMAND_PENDING) {
+    uint8_t frame[FRAME_MAX], reply[FRAME_MAX];
+    size_t len = gw.tick(now, frame);
+    if (len && delivered(lossPct)) {
+      size_t replyLen = controller.receive(frame, len, reply);
+      if (replyLen && delivered(lossPct)) {
+        gw.receive(reply, replyLen, now);
+      }
+    }
+    now += TICK_MS;
+  }
+  return gw.command.status == COMMAND_CONFIRMED;
+}
+
+bool nodeMatches(const RelayCommand &command, const Node &controller) {
+  for (int c = 0; c < command.count; c++) {
+    int relay = command.changes[c] & ~COMMAND_ON;
+    if (controller.relays[relay] != ((command.changes[c] & COMMAND_ON) != 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void testLossless() {
+  Gateway gw;
+  Node controller;
+  uint32_t now = 0;
+  queueCommandChange(gw.command, 3, true, now);
+  queueCommandChange(gw.command, 5, true, now);
+  queueCommandChange(gw.command, 3, false, now);  // Merged into the same change
+  CHECK_EQ(gw.command.count, 2);
+  CHECK(settle(gw, controller, now, 0));
+  CHECK_EQ(gw.transmissions, 1);  // Both changes in one frame
+  CHECK(!controller.relays[3]);
+  CHECK(controller.relays[5]);
+  CHECK_EQ(controller.applied, 1);
+}
+
+void testLossyLink(int lossPct, int minConfirmedPct) {
+  Gateway gw;
+  Node controller;
+  uint32_t now = 0;
+  rngState = 12345 + lossPct;
+  int confirmed = 0, commands = 500;
+  for (int i = 0; i < commands; i++) {
+    int changes = 1 + nextRandom() % 3;
+    for (int c = 0; c < changes; c++) {
+      queueCommandChange(gw.command, nextRandom() % RELAYS, nextRandom() & 1, now);
+    }
+    if (settle(gw, controller, now, lossPct)) {
+      confirmed++;
+      CHECK(nodeMatches(gw.command, controller));
+      CHECK_EQ(gw.command.seq, controller.applied);
+    }
+    // Retries never apply a sequence twice
+    CHECK(controller.applications <= (int)gw.command.seq);
+  }
+  printf("loss %d%%: %d/%d confirmed, %.2f transmissions per command\n", lossPct, confirmed, commands,
+         (double)gw.transmissions / commands);
+  CHECK(confirmed * 100 >= commands * minConfirmedPct);
+}
+
+void testDeadLinkFails() {
+  Gateway gw;
+  Node controller;
+  uint32_t now = 0;
+  queueCommandChange(gw.command, 1, true, now);
+  CHECK(!settle(gw, controller, now, 100));
+  CHECK_EQ(gw.command.status, COMMAND_FAILED);
+  CHECK_EQ(gw.transmissions, COMMAND_MAX_ATTEMPTS);
+}
+
+void testReplayChangesNothing() {
+  Gateway gw;
+  Node controller;
+  uint32_t now = 0;
+  uint8_t old[FRAME_MAX], reply[FRAME_MAX];
+  queueCommandChange(gw.command, 2, true, now);
+  size_t oldLen = gw.tick(now, old);
+  CHECK(controller.receive(old, oldLen, reply) > 0);
+  CHECK(controller.relays[2]);
+
+  gw.command = {};
+  gw.command.seq = controller.applied;
+  queueCommandChange(gw.command, 2, false, now);
+  CHECK(settle(gw, controller, now, 0));
+  CHECK(!controller.relays[2]);
+
+  // A captured CMD is answered with the current state and not applied
+  CHECK(controller.receive(old, oldLen, reply) > 0);
+  CHECK(!controller.relays[2]);
+  CHECK_EQ(controller.applications, 2);
+
+  // Forged and corrupted frames are ignored
+  old[oldLen - 2] ^= 1;
+  CHECK_EQ(controller.receive(old, oldLen, reply), 0);
+  old[oldLen - 1] = crc8(old, oldLen - 1);  // A good CRC over a bad tag
+  CHECK_EQ(controller.receive(old, oldLen, reply), 0);
+  Gateway forger;
+  forger.key = "guessed key";
+  forger.command.seq = 100;
+  queueCommandChange(forger.command, 2, true, now);
+  size_t forgedLen = forger.tick(now, old);
+  CHECK_EQ(controller.receive(old, forgedLen, reply), 0);
+  CHECK(!controller.relays[2]);
+}
+
+void testGatewayRestart() {
+  // The node has applied sequence 50; a restarted gateway starts from 0
+  Gateway gw;
+  Node controller;
+  controller.applied = 50;
+  uint32_t now = 0;
+  queueCommandChange(gw.command, 4, true, now);
+  CHECK(settle(gw, controller, now, 0));
+  CHECK(controller.relays[4]);
+  CHECK_EQ(controller.applied, 51);
+  CHECK_EQ(gw.transmissions, 2);  // Ignored once, then sent past the node's sequence
+}
+
+// RFC 4231 test case 2, so the tags match what mbedtls computes
+void testTagIsHmacSha256() {
+  const uint8_t expected[COMMAND_TAG_LEN] = {0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e};
+  uint8_t tag[COMMAND_TAG_LEN];
+  const char *data = "what do ya want for nothing?";
+  commandTag("Jefe", (const uint8_t *)data, strlen(data), tag);
+  CHECK(memcmp(tag, expected, COMMAND_TAG_LEN) == 0);
+}
+
+void testRelayBound() {
+  RelayCommand command = {};
+  CHECK(!queueCommandChange(command, TELEMETRY_MAX_RELAYS, true, 0));
+  CHECK(!queueCommandChange(command, 0xFF, true, 0));
+  CHECK_EQ(command.status, COMMAND_IDLE);
+  for (int relay = 0; relay < TELEMETRY_MAX_RELAYS; relay++) {
+    CHECK(queueCommandChange(command, relay, relay & 1, 0));
+  }
+  CHECK_EQ(command.count, TELEMETRY_MAX_RELAYS);
+}
+
+int main() {
+  testTagIsHmacSha256();
+  testRelayBound();
+  testLossless();
+  testLossyLink(10, 99);
+  testLossyLink(30, 90);
+  testDeadLinkFails();
+  testReplayChangesNothing();
+  testGatewayRestart();
+  return checkResult("command_channel");
+}
@@ -0,0 +1,180 @@
+// The tx-rx-ap-ssh remote console from testing/tx-rx/tx-rx-ap-ssh/
+// console_session.h with fake clients: login, line input, every session
+// getting the same traffic from the one ring, and a client that stops
+// reading being skipped ahead and then dropped while the others keep up.
+// tests/console_nc.sh runs the same code over real sockets.
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "check.h"
+#include "console_session.h"
+
+#define STALL_MS 2000
+
+// AsyncClient's send side with a window the test sets
+struct FakeClient {
+  size_t window;
+  std::string sent;
+  size_t pending = 0;  // Added since the last send()
+  size_t space() const { return window - pending; }
+  void add(const char *data, size_t len) {
+    sent.append(data, len);
+    pending += len;
+  }
+  void send() {
+    window -= pending;
+    pending = 0;
+  }
+};
+
+ConsoleRing ring;
+
+ConsoleAction type(ConsoleSession &session, const char *text, const char *&reply) {
+  ConsoleAction action = CONSOLE_REPLY;
+  reply = nullptr;
+  for (const char *c = text; *c; c++) {
+    if (consoleFeed(session, *c)) {
+      action = consoleLine(session, ring, 0, "admin", "admin123", reply);
+    }
+  }
+  return action;
+}
+
+void login(ConsoleSession &session) {
+  memset(&session, 0, sizeof(session));
+  const char *reply;
+  type(session, "admin\r\nadmin123\r\n", reply);
+  CHECK_EQ(session.state, CONSOLE_READY);
+}
+
+void publish(const char *text) {
+  consolePublish(ring, text, strlen(text));
+}
+
+void testLogin() {
+  memset(&ring, 0, sizeof(ring));
+  ConsoleSession session;
+  memset(&session, 0, sizeof(session));
+  const char *reply;
+  CHECK_EQ(type(session, "admin\n", reply), CONSOLE_REPLY);
+  CHECK(strcmp(reply, "password: ") == 0);
+  CHECK_EQ(type(session, "wrong\n", reply), CONSOLE_REPLY);
+  CHECK(strstr(reply, "Login incorrect") != nullptr);
+  CHECK_EQ(session.state, CONSOLE_LOGIN);
+
+  // A password alone is a user name; the third failure closes
+  CHECK_EQ(type(session, "admin123\nadmin123\n", reply), CONSOLE_REPLY);
+  CHECK_EQ(type(session, "root\nadmin123\n", reply), CONSOLE_CLOSE);
+
+  // Blank lines and control characters are dropped, long lines cut
+  login(session);
+  publish("before login");
+  login(session);
+  CHECK_EQ(session.cursor, ring.head);
+  CHECK_EQ(type(session, "\r\n\n\x07hi\x1b\n", reply), CONSOLE_RUN);
+  CHECK(strcmp(session.line, "hi") == 0);
+  std::string longLine(CONSOLE_LINE_MAX + 50, 'x');
+  CHECK_EQ(type(session, (longLine + "\n").c_str(), reply), CONSOLE_RUN);
+  CHECK_EQ(strlen(session.line), CONSOLE_LINE_MAX);
+  CHECK_EQ(type(session, "quit\n", reply), CONSOLE_CLOSE);
+}
+
+// Three sessions that keep up get the same lines in the same order, from
+// one copy in the ring however often it wraps
+void testFanOut() {
+  memset(&ring, 0, sizeof(ring));
+  ConsoleSession sessions[3];
+  FakeClient clients[3];
+  for (int i = 0; i < 3; i++) {
+    login(sessions[i]);
+    clients[i].window = 1 << 20;
+  }
+  std::string expected;
+  char text[64];
+  for (int n = 0; n < 1000; n++) {
+    snprintf(text, sizeof(text), "RX ch1-1 RSSI -87: frame %d", n);
+    publish(text);
+    expected += text;
+    expected += "\r\n";
+    for (int i = 0; i < 3; i++) {
+      if (n % (i + 1) == 0) {  // Sessions flushed at different rates
+        CHECK(consoleFlush(sessions[i], ring, clients[i], n, STALL_MS));
+      }
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    CHECK(consoleFlush(sessions[i], ring, clients[i], 1000, STALL_MS));
+    CHECK(clients[i].sent == expected);
+    CHECK(!consolePending(sessions[i], ring, 1000, STALL_MS, clients[i].space()));
+  }
+  CHECK(ring.head > 5 * CONSOLE_RING_SIZE);
+}
+
+// One client stops reading: publishing carries on, the session skips to
+// the oldest line still held with a notice, and is dropped after STALL_MS
+// with nothing taken, while a reader alongside misses nothing
+void testSlowClient() {
+  memset(&ring, 0, sizeof(ring));
+  ConsoleSession slow, fast;
+  login(slow);
+  login(fast);
+  FakeClient slowClient, fastClient;
+  slowClient.window = 200;
+  fastClient.window = 1 << 20;
+
+  char text[64];
+  int n = 0;
+  uint32_t now = 0;
+  for (; now < 1000; now += 10) {
+    snprintf(text, sizeof(text), "RX ch1-1 RSSI -87: frame %d", n++);
+    publish(text);
+    CHECK(consoleFlush(slow, ring, slowClient, now, STALL_MS));
+    CHECK(consoleFlush(fast, ring, fastClient, now, STALL_MS));
+  }
+  CHECK(slowClient.sent.size() <= 200);
+  CHECK(!consolePending(slow, ring, now, STALL_MS, slowClient.space()));
+  uint32_t taken = slow.entry;
+  CHECK(taken > 0);
+
+  // The client reads again after the ring has wrapped past it
+  for (int i = 0; i < 400; i++) {
+    snprintf(text, sizeof(text), "RX ch1-1 RSSI -87: frame %d", n++);
+    publish(text);
+    CHECK(consoleFlush(fast, ring, fastClient, now, STALL_MS));
+  }
+  CHECK(slow.cursor < ring.tail);
+  CHECK(consolePending(slow, ring, now, STALL_MS, 0));
+  slowClient.window = 1 << 20;
+  slowClient.sent.clear();
+  CHECK(consoleFlush(slow, ring, slowClient, now, STALL_MS));
+  unsigned skipped = 0;
+  int first = -1;
+  CHECK_EQ(sscanf(slowClient.sent.c_str(), "[%u lines skipped]\r\nRX ch1-1 RSSI -87: frame %d", &skipped, &first), 2);
+  CHECK_EQ(first, (int)ring.tailEntry);
+  CHECK_EQ(skipped, ring.tailEntry - taken);
+  CHECK_EQ(slow.cursor, ring.head);
+
+  // It stops again, with lines waiting: dropped once STALL_MS pass
+  slowClient.window = 0;
+  publish("RX ch1-1 RSSI -87: last");
+  CHECK(consoleFlush(slow, ring, slowClient, now + STALL_MS, STALL_MS));
+  CHECK(!consoleFlush(slow, ring, slowClient, now + STALL_MS + 1, STALL_MS));
+  CHECK(consolePending(slow, ring, now + STALL_MS + 1, STALL_MS, 0));
+
+  CHECK(consoleFlush(fast, ring, fastClient, now, STALL_MS));
+  CHECK_EQ(fast.entry, ring.entries);
+  std::string expected;
+  for (int i = 0; i < n; i++) {
+    snprintf(text, sizeof(text), "RX ch1-1 RSSI -87: frame %d\r\n", i);
+    expected += text;
+  }
+  CHECK(fastClient.sent == expected + "RX ch1-1 RSSI -87: last\r\n");
+}
+
+int main() {
+  testLogin();
+  testFanOut();
+  testSlowClient();
+  return checkResult("console_session");
+}
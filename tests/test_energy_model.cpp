@@ -0,0 +1,105 @@
+// The low-power energy model from testing/tx-rx/energy_model.h: with no
+// traffic the simulation draws what the closed form projects, every
+// message arrives with the stretched preamble as its only added latency,
+// traffic costs more the longer the interval, and messages that come in
+// while the node sends are lost rather than counted.
+#include <math.h>
+#include <stdio.h>
+
+#include "check.h"
+#include "energy_model.h"
+
+#define DAY_S 86400
+
+const RadioProfileInfo SF7 = RadioProfile<7, 125, 5>::info();
+const RadioProfileInfo SF12 = RadioProfile<12, 125, 5>::info();
+const uint32_t INTERVALS_MS[] = {0, 100, 250, 500, 1000, 2000, 5000};
+
+bool near(double a, double b, double tolerance) {
+  return fabs(a - b) <= tolerance * b;
+}
+
+void testIdle() {
+  const RadioProfileInfo *PROFILES[] = {&SF7, &SF12};
+  for (const RadioProfileInfo *profile : PROFILES) {
+    double previous = 1e9;
+    for (uint32_t intervalMs : INTERVALS_MS) {
+      LowPowerResult result = simulateLowPower(*profile, intervalMs, {0, 0, 20}, DAY_S);
+      CHECK(near(result.averageUa, projectedCurrentUa(*profile, intervalMs), 0.01));
+      CHECK_EQ(result.delivered + result.lost + result.sent, 0);
+      CHECK(result.averageUa < previous);
+      previous = result.averageUa;
+      int64_t total = 0;
+      for (int64_t us : result.ledger.radioUs) {
+        total += us;
+      }
+      CHECK_EQ(total, (int64_t)DAY_S * 1000000);
+      CHECK_EQ(result.ledger.cpuActiveUs + result.ledger.cpuSleepUs, (int64_t)DAY_S * 1000000);
+    }
+  }
+  CHECK(simulateLowPower(SF7, 1000, {0, 0, 20}, DAY_S).windows == DAY_S);
+}
+
+// Without own sends, and too few messages to overlap, every message
+// arrives one frame's airtime after it was keyed up; low-power mode adds
+// the preamble stretched past the window
+void testLatency() {
+  for (uint32_t intervalMs : INTERVALS_MS) {
+    LowPowerResult result = simulateLowPower(SF7, intervalMs, {4, 0, 20}, DAY_S);
+    CHECK(result.delivered > 70);
+    CHECK_EQ(result.lost, 0);
+    double frameMs = lowPowerAirtimeUs(SF7, intervalMs, 20) / 1000.0;
+    CHECK(near(result.latencyMs, frameMs, 1e-9));
+    CHECK(near(result.maxLatencyMs, frameMs, 1e-9));
+    uint32_t addedUs = lowPowerAirtimeUs(SF7, intervalMs, 20) - frameAirtimeUs(SF7, 20);
+    CHECK(addedUs >= intervalMs * 1000);
+    CHECK(addedUs <= intervalMs * 1000 + (LOWPOWER_CAD_SYMBOLS + 1) * SF7.symbolUs);
+  }
+  // The longest interval the preamble register allows at SF7
+  CHECK(lowPowerPreamble(SF7, 5000) <= LOWPOWER_MAX_PREAMBLE);
+  CHECK(lowPowerPreamble(SF7, 70000) > LOWPOWER_MAX_PREAMBLE);
+}
+
+// Receiving costs more than listening, sending more again, and the longer
+// the interval the more each message costs; continuous receive hardly
+// notices. Sending makes the node miss messages, more with long preambles.
+void testTraffic() {
+  const LowPowerTraffic QUIET = {0, 0, 20}, RX = {60, 0, 20}, BOTH = {60, 60, 20};
+  uint32_t lost = 0;
+  double addedShort = 0;
+  for (uint32_t intervalMs : INTERVALS_MS) {
+    double idle = simulateLowPower(SF7, intervalMs, QUIET, DAY_S).averageUa;
+    double rx = simulateLowPower(SF7, intervalMs, RX, DAY_S).averageUa;
+    LowPowerResult both = simulateLowPower(SF7, intervalMs, BOTH, DAY_S);
+    CHECK(intervalMs ? rx > idle : rx == idle);  // Continuous receive listens either way
+    CHECK(both.averageUa > rx);
+    CHECK(both.sent > 1300 && both.sent < 1600);
+    if (intervalMs == 0) {
+      CHECK(near(both.averageUa, idle, 0.01));
+    } else if (intervalMs == 100) {
+      addedShort = both.averageUa - idle;
+    } else {
+      CHECK(both.averageUa - idle > addedShort);
+    }
+    CHECK(both.lost >= lost);
+    lost = both.lost;
+  }
+  CHECK(lost > 100);
+
+  // Same seed, same run
+  LowPowerResult a = simulateLowPower(SF7, 500, BOTH, DAY_S, 3), b = simulateLowPower(SF7, 500, BOTH, DAY_S, 3);
+  CHECK_EQ(a.delivered, b.delivered);
+  CHECK_EQ(a.averageUa, b.averageUa);
+}
+
+int main() {
+  testIdle();
+  testLatency();
+  testTraffic();
+  for (uint32_t intervalMs : INTERVALS_MS) {
+    LowPowerResult result = simulateLowPower(SF7, intervalMs, {60, 60, 20}, DAY_S);
+    printf("SF7 %4u ms, 60/60 msgs/h: %.2f mA, %.1f days, %.0f ms latency, %u lost\n", (unsigned)intervalMs,
+           result.averageUa / 1000, batteryDays(result.averageUa), result.latencyMs, (unsigned)result.lost);
+  }
+  return checkResult("energy_model");
+}
@@ -0,0 +1,234 @@
+// The link benchmark from testing/tx-rx/link_bench.h over a simulated
+// link: the "/bench" generator on one node against "/respond" on another.
+//
+// Both nodes share a virtual clock. A frame reaches the other node only
+// when both are on the same profile and frequency, and only if the loss
+// draw lets it through. A transmit takes the frame's airtime. A receive
+// poll that finds nothing advances the clock by 1 ms.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "link_bench.h"
+
+const RadioProfileInfo PROFILES[] = {
+  RadioProfile<7, 125, 5>::info(),
+  RadioProfile<9, 125, 5>::info(),
+  RadioProfile<12, 125, 8>::info(),
+};
+const int NUM_PROFILES = sizeof(PROFILES) / sizeof(PROFILES[0]);
+const RadioProfileInfo SF10 = RadioProfile<10, 125, 5>::info();  // Not on the responder
+#define BASE_KHZ 915000
+
+struct SimNode {
+  const RadioProfileInfo *profile;
+  uint32_t freqKHz;
+  uint8_t inbox[BENCH_FRAME_MAX];
+  size_t inboxLen;
+};
+
+SimNode sender, responderNode;
+SimNode *self = &sender;  // The node whose code is running
+BenchResponder responder;
+uint64_t nowUs = 0;
+int lossPct = 0;
+int transmissions = 0;
+
+uint32_t rngState = 1;
+uint32_t nextRandom() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+const BenchRadio &simRadio();
+
+// The responder runs as soon as a frame reaches it; its reply lands in
+// the sender's inbox
+int simTransmit(const uint8_t *data, size_t len) {
+  SimNode &from = *self;
+  SimNode &to = self == &sender ? responderNode : sender;
+  nowUs += from.profile->airtimeUs[len];
+  transmissions++;
+  if (to.profile != from.profile || to.freqKHz != from.freqKHz || (int)(nextRandom() % 100) < lossPct) {
+    return 0;
+  }
+  if (&to == &responderNode) {
+    uint32_t freqKHz;
+    self = &responderNode;
+    benchRespond(simRadio(), responder, PROFILES, NUM_PROFILES, data, len, freqKHz);
+    self = &sender;
+  } else {
+    memcpy(to.inbox, data, len);
+    to.inboxLen = len;
+  }
+  return 0;
+}
+
+size_t simReceive(uint8_t *frame) {
+  size_t len = self->inboxLen;
+  if (len == 0) {
+    nowUs += 1000;
+    return 0;
+  }
+  memcpy(frame, self->inbox, len);
+  self->inboxLen = 0;
+  return len;
+}
+
+int simApplyProfile(float freq, const RadioProfileInfo &profile) {
+  self->profile = &profile;
+  self->freqKHz = (uint32_t)(freq * 1000 + 0.5);
+  return 0;
+}
+
+const BenchRadio SIM_RADIO = {
+  simTransmit,
+  simReceive,
+  simApplyProfile,
+  []() { return -97.0f; },
+  []() { return 6.25f; },
+  []() -> uint32_t { return nowUs / 1000; },
+  []() -> uint32_t { return nowUs; },
+  [](uint32_t ms) { nowUs += ms * 1000ULL; },
+  [](long low, long high) { return low + (long)(nextRandom() % (high - low)); },
+  []() { return false; },
+};
+
+const BenchRadio &simRadio() {
+  return SIM_RADIO;
+}
+
+uint32_t rtt[BENCH_MAX_SAMPLES];
+
+void reset(int loss) {
+  sender = {&PROFILES[0], BASE_KHZ, {}, 0};
+  responderNode = {&PROFILES[0], BASE_KHZ, {}, 0};
+  responder = {};
+  lossPct = loss;
+  rngState = 99 + loss;
+  transmissions = 0;
+}
+
+BenchConfig config(uint16_t count, uint8_t minSize, uint8_t maxSize, float rate, uint8_t burst) {
+  BenchConfig c = {};
+  c.freq = BASE_KHZ / 1000.0;
+  c.count = count;
+  c.minSize = minSize;
+  c.maxSize = maxSize;
+  c.rate = rate;
+  c.burst = burst;
+  return c;
+}
+
+// One combination as runBenchmark() in tx-rx.h runs it
+bool runCombination(uint8_t run, const RadioProfileInfo &profile, const BenchConfig &c, BenchResult &result) {
+  if (!benchSwitch(SIM_RADIO, run, *sender.profile, c.freq, profile)) {
+    return false;
+  }
+  result = benchCombination(SIM_RADIO, run, c, profile, rtt);
+  if (!benchSwitch(SIM_RADIO, run, *sender.profile, BASE_KHZ / 1000.0, PROFILES[0])) {
+    simApplyProfile(BASE_KHZ / 1000.0, PROFILES[0]);
+  }
+  return true;
+}
+
+void testAirtime() {
+  // SF7 125 kHz CR 4/5, 16 bytes, explicit header, CRC off: 12.25 + 33 symbols of 1.024 ms
+  CHECK_EQ(PROFILES[0].airtimeUs[16], 46336);
+  CHECK_EQ(PROFILES[0].symbolUs, 1024);
+  // Low data rate optimisation at SF12 125 kHz (32.768 ms symbols)
+  CHECK_EQ(PROFILES[2].symbolUs, 32768);
+  CHECK(PROFILES[2].airtimeUs[255] > 10000000);
+  // Receive timeouts: the longest frame plus two symbols of guard
+  CHECK_EQ(PROFILES[0].rxTimeoutUs, PROFILES[0].airtimeUs[PROFILE_MAX_PAYLOAD] + 2 * 1024);
+  CHECK_EQ(frameTimeoutUs(PROFILES[1], 16), PROFILES[1].airtimeUs[16] + 2 * PROFILES[1].symbolUs);
+  CHECK_EQ(frameAirtimeUs(PROFILES[0], 300), PROFILES[0].airtimeUs[PROFILE_MAX_PAYLOAD]);
+  CHECK(findRadioProfile(PROFILES, NUM_PROFILES, 9, 125, 5) == &PROFILES[1]);
+  CHECK(findRadioProfile(PROFILES, NUM_PROFILES, 10, 125, 5) == nullptr);
+}
+
+void testLossless() {
+  reset(0);
+  BenchResult result;
+  CHECK(runCombination(1, PROFILES[1], config(40, 16, 16, 2, 1), result));
+  CHECK_EQ(result.sent, 40);
+  CHECK_EQ(result.delivered, 40);
+  CHECK_EQ(result.deliveredBytes, 40 * 16);
+  CHECK_EQ(result.samples, 40);
+  // RTT is the probe's airtime plus the echo's, to the 1 ms poll step
+  uint32_t expectedMs = (PROFILES[1].airtimeUs[16] + PROFILES[1].airtimeUs[BENCH_ECHO_SIZE]) / 1000;
+  CHECK(result.p50Ms >= expectedMs && result.p99Ms <= expectedMs + 1);
+  CHECK_EQ(result.airUs, 40 * (PROFILES[1].airtimeUs[16] + PROFILES[1].airtimeUs[BENCH_ECHO_SIZE]));
+  CHECK(result.elapsedMs >= 39 * 500);  // 2 probes per second
+  // Both ends are back on the base profile
+  CHECK(sender.profile == &PROFILES[0] && responderNode.profile == &PROFILES[0]);
+  CHECK_EQ(responderNode.freqKHz, BASE_KHZ);
+}
+
+void testBurstsAndSizes() {
+  reset(0);
+  BenchResult result;
+  CHECK(runCombination(2, PROFILES[0], config(50, 8, 64, 4, 5), result));
+  CHECK_EQ(result.sent, 50);
+  CHECK_EQ(result.delivered, 50);
+  CHECK_EQ(result.samples, 10);  // One echo per burst
+  CHECK_EQ(responder.bytes, result.deliveredBytes);
+  CHECK(result.deliveredBytes >= 50 * 8 && result.deliveredBytes <= 50 * 64);
+}
+
+void testLossyLink() {
+  reset(20);
+  BenchResult result;
+  uint8_t run = 3;
+  while (!runCombination(run, PROFILES[1], config(200, 16, 32, 5, 1), result)) {
+    run++;  // Every SWITCH try lost; the sender moves on with a new run
+  }
+  CHECK_EQ(result.sent, 200);
+  // The count comes from the last echo that got back, so it trails the probes sent
+  CHECK(result.delivered >= 140 && result.delivered <= 190);
+  CHECK(result.samples >= 100 && result.samples <= 170);
+  printf("loss 20%% each way: %u/%u delivered, %u echoes\n", result.delivered, result.sent, result.samples);
+}
+
+void testNoResponder() {
+  reset(0);
+  BenchResult result;
+  CHECK(!runCombination(4, SF10, config(10, 16, 16, 2, 1), result));
+  CHECK_EQ(transmissions, BENCH_SWITCH_TRIES);
+  CHECK(sender.profile == &PROFILES[0] && responderNode.profile == &PROFILES[0]);
+}
+
+void testEchoFrame() {
+  reset(0);
+  uint8_t probe[20] = {BENCH_MARK | BENCH_PROBE | BENCH_FLAG_ECHO, 7, 0x34, 0x12, 1, 2, 3, 4};
+  uint32_t freqKHz;
+  self = &responderNode;
+  CHECK(benchRespond(SIM_RADIO, responder, PROFILES, NUM_PROFILES, probe, sizeof(probe), freqKHz) == nullptr);
+  self = &sender;
+  CHECK_EQ(sender.inboxLen, BENCH_ECHO_SIZE);
+  CHECK_EQ(sender.inbox[0], BENCH_MARK | BENCH_ECHO);
+  CHECK(memcmp(sender.inbox + 1, probe + 1, BENCH_PROBE_HEADER - 1) == 0);
+  CHECK_EQ(sender.inbox[8] | sender.inbox[9] << 8, 1);
+  CHECK_EQ(sender.inbox[10], sizeof(probe));
+  CHECK_EQ((int8_t)sender.inbox[14], -97);
+  CHECK_EQ((int8_t)sender.inbox[15], 25);
+
+  // An echo from another run is not taken for this one
+  uint8_t frame[BENCH_FRAME_MAX];
+  size_t len;
+  CHECK(!benchReceive(SIM_RADIO, 8, frame, len, BENCH_ECHO, 10));
+}
+
+int main() {
+  testAirtime();
+  testLossless();
+  testBurstsAndSizes();
+  testLossyLink();
+  testNoResponder();
+  testEchoFrame();
+  return checkResult("link_bench");
+}
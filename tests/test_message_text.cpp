@@ -0,0 +1,97 @@
+// Message hex, Serial lines and display text from testing/tx-rx/message_text.h
+#include <string.h>
+
+#include "check.h"
+#include "message_text.h"
+
+// A stand-in block cipher: XOR with the key, its own inverse
+void xorBlock(const uint8_t *in, uint8_t *out, const uint8_t *key) {
+  for (int i = 0; i < MESSAGE_BLOCK; i++) {
+    out[i] = in[i] ^ key[i];
+  }
+}
+
+void testHex() {
+  const uint8_t bytes[] = {0x00, 0x0F, 0xA0, 0xFF};
+  char hex[9];
+  hexEncode(bytes, sizeof(bytes), hex);
+  CHECK(strcmp(hex, "000fa0ff") == 0);  // Two digits even below 0x10
+
+  uint8_t out[4];
+  CHECK_EQ(hexDecode("000FA0ff", 8, out, sizeof(out)), 4);
+  CHECK(memcmp(out, bytes, sizeof(bytes)) == 0);
+  CHECK_EQ(hexDecode("000", 3, out, sizeof(out)), -1);
+  CHECK_EQ(hexDecode("0g", 2, out, sizeof(out)), -1);
+  CHECK_EQ(hexDecode("0011223344", 10, out, sizeof(out)), -1);
+}
+
+void testMessages() {
+  const uint8_t key[MESSAGE_BLOCK] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+  char hex[MESSAGE_HEX_LEN + 1];
+  char text[MESSAGE_BLOCK + 1];
+  encryptMessageHex("Hello", 5, key, xorBlock, hex);
+  CHECK_EQ(strlen(hex), MESSAGE_HEX_LEN);
+  CHECK_EQ(decryptMessageHex(hex, strlen(hex), key, xorBlock, text), 5);
+  CHECK(strcmp(text, "Hello") == 0);
+
+  // Sixteen characters fill the block and still come back terminated
+  encryptMessageHex("0123456789abcdefXYZ", 19, key, xorBlock, hex);
+  CHECK_EQ(decryptMessageHex(hex, strlen(hex), key, xorBlock, text), 16);
+  CHECK(strcmp(text, "0123456789abcdef") == 0);
+
+  CHECK_EQ(decryptMessageHex(hex, 30, key, xorBlock, text), -1);
+  CHECK_EQ(decryptMessageHex("plain text", 10, key, xorBlock, text), -1);
+}
+
+void testLines() {
+  LineReader reader = {};
+  const char *line = nullptr;
+  for (const char *c = "\r\n/replay 3\r\n"; *c; c++) {
+    if (const char *done = lineFeed(reader, *c)) {
+      CHECK(line == nullptr);  // Empty lines are not reported
+      line = done;
+    }
+  }
+  CHECK(line && strcmp(line, "/replay 3") == 0);
+
+  // An over-long line keeps its first SERIAL_LINE_MAX - 1 characters
+  for (int i = 0; i < SERIAL_LINE_MAX + 10; i++) {
+    CHECK(lineFeed(reader, 'x') == nullptr);
+  }
+  line = lineFeed(reader, '\n');
+  CHECK_EQ(strlen(line), SERIAL_LINE_MAX - 1);
+
+  const char *arg;
+  CHECK(commandIs("/replay 3", "/replay", &arg) && strcmp(arg, "3") == 0);
+  CHECK(commandIs("/replay", "/replay", &arg) && *arg == '\0');
+  CHECK(!commandIs("/replays", "/replay"));
+  CHECK(!commandIs("/rep", "/replay"));
+
+  int channel, key;
+  CHECK(parseChannelCommand("C 2 3", 4, 4, channel, key));
+  CHECK_EQ(channel, 2);
+  CHECK_EQ(key, 3);
+  CHECK(!parseChannelCommand("C 5 1", 4, 4, channel, key));
+  CHECK(!parseChannelCommand("C 2", 4, 4, channel, key));
+}
+
+void testDisplay() {
+  char line[DISPLAY_LINE_MAX];
+  CHECK_EQ(formatDisplayLine(line, sizeof(line), "Received", "hi"), 12);
+  CHECK(strcmp(line, "Received: hi") == 0);
+  char longText[100];
+  memset(longText, 'a', sizeof(longText) - 1);
+  longText[sizeof(longText) - 1] = '\0';
+  CHECK_EQ(formatDisplayLine(line, sizeof(line), "Rx", longText), DISPLAY_LINE_MAX - 1);
+
+  formatStatusLine(line, sizeof(line), -67.0f, 8.5f, 214);
+  CHECK(strcmp(line, "RSSI:-67.00 SNR:8.50 214s") == 0);
+}
+
+int main() {
+  testHex();
+  testMessages();
+  testLines();
+  testDisplay();
+  return checkResult("message_text");
+}
@@ -0,0 +1,182 @@
+// Gateway capture and replay from testing/tx-rx/tx-rx-ap-httpd/
+// packet_capture.h: records and their serial lines round trip, replay
+// skips the gateway's own sends and stops at a damaged record, and on a
+// simulated clock each frame is handed on no earlier than its recorded
+// offset divided by the speed, and no later than the loop() pass after.
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "packet_capture.h"
+
+#define BATCH 32
+#define LOOP_MS 1
+
+std::vector<uint8_t> capture;
+size_t capturePos;
+
+size_t readCapture(uint8_t *data, size_t len) {
+  size_t got = capture.size() - capturePos < len ? capture.size() - capturePos : len;
+  memcpy(data, capture.data() + capturePos, got);
+  capturePos += got;
+  return got;
+}
+
+void append(const CaptureRecord &record, const uint8_t *data) {
+  capture.insert(capture.end(), (const uint8_t *)&record, (const uint8_t *)&record + sizeof(record));
+  capture.insert(capture.end(), data, data + record.len);
+}
+
+struct Frame {
+  uint32_t time;
+  std::vector<uint8_t> bytes;
+};
+
+// Received frames in bursts of 7, each followed by the gateway's reply;
+// returns the received frames
+std::vector<Frame> record(int count, uint32_t startMs) {
+  capture.clear();
+  std::vector<Frame> received;
+  uint32_t time = startMs;
+  for (int i = 0; i < count; i++) {
+    time += i % 10 < 7 ? 3 : 250;  // Bursts of 7 close together
+    Frame frame = {time, {}};
+    for (int b = 0; b < 10 + i % 40; b++) {
+      frame.bytes.push_back((uint8_t)(i * 31 + b));
+    }
+    append(makeCaptureRecord(0, time, 915000, 7, -70 - i % 50, 0.25f * (i % 40) - 5, frame.bytes.size()),
+           frame.bytes.data());
+    received.push_back(frame);
+    uint8_t ack[5] = {0xA2, 1, 2, (uint8_t)i, 0};
+    append(makeCaptureRecord(CAPTURE_TX, time + 40, 915000, 7, 0, 0, sizeof(ack)), ack);
+  }
+  return received;
+}
+
+void testRecord() {
+  CaptureRecord record = makeCaptureRecord(0, 1234, 915125, 9, -140.5f, 40.0f, 300);
+  CHECK_EQ(sizeof(CaptureRecord), 14);
+  CHECK_EQ(record.magic, CAPTURE_MAGIC);
+  CHECK_EQ(record.rssi, -128);
+  CHECK_EQ(record.snr, 127);
+  CHECK_EQ(record.len, 255);
+  record = makeCaptureRecord(CAPTURE_TX, 1234, 915125, 9, -87.6f, -7.25f, 12);
+  CHECK_EQ(record.rssi, -87);
+  CHECK_EQ(record.snr, -29);
+
+  // A "CAP" line holds the same bytes as the file
+  uint8_t payload[12] = {0x50, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+  char hex[CAPTURE_HEX_MAX];
+  captureHex(record, payload, hex);
+  CHECK_EQ(strlen(hex), 2 * (sizeof(record) + sizeof(payload)));
+  std::string line = std::string("12:00:01.250 -> ") + CAPTURE_LINE_PREFIX + hex + "\r";
+  uint8_t bytes[CAPTURE_RECORD_MAX];
+  CHECK_EQ(parseCaptureLine(line.c_str(), bytes, sizeof(bytes)), sizeof(record) + sizeof(payload));
+  CHECK(memcmp(bytes, &record, sizeof(record)) == 0);
+  CHECK(memcmp(bytes + sizeof(record), payload, sizeof(payload)) == 0);
+
+  // Other lines, and cut or damaged records, give nothing
+  CHECK_EQ(parseCaptureLine("Received: CAPS LOCK", bytes, sizeof(bytes)), 0);
+  CHECK_EQ(parseCaptureLine("Node 1000 key seq 3 (40 bytes)", bytes, sizeof(bytes)), 0);
+  line = std::string(CAPTURE_LINE_PREFIX) + std::string(hex, strlen(hex) - 2);
+  CHECK_EQ(parseCaptureLine(line.c_str(), bytes, sizeof(bytes)), 0);
+  hex[0] = '0';
+  line = std::string(CAPTURE_LINE_PREFIX) + hex;
+  CHECK_EQ(parseCaptureLine(line.c_str(), bytes, sizeof(bytes)), 0);
+}
+
+// Replay on a simulated clock: loop() passes every LOOP_MS, each handing
+// on up to BATCH due frames. Returns when each frame was handed on.
+std::vector<uint32_t> replayAt(uint32_t speed, std::vector<Frame> &frames, bool &matched) {
+  static CaptureReplay replay;
+  replay.read = readCapture;
+  capturePos = 0;
+  uint32_t now = 5000;
+  startCaptureReplay(replay, speed, now);
+  std::vector<uint32_t> handledAt;
+  matched = true;
+  while (replayCaptureFrames(replay, now, BATCH, [&](CaptureRecord &record, uint8_t *payload) {
+    const Frame &frame = frames[handledAt.size()];
+    matched &= record.time == frame.time && record.len == frame.bytes.size() &&
+               memcmp(payload, frame.bytes.data(), record.len) == 0 && !(record.flags & CAPTURE_TX);
+    handledAt.push_back(now - 5000);
+  })) {
+    now += LOOP_MS;
+  }
+  CHECK_EQ(replay.frames, handledAt.size());
+  return handledAt;
+}
+
+void testPace() {
+  std::vector<Frame> frames = record(500, 100000);
+  for (uint32_t speed : {1u, 10u, 0u}) {
+    bool matched;
+    std::vector<uint32_t> handledAt = replayAt(speed, frames, matched);
+    CHECK(matched);
+    CHECK_EQ(handledAt.size(), frames.size());
+    CHECK_EQ(capturePos, capture.size());
+    int early = 0, late = 0;
+    for (size_t i = 0; i < handledAt.size() && i < frames.size(); i++) {
+      // Paced, a burst (fewer than BATCH frames) goes in the pass it is
+      // due; back to back, BATCH frames go in each pass
+      uint32_t due = speed ? (frames[i].time - frames[0].time) / speed : i / BATCH * LOOP_MS;
+      early += handledAt[i] < due;
+      late += handledAt[i] > due + (speed ? LOOP_MS : 0);
+    }
+    CHECK_EQ(early, 0);
+    CHECK_EQ(late, 0);
+    printf("speed %2u: %zu frames over %u ms of capture, replayed in %u ms\n", (unsigned)speed, handledAt.size(),
+           (unsigned)(frames.back().time - frames[0].time), (unsigned)handledAt.back());
+  }
+}
+
+// Back to back, a pass hands on at most BATCH frames
+void testBatch() {
+  std::vector<Frame> frames = record(100, 0);
+  static CaptureReplay replay;
+  replay.read = readCapture;
+  capturePos = 0;
+  startCaptureReplay(replay, 0, 0);
+  int passes = 0, handled = 0;
+  bool more = true;
+  while (more) {
+    int before = handled;
+    more = replayCaptureFrames(replay, 0, BATCH, [&](CaptureRecord &, uint8_t *) { handled++; });
+    passes++;
+    CHECK(handled - before <= BATCH);
+  }
+  CHECK_EQ(handled, 100);
+  CHECK_EQ(passes, (100 + BATCH - 1) / BATCH);
+}
+
+// Replay stops at a cut record or a wrong magic, after the good frames
+void testDamaged() {
+  std::vector<Frame> frames = record(20, 0);
+  size_t full = capture.size();
+  // Into the last reply, then into the last received frame
+  const size_t CUTS[] = {full - 1, full - sizeof(CaptureRecord) - 6};
+  const size_t KEPT[] = {20, 19};
+  for (int i = 0; i < 2; i++) {
+    capture.resize(CUTS[i]);
+    bool matched;
+    std::vector<uint32_t> handledAt = replayAt(0, frames, matched);
+    CHECK(matched);
+    CHECK_EQ(handledAt.size(), KEPT[i]);
+    record(20, 0);
+  }
+  capture[(sizeof(CaptureRecord) + frames[0].bytes.size()) + sizeof(CaptureRecord) + 5] = 0;  // Third record's magic
+  bool matched;
+  std::vector<uint32_t> handledAt = replayAt(0, frames, matched);
+  CHECK(matched);
+  CHECK_EQ(handledAt.size(), 1);
+}
+
+int main() {
+  testRecord();
+  testPace();
+  testBatch();
+  testDamaged();
+  return checkResult("packet_capture");
+}
@@ -0,0 +1,130 @@
+// Rule compile and evaluation from Automation/haltec_hydro/relay_rules.h
+#include "check.h"
+#include "relay_rules.h"
+
+#define MAX 16
+
+// 25.0-30.0 C, 40-60 %RH with 1.0 / 5 bands; water threshold 100 band 10;
+// lights on for the first 12 h of the day
+const RuleLevels LEVELS = {250, 300, 10, 400, 600, 50, 100, 10, 12 * 3600};
+
+void testParseRole() {
+  CHECK_EQ(parseRole("Fan"), ROLE_FAN);
+  CHECK_EQ(parseRole("humidifier"), ROLE_HUMIDIFIER);
+  CHECK_EQ(parseRole(""), ROLE_NONE);
+  CHECK_EQ(parseRole("Fans"), ROLE_NONE);
+}
+
+void testCompile() {
+  RelayRule rules[MAX];
+  int count = 0;
+  CHECK_EQ(addRoleRules(rules, count, MAX, 0, 0, ROLE_FAN, LEVELS), 2);
+  CHECK_EQ(addRoleRules(rules, count, MAX, 1, 0, ROLE_HEATER, LEVELS), 1);
+  CHECK_EQ(addRoleRules(rules, count, MAX, 2, 0, ROLE_NONE, LEVELS), 0);
+  CHECK_EQ(addRoleRules(rules, count, MAX, 3, 1, ROLE_PUMP, LEVELS), 1);
+  CHECK_EQ(count, 4);
+
+  CHECK_EQ(rules[0].source, SRC_TEMP);
+  CHECK(rules[0].onAbove);
+  CHECK_EQ(rules[0].onLevel, 300);
+  CHECK_EQ(rules[0].offLevel, 290);
+  CHECK_EQ(rules[1].source, SRC_HUMIDITY);
+  CHECK_EQ(rules[2].offLevel, 260);  // Heater releases above tempMin + band
+  CHECK(!rules[2].onAbove);
+  CHECK_EQ(rules[3].zone, 1);
+  CHECK_EQ(rules[3].onLevel, 110);   // Pump starts only past threshold + band
+  CHECK_EQ(rules[3].offLevel, 100);
+
+  // A full table drops the rules that do not fit
+  count = MAX - 1;
+  CHECK_EQ(addRoleRules(rules, count, MAX, 0, 0, ROLE_FAN, LEVELS), 1);
+  CHECK_EQ(count, MAX);
+}
+
+void testHysteresis() {
+  RelayRule fan[1];
+  int count = 0;
+  addRule(fan, count, 1, 0, 0, SRC_TEMP, true, 300, 10);
+  CHECK(!evaluateRule(fan[0], 300));  // Not past onLevel yet
+  CHECK(evaluateRule(fan[0], 301));
+  CHECK(evaluateRule(fan[0], 295));   // Inside the band: stays on
+  CHECK(evaluateRule(fan[0], 291));
+  CHECK(!evaluateRule(fan[0], 290));
+  CHECK(!evaluateRule(fan[0], 299));  // Inside the band: stays off
+
+  RelayRule heater[1];
+  count = 0;
+  addRule(heater, count, 1, 0, 0, SRC_TEMP, false, 250, 10);
+  CHECK(evaluateRule(heater[0], 249));
+  CHECK(evaluateRule(heater[0], 259));
+  CHECK(!evaluateRule(heater[0], 260));
+}
+
+void testMissingFailsSafe() {
+  RelayRule rules[1];
+  int count = 0;
+  addRule(rules, count, 1, 0, 0, SRC_WATER, true, 110, 10);
+  CHECK(evaluateRule(rules[0], 200));
+  CHECK(!evaluateRule(rules[0], RULE_MISSING));
+}
+
+void testTable() {
+  RelayRule rules[MAX];
+  int count = 0;
+  addRoleRules(rules, count, MAX, 0, 0, ROLE_FAN, LEVELS);
+  addRoleRules(rules, count, MAX, 1, 1, ROLE_LIGHT, LEVELS);
+  int32_t sources[2][SRC_COUNT] = {
+    {250, 650, 800, 500, 0},          // Humid: the fan's humidity rule latches
+    {RULE_MISSING, RULE_MISSING, RULE_MISSING, RULE_MISSING, 13 * 3600},
+  };
+  bool demand[2];
+  evaluateRuleTable(rules, count, sources, demand, 2);
+  CHECK(demand[0]);
+  CHECK(!demand[1]);  // Lights off after 12 h
+  sources[1][SRC_TIME_OF_DAY] = 3600;
+  sources[0][SRC_HUMIDITY] = 500;
+  evaluateRuleTable(rules, count, sources, demand, 2);
+  CHECK(!demand[0]);
+  CHECK(demand[1]);
+}
+
+void testCarryLatches() {
+  RelayRule previous[MAX], rules[MAX];
+  int previousCount = 0, count = 0;
+  addRoleRules(previous, previousCount, MAX, 0, 0, ROLE_FAN, LEVELS);
+  addRoleRules(previous, previousCount, MAX, 1, 0, ROLE_HEATER, LEVELS);
+  evaluateRule(previous[0], 400);
+  evaluateRule(previous[2], 100);
+
+  // Relay 1 becomes a humidifier; the fan keeps its latch, the new rule starts released
+  RuleLevels levels = LEVELS;
+  levels.tempMax = 320;
+  addRoleRules(rules, count, MAX, 0, 0, ROLE_FAN, levels);
+  addRoleRules(rules, count, MAX, 1, 0, ROLE_HUMIDIFIER, levels);
+  carryRuleLatches(rules, count, previous, previousCount);
+  CHECK(rules[0].latched);
+  CHECK(!rules[1].latched);
+  CHECK(!rules[2].latched);
+}
+
+void testMinimumTimes() {
+  // On since t=1000 with a 30 s minimum on time
+  CHECK(!relayMaySwitch(true, false, 20000, 1000, 0, 30000, 10000));
+  CHECK(relayMaySwitch(true, false, 31000, 1000, 0, 30000, 10000));
+  CHECK(!relayMaySwitch(true, true, 31000, 1000, 0, 30000, 10000));  // Demand unchanged
+  CHECK(relayMaySwitch(false, true, 11000, 1000, 0, 30000, 10000));
+  CHECK(!relayMaySwitch(false, true, 11000, 1000, 50000, 30000, 10000));  // Manual hold
+  // millis() wrap
+  CHECK(relayMaySwitch(false, true, 20000, 0xFFFFF000u, 0, 30000, 10000));
+}
+
+int main() {
+  testParseRole();
+  testCompile();
+  testHysteresis();
+  testMissingFailsSafe();
+  testTable();
+  testCarryLatches();
+  testMinimumTimes();
+  return checkResult("relay_rules");
+}
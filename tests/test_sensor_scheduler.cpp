@@ -0,0 +1,197 @@
+// Sensor sampling from Automation/haltec_hydro/sensor_scheduler.h with
+// fake drivers on a simulated clock: every driver call costs the same, and
+// loop() runs the control tick every 500 ms after the scheduler pass. The
+// work in a pass, and so how late the control tick runs, stays within the
+// same bound whether the sensors answer at once, take their time or hang.
+#include <stdio.h>
+#include <string.h>
+
+#include "check.h"
+#include "sensor_scheduler.h"
+
+#define SENSORS 12
+#define STARTS_PER_PASS 4
+#define DEFER_MS 5
+#define CALL_US 150   // One driver call
+#define LOOP_US 1000  // The rest of loop(), delay(1) included
+#define CONTROL_MS 500
+#define RUN_MS 60000
+
+enum FakeKind { FAKE_FAST, FAKE_SLOW, FAKE_SHARED, NUM_FAKE_KINDS };
+
+SensorTask tasks[SENSORS];
+uint64_t nowUs;
+int32_t sampleMs[NUM_FAKE_KINDS];  // How long a sample takes; -1 never ends
+uint32_t doneAt[SENSORS];
+int started[SENSORS], samples[SENSORS], aborts[SENSORS];
+int sharedOwner = -1;  // Sensor holding the one shared resource, as DHT22s share the capture buffer
+int passStarts, passPolls, passAborts;
+
+uint32_t nowMs() {
+  return (uint32_t)(nowUs / 1000);
+}
+
+void release(uint8_t id) {
+  if (sharedOwner == id) {
+    sharedOwner = -1;
+  }
+}
+
+SampleResult fakeStart(uint8_t id) {
+  nowUs += CALL_US;
+  passStarts++;
+  if (tasks[id].kind == FAKE_SHARED) {
+    if (sharedOwner >= 0) {
+      return SAMPLE_DEFER;
+    }
+    sharedOwner = id;
+  }
+  started[id]++;
+  doneAt[id] = nowMs() + sampleMs[tasks[id].kind];
+  return SAMPLE_BUSY;
+}
+
+SampleResult fakePoll(uint8_t id) {
+  nowUs += CALL_US;
+  passPolls++;
+  if (sampleMs[tasks[id].kind] < 0 || (int32_t)(nowMs() - doneAt[id]) < 0) {
+    return SAMPLE_BUSY;
+  }
+  release(id);
+  samples[id]++;
+  return SAMPLE_DONE;
+}
+
+void fakeAbort(uint8_t id) {
+  nowUs += CALL_US;
+  passAborts++;
+  release(id);
+  aborts[id]++;
+}
+
+const SensorDriver DRIVERS[NUM_FAKE_KINDS] = {
+  {"fast", 100, 20, fakeStart, fakePoll, fakeAbort},
+  {"slow", 2000, 200, fakeStart, fakePoll, fakeAbort},
+  {"shared", 1000, 50, fakeStart, fakePoll, fakeAbort},
+};
+
+int sampleBegins, sampleEnds;
+const SensorScheduler SCHEDULER = {
+  DRIVERS, NUM_FAKE_KINDS, STARTS_PER_PASS, DEFER_MS,
+  [](uint8_t) { sampleBegins++; },
+  [](uint8_t) { sampleEnds++; },
+};
+
+// A pass polls each sensor in flight at most once, and aborts it at most
+// once, on top of its starts; the control tick waits for one pass and the
+// rest of loop()
+const uint32_t PASS_BOUND_US = (2 * SENSORS + STARTS_PER_PASS) * CALL_US;
+const uint32_t LATE_BOUND_US = LOOP_US + PASS_BOUND_US;
+
+struct Run {
+  uint32_t maxPassUs;
+  uint32_t maxLateUs;
+};
+
+// Run loop() for RUN_MS with each kind's samples taking 'fast', 'slow' and
+// 'shared' ms
+Run run(int32_t fast, int32_t slow, int32_t shared) {
+  sampleMs[FAKE_FAST] = fast;
+  sampleMs[FAKE_SLOW] = slow;
+  sampleMs[FAKE_SHARED] = shared;
+  memset(started, 0, sizeof(started));
+  memset(samples, 0, sizeof(samples));
+  memset(aborts, 0, sizeof(aborts));
+  sharedOwner = -1;
+  sampleBegins = sampleEnds = 0;
+  nowUs = 0;
+  for (int id = 0; id < SENSORS; id++) {
+    tasks[id] = {(uint8_t)(id % NUM_FAKE_KINDS), false, 0, 0, 0};
+  }
+  scheduleFirstSamples(SCHEDULER, tasks, SENSORS, nowMs());
+
+  Run result = {0, 0};
+  uint64_t controlAt = CONTROL_MS * 1000;
+  while (nowUs < (uint64_t)RUN_MS * 1000) {
+    int inFlight = 0;
+    for (int id = 0; id < SENSORS; id++) {
+      inFlight += tasks[id].active;
+    }
+    passStarts = passPolls = passAborts = 0;
+    uint64_t passStart = nowUs;
+    runSensorScheduler(SCHEDULER, tasks, SENSORS, nowMs());
+    uint32_t passUs = (uint32_t)(nowUs - passStart);
+    result.maxPassUs = passUs > result.maxPassUs ? passUs : result.maxPassUs;
+    CHECK(passStarts <= STARTS_PER_PASS);
+    CHECK(passPolls <= inFlight);
+    CHECK(passAborts <= inFlight);
+
+    if (nowUs >= controlAt) {
+      uint32_t late = (uint32_t)(nowUs - controlAt);
+      result.maxLateUs = late > result.maxLateUs ? late : result.maxLateUs;
+      controlAt += CONTROL_MS * 1000;
+    }
+    nowUs += LOOP_US;
+  }
+  return result;
+}
+
+// Every sensor of a kind that answers sampled once a period, give or take
+// the staggered start and the last sample still in flight
+void checkPeriods(int kind) {
+  for (int id = kind; id < SENSORS; id += NUM_FAKE_KINDS) {
+    int expected = RUN_MS / (DRIVERS[kind].periodMs + DEFER_MS * (kind == FAKE_SHARED));
+    CHECK(samples[id] >= expected - 2);
+    CHECK(samples[id] <= RUN_MS / (int)DRIVERS[kind].periodMs + 1);
+    CHECK_EQ(tasks[id].failures, 0);
+  }
+}
+
+void report(const char *label, const Run &result) {
+  printf("%-22s max pass %5u us, control tick up to %5u us late (bound %u)\n", label, result.maxPassUs,
+         result.maxLateUs, LATE_BOUND_US);
+  CHECK(result.maxPassUs <= PASS_BOUND_US);
+  CHECK(result.maxLateUs <= LATE_BOUND_US);
+}
+
+void testFast() {
+  Run result = run(0, 0, 0);
+  report("answer at once", result);
+  for (int kind = 0; kind < NUM_FAKE_KINDS; kind++) {
+    checkPeriods(kind);
+  }
+  // The trace hooks pair up, bar the samples still in flight
+  int inFlight = 0;
+  for (int id = 0; id < SENSORS; id++) {
+    inFlight += tasks[id].active;
+  }
+  CHECK_EQ(sampleBegins - sampleEnds, inFlight);
+}
+
+void testSlow() {
+  Run result = run(15, 150, 40);  // Each just inside its timeout
+  report("answer near timeout", result);
+  for (int kind = 0; kind < NUM_FAKE_KINDS; kind++) {
+    checkPeriods(kind);
+  }
+}
+
+void testHung() {
+  Run result = run(-1, -1, -1);
+  report("never answer", result);
+  for (int id = 0; id < SENSORS; id++) {
+    // Each start ends in an abort and a failure, and the next one still
+    // comes on time
+    CHECK_EQ(samples[id], 0);
+    CHECK(aborts[id] >= started[id] - 1);
+    CHECK_EQ(tasks[id].failures, aborts[id]);
+    CHECK(started[id] >= RUN_MS / (int)DRIVERS[tasks[id].kind].periodMs - 1);
+  }
+}
+
+int main() {
+  testFast();
+  testSlow();
+  testHung();
+  return checkResult("sensor_scheduler");
+}
@@ -0,0 +1,303 @@
+// Settings slots and journal from Automation/haltec_hydro/settings_journal.h,
+// on files in memory: entry round trips, slot choice, crash consistency
+// and the older image versions loadSettings() accepts.
+#include <stdlib.h>
+
+#include "check.h"
+#include "mem_files.h"
+#include "settings_journal.h"
+
+#define IMAGE 4096
+#define V2_SIZE 3000  // An older layout: a prefix of the current one
+#define V1_SIZE 512
+#define ENTRY_MAX (sizeof(JournalHeader) + IMAGE + 64)
+#define JOURNAL_MAX 1024
+#define MAGIC 0x53445948
+
+const uint16_t VERSIONS[] = {3, 2, 1};
+const size_t SIZES[] = {IMAGE, V2_SIZE, V1_SIZE};
+
+uint8_t stored[IMAGE], current[IMAGE], loaded[IMAGE], entry[ENTRY_MAX];
+
+SettingsStore newStore() {
+  return {{"/settings.a.bin", "/settings.b.bin"}, "/settings.jnl", MAGIC, memRead, memWrite, 0, 1, 0};
+}
+
+// A fresh boot: load whatever is on flash
+int boot(SettingsStore &store) {
+  store = newStore();
+  return loadSettingsImage(store, VERSIONS, SIZES, 3, loaded, IMAGE, entry, ENTRY_MAX);
+}
+
+void randomImage(uint8_t *image, unsigned seed) {
+  srand(seed);
+  for (int i = 0; i < IMAGE; i++) {
+    image[i] = rand();
+  }
+}
+
+void testCrc32() {
+  CHECK_EQ(crc32((const uint8_t *)"123456789", 9), 0xCBF43926u);  // Standard check value
+}
+
+void testDiff() {
+  randomImage(stored, 1);
+  memcpy(current, stored, IMAGE);
+  CHECK_EQ(journalDiff(current, stored, IMAGE, entry, ENTRY_MAX), sizeof(JournalHeader));
+
+  current[0] ^= 1;              // First byte
+  current[100] ^= 1;            // Two changes 3 bytes apart share a run
+  current[103] ^= 1;
+  memset(current + 2000, 0x5A, 40);
+  current[IMAGE - 1] ^= 1;      // Last byte
+  size_t used = journalDiff(current, stored, IMAGE, entry, ENTRY_MAX);
+  // Four runs: 1, 4, up to 40 and 1 bytes
+  CHECK(used > sizeof(JournalHeader) && used <= sizeof(JournalHeader) + 4 * 4 + 1 + 4 + 40 + 1);
+  size_t len = journalSeal(entry, used, 7);
+  JournalHeader header;
+  memcpy(&header, entry, sizeof(header));
+  CHECK_EQ(header.seq, 7);
+  CHECK_EQ(header.bytes, used - sizeof(JournalHeader));
+  CHECK_EQ(len, used + 4);
+
+  memcpy(loaded, stored, IMAGE);
+  journalApply(loaded, IMAGE, entry, used);
+  CHECK(memcmp(loaded, current, IMAGE) == 0);
+
+  // One run per change, 5 bytes each: too scattered for a small entry
+  memcpy(current, stored, IMAGE);
+  for (int i = 0; i < IMAGE; i += 8) {
+    current[i] ^= 1;
+  }
+  CHECK_EQ(journalDiff(current, stored, IMAGE, entry, 1024), 0);
+  CHECK(journalDiff(current, stored, IMAGE, entry, ENTRY_MAX) > 0);
+}
+
+void testRunPastImageIsIgnored() {
+  memcpy(loaded, stored, IMAGE);
+  uint8_t bad[sizeof(JournalHeader) + 4 + 2];
+  uint16_t offset = IMAGE - 1, len = 2;
+  memcpy(bad + sizeof(JournalHeader), &offset, 2);
+  memcpy(bad + sizeof(JournalHeader) + 2, &len, 2);
+  journalApply(loaded, IMAGE, bad, sizeof(bad));
+  CHECK(memcmp(loaded, stored, IMAGE) == 0);
+}
+
+void testJournalRoundTrip() {
+  memReset();
+  SettingsStore store = newStore();
+  randomImage(stored, 2);
+  memcpy(current, stored, IMAGE);
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  uint8_t persisted[IMAGE];
+  memcpy(persisted, current, IMAGE);
+  for (int edit = 0; edit < 20; edit++) {
+    current[edit * 150] = edit;
+    CHECK(appendSettingsJournal(store, 3, current, persisted, IMAGE, entry, ENTRY_MAX, JOURNAL_MAX));
+  }
+  CHECK(memcmp(persisted, current, IMAGE) == 0);
+
+  SettingsStore booted;
+  CHECK_EQ(boot(booted), 0);
+  CHECK(memcmp(loaded, current, IMAGE) == 0);
+  CHECK_EQ(booted.seq, store.seq);
+  CHECK_EQ(booted.slot, store.slot);
+  CHECK_EQ(booted.journalSize, store.journalSize);
+  CHECK_EQ(booted.journalSize, memFiles["/settings.jnl"].size());
+
+  // The journal fills and is folded into the other slot
+  int slot = store.slot;
+  for (int edit = 0; store.journalSize > 0 && edit < 200; edit++) {
+    current[edit] ^= 0xFF;
+    CHECK(appendSettingsJournal(store, 3, current, persisted, IMAGE, entry, ENTRY_MAX, JOURNAL_MAX));
+    CHECK(store.journalSize <= JOURNAL_MAX);
+  }
+  CHECK_EQ(store.journalSize, 0);
+  CHECK_EQ(store.slot, 1 - slot);
+  CHECK_EQ(boot(booted), 0);
+  CHECK(memcmp(loaded, current, IMAGE) == 0);
+}
+
+void testNewestSlotWins() {
+  memReset();
+  SettingsStore store = newStore();
+  randomImage(current, 3);
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  int first = store.slot;
+  current[10] ^= 1;
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  CHECK_EQ(store.slot, 1 - first);
+
+  SettingsStore booted;
+  CHECK_EQ(boot(booted), 0);
+  CHECK_EQ(booted.slot, store.slot);
+  CHECK_EQ(booted.seq, 2);
+  CHECK(memcmp(loaded, current, IMAGE) == 0);
+
+  // Newest by sequence, not by slot: a third commit lands in the first slot
+  current[11] ^= 1;
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  CHECK_EQ(boot(booted), 0);
+  CHECK_EQ(booted.slot, first);
+  CHECK(memcmp(loaded, current, IMAGE) == 0);
+}
+
+void testTornSlotFallsBack() {
+  memReset();
+  SettingsStore store = newStore();
+  uint8_t persisted[IMAGE];
+  randomImage(current, 4);
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  memcpy(persisted, current, IMAGE);
+  current[5] = 0x42;
+  CHECK(appendSettingsJournal(store, 3, current, persisted, IMAGE, entry, ENTRY_MAX, JOURNAL_MAX));
+  uint8_t expected[IMAGE];
+  memcpy(expected, current, IMAGE);
+  uint32_t seq = store.seq;
+  int slot = store.slot;
+
+  // The filesystem fills halfway through the next image
+  current[6] = 0x43;
+  memWriteBudget = sizeof(PersistHeader) + IMAGE / 2;
+  CHECK(!commitSettingsImage(store, 3, current, IMAGE));
+  CHECK_EQ(store.slot, slot);
+  CHECK_EQ(store.seq, seq);
+  CHECK(store.journalSize > 0);
+  CHECK(!memFiles["/settings.jnl"].empty());  // Not truncated
+  memWriteBudget = -1;
+
+  // Its header is newer, but the image fails its CRC: the older slot and
+  // its journal load instead
+  SettingsStore booted;
+  CHECK_EQ(boot(booted), 0);
+  CHECK_EQ(booted.slot, slot);
+  CHECK(memcmp(loaded, expected, IMAGE) == 0);
+
+  // A damaged byte in the newer of two complete slots does the same
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  memFiles[store.slots[store.slot]][sizeof(PersistHeader) + 100] ^= 1;
+  CHECK_EQ(boot(booted), 0);
+  CHECK_EQ(booted.slot, slot);
+}
+
+void testTornAppend() {
+  memReset();
+  SettingsStore store = newStore();
+  uint8_t persisted[IMAGE];
+  randomImage(current, 5);
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  memcpy(persisted, current, IMAGE);
+  current[1] = 1;
+  CHECK(appendSettingsJournal(store, 3, current, persisted, IMAGE, entry, ENTRY_MAX, JOURNAL_MAX));
+  uint8_t expected[IMAGE];
+  memcpy(expected, current, IMAGE);
+  uint32_t journalSize = store.journalSize;
+
+  // An append cut short is not counted or marked persisted
+  current[2] = 2;
+  memWriteBudget = 7;
+  CHECK(!appendSettingsJournal(store, 3, current, persisted, IMAGE, entry, ENTRY_MAX, JOURNAL_MAX));
+  memWriteBudget = -1;
+  CHECK_EQ(store.journalSize, journalSize);
+  CHECK(memcmp(persisted, expected, IMAGE) == 0);
+  CHECK_EQ(memFiles["/settings.jnl"].size(), journalSize + 7);
+
+  // Replay stops at the torn entry
+  SettingsStore booted;
+  CHECK_EQ(boot(booted), 0);
+  CHECK(memcmp(loaded, expected, IMAGE) == 0);
+  CHECK_EQ(booted.journalSize, journalSize);
+
+  // The retry is a full image, so nothing ends up behind the torn entry
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  CHECK(memFiles["/settings.jnl"].empty());
+  CHECK_EQ(boot(booted), 0);
+  CHECK(memcmp(loaded, current, IMAGE) == 0);
+}
+
+void testStaleJournalSkipped() {
+  memReset();
+  SettingsStore store = newStore();
+  uint8_t persisted[IMAGE];
+  randomImage(current, 6);
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  memcpy(persisted, current, IMAGE);
+  current[20] = 20;
+  CHECK(appendSettingsJournal(store, 3, current, persisted, IMAGE, entry, ENTRY_MAX, JOURNAL_MAX));
+  std::vector<uint8_t> journal = memFiles["/settings.jnl"];
+
+  // A new image, then a power cut before the journal was truncated
+  current[20] = 21;
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  memFiles["/settings.jnl"] = journal;
+
+  SettingsStore booted;
+  CHECK_EQ(boot(booted), 0);
+  CHECK_EQ(loaded[20], 21);  // The older entry's 20 is not applied
+  CHECK_EQ(booted.seq, store.seq);
+  CHECK_EQ(booted.journalSize, journal.size());  // Counted, so the next append folds it away
+}
+
+void testOlderVersions() {
+  // A version 2 image loads into the front of the buffer, the rest zeroed
+  memReset();
+  SettingsStore store = newStore();
+  randomImage(current, 7);
+  CHECK(commitSettingsImage(store, 2, current, V2_SIZE));
+  SettingsStore booted;
+  memset(loaded, 0xEE, IMAGE);
+  CHECK_EQ(boot(booted), 1);
+  CHECK(memcmp(loaded, current, V2_SIZE) == 0);
+  bool zeroed = true;
+  for (int i = V2_SIZE; i < IMAGE; i++) {
+    zeroed = zeroed && loaded[i] == 0;
+  }
+  CHECK(zeroed);
+
+  // Its journal replays in the version 2 layout
+  uint8_t persisted[IMAGE];
+  memcpy(persisted, current, V2_SIZE);
+  current[V2_SIZE - 1] ^= 1;
+  CHECK(appendSettingsJournal(store, 2, current, persisted, V2_SIZE, entry, ENTRY_MAX, JOURNAL_MAX));
+  CHECK_EQ(boot(booted), 1);
+  CHECK(memcmp(loaded, current, V2_SIZE) == 0);
+
+  // The upgrade writes version 3 over the other slot; a torn upgrade
+  // leaves the version 2 image in use
+  memWriteBudget = 100;
+  CHECK(!commitSettingsImage(booted, 3, loaded, IMAGE));
+  memWriteBudget = -1;
+  CHECK_EQ(boot(booted), 1);
+  CHECK(commitSettingsImage(booted, 3, loaded, IMAGE));
+  CHECK_EQ(boot(booted), 0);
+  CHECK(memcmp(loaded, current, V2_SIZE) == 0);
+
+  // A pre-zone image, and nothing at all
+  memReset();
+  store = newStore();
+  CHECK(commitSettingsImage(store, 1, current, V1_SIZE));
+  CHECK_EQ(boot(booted), 2);
+  CHECK(memcmp(loaded, current, V1_SIZE) == 0);
+  memReset();
+  CHECK_EQ(boot(booted), -1);
+  CHECK_EQ(booted.seq, 0);
+
+  // Another file's magic is not a settings image
+  store = newStore();
+  store.magic = 0x47464347;
+  CHECK(commitSettingsImage(store, 3, current, IMAGE));
+  CHECK_EQ(boot(booted), -1);
+}
+
+int main() {
+  testCrc32();
+  testDiff();
+  testRunPastImageIsIgnored();
+  testJournalRoundTrip();
+  testNewestSlotWins();
+  testTornSlotFallsBack();
+  testTornAppend();
+  testStaleJournalSkipped();
+  testOlderVersions();
+  return checkResult("settings_journal");
+}
@@ -0,0 +1,131 @@
+// Round trip of hydro telemetry frames: the node's encoder
+// (Automation/haltec_hydro/telemetry_codec.h) against the gateway's
+// decoder (testing/tx-rx/tx-rx-ap-httpd/hydro_codec.h)
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "hydro_codec.h"
+#include "telemetry_codec.h"
+
+TelemetryState sample(int zones, int relays, unsigned seed) {
+  TelemetryState state;
+  memset(&state, 0, sizeof(state));
+  state.zoneCount = zones;
+  state.relayCount = relays;
+  srand(seed);
+  for (int z = 0; z < zones; z++) {
+    state.values[z][0] = 200 + rand() % 100;    // 20.0-29.9 C
+    state.values[z][1] = 400 + rand() % 300;    // 40.0-69.9 %RH
+    state.values[z][2] = 400 + rand() % 1200;   // ppm
+    state.values[z][3] = rand() % 4096;         // Raw ADC
+  }
+  for (int i = 0; i < relays; i++) {
+    if (rand() & 1) {
+      state.relays[i / 8] |= 1 << (i % 8);
+    }
+  }
+  return state;
+}
+
+bool same(const TelemetryState &a, const TelemetryState &b) {
+  if (a.zoneCount != b.zoneCount || a.relayCount != b.relayCount ||
+      memcmp(a.relays, b.relays, (a.relayCount + 7) / 8) != 0) {
+    return false;
+  }
+  for (int z = 0; z < a.zoneCount; z++) {
+    if (memcmp(a.values[z], b.values[z], sizeof(a.values[z])) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void testKeyRoundTrip() {
+  uint8_t frame[TELEMETRY_FRAME_MAX];
+  for (int zones = 0; zones <= TELEMETRY_MAX_ZONES; zones += 4) {
+    for (int relays = 0; relays <= TELEMETRY_MAX_RELAYS; relays += 13) {
+      TelemetryState state = sample(zones, relays, zones * 100 + relays);
+      state.values[0][2] = TELEMETRY_MISSING;  // Missing values travel as-is
+      size_t len = encodeTelemetryKey(frame, 0x1234, 7, state);
+      CHECK_EQ(len, TELEMETRY_HEADER + 2 + zones * TELEMETRY_FIELDS * 2 + (relays + 7) / 8 + 1);
+      CHECK_EQ(frame[0], TELEMETRY_MARK | FRAME_KEY);
+      CHECK_EQ(frame[1] | (frame[2] << 8), 0x1234);
+      CHECK_EQ(frame[3], 7);
+      CHECK_EQ(crc8(frame, len - 1), frame[len - 1]);
+
+      TelemetryState decoded;
+      CHECK(decodeTelemetryKey(frame, len, decoded));
+      CHECK(same(state, decoded));
+      CHECK(!decodeTelemetryKey(frame, len - 1, decoded));
+    }
+  }
+}
+
+void testDeltaRoundTrip() {
+  uint8_t frame[TELEMETRY_FRAME_MAX];
+  TelemetryState base = sample(5, 10, 1);
+  TelemetryState state = base;
+  state.values[0][0] += 3;
+  state.values[3][1] -= 128;
+  state.values[4][3] += 127;
+  size_t len = encodeTelemetryDelta(frame, 1, 9, 8, base, state);
+  // Header, base seq, 3 mask bytes, 3 deltas, CRC; relays unchanged
+  CHECK_EQ(len, TELEMETRY_HEADER + 1 + 3 + 3 + 1);
+  CHECK(!(frame[0] & FRAME_FLAG_RELAYS));
+  CHECK_EQ(frame[TELEMETRY_HEADER], 8);
+  TelemetryState decoded;
+  CHECK(decodeTelemetryDelta(frame, len, base, decoded));
+  CHECK(same(state, decoded));
+
+  // A relay change adds the bitmap
+  state.relays[1] ^= 0x02;
+  len = encodeTelemetryDelta(frame, 1, 10, 8, base, state);
+  CHECK(frame[0] & FRAME_FLAG_RELAYS);
+  CHECK(decodeTelemetryDelta(frame, len, base, decoded));
+  CHECK(same(state, decoded));
+
+  // Truncated and padded frames are refused
+  CHECK(!decodeTelemetryDelta(frame, len - 1, base, decoded));
+  frame[len] = 0;
+  CHECK(!decodeTelemetryDelta(frame, len + 1, base, decoded));
+  CHECK(!decodeTelemetryDelta(frame, TELEMETRY_HEADER + 2, base, decoded));
+  // Down to no bytes at all, which must not wrap len - 1
+  for (size_t shortLen = 0; shortLen < TELEMETRY_HEADER + 2; shortLen++) {
+    CHECK(!decodeTelemetryDelta(frame, shortLen, base, decoded));
+  }
+}
+
+void testDeltaFallsBackToKey() {
+  uint8_t frame[TELEMETRY_FRAME_MAX];
+  TelemetryState base = sample(2, 4, 2);
+  TelemetryState state = base;
+  state.values[1][2] += 128;  // Too far for an int8
+  CHECK_EQ(encodeTelemetryDelta(frame, 1, 2, 1, base, state), 0);
+  state = base;
+  state.values[0][0] = TELEMETRY_MISSING;
+  CHECK_EQ(encodeTelemetryDelta(frame, 1, 2, 1, base, state), 0);
+  state = base;
+  state.zoneCount = 3;
+  CHECK_EQ(encodeTelemetryDelta(frame, 1, 2, 1, base, state), 0);
+}
+
+void testUnchangedDeltaIsSmall() {
+  uint8_t frame[TELEMETRY_FRAME_MAX];
+  TelemetryState base = sample(TELEMETRY_MAX_ZONES, TELEMETRY_MAX_RELAYS, 3);
+  size_t len = encodeTelemetryDelta(frame, 1, 2, 1, base, base);
+  CHECK_EQ(len, TELEMETRY_HEADER + 1 + TELEMETRY_MAX_ZONES / 2 + 1);
+  TelemetryState decoded;
+  CHECK(decodeTelemetryDelta(frame, len, base, decoded));
+  CHECK(same(base, decoded));
+}
+
+int main() {
+  testKeyRoundTrip();
+  testDeltaRoundTrip();
+  testDeltaFallsBackToKey();
+  testUnchangedDeltaIsSmall();
+  return checkResult("telemetry_codec");
+}
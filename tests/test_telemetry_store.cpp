@@ -0,0 +1,284 @@
+// Gateway telemetry history from testing/tx-rx/tx-rx-ap-httpd/
+// telemetry_store.h, fed by the node's encoder: the id index, replacing
+// stale nodes, and a load test at the LoRa rate. The load test sends a
+// KEY and then DELTAs from every node, round robin, as fast as the
+// gateway's radio profile allows a report and its ACK, and checks that
+// every report lands, that the newest state and the windowed aggregates
+// match what was sent, and that ingest keeps far ahead of the radio at 32
+// nodes (the sketch's table) and at 512.
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "check.h"
+#include "radio_profile.h"
+#include "telemetry_codec.h"
+#include "telemetry_store.h"
+
+#define MAX_NODES 512
+#define STALE_MS 600000
+#define ZONES 4
+#define RELAYS 8
+#define RUN_S 3600
+
+typedef RadioProfile<7, 125, 5> GatewayProfile;  // As tx-rx-ap-httpd.h
+const RadioProfileInfo PROFILE = GatewayProfile::info();
+
+TelemetryNode *nodes[MAX_NODES];
+int16_t nodeIndex[2 * MAX_NODES];
+uint32_t now;
+
+TelemetryNode *reuseNode(uint16_t id);
+TelemetryNode *addNode(uint16_t id);
+int16_t *newHistory(int zones) {
+  return (int16_t *)malloc(zones * TELEMETRY_FIELDS * TELEMETRY_HISTORY * sizeof(int16_t));
+}
+TelemetryTable table;
+
+// As the sketch: a new node while there is room, else a stale one reused
+TelemetryNode *addNode(uint16_t id) {
+  if (table.count == table.capacity) {
+    return reuseNode(id);
+  }
+  TelemetryNode *node = (TelemetryNode *)calloc(1, sizeof(TelemetryNode));
+  node->id = id;
+  node->lastHeard = now;
+  addTelemetryNode(table, node);
+  return node;
+}
+
+TelemetryNode *reuseNode(uint16_t id) {
+  int oldest = stalestTelemetryNode(table, now, STALE_MS);
+  if (oldest < 0) {
+    return nullptr;
+  }
+  TelemetryNode *node = nodes[oldest];
+  int16_t *values = node->values;
+  uint8_t historyZones = node->historyZones;
+  memset(node, 0, sizeof(TelemetryNode));
+  node->id = id;
+  node->lastHeard = now;
+  node->values = values;
+  node->historyZones = historyZones;
+  rebuildTelemetryIndex(table);
+  return node;
+}
+
+void resetTable(int capacity) {
+  for (int i = 0; i < table.count; i++) {
+    free(nodes[i]->values);
+    free(nodes[i]);
+  }
+  uint16_t hashSize = 1;
+  while (hashSize < 2 * capacity) {
+    hashSize <<= 1;
+  }
+  table.nodes = nodes;
+  table.index = nodeIndex;
+  table.hashSize = hashSize;
+  table.capacity = capacity;
+  table.count = 0;
+  table.addNode = addNode;
+  table.newHistory = newHistory;
+  memset(nodeIndex, 0xFF, sizeof(nodeIndex));
+}
+
+// A report, CRC checked as handleTelemetryFrame() does, then ingested
+TelemetryNode *ingest(const uint8_t *frame, size_t len, TelemetryState &state) {
+  if (crc8(frame, len - 1) != frame[len - 1]) {
+    return nullptr;
+  }
+  return ingestTelemetryReport(table, frame, len, now, -90, 7.25f, state);
+}
+
+TelemetryState reading(int node, int step) {
+  TelemetryState state;
+  memset(&state, 0, sizeof(state));
+  state.zoneCount = ZONES;
+  state.relayCount = RELAYS;
+  for (int z = 0; z < ZONES; z++) {
+    state.values[z][0] = 200 + (node * 7 + step * 3 + z) % 100;
+    state.values[z][1] = 500 + (node + step) % 50;
+    state.values[z][2] = step % 10 == 9 && z == 1 ? TELEMETRY_MISSING : 400 + (node + step * 11) % 800;
+    state.values[z][3] = 2000 + step % 64;
+  }
+  state.relays[0] = step;
+  return state;
+}
+
+void testIndex() {
+  resetTable(MAX_NODES);
+  now = 1000;
+  srand(3);
+  uint16_t ids[MAX_NODES];
+  for (int i = 0; i < MAX_NODES; i++) {
+    do {
+      ids[i] = rand();
+    } while (lookupTelemetryNode(table, ids[i]));
+    CHECK(findTelemetryNode(table, ids[i]) != nullptr);
+  }
+  CHECK_EQ(table.count, MAX_NODES);
+  // Half full, so probe runs stay short however many nodes there are
+  int longest = 0;
+  for (int i = 0; i < MAX_NODES; i++) {
+    CHECK(lookupTelemetryNode(table, ids[i]) == nodes[i]);
+    int probes = (telemetrySlot(table, ids[i]) - telemetryHome(table, ids[i])) & (table.hashSize - 1);
+    longest = probes > longest ? probes : longest;
+  }
+  CHECK(longest <= 24);
+  CHECK(lookupTelemetryNode(table, 0) == nullptr || ids[0] == 0);
+}
+
+void testReuse() {
+  resetTable(4);
+  uint8_t frame[TELEMETRY_FRAME_MAX];
+  TelemetryState state;
+  for (int i = 0; i < 4; i++) {
+    now = 1000 + i * 1000;
+    size_t len = encodeTelemetryKey(frame, 0x100 + i, 1, reading(i, 0));
+    CHECK(ingest(frame, len, state) != nullptr);
+  }
+
+  // Full, and every node is still reporting: the newcomer is refused
+  now = 10000;
+  size_t len = encodeTelemetryKey(frame, 0x200, 1, reading(9, 0));
+  CHECK(ingest(frame, len, state) == nullptr);
+  CHECK(lookupTelemetryNode(table, 0x200) == nullptr);
+
+  // Node 0x100 goes quiet first, so it is the one reused
+  now = 1000 + STALE_MS + 500;
+  TelemetryNode *node = ingest(frame, len, state);
+  CHECK(node == nodes[0]);
+  CHECK(lookupTelemetryNode(table, 0x200) == node);
+  CHECK(lookupTelemetryNode(table, 0x100) == nullptr);
+  CHECK(lookupTelemetryNode(table, 0x103) == nodes[3]);
+  CHECK_EQ(node->count, 1);
+
+  // A DELTA from an unknown node, or against an unknown base, is dropped
+  TelemetryState base = reading(9, 0);
+  len = encodeTelemetryDelta(frame, 0x300, 2, 1, base, reading(9, 1));
+  CHECK(ingest(frame, len, state) == nullptr);
+  len = encodeTelemetryDelta(frame, 0x200, 2, 7, base, reading(9, 1));
+  CHECK(ingest(frame, len, state) == nullptr);
+  len = encodeTelemetryDelta(frame, 0x200, 2, 1, base, reading(9, 1));
+  CHECK(ingest(frame, len, state) == node);
+  CHECK_EQ(node->count, 2);
+}
+
+// What each node sent, newest last, for checking the aggregates
+struct Sent {
+  uint32_t at;
+  int16_t temperature;
+  int16_t co2;
+};
+
+void testLoad(int nodeCount) {
+  resetTable(nodeCount);
+  std::vector<std::vector<Sent> > sent(nodeCount);
+  std::vector<TelemetryState> acked(nodeCount);
+  std::vector<int> steps(nodeCount, 0);
+  uint32_t ackUs = frameAirtimeUs(PROFILE, TELEMETRY_HEADER + 1);
+
+  uint8_t frame[TELEMETRY_FRAME_MAX];
+  uint64_t simUs = 0;
+  size_t frames = 0, keys = 0, accepted = 0, bytes = 0;
+  double ingestNs = 0;
+  while (simUs < (uint64_t)RUN_S * 1000000) {
+    int n = frames % nodeCount;
+    int step = steps[n]++;
+    TelemetryState state = reading(n, step);
+    uint16_t id = 0x1000 + n * 37;
+    // A DELTA against the last report, or a KEY when it cannot carry the change
+    size_t len = step ? encodeTelemetryDelta(frame, id, step & 0xFF, (step - 1) & 0xFF, acked[n], state) : 0;
+    if (len == 0) {
+      len = encodeTelemetryKey(frame, id, step & 0xFF, state);
+      keys++;
+    }
+    simUs += frameAirtimeUs(PROFILE, len) + ackUs;
+    now = simUs / 1000;
+
+    TelemetryState decoded;
+    auto start = std::chrono::steady_clock::now();
+    TelemetryNode *node = ingest(frame, len, decoded);
+    ingestNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (node) {
+      accepted++;
+      acked[n] = state;
+      sent[n].push_back({now / 1000, state.values[0][0], state.values[0][2]});
+    }
+    frames++;
+    bytes += len;
+  }
+  CHECK_EQ(accepted, frames);
+  CHECK_EQ(table.count, nodeCount);
+
+  // The newest report of every node is what it sent last
+  for (int n = 0; n < nodeCount; n++) {
+    const TelemetryNode *node = lookupTelemetryNode(table, 0x1000 + n * 37);
+    CHECK(node != nullptr);
+    if (!node) continue;
+    CHECK(memcmp(node->acked[0].values, acked[n].values, sizeof(acked[n].values)) == 0);
+    CHECK_EQ(node->values[newestTelemetrySlot(*node)], sent[n].back().temperature);
+    CHECK_EQ(node->count, sent[n].size() < TELEMETRY_HISTORY ? sent[n].size() : TELEMETRY_HISTORY);
+  }
+
+  // Windowed aggregates against the same sums over what was sent
+  uint32_t nowS = now / 1000;
+  const uint32_t WINDOWS[] = {60, 600, 86400};
+  double queryNs = 0;
+  for (uint32_t window : WINDOWS) {
+    for (int column : {0, 2}) {
+      TelemetryAggregate result;
+      auto start = std::chrono::steady_clock::now();
+      aggregateTelemetry(table, table.count, column, 0, nowS, window, result);
+      queryNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+      TelemetryAggregate expected = {INT32_MAX, INT32_MIN, 0, 0, 0};
+      for (int n = 0; n < nodeCount; n++) {
+        bool counted = false;
+        size_t kept = sent[n].size() < TELEMETRY_HISTORY ? sent[n].size() : TELEMETRY_HISTORY;
+        for (size_t k = sent[n].size() - kept; k < sent[n].size(); k++) {
+          int32_t value = column == 0 ? sent[n][k].temperature : sent[n][k].co2;
+          if (nowS - sent[n][k].at > window || value == TELEMETRY_MISSING) continue;
+          expected.min = value < expected.min ? value : expected.min;
+          expected.max = value > expected.max ? value : expected.max;
+          expected.sum += value;
+          expected.samples++;
+          counted = true;
+        }
+        expected.nodes += counted;
+      }
+      CHECK_EQ(result.samples, expected.samples);
+      CHECK_EQ(result.nodes, expected.nodes);
+      CHECK_EQ(result.sum, expected.sum);
+      if (expected.samples) {
+        CHECK_EQ(result.min, expected.min);
+        CHECK_EQ(result.max, expected.max);
+      }
+    }
+  }
+  TelemetryAggregate rssi;
+  aggregateTelemetry(table, table.count, TELEMETRY_COLUMN_RSSI, 0, nowS, 86400, rssi);
+  CHECK_EQ(rssi.min, -90);
+  CHECK_EQ(rssi.max, -90);
+
+  // The radio's best is one report and one ACK at a time; ingest must
+  // keep at least 100 times ahead of it
+  double loraRate = frames / (double)RUN_S;
+  double ingestRate = frames / (ingestNs / 1e9);
+  printf("%4d nodes: %zu reports, %zu KEY (%.1f/s at SF7, %.1f bytes avg), ingest %.0f ns/report (%.0fx the radio), "
+         "aggregate %.1f us\n",
+         nodeCount, frames, keys, loraRate, (double)bytes / frames, ingestNs / frames, ingestRate / loraRate,
+         queryNs / 6 / 1000);
+  CHECK(ingestRate > 100 * loraRate);
+}
+
+int main() {
+  testIndex();
+  testReuse();
+  testLoad(32);
+  testLoad(MAX_NODES);
+  return checkResult("telemetry_store");
+}
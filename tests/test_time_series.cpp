@@ -0,0 +1,144 @@
+// Sensor history from Automation/haltec_hydro/time_series.h on files in
+// memory: bucket statistics, checkpoints across a reboot, and range
+// queries over the slot rings
+#include <stdio.h>
+#include <string.h>
+
+#include "check.h"
+#include "mem_files.h"
+#include "time_series.h"
+
+const RollupLevel FIVE_MIN = {300, 12, "ts_5m"};  // An hour of slots
+const LogStore STORE = {memRead, memWriteAt};
+#define PATH "/ts_5m.bin"
+#define CHECKPOINT "/ts_open.bin"
+
+void values(int16_t out[LOG_FIELDS], int16_t value) {
+  for (int f = 0; f < LOG_FIELDS; f++) {
+    out[f] = value + f;
+  }
+}
+
+// Add a sample every 10 s over [from, to), writing closed buckets
+void logRange(RollupBucket &open, uint32_t from, uint32_t to) {
+  for (uint32_t t = from; t < to; t += 10) {
+    int16_t v[LOG_FIELDS];
+    values(v, t / 10 % 100);
+    RollupBucket closed;
+    if (rollupAdd(FIVE_MIN, open, t, v, closed)) {
+      CHECK(writeRollup(STORE, PATH, FIVE_MIN, closed));
+    }
+  }
+}
+
+void testBucket() {
+  RollupBucket open, closed;
+  rollupReset(open, 0);
+  int16_t v[LOG_FIELDS] = {10, LOG_MISSING, -5, 7};
+  CHECK(!rollupAdd(FIVE_MIN, open, 600, v, closed));
+  v[0] = 30;
+  v[2] = -1;
+  CHECK(!rollupAdd(FIVE_MIN, open, 890, v, closed));
+  CHECK(rollupAdd(FIVE_MIN, open, 900, v, closed));  // The next bucket closes this one
+  CHECK_EQ(closed.start, 600);
+  CHECK_EQ(open.start, 900);
+  CHECK_EQ(open.count, 1);
+
+  RollupRecord record;
+  rollupToRecord(closed, record);
+  CHECK_EQ(record.count, 2);
+  CHECK_EQ(record.min[0], 10);
+  CHECK_EQ(record.max[0], 30);
+  CHECK_EQ(record.avg[0], 20);
+  CHECK_EQ(record.min[1], LOG_MISSING);  // No reading in the bucket
+  CHECK_EQ(record.avg[2], -3);
+  CHECK_EQ(record.avg[3], 7);
+}
+
+void testCheckpoint() {
+  memReset();
+  LogCheckpoint checkpoint;
+  CHECK(!loadLogCheckpoint(STORE, CHECKPOINT, checkpoint));
+  memFiles[CHECKPOINT].assign(sizeof(LogCheckpoint), 0);  // As logEnsureFile() leaves it
+  CHECK(!loadLogCheckpoint(STORE, CHECKPOINT, checkpoint));
+
+  // Log until mid-bucket, checkpoint, then "reboot" and carry on
+  memset(&checkpoint, 0, sizeof(checkpoint));
+  rollupReset(checkpoint.open[0][0], 0);
+  logRange(checkpoint.open[0][0], 3000, 3150);
+  checkpoint.magic = LOG_CHECKPOINT_MAGIC;
+  checkpoint.time = 3140;
+  CHECK(saveLogCheckpoint(STORE, CHECKPOINT, checkpoint));
+
+  LogCheckpoint booted;
+  CHECK(loadLogCheckpoint(STORE, CHECKPOINT, booted));
+  CHECK_EQ(booted.time, 3140);
+  CHECK(memcmp(&booted.open, &checkpoint.open, sizeof(booted.open)) == 0);
+  logRange(booted.open[0][0], 3150, 3310);
+
+  RollupRecord record;
+  memRead(PATH, rollupSlotOffset(FIVE_MIN, 3000), (uint8_t *)&record, sizeof(record));
+  CHECK_EQ(record.start, 3000);
+  CHECK_EQ(record.count, 30);  // Samples before the reboot are still in the bucket
+
+  // A checkpoint of another layout is ignored
+  booted.magic++;
+  saveLogCheckpoint(STORE, CHECKPOINT, booted);
+  CHECK(!loadLogCheckpoint(STORE, CHECKPOINT, booted));
+}
+
+void testQuery() {
+  memReset();
+  memFiles[PATH].assign(FIVE_MIN.slots * sizeof(RollupRecord), 0);
+  RollupBucket open;
+  rollupReset(open, 0);
+  logRange(open, 6000, 6000 + 2 * 3600 + 100);  // Two hours: the first has been overwritten
+  uint32_t now = 6000 + 2 * 3600 + 90;
+  CHECK_EQ(newestRollupEnd(STORE, PATH, FIVE_MIN), now - now % 300);
+
+  RollupCursor cursor;
+  RollupRecord record;
+  uint32_t expected = now - now % 300 - 11 * 300;  // Only as far back as the ring holds
+  startRollupQuery(cursor, FIVE_MIN, PATH, open, 0, now, now);
+  int points = 0;
+  while (nextRollupRecord(STORE, cursor, record)) {
+    CHECK_EQ(record.start, expected);
+    expected += 300;
+    points++;
+  }
+  CHECK_EQ(points, 12);
+  CHECK_EQ(record.count, 10);  // The last comes from the open bucket
+
+  // A range inside the ring, one that ends before it starts, and one
+  // beyond now
+  startRollupQuery(cursor, FIVE_MIN, PATH, open, now - 900, now - 300, now);
+  points = 0;
+  while (nextRollupRecord(STORE, cursor, record)) {
+    points++;
+  }
+  CHECK_EQ(points, 3);
+  startRollupQuery(cursor, FIVE_MIN, PATH, open, 600, 1200, now);
+  CHECK(!nextRollupRecord(STORE, cursor, record));
+  startRollupQuery(cursor, FIVE_MIN, PATH, open, now + 600, now + 900, now);
+  CHECK(!nextRollupRecord(STORE, cursor, record));
+
+  // Empty slots are skipped
+  memset(memFiles[PATH].data() + rollupSlotOffset(FIVE_MIN, now - now % 300 - 600), 0, sizeof(RollupRecord));
+  startRollupQuery(cursor, FIVE_MIN, PATH, open, now - 900, now, now);
+  points = 0;
+  while (nextRollupRecord(STORE, cursor, record)) {
+    points++;
+  }
+  CHECK_EQ(points, 3);
+
+  // With no file the query ends at the first slot it has to read
+  startRollupQuery(cursor, FIVE_MIN, "/missing.bin", open, now - 300, now, now);
+  CHECK(!nextRollupRecord(STORE, cursor, record));
+}
+
+int main() {
+  testBucket();
+  testCheckpoint();
+  testQuery();
+  return checkResult("time_series");
+}
@@ -0,0 +1,211 @@
+// User session frames from testing/tx-rx/user_session.h: the gateway's
+// id index and cipher LRU, and a node's receive path, over a stand-in
+// cipher that counts its calls. bench_user_sessions times the same code
+// with AES-CCM.
+#include <stdio.h>
+#include <string.h>
+
+#include "check.h"
+#include "user_session.h"
+
+// Stand-in crypto: the "MAC" of a key is an FNV stream over it, and a
+// frame is XORed with its slot key and tagged with a checksum. Keys that
+// start with 'c' all get recipient id 0x0c0c, to force collisions.
+uint8_t slotKeys[USER_CIPHER_CACHE][16];
+int opens = 0, setKeys = 0;
+
+uint8_t streamByte(const uint8_t *key, const uint8_t *header, size_t i) {
+  return key[i % 16] ^ header[i % USER_HEADER] ^ (uint8_t)(i * 31);
+}
+
+void tagOf(const uint8_t *key, const uint8_t *header, const uint8_t *data, size_t len, uint8_t *tag) {
+  uint32_t sum = 2166136261u;
+  for (size_t i = 0; i < USER_HEADER; i++) {
+    sum = (sum ^ header[i]) * 16777619u;
+  }
+  for (size_t i = 0; i < len; i++) {
+    sum = (sum ^ data[i] ^ key[i % 16]) * 16777619u;
+  }
+  memcpy(tag, &sum, USER_TAG_LEN);
+}
+
+const SessionCrypto FAKE_CRYPTO = {
+  [](const uint8_t *key, size_t keyLen, uint8_t *mac) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 32; i++) {
+      h = (h ^ (keyLen ? key[i % keyLen] : 0) ^ i) * 16777619u;
+      mac[i] = h >> 24;
+    }
+    if (keyLen && key[0] == 'c') {
+      mac[16] = mac[17] = 0x0c;
+    }
+  },
+  [](int slot, const uint8_t *key) {
+    setKeys++;
+    memcpy(slotKeys[slot], key, 16);
+  },
+  [](int slot, const uint8_t *header, const uint8_t *text, size_t len, uint8_t *out, uint8_t *tag) {
+    for (size_t i = 0; i < len; i++) {
+      out[i] = text[i] ^ streamByte(slotKeys[slot], header, i);
+    }
+    tagOf(slotKeys[slot], header, out, len, tag);
+  },
+  [](int slot, const uint8_t *header, const uint8_t *in, size_t len, uint8_t *text, const uint8_t *tag) {
+    opens++;
+    uint8_t expected[USER_TAG_LEN];
+    tagOf(slotKeys[slot], header, in, len, expected);
+    if (memcmp(expected, tag, USER_TAG_LEN) != 0) {
+      return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+      text[i] = in[i] ^ streamByte(slotKeys[slot], header, i);
+    }
+    return true;
+  },
+};
+
+SessionTable table;
+UserSession *sessions = table.sessions;
+
+// A user's node: its own session, keyed in a slot of the shared stand-in
+// past the gateway's
+struct Node {
+  UserSession session;
+  uint32_t upCounter;
+};
+const int NODE_SLOT = USER_CIPHER_CACHE - 1;
+
+Node makeNode(const char *key) {
+  Node node = {};
+  deriveUserSession(FAKE_CRYPTO, key, strlen(key), node.session);
+  node.upCounter = 1;
+  return node;
+}
+
+size_t nodeSend(Node &node, const char *text, uint8_t *frame) {
+  FAKE_CRYPTO.setKey(NODE_SLOT, node.session.key);
+  return sealUserFrame(FAKE_CRYPTO, NODE_SLOT, node.session, USER_UP, node.upCounter++, text, strlen(text), frame);
+}
+
+int nodeReceive(Node &node, const uint8_t *frame, size_t len, char *text) {
+  memcpy(slotKeys[NODE_SLOT], node.session.key, 16);
+  return openSessionFrame(FAKE_CRYPTO, NODE_SLOT, node.session, frame, len, USER_DOWN, text);
+}
+
+void reset(int users, const char *prefix = "key") {
+  clearSessionTable(table);
+  table.misses = 0;
+  for (int i = 0; i < users; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "%s%d", prefix, i);
+    CHECK(addUserSession(table, FAKE_CRYPTO, key, strlen(key)));
+  }
+}
+
+void testRoundTrip() {
+  reset(3);
+  Node alice = makeNode("key1");
+  CHECK_EQ(alice.session.id, sessions[1].id);
+  uint8_t frame[USER_FRAME_MAX];
+  char text[USER_TEXT_MAX + 1] = "";
+
+  size_t len = sealUserFrameTo(table, FAKE_CRYPTO, 1, 7, "hello", 5, frame);
+  CHECK_EQ(len, USER_HEADER + 5 + USER_TAG_LEN);
+  CHECK_EQ(frame[0], USER_MARK | USER_DOWN);
+  CHECK_EQ(userFrameCounter(frame), 7);
+  CHECK_EQ(nodeReceive(alice, frame, len, text), 0);
+  CHECK(strcmp(text, "hello") == 0);
+  CHECK_EQ(nodeReceive(alice, frame, len, text), USER_FRAME_REPLAYED);
+
+  len = nodeSend(alice, "hi back", frame);
+  CHECK_EQ(openUserFrame(table, FAKE_CRYPTO, frame, len, text), 1);
+  CHECK(strcmp(text, "hi back") == 0);
+  CHECK_EQ(sessions[1].lastCounter, 1);
+  CHECK_EQ(openUserFrame(table, FAKE_CRYPTO, frame, len, text), USER_FRAME_REPLAYED);
+
+  // A changed byte fails the tag; a downlink frame is not taken as uplink
+  len = nodeSend(alice, "tampered", frame);
+  frame[USER_HEADER] ^= 1;
+  CHECK_EQ(openUserFrame(table, FAKE_CRYPTO, frame, len, text), USER_FRAME_REJECTED);
+  frame[USER_HEADER] ^= 1;
+  frame[0] = USER_MARK | USER_DOWN;
+  CHECK_EQ(openUserFrame(table, FAKE_CRYPTO, frame, len, text), USER_FRAME_REJECTED);
+
+  // Text past USER_TEXT_MAX is cut
+  char longText[300];
+  memset(longText, 'x', sizeof(longText));
+  CHECK_EQ(sealUserFrameTo(table, FAKE_CRYPTO, 0, 8, longText, sizeof(longText), frame), USER_FRAME_MAX);
+}
+
+void testFiltering() {
+  reset(3);
+  Node alice = makeNode("key1");
+  uint8_t frame[USER_FRAME_MAX];
+  char text[USER_TEXT_MAX + 1] = "";
+
+  // A node drops a frame for another user on its id, without decrypting
+  size_t len = sealUserFrameTo(table, FAKE_CRYPTO, 2, 1, "for bob", 7, frame);
+  opens = 0;
+  CHECK_EQ(nodeReceive(alice, frame, len, text), USER_FRAME_REJECTED);
+  CHECK_EQ(opens, 0);
+
+  // The gateway drops an unknown id after one index probe, also unread
+  Node stranger = makeNode("unknown");
+  len = nodeSend(stranger, "let me in", frame);
+  opens = 0;
+  CHECK_EQ(openUserFrame(table, FAKE_CRYPTO, frame, len, text), USER_FRAME_REJECTED);
+  CHECK_EQ(opens, 0);
+
+  // Short and over-long frames are rejected before any lookup
+  CHECK_EQ(openUserFrame(table, FAKE_CRYPTO, frame, USER_HEADER + USER_TAG_LEN - 1, text), USER_FRAME_REJECTED);
+  CHECK_EQ(openUserFrame(table, FAKE_CRYPTO, frame, USER_FRAME_MAX + 1, text), USER_FRAME_REJECTED);
+}
+
+void testCollisions() {
+  reset(4, "c");  // Four users on one id
+  CHECK_EQ(sessions[0].id, sessions[3].id);
+  Node third = makeNode("c2");
+  uint8_t frame[USER_FRAME_MAX];
+  char text[USER_TEXT_MAX + 1] = "";
+  size_t len = nodeSend(third, "collided", frame);
+  opens = 0;
+  CHECK_EQ(openUserFrame(table, FAKE_CRYPTO, frame, len, text), 2);
+  CHECK_EQ(opens, 3);  // Tried in index order until the tag verified
+}
+
+void testCacheAndLimit() {
+  reset(USER_CIPHER_CACHE + 1);
+  uint8_t frame[USER_FRAME_MAX];
+  // Up to USER_CIPHER_CACHE users in rotation expand each key once
+  for (int round = 0; round < 3; round++) {
+    for (int user = 0; user < USER_CIPHER_CACHE; user++) {
+      sealUserFrameTo(table, FAKE_CRYPTO, user, round + 1, "x", 1, frame);
+    }
+  }
+  CHECK_EQ(table.misses, USER_CIPHER_CACHE);
+  // One more in rotation evicts the least recently used every time
+  table.misses = 0;
+  for (int round = 0; round < 3; round++) {
+    for (int user = 0; user <= USER_CIPHER_CACHE; user++) {
+      sealUserFrameTo(table, FAKE_CRYPTO, user, round + 10, "x", 1, frame);
+    }
+  }
+  CHECK_EQ(table.misses, 1 + 2 * (USER_CIPHER_CACHE + 1));
+
+  reset(USER_MAX);
+  CHECK(!addUserSession(table, FAKE_CRYPTO, "one more", 8));
+  CHECK_EQ(table.count, USER_MAX);
+  // Every user is still found through the full index
+  Node last = makeNode("key511");
+  char text[USER_TEXT_MAX + 1] = "";
+  size_t len = nodeSend(last, "last", frame);
+  CHECK_EQ(openUserFrame(table, FAKE_CRYPTO, frame, len, text), USER_MAX - 1);
+}
+
+int main() {
+  testRoundTrip();
+  testFiltering();
+  testCollisions();
+  testCacheAndLimit();
+  return checkResult("user_session");
+}